@@ -1,9 +1,8 @@
 MYSQL=CONN_LOC
 
-clang++ sql.cpp -o app \
-    -std=c++17 -stdlib=libc++ \
-    -I ${MYSQL}/include \
-    -I ${MYSQL}/include/jdbc \
-    -L ${MYSQL}/lib64 \
-    -lmysqlcppconn \
-    -Wl,-rpath,${MYSQL}/lib64
\ No newline at end of file
+# Release build with link-time optimization through CMake (clang and
+# libc++, as before); ./pgo.sh adds profile-guided optimization.
+cmake -S . -B build -DCMAKE_BUILD_TYPE=Release -DMYSQL_CONNECTOR_DIR=${MYSQL} \
+    -DCMAKE_CXX_COMPILER=clang++ -DCMAKE_CXX_FLAGS=-stdlib=libc++
+cmake --build build
+cp build/app app
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Profile-guided optimization build of app and app_bench:
+#   1. instrumented build
+#   2. training run on the benchmark workload (needs the MySQL server
+#      from DbConfig; add an import with PGO_TRAIN_CSV=users.csv)
+#   3. optimized Release+LTO build using the profiles
+# Both builds use the same directory (build-pgo): gcc finds the profile
+# of an object file by that object's path.
+# Usage: MYSQL=CONN_LOC ./pgo.sh   (CXX=clang++ to use clang; on macOS
+# the Apple clang from the command line tools is picked up by default;
+# clang or gcc is then taken from the build's CMakeCache.txt)
+set -e
+
+MYSQL=${MYSQL:-CONN_LOC}
+PROFILES=$(pwd)/build-pgo-data
+
+rm -rf "$PROFILES"
+cmake -S . -B build-pgo -DCMAKE_BUILD_TYPE=Release \
+    -DMYSQL_CONNECTOR_DIR="$MYSQL" -DAPP_PGO=generate -DAPP_PGO_DIR="$PROFILES"
+cmake --build build-pgo
+
+./build-pgo/app_bench
+./build-pgo/app --bench
+if [ -n "$PGO_TRAIN_CSV" ]; then
+    ./build-pgo/app --import "$PGO_TRAIN_CSV" --dedup last
+fi
+
+# The compiler cmake actually picked (CXX, CMAKE_CXX_COMPILER or the default)
+COMPILER_ID=$(sed -n 's/^APP_CXX_COMPILER_ID:INTERNAL=//p' build-pgo/CMakeCache.txt)
+case "$COMPILER_ID" in
+    *Clang*)
+        PROFDATA=llvm-profdata
+        if [ "$(uname)" = Darwin ]; then PROFDATA="xcrun llvm-profdata"; fi
+        for target in app app_bench; do
+            $PROFDATA merge -o "$PROFILES/$target.profdata" "$PROFILES/$target"/*.profraw
+        done
+        ;;
+esac
+
+cmake -S . -B build-pgo -DAPP_PGO=use
+cmake --build build-pgo
+echo "Optimized binaries: build-pgo/app, build-pgo/app_bench"
@@ -15,6 +15,62 @@
 #include <vector>      // for std::vector container
 #include <string>      // for std::string
 #include <iomanip>     // for std::setw, formatting output
+#include <fstream>     // for std::ifstream (CSV import)
+#include <string_view> // for std::string_view (zero-copy field access)
+#include <charconv>    // for std::from_chars (allocation-free number parsing)
+#include <cstdint>     // for fixed-width integer types
+#include <algorithm>   // for std::min
+#include <stdexcept>   // for std::runtime_error
+#include <chrono>      // for timing imports and benchmarks
+#include <thread>      // for std::thread (parallel loaders)
+#include <mutex>       // for std::mutex, std::lock_guard
+#include <condition_variable> // for blocking queues
+#include <deque>       // for the queue storage
+#include <atomic>      // for lock-free counters
+#include <exception>   // for std::exception_ptr
+#include <cstdio>      // for std::remove (spill files)
+#include <unistd.h>    // for getpid, rmdir (spill directories)
+#include <map>         // for ordered aggregation
+#include <sstream>     // for std::ostringstream
+#include <cerrno>      // for errno (saved in the signal handler)
+#include <cstdlib>     // for std::free, mkdtemp
+#include <csignal>     // for sigaction (sampling profiler)
+#include <sys/time.h>  // for setitimer
+#include <execinfo.h>  // for backtrace
+#include <dlfcn.h>     // for dladdr (symbol names)
+#include <cxxabi.h>    // for abi::__cxa_demangle
+#include <functional>  // for std::function
+#include <cmath>       // for std::erfc, std::sqrt (significance tests)
+#include <random>      // for std::mt19937 (bootstrap)
+#include <iterator>    // for std::istreambuf_iterator
+#include <cctype>      // for std::isspace
+#include <cstring>     // for std::memcpy
+#include <unordered_map> // for hash-based baselines in benchmarks
+#include <unordered_set> // for id sets
+#include <climits>     // for INT_MIN
+#include <set>         // for small sorted deltas
+#include <shared_mutex> // for reader/writer locks
+#include <array>       // for per-thread radix counts
+#include <optional>    // for pipeline results
+#include <fcntl.h>     // for open (settings lock file)
+#include <sys/file.h>  // for flock
+#include <sys/stat.h>  // for fstat, fchmod
+#include <sys/mman.h>  // for mmap (counters shared with child processes)
+#include <sys/wait.h>  // for waitpid
+#include <type_traits> // for std::invoke_result_t
+#include <list>        // for the proxy's client list
+#include <poll.h>      // for poll (proxy acceptor)
+#include <netdb.h>     // for getaddrinfo (proxy server address)
+#include <sys/socket.h> // for socket, send, recv
+#include <sys/un.h>    // for sockaddr_un
+#include <netinet/in.h> // for IPPROTO_TCP
+#include <netinet/tcp.h> // for TCP_NODELAY
+#ifdef __linux__
+#include <linux/perf_event.h> // for perf_event_attr (hardware counters)
+#include <sys/ioctl.h>        // for ioctl (enable/disable counters)
+#include <sys/syscall.h>      // for SYS_perf_event_open
+#include <sched.h>            // for sched_getcpu (per-core free lists)
+#endif
 
 // ====== MySQL Connector headers ======
 // These come from the "include" directory of MySQL Connector/C++
@@ -26,6 +82,14 @@
 #include <cppconn/prepared_statement.h>  // defines sql::PreparedStatement (parameterized SQL)
 #include <cppconn/resultset.h>           // defines sql::ResultSet (returned query results)
 
+// ====== Apache Arrow / Parquet (optional, -DAPP_WITH_ARROW=ON) ======
+#ifdef APP_WITH_ARROW
+#include <arrow/api.h>                   // for arrow::RecordBatch, arrow::StringArray
+#include <arrow/io/file.h>               // for arrow::io::ReadableFile
+#include <arrow/ipc/reader.h>            // for the Arrow IPC file and stream readers
+#include <parquet/arrow/reader.h>        // for parquet::arrow::FileReader
+#endif
+
 // ---------------------------------------------------------
 // Struct: DbConfig
 // Holds MySQL connection configuration info.
@@ -49,185 +113,9260 @@ struct User {
     int         age;   // user's age
 };
 
-// ---------------------------------------------------------
-// Helper function: printSqlError
-// Prints all possible details of a sql::SQLException
-// ---------------------------------------------------------
-void printSqlError(const sql::SQLException& e, const std::string& where) {
-    std::cerr << "[SQL ERROR @ " << where << "] "
-        << e.what()                                  // human-readable error message
-        << " | MySQL error code: " << e.getErrorCode() // numeric error code from MySQL
-        << " | SQLState: " << e.getSQLStateCStr()      // 5-character SQLState diagnostic
-        << "\n";
-}
+// Defined with the benchmarks; the caches and indexes size their memory charges with it
+size_t userVectorBytes(const std::vector<User>& users);
 
 // ---------------------------------------------------------
-// Function: ensureSchemaAndTables
-// Ensures that the desired database and table exist.
-// If not, creates them.
+// Class: MemoryGovernor
+// One process-wide memory budget shared by every subsystem that holds
+// data in memory. Each consumer charges what it allocates to its
+// Account:
+//   "cache"    result and row caches   (evictable)
+//   "index"    local indexes           (must fit; others make room)
+//   "arena"    NameArena chunks        (must fit; others make room)
+//   "buffers"  import batches in flight (wait for room: backpressure)
+// An account's weight sets its share of the budget. A consumer may
+// use more than its share while the total is under budget; once the
+// budget is reached, accounts that registered a reclaimer (the
+// caches) are asked to free memory, largest overshoot first. What
+// happens then depends on how the memory was asked for: tryCharge()
+// fails, forceCharge() goes over anyway, and charge() waits for
+// other consumers to release.
+// With no budget set (the default) nothing is ever refused; usage is
+// still tracked. APP_MEMORY_BUDGET_MB sets the budget at startup.
+//
+// Metrics: memory.budget_bytes, memory.used_bytes, and per account
+// memory.<name>.{used_bytes,share_bytes}, memory.<name>.reclaimed_bytes,
+// memory.<name>.denied, memory.<name>.waits.
 // ---------------------------------------------------------
-void ensureSchemaAndTables(sql::Connection* con, const std::string& schema) {
-    // Create a statement object (used for executing SQL without parameters)
-    std::unique_ptr<sql::Statement> stmt(con->createStatement());
+class MemoryGovernor {
+public:
+    // Frees up to `bytes` (releasing them through the account) and
+    // returns how much it freed. Called without any governor lock held
+    // other than the one that serializes reclaiming.
+    using Reclaimer = std::function<size_t(size_t bytes)>;
 
-    // Create the database if it doesn't exist
-    stmt->execute("CREATE DATABASE IF NOT EXISTS `" + schema + "`");
+    class Account {
+    public:
+        const std::string& name() const { return name_; }
+        size_t used() const { return used_.load(std::memory_order_relaxed); }
+        size_t share() const { return gov_.shareOf(*this); }
 
-    // Switch to using that database
-    con->setSchema(schema);
+        bool tryCharge(size_t bytes) { return gov_.charge(*this, bytes, Mode::Try, {}); }
+        void forceCharge(size_t bytes) { gov_.charge(*this, bytes, Mode::Force, {}); }
+        bool charge(size_t bytes, std::chrono::milliseconds wait) { return gov_.charge(*this, bytes, Mode::Wait, wait); }
+        void release(size_t bytes) { gov_.release(*this, bytes); }
 
-    // Create the users table (if not exists)
-    stmt->execute(
-        "CREATE TABLE IF NOT EXISTS users ("
-        "  id INT AUTO_INCREMENT PRIMARY KEY,"   // unique row ID
-        "  name VARCHAR(100) NOT NULL,"          // required string field
-        "  age INT NULL,"                        // optional integer field
-        "  UNIQUE KEY uq_users_name (name)"      // make name unique for demo purposes
-        ") ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;"
-    );
-}
+        // Returns an id for removeReclaimer(); accounts may have several
+        uint64_t addReclaimer(Reclaimer reclaim) {
+            std::lock_guard<std::mutex> lock(reclaimMu_);
+            reclaimers_.emplace(++lastReclaimer_, std::move(reclaim));
+            return lastReclaimer_;
+        }
+
+        // Blocks while a reclaim is running, so the reclaimer's owner
+        // can be destroyed right after this returns
+        void removeReclaimer(uint64_t id) {
+            std::lock_guard<std::mutex> lock(reclaimMu_);
+            reclaimers_.erase(id);
+        }
+
+    private:
+        friend class MemoryGovernor;
+
+        Account(MemoryGovernor& gov, std::string name, double weight);  // after Metrics
+
+        size_t reclaim(size_t bytes) {
+            std::lock_guard<std::mutex> lock(reclaimMu_);
+            size_t freed = 0;
+            for (auto& r : reclaimers_) {
+                if (freed >= bytes) break;
+                freed += r.second(bytes - freed);
+            }
+            reclaimed_ += freed;
+            return freed;
+        }
+
+        MemoryGovernor&             gov_;
+        std::string                 name_;
+        double                      weight_;
+        std::atomic<size_t>         used_{ 0 };
+        std::mutex                  reclaimMu_;
+        std::map<uint64_t, Reclaimer> reclaimers_;
+        uint64_t                    lastReclaimer_ = 0;
+        std::atomic<uint64_t>&      reclaimed_;
+        std::atomic<uint64_t>&      denied_;
+        std::atomic<uint64_t>&      waits_;
+    };
+
+    // RAII: holds `bytes()` charged to an account and releases them on
+    // destruction. Owners resize it as their footprint changes.
+    class Reservation {
+    public:
+        explicit Reservation(Account& account) : account_(&account) {}
+        Reservation(Reservation&& o) noexcept : account_(o.account_), bytes_(o.bytes_) { o.bytes_ = 0; }
+        Reservation& operator=(Reservation&& o) noexcept {
+            if (this != &o) {
+                resize(0);
+                account_ = o.account_;
+                bytes_ = o.bytes_;
+                o.bytes_ = 0;
+            }
+            return *this;
+        }
+        ~Reservation() { resize(0); }
+
+        // Growing asks for the difference (tryCharge, or charge with a
+        // wait when `wait` > 0); shrinking always succeeds
+        bool resize(size_t bytes, std::chrono::milliseconds wait = std::chrono::milliseconds(0)) {
+            if (bytes > bytes_) {
+                size_t more = bytes - bytes_;
+                if (!(wait.count() > 0 ? account_->charge(more, wait) : account_->tryCharge(more))) return false;
+            }
+            else if (bytes < bytes_) account_->release(bytes_ - bytes);
+            bytes_ = bytes;
+            return true;
+        }
+
+        void forceResize(size_t bytes) {
+            if (bytes > bytes_) account_->forceCharge(bytes - bytes_);
+            else if (bytes < bytes_) account_->release(bytes_ - bytes);
+            bytes_ = bytes;
+        }
+
+        size_t bytes() const { return bytes_; }
+
+    private:
+        Account* account_;
+        size_t   bytes_ = 0;
+    };
+
+    static MemoryGovernor& instance() {
+        static MemoryGovernor g;
+        return g;
+    }
+
+    void setBudget(size_t bytes) {
+        budget_.store(bytes);
+        std::lock_guard<std::mutex> lock(waitMu_);
+        room_.notify_all();
+    }
+
+    size_t budget() const { return budget_.load(std::memory_order_relaxed); }
+    size_t used() const { return used_.load(std::memory_order_relaxed); }
+
+    // The named account, created on first use (`weight` only counts then)
+    Account& account(const std::string& name, double weight = 1.0);
+
+private:
+    enum class Mode { Try, Force, Wait };
+
+    MemoryGovernor();
+
+    size_t shareOf(const Account& a) {
+        std::lock_guard<std::mutex> lock(accountsMu_);
+        size_t b = budget();
+        return b == SIZE_MAX ? b : static_cast<size_t>(double(b) * a.weight_ / totalWeight_);
+    }
+
+    bool charge(Account& a, size_t bytes, Mode mode, std::chrono::milliseconds wait) {
+        auto deadline = std::chrono::steady_clock::now() + wait;
+        for (;;) {
+            size_t cur = used_.load(std::memory_order_relaxed);
+            size_t b = budget();
+            while (cur <= b && bytes <= b - cur) {
+                if (used_.compare_exchange_weak(cur, cur + bytes, std::memory_order_relaxed)) {
+                    a.used_.fetch_add(bytes, std::memory_order_relaxed);
+                    return true;
+                }
+            }
+            if (reclaim(cur + bytes - b) > 0) continue;
+
+            if (mode == Mode::Force) {
+                used_.fetch_add(bytes, std::memory_order_relaxed);
+                a.used_.fetch_add(bytes, std::memory_order_relaxed);
+                return true;
+            }
+            if (mode == Mode::Try || std::chrono::steady_clock::now() >= deadline) {
+                ++a.denied_;
+                return false;
+            }
+            ++a.waits_;
+            std::unique_lock<std::mutex> lock(waitMu_);
+            ++waiters_;
+            room_.wait_until(lock, deadline, [&] { return used() + bytes <= budget(); });
+            --waiters_;
+        }
+    }
+
+    void release(Account& a, size_t bytes) {
+        a.used_.fetch_sub(bytes, std::memory_order_relaxed);
+        used_.fetch_sub(bytes, std::memory_order_relaxed);
+        if (waiters_.load() > 0) {
+            std::lock_guard<std::mutex> lock(waitMu_);
+            room_.notify_all();
+        }
+    }
+
+    // Ask evictable accounts for `bytes`, the one furthest over its
+    // share first; one reclaim at a time
+    size_t reclaim(size_t bytes) {
+        std::lock_guard<std::mutex> serialize(reclaimMu_);
+        std::vector<std::pair<double, Account*>> order;
+        {
+            std::lock_guard<std::mutex> lock(accountsMu_);
+            for (auto& a : accounts_) {
+                double share = double(budget()) * a->weight_ / totalWeight_;
+                order.push_back({ double(a->used()) - share, a.get() });
+            }
+        }
+        std::sort(order.begin(), order.end(), [](const auto& x, const auto& y) { return x.first > y.first; });
+        size_t freed = 0;
+        for (auto& o : order) {
+            if (freed >= bytes) break;
+            freed += o.second->reclaim(bytes - freed);
+        }
+        return freed;
+    }
+
+    std::atomic<size_t>                   budget_{ SIZE_MAX };
+    std::atomic<size_t>                   used_{ 0 };
+    std::mutex                            accountsMu_;
+    std::vector<std::unique_ptr<Account>> accounts_;
+    double                                totalWeight_ = 0;
+    std::mutex                            reclaimMu_;
+    std::mutex                            waitMu_;
+    std::condition_variable               room_;
+    std::atomic<int>                      waiters_{ 0 };
+};
 
 // ---------------------------------------------------------
-// Function: insertUser
-// Demonstrates an INSERT with a PreparedStatement.
-// Returns the new auto-generated ID.
+// Class: NameArena
+// Append-only storage for names that do not fit inline in a
+// CompactUser. Memory comes in large chunks that never move, so the
+// pointers handed out stay valid until the arena is cleared or
+// destroyed. Chunks are charged to the MemoryGovernor "arena"
+// account. Not thread-safe.
 // ---------------------------------------------------------
-int insertUser(sql::Connection* con, const User& u) {
-    // Create a prepared statement with placeholders '?'
-    std::unique_ptr<sql::PreparedStatement> ps(
-        con->prepareStatement("INSERT INTO users(name, age) VALUES(?, ?)")
-    );
+class NameArena {
+public:
+    static constexpr size_t kChunkSize = 64 * 1024;
 
-    // Bind values to the placeholders (1-indexed)
-    ps->setString(1, u.name);
-    if (u.age == 0) ps->setNull(2, 0);  // handle NULL properly
-    else ps->setInt(2, u.age);
+    // Copy `s` into the arena and return where it now lives
+    const char* store(std::string_view s) {
+        if (s.size() > kChunkSize - used_ || chunks_.empty()) {
+            chunks_.emplace_back(new char[std::max(kChunkSize, s.size())]);
+            used_ = 0;
+            reserved_ += std::max(kChunkSize, s.size());
+            mem_.forceResize(mem_.bytes() + std::max(kChunkSize, s.size()));
+        }
+        char* dst = chunks_.back().get() + used_;
+        std::memcpy(dst, s.data(), s.size());
+        used_ += s.size();
+        return dst;
+    }
 
-    // Execute the SQL command (no resultset expected)
-    ps->executeUpdate();
+    void clear() {
+        chunks_.clear();
+        used_ = 0;
+        reserved_ = 0;
+        mem_.forceResize(0);
+    }
 
-    // Retrieve the auto-generated ID of the inserted row
-    std::unique_ptr<sql::Statement> s(con->createStatement());
-    std::unique_ptr<sql::ResultSet> r(s->executeQuery("SELECT LAST_INSERT_ID()"));
+    size_t bytesReserved() const { return reserved_; }
 
-    if (r->next()) return r->getInt(1); // first column is the ID
-    return 0;
-}
+private:
+    std::vector<std::unique_ptr<char[]>> chunks_;
+    size_t used_ = 0;      // bytes used in the last chunk
+    size_t reserved_ = 0;  // bytes allocated in all chunks
+    MemoryGovernor::Reservation mem_{ MemoryGovernor::instance().account("arena") };
+};
 
 // ---------------------------------------------------------
-// Function: insertUsersBulk
-// Inserts multiple rows efficiently using one prepared statement.
+// Struct: CompactUser
+// A 32-byte alternative to User. Names up to kInline bytes (most
+// of them) live inside the record; longer ones (the schema allows up
+// to VARCHAR(100), i.e. 400 bytes of utf8mb4) are copied into a
+// NameArena and the record keeps a pointer to them. A vector of
+// CompactUser is one contiguous block with no per-row allocation.
 // ---------------------------------------------------------
-void insertUsersBulk(sql::Connection* con, const std::vector<User>& users) {
-    std::unique_ptr<sql::PreparedStatement> ps(
-        con->prepareStatement("INSERT INTO users(name, age) VALUES(?, ?)")
-    );
+struct CompactUser {
+    static constexpr size_t kInline = 22;
 
-    // Loop through each user and reuse the prepared statement
-    for (const auto& u : users) {
-        ps->setString(1, u.name);
-        if (u.age == 0) ps->setNull(2, 0);
-        else ps->setInt(2, u.age);
-        ps->executeUpdate();
+    int32_t  id = 0;
+    int32_t  age = 0;      // 0 = NULL, same as User
+    uint16_t len = 0;      // name length in bytes
+    char     buf[kInline]; // the name, or a pointer into a NameArena
+
+    CompactUser() = default;
+    CompactUser(int id, std::string_view name, int age, NameArena& arena) : id(id), age(age) {
+        if (name.size() > UINT16_MAX) throw std::length_error("name too long");
+        len = static_cast<uint16_t>(name.size());
+        if (len <= kInline) std::memcpy(buf, name.data(), len);
+        else {
+            const char* p = arena.store(name);
+            std::memcpy(buf, &p, sizeof p);  // buf is not pointer-aligned, so copy
+        }
     }
-}
+
+    std::string_view name() const {
+        if (len <= kInline) return std::string_view(buf, len);
+        const char* p;
+        std::memcpy(&p, buf, sizeof p);
+        return std::string_view(p, len);
+    }
+};
+static_assert(sizeof(CompactUser) == 32, "CompactUser should stay half a cache line");
 
 // ---------------------------------------------------------
-// Function: updateUserAgeByName
-// Updates a user's age by name using a parameterized UPDATE query.
-// Returns number of rows affected.
+// Class: CompactUserTable
+// A vector of CompactUser plus the arena holding its long names.
+// The read and write helpers have overloads that take this type.
 // ---------------------------------------------------------
-int updateUserAgeByName(sql::Connection* con, const std::string& name, int newAge) {
-    std::unique_ptr<sql::PreparedStatement> ps(
-        con->prepareStatement("UPDATE users SET age = ? WHERE name = ?")
-    );
-    ps->setInt(1, newAge);
-    ps->setString(2, name);
-    return ps->executeUpdate();
-}
+class CompactUserTable {
+public:
+    void push_back(int id, std::string_view name, int age) { rows_.emplace_back(id, name, age, arena_); }
+    void reserve(size_t n) { rows_.reserve(n); }
+    void clear() { rows_.clear(); arena_.clear(); }
+
+    size_t size() const { return rows_.size(); }
+    bool   empty() const { return rows_.empty(); }
+    const CompactUser& operator[](size_t i) const { return rows_[i]; }
+    std::vector<CompactUser>::const_iterator begin() const { return rows_.begin(); }
+    std::vector<CompactUser>::const_iterator end() const { return rows_.end(); }
+
+    // Heap bytes held by the table (rows plus long-name arena)
+    size_t memoryBytes() const { return rows_.capacity() * sizeof(CompactUser) + arena_.bytesReserved(); }
+
+private:
+    std::vector<CompactUser> rows_;
+    NameArena                arena_;
+};
 
 // ---------------------------------------------------------
-// Function: getUsersByMinAge
-// Runs a SELECT query with a parameter and stores results in a vector<User>
+// Class: NameInterner
+// Stores each distinct name once and hands out dense 32-bit handles
+// (0, 1, 2, ...). Two names are equal exactly when their handles are,
+// so caches and batches can compare and hash names as integers, and
+// a per-name table can simply be a vector indexed by handle.
+// Names live in a NameArena, so lookup() views stay valid for the
+// interner's lifetime. Not thread-safe.
 // ---------------------------------------------------------
-std::vector<User> getUsersByMinAge(sql::Connection* con, int minAge) {
-    std::vector<User> out;
+class NameInterner {
+public:
+    using Handle = uint32_t;
+    static constexpr Handle kNone = UINT32_MAX;
 
-    std::unique_ptr<sql::PreparedStatement> ps(
-        con->prepareStatement("SELECT id, name, age FROM users WHERE age >= ? ORDER BY age DESC, id ASC")
-    );
-    ps->setInt(1, minAge);
+    NameInterner() : slots_(1024, kNone) {}
 
-    std::unique_ptr<sql::ResultSet> rs(ps->executeQuery());
-    while (rs->next()) {
-        User u{
-            rs->getInt("id"),                 // read by column name
-            rs->getString("name"),
-            rs->isNull("age") ? 0 : rs->getInt("age")
-        };
-        out.push_back(u);
+    // Handle of `name`, adding it on first sight
+    Handle intern(std::string_view name) {
+        size_t hash = std::hash<std::string_view>()(name);
+        size_t slot = findSlot(name, hash);
+        if (slots_[slot] != kNone) return slots_[slot];
+
+        Handle h = static_cast<Handle>(entries_.size());
+        entries_.push_back({ arena_.store(name), static_cast<uint32_t>(name.size()), hash });
+        slots_[slot] = h;
+        if (entries_.size() * 4 > slots_.size() * 3) grow();  // keep load factor <= 0.75
+        return h;
+    }
+
+    // Handle of `name` if it was interned before, else kNone
+    Handle find(std::string_view name) const {
+        return slots_[findSlot(name, std::hash<std::string_view>()(name))];
+    }
+
+    std::string_view lookup(Handle h) const { return std::string_view(entries_[h].data, entries_[h].len); }
+    size_t size() const { return entries_.size(); }
+
+    size_t memoryBytes() const {
+        return arena_.bytesReserved() + entries_.capacity() * sizeof(Entry) + slots_.capacity() * sizeof(Handle);
+    }
+
+private:
+    struct Entry {
+        const char* data;
+        uint32_t    len;
+        size_t      hash;
+    };
+
+    // Linear probing: the slot holding `name`, or the empty slot where it would go
+    size_t findSlot(std::string_view name, size_t hash) const {
+        size_t mask = slots_.size() - 1;
+        for (size_t i = hash & mask;; i = (i + 1) & mask) {
+            Handle h = slots_[i];
+            if (h == kNone) return i;
+            const Entry& e = entries_[h];
+            if (e.hash == hash && std::string_view(e.data, e.len) == name) return i;
+        }
     }
-    return out;
-}
+
+    void grow() {
+        std::vector<Handle> bigger(slots_.size() * 2, kNone);
+        size_t mask = bigger.size() - 1;
+        for (Handle h = 0; h < entries_.size(); ++h) {
+            size_t i = entries_[h].hash & mask;
+            while (bigger[i] != kNone) i = (i + 1) & mask;
+            bigger[i] = h;
+        }
+        slots_.swap(bigger);
+    }
+
+    NameArena           arena_;
+    std::vector<Entry>  entries_;  // indexed by handle
+    std::vector<Handle> slots_;    // open-addressing table of handles (power of two)
+};
 
 // ---------------------------------------------------------
-// Function: demoTransaction
-// Shows how to group operations in a transaction.
-// If one fails, rollback undoes all prior changes.
+// Class: LatencyHistogram
+// Lock-free latency histogram with power-of-two microsecond buckets
+// (bucket b counts samples in [2^(b-1), 2^b) us). Good enough for
+// p50/p99/p999 to within a factor of two, at the cost of one atomic
+// increment per sample.
 // ---------------------------------------------------------
-void demoTransaction(sql::Connection* con) {
-    // Disable autocommit to start a transaction manually
-    con->setAutoCommit(false);
+class LatencyHistogram {
+public:
+    static constexpr int kBuckets = 40;
 
-    try {
-        // Insert a few users
-        insertUsersBulk(con, {
-            {0, "alice", 24},
-            {0, "bob",   29}
-            });
+    void record(std::chrono::nanoseconds d) {
+        uint64_t us = static_cast<uint64_t>(std::max<int64_t>(0, d.count() / 1000));
+        int b = 0;
+        while (us > 0 && b < kBuckets - 1) { us >>= 1; ++b; }
+        buckets_[b].fetch_add(1, std::memory_order_relaxed);
+    }
 
-        // Update one record
-        int changed = updateUserAgeByName(con, "alice", 25);
-        std::cout << "Rows updated: " << changed << "\n";
+    uint64_t count() const {
+        uint64_t n = 0;
+        for (const auto& b : buckets_) n += b.load(std::memory_order_relaxed);
+        return n;
+    }
 
-        // Uncomment to simulate an error and trigger rollback:
-        // insertUser(con, {0, "alice", 40}); // violates unique constraint
+    // Upper bound (us) of the bucket holding quantile q (0..1)
+    uint64_t percentileUs(double q) const {
+        uint64_t total = count(), seen = 0;
+        if (total == 0) return 0;
+        for (int b = 0; b < kBuckets; ++b) {
+            seen += buckets_[b].load(std::memory_order_relaxed);
+            if (seen >= q * total) return uint64_t(1) << b;
+        }
+        return uint64_t(1) << (kBuckets - 1);
+    }
 
-        // Commit changes if all succeeded
-        con->commit();
-        con->setAutoCommit(true);
-        std::cout << "Transaction committed.\n";
+    void reset() { for (auto& b : buckets_) b.store(0); }
+
+private:
+    std::atomic<uint64_t> buckets_[kBuckets] = {};
+};
+
+// ---------------------------------------------------------
+// Class: Metrics
+// Process-wide metrics surface: named counters, latency histograms
+// and gauges (callbacks read at dump time). Look a metric up once and
+// keep the reference; updating it is then a single atomic operation.
+// write() prints everything in Prometheus text format; the dotted
+// names used in code come out with '_' (cache.min_age.hits is
+// exported as cache_min_age_hits). main's --metrics flag writes the
+// file periodically (see MetricsToFile).
+// ---------------------------------------------------------
+class Metrics {
+public:
+    static Metrics& instance() {
+        static Metrics m;
+        return m;
     }
-    catch (const sql::SQLException& e) {
-        // Print the error, rollback changes
-        printSqlError(e, "demoTransaction");
-        try {
-            con->rollback();
-            std::cerr << "Transaction rolled back.\n";
+
+    std::atomic<uint64_t>& counter(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto& c = counters_[name];
+        if (!c) c = std::make_unique<std::atomic<uint64_t>>(0);
+        return *c;
+    }
+
+    LatencyHistogram& histogram(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto& h = histograms_[name];
+        if (!h) h = std::make_unique<LatencyHistogram>();
+        return *h;
+    }
+
+    // Replaces any gauge of the same name
+    void gauge(const std::string& name, std::function<double()> read) {
+        std::lock_guard<std::mutex> lock(mu_);
+        gauges_[name] = std::move(read);
+    }
+
+    void removeGauge(const std::string& name) {
+        std::lock_guard<std::mutex> lock(mu_);
+        gauges_.erase(name);
+    }
+
+    // Escapes a label value for name{label="..."}: \\, \" and \n
+    static std::string labelValue(std::string_view value) {
+        std::string out;
+        out.reserve(value.size());
+        for (char c : value) {
+            if (c == '\\' || c == '"') out += '\\';
+            if (c == '\n') out += "\\n";
+            else out += c;
         }
-        catch (const sql::SQLException& e2) {
-            printSqlError(e2, "rollback");
+        return out;
+    }
+
+    void write(std::ostream& out) {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (const auto& c : counters_) out << exportName(c.first) << " " << c.second->load() << "\n";
+        for (const auto& g : gauges_) out << exportName(g.first) << " " << g.second() << "\n";
+        for (const auto& h : histograms_) {
+            std::string name = exportName(h.first), labels;
+            size_t brace = name.find('{');
+            if (brace != std::string::npos) {
+                labels = name.substr(brace + 1, name.size() - brace - 2) + ",";
+                name.resize(brace);
+            }
+            out << name << "_count";
+            if (!labels.empty()) out << "{" << labels.substr(0, labels.size() - 1) << "}";
+            out << " " << h.second->count() << "\n";
+            for (double q : { 0.5, 0.99, 0.999 })
+                out << name << "_us{" << labels << "quantile=\"" << q << "\"} " << h.second->percentileUs(q) << "\n";
         }
-        con->setAutoCommit(true);  // restore default behavior
-        throw; // rethrow to inform caller
     }
+
+private:
+    // "pool.borrow.stolen{pool=\"a\"}" -> "pool_borrow_stolen{pool=\"a\"}":
+    // metric names may only use [a-zA-Z0-9_:]; labels are kept as is
+    static std::string exportName(std::string name) {
+        size_t end = std::min(name.find('{'), name.size());
+        for (size_t i = 0; i < end; ++i) {
+            char c = name[i];
+            bool ok = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_' || c == ':' || (i > 0 && c >= '0' && c <= '9');
+            if (!ok) name[i] = '_';
+        }
+        return name;
+    }
+
+    std::mutex mu_;
+    std::map<std::string, std::unique_ptr<std::atomic<uint64_t>>> counters_;
+    std::map<std::string, std::unique_ptr<LatencyHistogram>>      histograms_;
+    std::map<std::string, std::function<double()>>                gauges_;
+};
+
+// The MemoryGovernor members that register its metrics; the governor
+// itself comes before NameArena, which charges it
+MemoryGovernor::Account::Account(MemoryGovernor& gov, std::string name, double weight)
+    : gov_(gov), name_(std::move(name)), weight_(weight),
+      reclaimed_(Metrics::instance().counter("memory." + name_ + ".reclaimed_bytes")),
+      denied_(Metrics::instance().counter("memory." + name_ + ".denied")),
+      waits_(Metrics::instance().counter("memory." + name_ + ".waits")) {}
+
+MemoryGovernor::Account& MemoryGovernor::account(const std::string& name, double weight) {
+    std::lock_guard<std::mutex> lock(accountsMu_);
+    for (auto& a : accounts_)
+        if (a->name_ == name) return *a;
+    accounts_.emplace_back(new Account(*this, name, weight));
+    totalWeight_ += weight;
+    Account* a = accounts_.back().get();
+    Metrics::instance().gauge("memory." + name + ".used_bytes", [a] { return double(a->used()); });
+    Metrics::instance().gauge("memory." + name + ".share_bytes", [a] { return double(a->share()); });
+    return *a;
+}
+
+MemoryGovernor::MemoryGovernor() {
+    // A budget of 0 or a value that is not a number would refuse every
+    // charge; treat it as unset instead
+    if (const char* mb = std::getenv("APP_MEMORY_BUDGET_MB")) {
+        char* end = nullptr;
+        errno = 0;
+        unsigned long long v = std::strtoull(mb, &end, 10);
+        if (end == mb || *end != '\0' || errno == ERANGE || v == 0 || v > (SIZE_MAX >> 20))
+            std::cerr << "Ignoring APP_MEMORY_BUDGET_MB=\"" << mb << "\": expected a positive number of MiB\n";
+        else
+            budget_ = static_cast<size_t>(v) << 20;
+    }
+    Metrics::instance().gauge("memory.budget_bytes", [this] { return double(budget()); });
+    Metrics::instance().gauge("memory.used_bytes", [this] { return double(used()); });
+    account("cache", 4);
+    account("index", 3);
+    account("buffers", 2);
+    account("arena", 1);
 }
 
 // ---------------------------------------------------------
-// Main entry point
+// Class: HeavyHitters
+// Streaming top-K of statement parameters (which names, which minAge
+// values, ... are hot), using the Space-Saving algorithm.
+// Every thread updates its own fixed-size sketch of kSlots counters,
+// so record() takes no lock and touches no shared cache line. A
+// snapshot merges all sketches; counts are overestimates by at most
+// the reported error. Memory is bounded by kSlots per thread.
+// Sketch slots are written by their owner only and read under a
+// per-slot sequence counter, so snapshots never see a torn slot.
+//
+// publishTo() exposes the merged top-K through Metrics as gauges
+//   heavy_hitter{statement="...",key="..."} count
+// and keeps the counts of every tracked key for estimate(), which
+// cache layers use to decide admission. startPublishing() runs it on
+// a background thread. String keys are user data (names), so their
+// gauges carry key_hash="<hex>" instead of the key; numeric keys
+// (minAge) are shown as is. Keys are told apart by their full hash,
+// even when the stored text (kLabelBytes) is cut short.
 // ---------------------------------------------------------
-int main() {
-    DbConfig cfg; // Use default config values above
+class HeavyHitters {
+public:
+    static constexpr size_t kSlots = 64;
+    static constexpr size_t kLabelBytes = 56;  // "statement\x1fkey" ("\x1e" for numbers), truncated
 
-    try {
-        // Step 1: Get the driver instance (singleton)
-        sql::mysql::MySQL_Driver* driver = sql::mysql::get_mysql_driver_instance();
+    struct Item {
+        std::string statement;
+        std::string key;      // may be cut short; hash identifies it
+        uint64_t    hash;
+        bool        numeric;  // recorded with the int64_t overload
+        uint64_t    count;
+        uint64_t    error;    // count may be too high by this much
+    };
 
-        // Step 2: Create a connection to the MySQL server
-        std::unique_ptr<sql::Connection> con(driver->connect(cfg.host, cfg.user, cfg.pass));
+    static HeavyHitters& instance() {
+        Metrics::instance();  // constructed first, so it outlives the publisher
+        static HeavyHitters hh;
+        return hh;
+    }
 
-        // Step 3: Ensure the schema and users table exist
-        ensureSchemaAndTables(con.get(), cfg.schema);
+    ~HeavyHitters() {
+        {
+            std::lock_guard<std::mutex> lock(publisherMu_);
+            stopping_ = true;
+        }
+        publisherWake_.notify_all();
+        if (publisher_.joinable()) publisher_.join();
+    }
+
+    void record(const char* statement, std::string_view key) { localSketch().add(statement, key, false); }
+
+    void record(const char* statement, int64_t key) {
+        char buf[24];
+        auto res = std::to_chars(buf, buf + sizeof buf, key);
+        localSketch().add(statement, std::string_view(buf, res.ptr - buf), true);
+    }
+
+    // Merged top-k over all threads, highest count first
+    std::vector<Item> snapshot(size_t k = 20) const {
+        std::unordered_map<uint64_t, Item> merged;
+        {
+            std::lock_guard<std::mutex> lock(registryMu_);
+            for (const auto& sketch : sketches_) sketch->collect(merged);
+        }
+        std::vector<Item> items;
+        for (auto& m : merged) items.push_back(std::move(m.second));
+        std::sort(items.begin(), items.end(), [](const Item& a, const Item& b) { return a.count > b.count; });
+        if (items.size() > k) items.resize(k);
+        return items;
+    }
+
+    // Publish the top k as gauges and refresh estimate() (call
+    // periodically, or let startPublishing do it)
+    void publishTo(Metrics& metrics, size_t k = 20) {
+        std::vector<Item> all = snapshot(SIZE_MAX);
+        auto counts = std::make_shared<std::unordered_map<uint64_t, uint64_t>>();
+        for (const auto& it : all) (*counts)[it.hash] = it.count;
+        std::vector<std::string> names;
+        for (size_t i = 0; i < all.size() && i < k; ++i) {
+            const Item& it = all[i];
+            std::string name = "heavy_hitter{statement=\"" + Metrics::labelValue(it.statement) + "\",";
+            if (it.numeric) name += "key=\"" + Metrics::labelValue(it.key) + "\"}";
+            else {
+                char hex[17];
+                std::snprintf(hex, sizeof hex, "%016llx", static_cast<unsigned long long>(it.hash));
+                name += "key_hash=\"" + std::string(hex) + "\"}";
+            }
+            names.push_back(name);
+            uint64_t count = it.count;
+            metrics.gauge(names.back(), [count] { return double(count); });
+        }
+        std::lock_guard<std::mutex> lock(publishMu_);
+        for (const auto& old : published_)
+            if (std::find(names.begin(), names.end(), old) == names.end()) metrics.removeGauge(old);
+        published_ = std::move(names);
+        std::atomic_store(&lastCounts_, std::shared_ptr<const std::unordered_map<uint64_t, uint64_t>>(counts));
+    }
+
+    // Publishes every `interval` on a background thread until the
+    // process exits; later calls do nothing
+    void startPublishing(std::chrono::milliseconds interval = std::chrono::seconds(1), size_t k = 20) {
+        std::lock_guard<std::mutex> lock(publisherMu_);
+        if (publisher_.joinable()) return;
+        publisher_ = std::thread([this, interval, k] {
+            std::unique_lock<std::mutex> lock(publisherMu_);
+            while (!publisherWake_.wait_for(lock, interval, [this] { return stopping_; })) {
+                lock.unlock();
+                publishTo(Metrics::instance(), k);
+                lock.lock();
+            }
+        });
+    }
+
+    // Count of (statement, key) as of the last publish, else 0
+    uint64_t estimate(const char* statement, std::string_view key) const { return lastCount(labelHash(statement, key, false)); }
+
+    uint64_t estimate(const char* statement, int64_t key) const {
+        char buf[24];
+        auto res = std::to_chars(buf, buf + sizeof buf, key);
+        return lastCount(labelHash(statement, std::string_view(buf, res.ptr - buf), true));
+    }
+
+private:
+    static uint64_t labelHash(std::string_view statement, std::string_view key, bool numeric) {
+        uint64_t h = 14695981039346656037ull;  // FNV-1a over the untruncated label
+        for (char c : statement) h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        h = (h ^ (numeric ? 0x1e : 0x1f)) * 1099511628211ull;
+        for (char c : key) h = (h ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+        return h;
+    }
+
+    uint64_t lastCount(uint64_t hash) const {
+        auto counts = std::atomic_load(&lastCounts_);
+        if (!counts) return 0;
+        auto it = counts->find(hash);
+        return it == counts->end() ? 0 : it->second;
+    }
+
+    class Sketch {
+    public:
+        std::atomic<bool> owned{ true };
+
+        // Owner thread only
+        void add(const char* statement, std::string_view key, bool numeric) {
+            uint64_t h = labelHash(statement, key, numeric);
+            size_t minSlot = 0;
+            uint64_t minCount = UINT64_MAX;
+            for (size_t i = 0; i < kSlots; ++i) {
+                uint64_t c = count_[i].load(std::memory_order_relaxed);
+                if (c != 0 && hash_[i].load(std::memory_order_relaxed) == h) {
+                    count_[i].store(c + 1, std::memory_order_relaxed);
+                    return;
+                }
+                if (c < minCount) { minCount = c; minSlot = i; }
+            }
+            // Not tracked: take over the smallest counter (Space-Saving)
+            Slot& s = slots_[minSlot];
+            uint32_t seq = s.seq.load(std::memory_order_relaxed);
+            s.seq.store(seq + 1, std::memory_order_relaxed);  // odd: being rewritten
+            std::atomic_thread_fence(std::memory_order_release);
+            hash_[minSlot].store(h, std::memory_order_relaxed);
+            count_[minSlot].store(minCount + 1, std::memory_order_relaxed);
+            s.error.store(minCount, std::memory_order_relaxed);
+            char label[kLabelBytes] = {};
+            std::string_view st(statement);
+            size_t n = std::min(st.size(), kLabelBytes);
+            std::memcpy(label, st.data(), n);
+            if (n < kLabelBytes) label[n++] = numeric ? '\x1e' : '\x1f';
+            std::memcpy(label + n, key.data(), std::min(key.size(), kLabelBytes - n));
+            for (size_t w = 0; w < kLabelBytes / 8; ++w) {
+                uint64_t word;
+                std::memcpy(&word, label + 8 * w, 8);
+                s.label[w].store(word, std::memory_order_relaxed);
+            }
+            s.seq.store(seq + 2, std::memory_order_release);
+        }
+
+        // Any thread: add this sketch's consistent slots into `out`
+        void collect(std::unordered_map<uint64_t, Item>& out) const {
+            for (size_t i = 0; i < kSlots; ++i) {
+                const Slot& s = slots_[i];
+                for (;;) {
+                    uint32_t before = s.seq.load(std::memory_order_acquire);
+                    if (before & 1) { std::this_thread::yield(); continue; }
+                    uint64_t h = hash_[i].load(std::memory_order_relaxed);
+                    uint64_t count = count_[i].load(std::memory_order_relaxed);
+                    uint64_t error = s.error.load(std::memory_order_relaxed);
+                    char label[kLabelBytes];
+                    for (size_t w = 0; w < kLabelBytes / 8; ++w) {
+                        uint64_t word = s.label[w].load(std::memory_order_relaxed);
+                        std::memcpy(label + 8 * w, &word, 8);
+                    }
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (s.seq.load(std::memory_order_relaxed) != before) continue;
+                    if (count == 0) break;
+
+                    Item& item = out[h];
+                    if (item.count == 0) {
+                        std::string_view text(label, strnlen(label, kLabelBytes));
+                        size_t sep = text.find_first_of("\x1e\x1f");
+                        item.statement = std::string(text.substr(0, sep));
+                        item.key = sep == std::string_view::npos ? "" : std::string(text.substr(sep + 1));
+                        item.hash = h;
+                        item.numeric = sep != std::string_view::npos && text[sep] == '\x1e';
+                    }
+                    item.count += count;
+                    item.error += error;
+                    break;
+                }
+            }
+        }
+
+    private:
+        // Hashes and counts are scanned on every add, so they live in
+        // their own dense arrays; the rest is only touched on takeover
+        struct alignas(64) Slot {
+            std::atomic<uint32_t> seq{ 0 };
+            std::atomic<uint64_t> error{ 0 };
+            std::atomic<uint64_t> label[kLabelBytes / 8] = {};
+        };
+        std::atomic<uint64_t> hash_[kSlots] = {};
+        std::atomic<uint64_t> count_[kSlots] = {};
+        Slot                  slots_[kSlots];
+    };
+
+    // A thread's sketch outlives the thread (its counts still matter);
+    // the next new thread adopts it instead of allocating another
+    struct LocalHandle {
+        Sketch* sketch = nullptr;
+        ~LocalHandle() { if (sketch) sketch->owned.store(false); }
+    };
+
+    Sketch& localSketch() {
+        thread_local LocalHandle handle;
+        if (handle.sketch == nullptr) {
+            std::lock_guard<std::mutex> lock(registryMu_);
+            for (auto& s : sketches_) {
+                bool expected = false;
+                if (s->owned.compare_exchange_strong(expected, true)) { handle.sketch = s.get(); break; }
+            }
+            if (handle.sketch == nullptr) {
+                sketches_.push_back(std::make_unique<Sketch>());
+                handle.sketch = sketches_.back().get();
+            }
+        }
+        return *handle.sketch;
+    }
+
+    mutable std::mutex                   registryMu_;
+    std::vector<std::unique_ptr<Sketch>> sketches_;
+    std::mutex                           publishMu_;
+    std::vector<std::string>             published_;  // gauge names from the last publishTo
+    std::shared_ptr<const std::unordered_map<uint64_t, uint64_t>> lastCounts_;
+    std::mutex                           publisherMu_;
+    std::condition_variable              publisherWake_;
+    bool                                 stopping_ = false;
+    std::thread                          publisher_;
+};
+
+// ---------------------------------------------------------
+// Class: StatementScope
+// Marks the statement the current thread is working on, so tools
+// like the sampling profiler can attribute CPU time to it.
+// Scopes nest; the innermost one wins until it goes out of scope.
+// The name must be a string literal (it is stored, not copied).
+// ---------------------------------------------------------
+class StatementScope {
+public:
+    explicit StatementScope(const char* name) : prev_(current_) { current_ = name; }
+    ~StatementScope() { current_ = prev_; }
+    StatementScope(const StatementScope&) = delete;
+    StatementScope& operator=(const StatementScope&) = delete;
+
+    // Name of the innermost active scope on this thread, or nullptr
+    static const char* current() { return current_; }
+
+private:
+    const char* prev_;
+    // volatile: also read from the profiler's signal handler on this thread
+    static thread_local const char* volatile current_;
+};
+
+thread_local const char* volatile StatementScope::current_ = nullptr;
+
+// ---------------------------------------------------------
+// Helper function: printSqlError
+// Prints all possible details of a sql::SQLException
+// ---------------------------------------------------------
+void printSqlError(const sql::SQLException& e, const std::string& where) {
+    std::cerr << "[SQL ERROR @ " << where << "] "
+        << e.what()                                  // human-readable error message
+        << " | MySQL error code: " << e.getErrorCode() // numeric error code from MySQL
+        << " | SQLState: " << e.getSQLStateCStr()      // 5-character SQLState diagnostic
+        << "\n";
+}
+
+// ---------------------------------------------------------
+// Struct: DbError
+// What went wrong in a call made through tryCall(): the MySQL error
+// code, SQLState and message, or kCircuitOpen when the call was
+// refused without touching the server.
+// ---------------------------------------------------------
+struct DbError {
+    static constexpr int kCircuitOpen = -1;
+
+    int         code = 0;
+    std::string sqlState;
+    std::string message;
+
+    static DbError from(const sql::SQLException& e) { return { e.getErrorCode(), e.getSQLState(), e.what() }; }
+
+    bool circuitOpen() const { return code == kCircuitOpen; }
+};
+
+// ---------------------------------------------------------
+// Helper function: isConnectionError
+// True for errors that say the endpoint is unreachable or dropped us
+// (SQLState class 08, "server has gone away", "lost connection",
+// server shutdown), as opposed to errors in the statement itself.
+// ---------------------------------------------------------
+bool isConnectionError(int code, const std::string& sqlState) {
+    if (sqlState.compare(0, 2, "08") == 0) return true;
+    switch (code) {
+    case 1053:  // ER_SERVER_SHUTDOWN
+    case 2002:  // CR_CONNECTION_ERROR
+    case 2003:  // CR_CONN_HOST_ERROR
+    case 2006:  // CR_SERVER_GONE_ERROR
+    case 2013:  // CR_SERVER_LOST
+    case 2055:  // CR_SERVER_LOST_EXTENDED
+    case 4031:  // ER_CLIENT_INTERACTION_TIMEOUT
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool isConnectionError(const DbError& e) { return isConnectionError(e.code, e.sqlState); }
+
+// ---------------------------------------------------------
+// Class template: DbResult
+// A value or a DbError, for callers that would rather branch than
+// catch (DbResult<void> carries only the error).
+// ---------------------------------------------------------
+template <typename T>
+class DbResult {
+public:
+    DbResult(T value) : value_(std::move(value)) {}
+    DbResult(DbError error) : error_(std::move(error)) {}
+
+    bool ok() const { return value_.has_value(); }
+    explicit operator bool() const { return ok(); }
+
+    T&             value() { return *value_; }
+    const T&       value() const { return *value_; }
+    const DbError& error() const { return error_; }
+
+private:
+    std::optional<T> value_;
+    DbError          error_;
+};
+
+template <>
+class DbResult<void> {
+public:
+    DbResult() = default;
+    DbResult(DbError error) : ok_(false), error_(std::move(error)) {}
+
+    bool ok() const { return ok_; }
+    explicit operator bool() const { return ok_; }
+
+    const DbError& error() const { return error_; }
+
+private:
+    bool    ok_ = true;
+    DbError error_;
+};
+
+// ---------------------------------------------------------
+// Struct: CircuitBreakerOptions
+// ---------------------------------------------------------
+struct CircuitBreakerOptions {
+    int                       failureThreshold = 5;  // consecutive connection errors that open the circuit
+    std::chrono::milliseconds openFor{ 5000 };       // how long calls fail fast before a probe
+};
+
+// ---------------------------------------------------------
+// Class: CircuitBreaker
+// Stops calls to an endpoint that is down from each waiting out the
+// connect or read timeout.
+// Closed: calls go through; failureThreshold connection errors in a
+// row open the circuit. Open: calls are refused at once (tryCall
+// returns DbError::kCircuitOpen) for openFor. Half-open: after that,
+// one call is let through as a probe; if it reaches the server the
+// circuit closes, if not it opens for another openFor. Errors the
+// server itself returns (bad SQL, duplicate key) count as success,
+// since the endpoint answered.
+//
+// One breaker per endpoint, shared by every pool and helper talking
+// to it: CircuitBreaker::forEndpoint(cfg), keyed by user and server
+// address, so "tcp://127.0.0.1:3306" and "127.0.0.1" share one.
+// connectDb() opens every connection the app makes from a DbConfig
+// through it, so with the server down connects fail fast by default.
+// The closed path is one atomic load.
+//
+// Metrics: breaker.state{endpoint="..."} (0 closed, 1 open, 2 half
+// open), breaker.opened{...} and breaker.rejected{...}.
+// ---------------------------------------------------------
+class CircuitBreaker {
+public:
+    enum class State { Closed = 0, Open = 1, HalfOpen = 2 };
+
+    // What allow() granted; abandon() needs it back
+    enum class Permit { Refused, Call, Probe };
+
+    CircuitBreaker(const std::string& endpoint, const CircuitBreakerOptions& opts = {})
+        : endpoint_(endpoint), opts_(opts),
+          opened_(Metrics::instance().counter("breaker.opened{endpoint=\"" + Metrics::labelValue(endpoint) + "\"}")),
+          rejected_(Metrics::instance().counter("breaker.rejected{endpoint=\"" + Metrics::labelValue(endpoint) + "\"}")) {
+        Metrics::instance().gauge(stateGauge(), [this] { return double(int(state_.load())); });
+    }
+
+    ~CircuitBreaker() { Metrics::instance().removeGauge(stateGauge()); }
+
+    CircuitBreaker(const CircuitBreaker&) = delete;
+    CircuitBreaker& operator=(const CircuitBreaker&) = delete;
+
+    // The process-wide breaker for an endpoint; opts apply on first use
+    static CircuitBreaker& forEndpoint(const std::string& endpoint, const CircuitBreakerOptions& opts = {}) {
+        Metrics::instance();  // constructed first, so it outlives the breakers' gauges
+        static std::mutex mu;
+        static std::map<std::string, std::unique_ptr<CircuitBreaker>> breakers;
+        std::lock_guard<std::mutex> lock(mu);
+        auto& b = breakers[endpoint];
+        if (!b) b = std::make_unique<CircuitBreaker>(endpoint, opts);
+        return *b;
+    }
+
+    static CircuitBreaker& forEndpoint(const DbConfig& cfg, const CircuitBreakerOptions& opts = {}) {
+        return forEndpoint(endpointOf(cfg), opts);
+    }
+
+    // "user@host:port" (or "user@unix:/path"): the scheme is dropped,
+    // the host lowercased and the default port filled in
+    static std::string endpointOf(const DbConfig& cfg) {
+        std::string addr = cfg.host;
+        if (addr.compare(0, 7, "unix://") == 0) return cfg.user + "@unix:" + addr.substr(7);
+        if (addr.compare(0, 6, "tcp://") == 0) addr.erase(0, 6);
+        for (char& c : addr) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+        size_t colon = addr.rfind(':');
+        if (colon == std::string::npos || addr.back() == ']') addr += ":3306";  // "[::1]" has colons but no port
+        return cfg.user + "@" + addr;
+    }
+
+    // Whether a call may go ahead; every Call or Probe must be followed
+    // by onSuccess(permit), onFailure(permit) or abandon(permit)
+    Permit allow() {
+        if (state_.load(std::memory_order_acquire) == State::Closed) return Permit::Call;
+        std::lock_guard<std::mutex> lock(mu_);
+        if (state_ == State::Open && std::chrono::steady_clock::now() >= probeAt_) {
+            state_.store(State::HalfOpen);
+            probing_ = false;
+        }
+        if (state_ == State::Closed) return Permit::Call;
+        if (state_ == State::HalfOpen && !probing_) {
+            probing_ = true;
+            return Permit::Probe;
+        }
+        ++rejected_;
+        return Permit::Refused;
+    }
+
+    // The endpoint answered. Only the probe closes a half-open circuit;
+    // a Call granted before the circuit opened changes nothing once it has
+    void onSuccess(Permit permit) {
+        if (permit == Permit::Call) {
+            failures_.store(0, std::memory_order_relaxed);
+            return;
+        }
+        if (permit != Permit::Probe) return;
+        std::lock_guard<std::mutex> lock(mu_);
+        state_.store(State::Closed);
+        failures_.store(0, std::memory_order_relaxed);
+        probing_ = false;
+    }
+
+    // The endpoint could not be reached. Calls count towards
+    // failureThreshold while closed; a failed probe reopens at once
+    void onFailure(Permit permit) {
+        if (permit == Permit::Call) {
+            if (state_.load(std::memory_order_acquire) != State::Closed ||
+                failures_.fetch_add(1, std::memory_order_relaxed) + 1 < opts_.failureThreshold) return;
+        }
+        else if (permit != Permit::Probe) return;
+        std::lock_guard<std::mutex> lock(mu_);
+        if (permit == Permit::Call && state_ != State::Closed) return;  // another failing call got here first
+        state_.store(State::Open);
+        probing_ = false;
+        probeAt_ = std::chrono::steady_clock::now() + opts_.openFor;
+        failures_.store(0, std::memory_order_relaxed);
+        ++opened_;
+    }
+
+    // The call ended without telling us anything about the endpoint;
+    // only an abandoned probe lets the next call probe instead
+    void abandon(Permit permit) {
+        if (permit != Permit::Probe) return;
+        std::lock_guard<std::mutex> lock(mu_);
+        probing_ = false;
+    }
+
+    State state() const { return state_.load(); }
+    const std::string& endpoint() const { return endpoint_; }
+
+private:
+    std::string stateGauge() const { return "breaker.state{endpoint=\"" + Metrics::labelValue(endpoint_) + "\"}"; }
+
+    std::string                           endpoint_;
+    CircuitBreakerOptions                 opts_;
+    std::atomic<State>                    state_{ State::Closed };
+    std::atomic<int>                      failures_{ 0 };
+    std::mutex                            mu_;
+    bool                                  probing_ = false;  // a half-open probe is in flight
+    std::chrono::steady_clock::time_point probeAt_;
+    std::atomic<uint64_t>& opened_;
+    std::atomic<uint64_t>& rejected_;
+};
+
+// ---------------------------------------------------------
+// Function: tryCall
+// Runs fn() behind the breaker and returns its result or the error
+// instead of throwing sql::SQLException. While the circuit is open it
+// returns DbError::kCircuitOpen without calling fn. Other exception
+// types still propagate.
+//
+//   auto users = tryCall(CircuitBreaker::forEndpoint(cfg),
+//                        [&] { return getUsersByMinAge(con, 25); });
+//   if (!users) ... users.error().message ...
+// ---------------------------------------------------------
+template <typename Fn>
+auto tryCall(CircuitBreaker& breaker, Fn&& fn) -> DbResult<decltype(fn())> {
+    using R = decltype(fn());
+    CircuitBreaker::Permit permit = breaker.allow();
+    if (permit == CircuitBreaker::Permit::Refused)
+        return DbError{ DbError::kCircuitOpen, "08001", "circuit open for " + breaker.endpoint() };
+    try {
+        if constexpr (std::is_void_v<R>) {
+            fn();
+            breaker.onSuccess(permit);
+            return {};
+        }
+        else {
+            R value = fn();
+            breaker.onSuccess(permit);
+            return value;
+        }
+    }
+    catch (const sql::SQLException& e) {
+        DbError err = DbError::from(e);
+        if (isConnectionError(err)) breaker.onFailure(permit);
+        else breaker.onSuccess(permit);
+        return err;
+    }
+    catch (...) {
+        breaker.abandon(permit);
+        throw;
+    }
+}
+
+// ---------------------------------------------------------
+// Function: connectDb
+// driver->connect for cfg through the endpoint's CircuitBreaker.
+// While the circuit is open it throws sql::SQLException at once
+// (error code DbError::kCircuitOpen, SQLState 08001) instead of
+// waiting out the connect timeout again.
+// ---------------------------------------------------------
+std::unique_ptr<sql::Connection> connectDb(sql::Driver* driver, const DbConfig& cfg) {
+    auto con = tryCall(CircuitBreaker::forEndpoint(cfg),
+        [&] { return std::unique_ptr<sql::Connection>(driver->connect(cfg.host, cfg.user, cfg.pass)); });
+    if (!con) throw sql::SQLException(con.error().message, con.error().sqlState, con.error().code);
+    return std::move(con.value());
+}
+
+// ---------------------------------------------------------
+// Function: ensureSchemaAndTables
+// Ensures that the desired database and table exist.
+// If not, creates them.
+// ---------------------------------------------------------
+void ensureSchemaAndTables(sql::Connection* con, const std::string& schema) {
+    StatementScope scope("ensureSchemaAndTables");
+    // Create a statement object (used for executing SQL without parameters)
+    std::unique_ptr<sql::Statement> stmt(con->createStatement());
+
+    // Create the database if it doesn't exist
+    stmt->execute("CREATE DATABASE IF NOT EXISTS `" + schema + "`");
+
+    // Switch to using that database
+    con->setSchema(schema);
+
+    // Create the users table (if not exists)
+    stmt->execute(
+        "CREATE TABLE IF NOT EXISTS users ("
+        "  id INT AUTO_INCREMENT PRIMARY KEY,"   // unique row ID
+        "  name VARCHAR(100) NOT NULL,"          // required string field
+        "  age INT NULL,"                        // optional integer field
+        "  UNIQUE KEY uq_users_name (name)"      // make name unique for demo purposes
+        ") ENGINE=InnoDB DEFAULT CHARSET=utf8mb4;"
+    );
+}
+
+// ---------------------------------------------------------
+// Helper function: bindNameAge
+// Binds a (name, age) pair to placeholders col and col + 1.
+// An age of 0 is stored as NULL.
+// ---------------------------------------------------------
+void bindNameAge(sql::PreparedStatement* ps, unsigned int col, std::string_view name, int age) {
+    ps->setString(col, sql::SQLString(name.data(), name.size()));
+    if (age == 0) ps->setNull(col + 1, 0);  // handle NULL properly
+    else ps->setInt(col + 1, age);
+}
+
+// ---------------------------------------------------------
+// Class: UserWriteHooks
+// Process-wide callbacks told about every write the users helpers
+// below make: insertUser, insertUsersBulk, insertUserBatch (and so
+// importUsers), updateUserAgeByName and their pooled variants. Local
+// copies of the table, like the CachedUserQueries indexes, use them
+// to follow writes made without them.
+// A callback runs on the writing thread right after the statement,
+// before any commit, so a write that is rolled back later is still
+// reported. Callbacks run one at a time, under a lock that remove()
+// also takes. Once remove() returns, the callback's owner can go.
+// With nothing registered, a write pays one atomic load.
+// ---------------------------------------------------------
+class UserWriteHooks {
+public:
+    struct Write {
+        enum Kind { Insert, Update } kind;
+        int              id;    // Insert: the new id, 0 when the helper does not read it back
+        std::string_view name;  // as written, not folded
+        int              age;   // Update: the new age
+    };
+    using Hook = std::function<void(const Write&)>;
+
+    static UserWriteHooks& instance() {
+        static UserWriteHooks hooks;
+        return hooks;
+    }
+
+    // Returns an id for remove()
+    uint64_t add(Hook hook) {
+        std::lock_guard<std::mutex> lock(mu_);
+        hooks_.emplace(++lastId_, std::move(hook));
+        active_.store(true, std::memory_order_release);
+        return lastId_;
+    }
+
+    void remove(uint64_t id) {
+        std::lock_guard<std::mutex> lock(mu_);
+        hooks_.erase(id);
+        active_.store(!hooks_.empty(), std::memory_order_release);
+    }
+
+    void inserted(int id, std::string_view name, int age) {
+        if (active_.load(std::memory_order_acquire)) notify({ Write::Insert, id, name, age });
+    }
+
+    void updated(std::string_view name, int newAge) {
+        if (active_.load(std::memory_order_acquire)) notify({ Write::Update, 0, name, newAge });
+    }
+
+private:
+    void notify(const Write& w) {
+        std::lock_guard<std::mutex> lock(mu_);
+        for (auto& h : hooks_) h.second(w);
+    }
+
+    std::mutex               mu_;
+    std::map<uint64_t, Hook> hooks_;
+    uint64_t                 lastId_ = 0;
+    std::atomic<bool>        active_{ false };
+};
+
+// ---------------------------------------------------------
+// Function: insertUser
+// Demonstrates an INSERT with a PreparedStatement.
+// Returns the new auto-generated ID.
+// ---------------------------------------------------------
+int insertUser(sql::Connection* con, std::string_view name, int age) {
+    StatementScope scope("insertUser");
+    HeavyHitters::instance().record("insertUser", name);
+    // Create a prepared statement with placeholders '?'
+    std::unique_ptr<sql::PreparedStatement> ps(
+        con->prepareStatement("INSERT INTO users(name, age) VALUES(?, ?)")
+    );
+
+    // Bind values to the placeholders (1-indexed)
+    bindNameAge(ps.get(), 1, name, age);
+
+    // Execute the SQL command (no resultset expected)
+    ps->executeUpdate();
+
+    // Retrieve the auto-generated ID of the inserted row
+    std::unique_ptr<sql::Statement> s(con->createStatement());
+    std::unique_ptr<sql::ResultSet> r(s->executeQuery("SELECT LAST_INSERT_ID()"));
+
+    int id = r->next() ? r->getInt(1) : 0;  // first column is the ID
+    UserWriteHooks::instance().inserted(id, name, age);
+    return id;
+}
+
+int insertUser(sql::Connection* con, const User& u) { return insertUser(con, u.name, u.age); }
+int insertUser(sql::Connection* con, const CompactUser& u) { return insertUser(con, u.name(), u.age); }
+
+// ---------------------------------------------------------
+// Function: insertUsersBulk
+// Inserts multiple rows efficiently using one prepared statement.
+// Works for vector<User> and CompactUserTable alike.
+// ---------------------------------------------------------
+inline std::string_view userName(const User& u) { return u.name; }
+inline std::string_view userName(const CompactUser& u) { return u.name(); }
+
+template <typename Rows>
+void insertUsersBulkImpl(sql::Connection* con, const Rows& users) {
+    StatementScope scope("insertUsersBulk");
+    for (const auto& u : users) HeavyHitters::instance().record("insertUsersBulk", userName(u));
+    std::unique_ptr<sql::PreparedStatement> ps(
+        con->prepareStatement("INSERT INTO users(name, age) VALUES(?, ?)")
+    );
+
+    // Loop through each user and reuse the prepared statement
+    for (const auto& u : users) {
+        bindNameAge(ps.get(), 1, userName(u), u.age);
+        ps->executeUpdate();
+        UserWriteHooks::instance().inserted(0, userName(u), u.age);
+    }
+}
+
+void insertUsersBulk(sql::Connection* con, const std::vector<User>& users) { insertUsersBulkImpl(con, users); }
+void insertUsersBulk(sql::Connection* con, const CompactUserTable& users) { insertUsersBulkImpl(con, users); }
+
+// ---------------------------------------------------------
+// Function: updateUserAgeByName
+// Updates a user's age by name using a parameterized UPDATE query.
+// Returns number of rows affected.
+// ---------------------------------------------------------
+int updateUserAgeByName(sql::Connection* con, std::string_view name, int newAge) {
+    StatementScope scope("updateUserAgeByName");
+    HeavyHitters::instance().record("updateUserAgeByName", name);
+    std::unique_ptr<sql::PreparedStatement> ps(
+        con->prepareStatement("UPDATE users SET age = ? WHERE name = ?")
+    );
+    ps->setInt(1, newAge);
+    ps->setString(2, sql::SQLString(name.data(), name.size()));
+    int changed = ps->executeUpdate();
+    if (changed > 0) UserWriteHooks::instance().updated(name, newAge);
+    return changed;
+}
+
+// ---------------------------------------------------------
+// Function: getUsersByMinAge
+// Runs a SELECT query with a parameter and stores results in a vector<User>
+// ---------------------------------------------------------
+std::vector<User> getUsersByMinAge(sql::Connection* con, int minAge) {
+    StatementScope scope("getUsersByMinAge");
+    HeavyHitters::instance().record("getUsersByMinAge", minAge);
+    std::vector<User> out;
+
+    std::unique_ptr<sql::PreparedStatement> ps(
+        con->prepareStatement("SELECT id, name, age FROM users WHERE age >= ? ORDER BY age DESC, id ASC")
+    );
+    ps->setInt(1, minAge);
+
+    std::unique_ptr<sql::ResultSet> rs(ps->executeQuery());
+    while (rs->next()) {
+        User u{
+            rs->getInt("id"),                 // read by column name
+            rs->getString("name"),
+            rs->isNull("age") ? 0 : rs->getInt("age")
+        };
+        out.push_back(u);
+    }
+    return out;
+}
+
+// Same query, decoded into a CompactUserTable (reads columns by index)
+void getUsersByMinAge(sql::Connection* con, int minAge, CompactUserTable& out) {
+    StatementScope scope("getUsersByMinAge");
+    HeavyHitters::instance().record("getUsersByMinAge", minAge);
+    out.clear();
+
+    std::unique_ptr<sql::PreparedStatement> ps(
+        con->prepareStatement("SELECT id, name, age FROM users WHERE age >= ? ORDER BY age DESC, id ASC")
+    );
+    ps->setInt(1, minAge);
+
+    std::unique_ptr<sql::ResultSet> rs(ps->executeQuery());
+    out.reserve(rs->rowsCount());  // results are buffered, so the count is known
+    while (rs->next()) {
+        // getString's own copy is the only one: the bytes go straight
+        // into the row (or the table's arena), no std::string in between
+        sql::SQLString name = rs->getString(2);
+        out.push_back(rs->getInt(1), std::string_view(name.c_str(), name.length()), rs->isNull(3) ? 0 : rs->getInt(3));
+    }
+}
+
+// ---------------------------------------------------------
+// Helper functions: foldNameByte / foldNameKey
+// Names the way uq_users_name sees them, as far as we can without
+// ICU: the default utf8mb4_0900_ai_ci collation treats "Bob" and
+// "bob" as the same name, so ASCII letters fold to lower case; every
+// other byte is kept as-is. Two names are duplicates for the server
+// exactly when their folded keys are equal.
+// ---------------------------------------------------------
+inline unsigned char foldNameByte(unsigned char c) { return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c; }
+
+std::string foldNameKey(std::string_view name) {
+    std::string key(name);
+    for (char& c : key) c = static_cast<char>(foldNameByte(static_cast<unsigned char>(c)));
+    return key;
+}
+
+// ---------------------------------------------------------
+// Function: compareNameKeys
+// Three-way compare of two names the way uq_users_name sees them
+// (see foldNameKey), without building the folded keys.
+// ---------------------------------------------------------
+int compareNameKeys(std::string_view a, std::string_view b) {
+    size_t n = std::min(a.size(), b.size());
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char ca = foldNameByte(static_cast<unsigned char>(a[i]));
+        unsigned char cb = foldNameByte(static_cast<unsigned char>(b[i]));
+        if (ca != cb) return ca < cb ? -1 : 1;
+    }
+    return a.size() == b.size() ? 0 : (a.size() < b.size() ? -1 : 1);
+}
+
+// compareNameKeys as a (transparent) less-than, for sorted containers
+struct NameKeyLess {
+    using is_transparent = void;
+    bool operator()(std::string_view a, std::string_view b) const { return compareNameKeys(a, b) < 0; }
+};
+
+// ---------------------------------------------------------
+// Class: FrontCodedNames
+// A read-only, compressed, sorted set of names, in byte order or,
+// with foldCase, in compareNameKeys order (names that differ only in
+// ASCII case are the same name, as in uq_users_name).
+// Names are grouped in blocks of kBlock. The first name of a block is
+// stored whole; every other one stores only how many leading bytes
+// it shares with its predecessor plus the remaining suffix, which
+// removes most of the bytes of a sorted name list. Lengths are
+// varints.
+//   get(i)          decodes one name (at most kBlock - 1 steps)
+//   lowerBound(k)   binary search on block heads, then one block scan
+//   prefixRange(p)  ranks of all names starting with p
+// ---------------------------------------------------------
+class FrontCodedNames {
+public:
+    static constexpr size_t kBlock = 16;
+    static constexpr size_t npos = SIZE_MAX;
+
+    FrontCodedNames() = default;
+
+    // `sorted` must be sorted and free of duplicates in the set's order
+    explicit FrontCodedNames(const std::vector<std::string>& sorted, bool foldCase = false) : fold_(foldCase) {
+        for (size_t i = 0; i < sorted.size(); ++i) {
+            const std::string& s = sorted[i];
+            rawBytes_ += s.size();
+            if (i % kBlock == 0) {
+                blockStarts_.push_back(static_cast<uint32_t>(bytes_.size()));
+                putVarint(s.size());
+                bytes_ += s;
+            }
+            else {
+                const std::string& prev = sorted[i - 1];
+                size_t shared = 0;
+                while (shared < s.size() && shared < prev.size() && s[shared] == prev[shared]) ++shared;
+                putVarint(shared);
+                putVarint(s.size() - shared);
+                bytes_.append(s, shared, std::string::npos);
+            }
+        }
+        count_ = sorted.size();
+        bytes_.shrink_to_fit();
+        blockStarts_.shrink_to_fit();
+    }
+
+    size_t size() const { return count_; }
+
+    // Name with rank i
+    std::string get(size_t i) const {
+        std::string out;
+        size_t pos;
+        seek(i, pos, out);
+        return out;
+    }
+
+    // Rank of the first name >= key (size() if none)
+    size_t lowerBound(std::string_view key) const {
+        std::string scratch;
+        return lowerBound(key, scratch);
+    }
+
+    // Rank of `name`, or npos
+    size_t find(std::string_view name) const {
+        std::string at;
+        size_t r = lowerBound(name, at);
+        return r < count_ && compare(at, name) == 0 ? r : npos;
+    }
+
+    // Ranks [first, last) of the names that start with `prefix`
+    std::pair<size_t, size_t> prefixRange(std::string_view prefix) const {
+        size_t first = lowerBound(prefix);
+        // Smallest string greater than every string with this prefix
+        std::string next = fold_ ? foldNameKey(prefix) : std::string(prefix);
+        while (!next.empty() && static_cast<unsigned char>(next.back()) == 0xFF) next.pop_back();
+        if (next.empty()) return { first, count_ };
+        next.back() = static_cast<char>(static_cast<unsigned char>(next.back()) + 1);
+        if (fold_ && next.back() >= 'A' && next.back() <= 'Z') next.back() = '[';  // upper case sorts as lower case
+        return { first, lowerBound(next) };
+    }
+
+    // Calls fn(name) for ranks [first, last), decoding sequentially
+    template <typename Fn>
+    void forEach(size_t first, size_t last, Fn&& fn) const {
+        if (first >= last) return;
+        std::string cur;
+        size_t pos;
+        seek(first, pos, cur);
+        fn(std::string_view(cur));
+        for (size_t i = first + 1; i < last; ++i) {
+            // Blocks are contiguous, so pos is already at the next block's head
+            if (i % kBlock == 0) decodeHead(pos, cur);
+            else decodeNext(pos, cur);
+            fn(std::string_view(cur));
+        }
+    }
+
+    size_t memoryBytes() const { return bytes_.capacity() + blockStarts_.capacity() * sizeof(uint32_t); }
+    size_t rawBytes() const { return rawBytes_; }  // sum of the names' lengths
+
+private:
+    int compare(std::string_view a, std::string_view b) const { return fold_ ? compareNameKeys(a, b) : a.compare(b); }
+
+    void putVarint(size_t v) {
+        while (v >= 0x80) {
+            bytes_ += static_cast<char>((v & 0x7F) | 0x80);
+            v >>= 7;
+        }
+        bytes_ += static_cast<char>(v);
+    }
+
+    size_t getVarint(size_t& pos) const {
+        size_t v = 0;
+        for (int shift = 0;; shift += 7) {
+            unsigned char b = static_cast<unsigned char>(bytes_[pos++]);
+            v |= size_t(b & 0x7F) << shift;
+            if (b < 0x80) return v;
+        }
+    }
+
+    // Block heads are stored whole, so they can be compared in place
+    std::string_view headView(size_t block) const {
+        size_t pos = blockStarts_[block];
+        size_t len = getVarint(pos);
+        return std::string_view(bytes_).substr(pos, len);
+    }
+
+    // lowerBound that also leaves the name at the returned rank in `at`
+    size_t lowerBound(std::string_view key, std::string& at) const {
+        if (blockStarts_.empty()) return 0;
+        // Last block whose head is <= key
+        size_t lo = 0, hi = blockStarts_.size();
+        while (hi - lo > 1) {
+            size_t mid = (lo + hi) / 2;
+            if (compare(headView(mid), key) <= 0) lo = mid;
+            else hi = mid;
+        }
+
+        size_t pos = blockStarts_[lo];
+        decodeHead(pos, at);
+        size_t rank = lo * kBlock;
+        size_t end = std::min(count_, rank + kBlock);
+        while (rank < end && compare(at, key) < 0) {
+            if (++rank < count_) {
+                // Stepping past the block lands on the next block's head
+                if (rank % kBlock == 0) decodeHead(pos, at);
+                else decodeNext(pos, at);
+            }
+        }
+        return rank;
+    }
+
+    void decodeHead(size_t& pos, std::string& out) const {
+        size_t len = getVarint(pos);
+        out.assign(bytes_, pos, len);
+        pos += len;
+    }
+
+    void decodeNext(size_t& pos, std::string& out) const {
+        size_t shared = getVarint(pos);
+        size_t len = getVarint(pos);
+        out.resize(shared);
+        out.append(bytes_, pos, len);
+        pos += len;
+    }
+
+    // Decode the name with rank i into out; pos ends just after it
+    void seek(size_t i, size_t& pos, std::string& out) const {
+        pos = blockStarts_[i / kBlock];
+        decodeHead(pos, out);
+        for (size_t k = 0; k < i % kBlock; ++k) decodeNext(pos, out);
+    }
+
+    std::string           bytes_;        // the encoded blocks
+    std::vector<uint32_t> blockStarts_;  // offset of each block in bytes_
+    size_t                count_ = 0;
+    size_t                rawBytes_ = 0;
+    bool                  fold_ = false;
+};
+
+// ---------------------------------------------------------
+// Class: NameIdIndex
+// In-process name -> id lookup for the whole users table, backed by
+// FrontCodedNames. Names compare like uq_users_name (compareNameKeys),
+// so "BOB" finds "bob". The ids sit in a plain array in rank order.
+// Built from one scan; rebuild it to pick up changes.
+// Charged to the MemoryGovernor "index" account.
+// ---------------------------------------------------------
+class NameIdIndex {
+public:
+    // Scan users and build the index
+    void load(sql::Connection* con) {
+        StatementScope scope("NameIdIndex::load");
+        std::vector<std::pair<std::string, int>> rows;
+        std::unique_ptr<sql::Statement> s(con->createStatement());
+        std::unique_ptr<sql::ResultSet> rs(s->executeQuery("SELECT name, id FROM users"));
+        while (rs->next()) rows.emplace_back(rs->getString(1).asStdString(), rs->getInt(2));
+        build(std::move(rows));
+    }
+
+    void build(std::vector<std::pair<std::string, int>> rows) {
+        std::sort(rows.begin(), rows.end(), [](const auto& a, const auto& b) { return NameKeyLess()(a.first, b.first); });
+        std::vector<std::string> names;
+        ids_.clear();
+        for (auto& r : rows) {
+            if (!names.empty() && compareNameKeys(names.back(), r.first) == 0) continue;  // same name for the server
+            names.push_back(std::move(r.first));
+            ids_.push_back(r.second);
+        }
+        ids_.shrink_to_fit();
+        names_ = FrontCodedNames(names, true);
+        mem_.forceResize(memoryBytes());
+    }
+
+    // Id of `name`, or 0 if unknown
+    int idOf(std::string_view name) const {
+        size_t r = names_.find(name);
+        return r == FrontCodedNames::npos ? 0 : ids_[r];
+    }
+
+    const FrontCodedNames& names() const { return names_; }
+    size_t memoryBytes() const { return names_.memoryBytes() + ids_.capacity() * sizeof(int); }
+
+private:
+    FrontCodedNames  names_;
+    std::vector<int> ids_;  // id of the name with rank i
+    MemoryGovernor::Reservation mem_{ MemoryGovernor::instance().account("index") };
+};
+
+// ---------------------------------------------------------
+// Class: AgeRangeIndex
+// Local answer to getUsersByMinAge: all users ordered by
+// (age DESC, id ASC), exactly like the server query.
+//
+// The bulk of the rows sit in a static array sorted in that order,
+// so "age >= minAge" is always a prefix of it. The prefix end is
+// found by searching the distinct ages, kept in Eytzinger (BFS)
+// layout: the top levels of the implicit search tree share cache
+// lines, which makes the search nearly miss-free.
+// Writes go to a small sorted delta (upserts and deletes by id) that
+// is merged in at query time and folded into the static array once
+// it grows past kMaxDelta.
+// Users with a NULL age (0) never match and are not indexed.
+// The static part is charged to the MemoryGovernor "index" account.
+// Not thread-safe.
+// ---------------------------------------------------------
+class AgeRangeIndex {
+public:
+    static constexpr size_t kMaxDelta = 4096;
+
+    // Build from a snapshot of the table
+    void build(std::vector<User> users) {
+        users.erase(std::remove_if(users.begin(), users.end(), [](const User& u) { return u.age == 0; }), users.end());
+        std::sort(users.begin(), users.end(), indexOrder);
+        rows_ = std::move(users);
+        delta_.clear();
+        deleted_.clear();
+        rebuildSearchTree();
+        mem_.forceResize(memoryBytes());
+    }
+
+    // Scan users and build the index
+    void load(sql::Connection* con) {
+        StatementScope scope("AgeRangeIndex::load");
+        build(getUsersByMinAge(con, INT_MIN));
+    }
+
+    // Record an insert or an update (matched by id)
+    void upsert(const User& u) {
+        remove(u.id);
+        if (u.age == 0) return;
+        delta_.insert(std::upper_bound(delta_.begin(), delta_.end(), u, indexOrder), u);
+        if (delta_.size() > kMaxDelta) compact();
+    }
+
+    // Record a delete
+    void remove(int id) {
+        auto it = std::find_if(delta_.begin(), delta_.end(), [&](const User& d) { return d.id == id; });
+        if (it != delta_.end()) delta_.erase(it);
+        deleted_.insert(id);  // hides any copy in rows_
+        if (deleted_.size() > kMaxDelta) compact();
+    }
+
+    // Same rows, same order as getUsersByMinAge(con, minAge)
+    std::vector<User> usersByMinAge(int minAge) const {
+        std::vector<User> out;
+        size_t end = prefixEnd(minAge);
+        auto dEnd = std::find_if(delta_.begin(), delta_.end(), [&](const User& d) { return d.age < minAge; });
+        out.reserve(end + (dEnd - delta_.begin()));
+
+        // Merge the static prefix with the matching part of the delta
+        auto d = delta_.begin();
+        for (size_t i = 0; i < end; ++i) {
+            const User& u = rows_[i];
+            if (!deleted_.empty() && deleted_.count(u.id)) continue;
+            while (d != dEnd && indexOrder(*d, u)) out.push_back(*d++);
+            out.push_back(u);
+        }
+        out.insert(out.end(), d, dEnd);
+        return out;
+    }
+
+    size_t size() const { return rows_.size() + delta_.size(); }
+
+    size_t memoryBytes() const {
+        return userVectorBytes(rows_) + tree_.capacity() * sizeof(int) + ends_.capacity() * sizeof(size_t);
+    }
+
+private:
+    static bool indexOrder(const User& a, const User& b) {
+        return a.age != b.age ? a.age > b.age : a.id < b.id;
+    }
+
+    // Number of static rows with age >= minAge
+    size_t prefixEnd(int minAge) const {
+        if (tree_.size() <= 1) return 0;  // never built, or no rows
+        // Eytzinger lower bound: first distinct age (ascending) >= minAge,
+        // i.e. the smallest age that still matches
+        size_t k = 1, n = tree_.size() - 1;
+        while (k <= n) k = 2 * k + (tree_[k] < minAge);
+        k >>= __builtin_ffsl(static_cast<long>(~k));
+        return k == 0 ? 0 : ends_[k];
+    }
+
+    void rebuildSearchTree() {
+        // Distinct ages ascending, with the end of each age's run in rows_
+        std::vector<std::pair<int, size_t>> ages;
+        for (size_t i = 0; i < rows_.size(); ++i) {
+            if (i + 1 == rows_.size() || rows_[i + 1].age != rows_[i].age) ages.push_back({ rows_[i].age, i + 1 });
+        }
+        std::reverse(ages.begin(), ages.end());
+
+        // Lay them out in BFS order (1-based, slot 0 unused)
+        tree_.assign(ages.size() + 1, 0);
+        ends_.assign(ages.size() + 1, 0);
+        size_t next = 0;
+        std::function<void(size_t)> fill = [&](size_t k) {
+            if (k > ages.size()) return;
+            fill(2 * k);
+            tree_[k] = ages[next].first;
+            ends_[k] = ages[next].second;
+            ++next;
+            fill(2 * k + 1);
+        };
+        fill(1);
+    }
+
+    // Fold the delta and deletions into the static array
+    void compact() {
+        std::vector<User> all = usersByMinAge(INT_MIN);
+        rows_.swap(all);
+        delta_.clear();
+        deleted_.clear();
+        rebuildSearchTree();
+        mem_.forceResize(memoryBytes());
+    }
+
+    std::vector<User>       rows_;    // static part, index order
+    std::vector<int>        tree_;    // distinct ages, Eytzinger layout
+    std::vector<size_t>     ends_;    // rows_ prefix length for tree_[k]
+    std::vector<User>       delta_;   // recent upserts, index order
+    std::unordered_set<int> deleted_; // ids hidden in rows_
+    MemoryGovernor::Reservation mem_{ MemoryGovernor::instance().account("index") };
+};
+
+// ---------------------------------------------------------
+// Class: EpochDomain
+// Epoch-based reclamation shared by all snapshot structures.
+// A reader announces the global epoch in its own slot while it looks
+// at shared data; a writer that unlinks an object tags it with the
+// epoch at retirement and frees it only once no reader announced an
+// epoch that old. Readers never take a lock and never write to a
+// cache line another reader uses.
+// Slots come in segments of kSegmentSlots; a thread that finds every
+// slot taken links a new segment, so any number of threads can read.
+// Segments are never unlinked (slots are reused as threads exit).
+// ---------------------------------------------------------
+class EpochDomain {
+public:
+    static constexpr size_t kSegmentSlots = 256;
+    static constexpr uint64_t kIdle = UINT64_MAX;
+
+    static EpochDomain& instance() {
+        static EpochDomain domain;
+        return domain;
+    }
+
+    // Pin/unpin the calling thread (nested pins are counted)
+    void enter() {
+        ThreadSlot& ts = threadSlot();
+        if (ts.depth++ == 0) ts.slot->epoch.store(epoch_.load(), std::memory_order_seq_cst);
+    }
+    void leave() {
+        ThreadSlot& ts = threadSlot();
+        if (--ts.depth == 0) ts.slot->epoch.store(kIdle, std::memory_order_release);
+    }
+
+    // Called by a writer right after unlinking an object: objects
+    // retired now may be freed once safeToFree(returned epoch) holds
+    uint64_t retireEpoch() { return epoch_.fetch_add(1, std::memory_order_seq_cst); }
+
+    bool safeToFree(uint64_t retired) const {
+        for (const Segment* seg = &head_; seg != nullptr; seg = seg->next.load(std::memory_order_seq_cst))
+            for (const Slot& s : seg->slots)
+                if (s.epoch.load(std::memory_order_seq_cst) <= retired) return false;
+        return true;
+    }
+
+    ~EpochDomain() {
+        for (Segment* seg = head_.next.load(); seg != nullptr;) {
+            Segment* next = seg->next.load();
+            delete seg;
+            seg = next;
+        }
+    }
+
+private:
+    struct alignas(64) Slot {
+        std::atomic<uint64_t> epoch{ kIdle };
+        std::atomic<bool>     owned{ false };
+    };
+
+    struct Segment {
+        Slot                  slots[kSegmentSlots];
+        std::atomic<Segment*> next{ nullptr };
+    };
+
+    // Claims a slot on a thread's first read and frees it when the thread exits
+    struct ThreadSlot {
+        Slot* slot = nullptr;
+        int   depth = 0;
+        ~ThreadSlot() { if (slot) slot->owned.store(false); }
+    };
+
+    ThreadSlot& threadSlot() {
+        thread_local ThreadSlot ts;
+        if (ts.slot) return ts;
+        for (Segment* seg = &head_;;) {
+            for (Slot& s : seg->slots) {
+                bool expected = false;
+                if (s.owned.compare_exchange_strong(expected, true)) {
+                    ts.slot = &s;
+                    return ts;
+                }
+            }
+            Segment* next = seg->next.load(std::memory_order_seq_cst);
+            if (next == nullptr) {
+                // Every slot is taken: link a new segment (or use the one a racing thread linked)
+                auto fresh = std::make_unique<Segment>();
+                if (seg->next.compare_exchange_strong(next, fresh.get(), std::memory_order_seq_cst)) next = fresh.release();
+            }
+            seg = next;
+        }
+    }
+
+    std::atomic<uint64_t> epoch_{ 1 };
+    Segment               head_;
+};
+
+// ---------------------------------------------------------
+// Class: SnapshotUserTable
+// An in-memory users table with lock-free snapshot reads (RCU).
+// Readers call read() and look at an immutable version of the table;
+// they never block and never see a half-applied write.
+// Writers queue upserts/deletes; once publishBatch of them are
+// pending (or on flush()), one writer copies the current version,
+// applies the whole batch, publishes the copy with a single atomic
+// pointer swap and retires the old version to EpochDomain. Batching
+// amortizes the copy over many writes.
+// ---------------------------------------------------------
+class SnapshotUserTable {
+public:
+    using NameMap = std::unordered_map<std::string, int>;
+
+    // The name map is a base shared by consecutive versions plus the
+    // names upserted since it was built, so a publish copies only the
+    // small delta. Entries can be stale (renamed or removed users);
+    // findByName checks the row it lands on.
+    struct Version {
+        std::vector<User>              byId;  // sorted by id
+        std::shared_ptr<const NameMap> nameBase = std::make_shared<const NameMap>();
+        NameMap                        nameDelta;  // wins over nameBase
+
+        const User* findById(int id) const {
+            auto it = std::lower_bound(byId.begin(), byId.end(), id, [](const User& u, int v) { return u.id < v; });
+            return it != byId.end() && it->id == id ? &*it : nullptr;
+        }
+        const User* findByName(const std::string& name) const {
+            auto it = nameDelta.find(name);
+            if (it == nameDelta.end()) {
+                it = nameBase->find(name);
+                if (it == nameBase->end()) return nullptr;
+            }
+            const User* u = findById(it->second);
+            return u && u->name == name ? u : nullptr;
+        }
+
+        // Fresh base from byId; drops the delta
+        void rebuildNames() {
+            auto base = std::make_shared<NameMap>();
+            base->reserve(byId.size());
+            for (const auto& u : byId) (*base)[u.name] = u.id;
+            nameBase = std::move(base);
+            nameDelta.clear();
+        }
+    };
+
+    // Pins the version it was created from; keep it short-lived
+    class Snapshot {
+    public:
+        explicit Snapshot(const SnapshotUserTable& t) {
+            EpochDomain::instance().enter();
+            v_ = t.current_.load(std::memory_order_seq_cst);
+        }
+        ~Snapshot() { EpochDomain::instance().leave(); }
+        Snapshot(const Snapshot&) = delete;
+        Snapshot& operator=(const Snapshot&) = delete;
+        const Version* operator->() const { return v_; }
+        const Version& operator*() const { return *v_; }
+    private:
+        const Version* v_;
+    };
+
+    explicit SnapshotUserTable(size_t publishBatch = 256) : publishBatch_(publishBatch) {
+        current_.store(new Version());
+    }
+
+    ~SnapshotUserTable() {
+        delete current_.load();
+        for (auto& r : retired_) delete r.second;
+    }
+
+    SnapshotUserTable(const SnapshotUserTable&) = delete;
+    SnapshotUserTable& operator=(const SnapshotUserTable&) = delete;
+
+    Snapshot read() const { return Snapshot(*this); }
+
+    // Replace the whole table with a scan of users
+    void load(sql::Connection* con) {
+        StatementScope scope("SnapshotUserTable::load");
+        std::vector<User> rows;
+        std::unique_ptr<sql::Statement> s(con->createStatement());
+        std::unique_ptr<sql::ResultSet> rs(s->executeQuery("SELECT id, name, age FROM users ORDER BY id"));
+        while (rs->next()) rows.push_back({ rs->getInt(1), rs->getString(2), rs->isNull(3) ? 0 : rs->getInt(3) });
+
+        auto v = std::make_unique<Version>();
+        v->byId = std::move(rows);
+        v->rebuildNames();
+        std::lock_guard<std::mutex> lock(writeMu_);
+        pending_.clear();
+        publish(v.release());
+    }
+
+    void upsert(const User& u) { enqueue({ false, u }); }
+    void remove(int id) { enqueue({ true, User{ id, "", 0 } }); }
+
+    // Publish whatever is pending now
+    void flush() {
+        std::lock_guard<std::mutex> lock(writeMu_);
+        applyPending();
+    }
+
+private:
+    static constexpr size_t kMinNameDelta = 1024;
+
+    struct Change {
+        bool remove;
+        User user;
+    };
+
+    void enqueue(Change c) {
+        std::lock_guard<std::mutex> lock(writeMu_);
+        pending_.push_back(std::move(c));
+        if (pending_.size() >= publishBatch_) applyPending();
+    }
+
+    // Copy-on-write: apply every pending change to a copy (writeMu_ held)
+    void applyPending() {
+        if (pending_.empty()) return;
+        const Version* cur = current_.load();
+        std::map<int, const Change*> last;  // the last change per id wins
+        for (const auto& c : pending_) last[c.user.id] = &c;
+
+        auto next = std::make_unique<Version>();
+        next->byId.reserve(cur->byId.size() + last.size());
+        auto change = last.begin();
+        for (const User& u : cur->byId) {
+            for (; change != last.end() && change->first < u.id; ++change)
+                if (!change->second->remove) next->byId.push_back(change->second->user);
+            if (change != last.end() && change->first == u.id) {
+                if (!change->second->remove) next->byId.push_back(change->second->user);
+                ++change;
+            }
+            else next->byId.push_back(u);
+        }
+        for (; change != last.end(); ++change)
+            if (!change->second->remove) next->byId.push_back(change->second->user);
+        // Copying byId (and the name delta) makes every flush O(n), however
+        // few writes it applies; only the writes batched into one flush
+        // share that cost. The name map is rebuilt, also O(n), when the
+        // delta outgrows max(kMinNameDelta, n/8) names
+        next->nameBase = cur->nameBase;
+        next->nameDelta = cur->nameDelta;
+        for (const auto& c : last)
+            if (!c.second->remove) next->nameDelta[c.second->user.name] = c.first;
+        if (next->nameDelta.size() > std::max<size_t>(kMinNameDelta, next->byId.size() / 8)) next->rebuildNames();
+
+        pending_.clear();
+        publish(next.release());
+    }
+
+    // Swap in a new version, retire the old one, free what is safe (writeMu_ held)
+    void publish(Version* next) {
+        Version* old = current_.exchange(next, std::memory_order_seq_cst);
+        retired_.push_back({ EpochDomain::instance().retireEpoch(), old });
+        auto& domain = EpochDomain::instance();
+        auto keep = std::remove_if(retired_.begin(), retired_.end(), [&](const std::pair<uint64_t, Version*>& r) {
+            if (!domain.safeToFree(r.first)) return false;
+            delete r.second;
+            return true;
+        });
+        retired_.erase(keep, retired_.end());
+    }
+
+    std::atomic<Version*>                     current_;
+    std::mutex                                writeMu_;  // writers only
+    std::vector<Change>                       pending_;
+    std::vector<std::pair<uint64_t, Version*>> retired_;  // (retire epoch, version)
+    size_t                                    publishBatch_;
+};
+
+// ---------------------------------------------------------
+// Class template: ShardedCache
+// A concurrent, bounded hash map for the query caches.
+// Keys are spread over kShards independent shards, each with its own
+// lock on its own cache line, so threads touching different keys do
+// not contend. Inside a shard, entries live in one open-addressing
+// array (linear probing, backward-shift delete: no tombstones and no
+// per-entry allocation). When a shard is full, CLOCK evicts an entry
+// that was not read since the hand last passed it.
+// Values are copied out under the shard lock, so cache large results
+// as shared_ptr<const T>.
+// ---------------------------------------------------------
+template <typename K, typename V, typename Hash = std::hash<K>>
+class ShardedCache {
+public:
+    static constexpr size_t kShards = 64;
+
+    // Called (under the shard lock) for every value that leaves the
+    // cache: evicted, erased, overwritten or cleared
+    using RemoveHook = std::function<void(const K&, const V&)>;
+
+    explicit ShardedCache(size_t capacity, RemoveHook onRemove = {}) : onRemove_(std::move(onRemove)) {
+        size_t perShard = std::max<size_t>(8, (capacity + kShards - 1) / kShards);
+        size_t slots = 16;
+        while (slots < perShard * 2) slots *= 2;  // load factor <= 0.5
+        for (auto& s : shards_) {
+            s.slots.resize(slots);
+            s.maxEntries = perShard;
+        }
+    }
+
+    bool get(const K& key, V& out) {
+        size_t h = hash(key);
+        Shard& s = shardFor(h);
+        std::lock_guard<std::mutex> lock(s.mu);
+        size_t i = s.find(key, h);
+        if (i == npos) return false;
+        s.slots[i].referenced = true;
+        out = s.slots[i].value;
+        return true;
+    }
+
+    void put(const K& key, V value) {
+        size_t h = hash(key);
+        Shard& s = shardFor(h);
+        std::lock_guard<std::mutex> lock(s.mu);
+        size_t i = s.find(key, h);
+        if (i == npos) {
+            if (s.size >= s.maxEntries) s.evictOne(onRemove_);
+            i = s.emptySlotFor(h);
+            s.slots[i].used = true;
+            s.slots[i].key = key;
+            s.slots[i].hash = h;
+            ++s.size;
+        }
+        else if (onRemove_) onRemove_(key, s.slots[i].value);
+        s.slots[i].value = std::move(value);
+        s.slots[i].referenced = true;
+    }
+
+    void erase(const K& key) {
+        size_t h = hash(key);
+        Shard& s = shardFor(h);
+        std::lock_guard<std::mutex> lock(s.mu);
+        size_t i = s.find(key, h);
+        if (i != npos) s.removeAt(i, onRemove_);
+    }
+
+    void clear() {
+        for (auto& s : shards_) {
+            std::lock_guard<std::mutex> lock(s.mu);
+            for (auto& slot : s.slots) {
+                if (slot.used && onRemove_) onRemove_(slot.key, slot.value);
+                slot = Slot();
+            }
+            s.size = 0;
+        }
+    }
+
+    // Evict one entry (CLOCK order within a shard, shards taken in
+    // turn); false when the cache is empty
+    bool evictOne() {
+        for (size_t n = 0; n < kShards; ++n) {
+            Shard& s = shards_[nextShard_.fetch_add(1, std::memory_order_relaxed) % kShards];
+            std::lock_guard<std::mutex> lock(s.mu);
+            if (s.size > 0) {
+                s.evictOne(onRemove_);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    size_t size() {
+        size_t n = 0;
+        for (auto& s : shards_) {
+            std::lock_guard<std::mutex> lock(s.mu);
+            n += s.size;
+        }
+        return n;
+    }
+
+private:
+    static constexpr size_t npos = SIZE_MAX;
+
+    struct Slot {
+        K      key{};
+        V      value{};
+        size_t hash = 0;
+        bool   used = false;
+        bool   referenced = false;  // CLOCK bit
+    };
+
+    struct alignas(64) Shard {
+        std::mutex        mu;
+        std::vector<Slot> slots;  // power of two
+        size_t            size = 0;
+        size_t            maxEntries = 0;
+        size_t            hand = 0;  // CLOCK position
+
+        size_t mask() const { return slots.size() - 1; }
+
+        size_t find(const K& key, size_t h) const {
+            for (size_t i = h & mask();; i = (i + 1) & mask()) {
+                const Slot& s = slots[i];
+                if (!s.used) return npos;
+                if (s.hash == h && s.key == key) return i;
+            }
+        }
+
+        size_t emptySlotFor(size_t h) const {
+            size_t i = h & mask();
+            while (slots[i].used) i = (i + 1) & mask();
+            return i;
+        }
+
+        // Backward-shift deletion keeps every probe chain unbroken
+        void removeAt(size_t i, const RemoveHook& onRemove) {
+            if (onRemove) onRemove(slots[i].key, slots[i].value);
+            size_t hole = i;
+            for (size_t j = (i + 1) & mask(); slots[j].used; j = (j + 1) & mask()) {
+                size_t home = slots[j].hash & mask();
+                // Move j into the hole unless its home lies cyclically in (hole, j]
+                bool stays = hole <= j ? (home > hole && home <= j) : (home > hole || home <= j);
+                if (!stays) {
+                    slots[hole] = std::move(slots[j]);
+                    hole = j;
+                }
+            }
+            slots[hole] = Slot();
+            --size;
+        }
+
+        void evictOne(const RemoveHook& onRemove) {
+            for (;;) {
+                Slot& s = slots[hand];
+                if (s.used && !s.referenced) {
+                    removeAt(hand, onRemove);
+                    return;
+                }
+                s.referenced = false;
+                hand = (hand + 1) & mask();
+            }
+        }
+    };
+
+    size_t hash(const K& key) const {
+        // Spread weak hashes (std::hash<int> is the identity) over all bits
+        uint64_t h = Hash()(key) * 0x9E3779B97F4A7C15ull;
+        return static_cast<size_t>(h ^ (h >> 29));
+    }
+
+    Shard& shardFor(size_t h) { return shards_[(h >> 58) & (kShards - 1)]; }
+
+    RemoveHook          onRemove_;
+    std::atomic<size_t> nextShard_{ 0 };
+    Shard               shards_[kShards];
+};
+
+// ---------------------------------------------------------
+// Function: getUserByName
+// Looks a single user up by name (uses uq_users_name).
+// Returns false when there is no such user.
+// ---------------------------------------------------------
+bool getUserByName(sql::Connection* con, std::string_view name, User& out) {
+    StatementScope scope("getUserByName");
+    HeavyHitters::instance().record("getUserByName", name);
+    std::unique_ptr<sql::PreparedStatement> ps(
+        con->prepareStatement("SELECT id, name, age FROM users WHERE name = ?")
+    );
+    ps->setString(1, sql::SQLString(name.data(), name.size()));
+    std::unique_ptr<sql::ResultSet> rs(ps->executeQuery());
+    if (!rs->next()) return false;
+    out = { rs->getInt(1), rs->getString(2), rs->isNull(3) ? 0 : rs->getInt(3) };
+    return true;
+}
+
+// ---------------------------------------------------------
+// Function: getNamesByPrefix
+// Server-side autocomplete: up to `limit` names starting with
+// `prefix`, in index order. LIKE 'abc%' is a range scan on
+// uq_users_name; %, _ and \ in the prefix are escaped.
+// ---------------------------------------------------------
+std::vector<std::string> getNamesByPrefix(sql::Connection* con, std::string_view prefix, size_t limit) {
+    StatementScope scope("getNamesByPrefix");
+    HeavyHitters::instance().record("getNamesByPrefix", prefix);
+    std::string pattern;
+    for (char c : prefix) {
+        if (c == '%' || c == '_' || c == '\\') pattern += '\\';
+        pattern += c;
+    }
+    pattern += '%';
+
+    std::unique_ptr<sql::PreparedStatement> ps(
+        con->prepareStatement("SELECT name FROM users WHERE name LIKE ? ORDER BY name LIMIT ?")
+    );
+    ps->setString(1, pattern);
+    ps->setInt(2, static_cast<int>(limit));
+    std::vector<std::string> out;
+    std::unique_ptr<sql::ResultSet> rs(ps->executeQuery());
+    while (rs->next()) out.push_back(rs->getString(1));
+    return out;
+}
+
+// ---------------------------------------------------------
+// Class: NameAutocomplete
+// Local prefix search over all user names.
+// A FrontCodedNames snapshot (built from a scan) holds the bulk of the
+// names; names added or removed since then sit in two small sorted
+// sets that complete() merges in, and that are folded into a new
+// snapshot once they pass kMaxDelta. Names match and sort like
+// compareNameKeys, so "bo" finds "Bob", as LIKE 'bo%' does under the
+// default collation.
+// complete(con, ...) falls back to the server (uq_users_name) when
+// the index is not loaded or has no match.
+// The snapshot is charged to the MemoryGovernor "index" account.
+// Safe for concurrent readers and writers.
+// ---------------------------------------------------------
+class NameAutocomplete {
+public:
+    static constexpr size_t kMaxDelta = 8192;
+
+    void load(sql::Connection* con) {
+        StatementScope scope("NameAutocomplete::load");
+        std::vector<std::string> names;
+        std::unique_ptr<sql::Statement> s(con->createStatement());
+        std::unique_ptr<sql::ResultSet> rs(s->executeQuery("SELECT name FROM users"));
+        while (rs->next()) names.push_back(rs->getString(1));
+        build(std::move(names));
+    }
+
+    void build(std::vector<std::string> names) {
+        std::sort(names.begin(), names.end(), NameKeyLess());
+        names.erase(std::unique(names.begin(), names.end(),
+            [](const std::string& a, const std::string& b) { return compareNameKeys(a, b) == 0; }), names.end());
+        FrontCodedNames coded(names, true);
+        std::unique_lock<std::shared_mutex> lock(mu_);
+        base_ = std::move(coded);
+        added_.clear();
+        removed_.clear();
+        mem_.forceResize(base_.memoryBytes());
+        loaded_ = true;
+    }
+
+    // Write path: call after a successful insert / rename / delete
+    void add(const std::string& name) {
+        std::unique_lock<std::shared_mutex> lock(mu_);
+        size_t r = base_.find(name);
+        if (r != FrontCodedNames::npos && base_.get(r) == name) {
+            removed_.erase(name);
+            added_.erase(name);
+        }
+        else {
+            // New, or the same name with other letter case: this spelling wins
+            if (r != FrontCodedNames::npos) removed_.insert(base_.get(r));
+            added_.erase(name);
+            added_.insert(name);
+        }
+        if (added_.size() + removed_.size() > kMaxDelta) fold();
+    }
+
+    void remove(const std::string& name) {
+        std::unique_lock<std::shared_mutex> lock(mu_);
+        added_.erase(name);
+        if (base_.find(name) != FrontCodedNames::npos) removed_.insert(name);
+        if (added_.size() + removed_.size() > kMaxDelta) fold();
+    }
+
+    // Up to `limit` names starting with `prefix` (ignoring ASCII case),
+    // in compareNameKeys order
+    std::vector<std::string> complete(std::string_view prefix, size_t limit) const {
+        std::shared_lock<std::shared_mutex> lock(mu_);
+        std::vector<std::string> out;
+        auto range = base_.prefixRange(prefix);
+        auto a = added_.lower_bound(prefix);
+        auto startsWith = [&](std::string_view s) {
+            return s.size() >= prefix.size() && compareNameKeys(s.substr(0, prefix.size()), prefix) == 0;
+        };
+
+        // Merge the snapshot range with the added names, skipping removed ones
+        auto emit = [&](std::string_view name) {
+            while (out.size() < limit && a != added_.end() && startsWith(*a) && NameKeyLess()(*a, name)) out.push_back(*a++);
+            if (out.size() < limit && !removed_.count(name)) out.emplace_back(name);
+        };
+        size_t first = range.first;
+        while (out.size() < limit && first < range.second) {
+            // Decode in small chunks so a short limit stops early
+            size_t last = std::min(range.second, first + limit - out.size() + removed_.size());
+            base_.forEach(first, last, emit);
+            first = last;
+        }
+        while (out.size() < limit && a != added_.end() && startsWith(*a)) out.push_back(*a++);
+        return out;
+    }
+
+    // Local first; the server answers when we have nothing
+    std::vector<std::string> complete(sql::Connection* con, std::string_view prefix, size_t limit) const {
+        if (loaded_) {
+            std::vector<std::string> local = complete(prefix, limit);
+            if (!local.empty()) return local;
+        }
+        return getNamesByPrefix(con, prefix, limit);
+    }
+
+private:
+    // Merge the deltas into a new snapshot (mu_ held exclusively)
+    void fold() {
+        std::vector<std::string> names;
+        names.reserve(base_.size() + added_.size());
+        auto a = added_.begin();
+        base_.forEach(0, base_.size(), [&](std::string_view name) {
+            while (a != added_.end() && NameKeyLess()(*a, name)) names.push_back(*a++);
+            if (!removed_.count(name)) names.emplace_back(name);
+        });
+        names.insert(names.end(), a, added_.end());
+        base_ = FrontCodedNames(names, true);
+        added_.clear();
+        removed_.clear();
+        mem_.forceResize(base_.memoryBytes());
+    }
+
+    mutable std::shared_mutex mu_;
+    FrontCodedNames           base_;
+    std::set<std::string, NameKeyLess> added_;
+    std::set<std::string, NameKeyLess> removed_;
+    std::atomic<bool>         loaded_{ false };
+    MemoryGovernor::Reservation mem_{ MemoryGovernor::instance().account("index") };
+};
+
+// ---------------------------------------------------------
+// Class: CachedUserQueries
+// Read-through caches in front of getUsersByMinAge and
+// getUserByName, safe to share between threads. Writes made through
+// this class, or through the users helpers anywhere in this process
+// (see UserWriteHooks), invalidate what they could have changed;
+// writes made by other processes are not seen until invalidateAll().
+// After loadRangeIndex(), usersByMinAge is answered from a local
+// AgeRangeIndex instead, and after loadAutocomplete(), namesByPrefix
+// from a NameAutocomplete. After loadNameIndex(), userByName answers
+// misses for names that do not exist from a compressed NameIdIndex
+// of every name, without a query. Those writes keep the local indexes
+// current, with one exception. The range index is keyed by id, so an
+// update or a bulk insert made outside this class drops it, and
+// usersByMinAge goes back to the server until the next
+// loadRangeIndex(). Writes reported while a load scans the table are
+// replayed onto the new index. invalidateAll() drops all three
+// indexes. A fill that raced
+// with an invalidation is dropped rather than cached: every
+// invalidation bumps a generation, and a reader only keeps what it
+// loaded if the generation it saw before the query still holds after
+// the put. Name lookups are keyed by foldNameKey(), like the unique
+// index, so "BOB" and "bob" share an entry.
+// Cached entries are charged to the MemoryGovernor "cache" account;
+// an entry that does not fit is simply not cached, and the governor
+// evicts entries when other consumers need the memory.
+// ---------------------------------------------------------
+class CachedUserQueries {
+public:
+    using Rows = std::shared_ptr<const std::vector<User>>;
+
+    // admitAfter > 0: only cache keys that HeavyHitters has published
+    // with at least that many hits, so one-off lookups don't evict hot ones
+    explicit CachedUserQueries(size_t resultCapacity = 1024, size_t rowCapacity = 100000, uint64_t admitAfter = 0)
+        : byMinAge_(resultCapacity, [this](const int&, const Rows& rows) { uncharge(rowsBytes(*rows)); }),
+          byName_(rowCapacity, [this](const std::string& name, const User& u) { uncharge(userBytes(name, u)); }),
+          admitAfter_(admitAfter), mem_(MemoryGovernor::instance().account("cache")) {
+        if (admitAfter_ > 0) HeavyHitters::instance().startPublishing();
+        reclaimer_ = mem_.addReclaimer([this](size_t want) {
+            size_t start = bytes_.load(), freed = 0;
+            while (freed < want && (byMinAge_.evictOne() || byName_.evictOne())) freed = start - std::min(start, bytes_.load());
+            return freed;
+        });
+        writeHook_ = UserWriteHooks::instance().add([this](const UserWriteHooks::Write& w) { noteWrite(w); });
+    }
+
+    ~CachedUserQueries() {
+        UserWriteHooks::instance().remove(writeHook_);
+        mem_.removeReclaimer(reclaimer_);
+        invalidateAll();  // releases what is still charged
+    }
+
+    // Scan the table into an AgeRangeIndex that answers usersByMinAge
+    // from now on. Writes through this class wait for the scan, so none
+    // is missed.
+    void loadRangeIndex(sql::Connection* con) {
+        loadIndex(con, ageIndex_, [] {});
+    }
+
+    // Same for a NameAutocomplete that answers namesByPrefix
+    void loadAutocomplete(sql::Connection* con) {
+        loadIndex(con, autocomplete_, [] {});
+    }
+
+    // Same for a NameIdIndex of every name (see userByName)
+    void loadNameIndex(sql::Connection* con) {
+        loadIndex(con, nameIndex_, [this] { insertedNames_.clear(); });
+    }
+
+    // Up to `limit` names starting with `prefix`: local when loaded
+    // (falling back to the server on no match), else the server
+    std::vector<std::string> namesByPrefix(sql::Connection* con, std::string_view prefix, size_t limit) {
+        {
+            std::shared_lock<std::shared_mutex> lock(indexMu_);
+            if (autocomplete_) return autocomplete_->complete(con, prefix, limit);
+        }
+        return getNamesByPrefix(con, prefix, limit);
+    }
+
+    Rows usersByMinAge(sql::Connection* con, int minAge) {
+        {
+            std::shared_lock<std::shared_mutex> lock(indexMu_);
+            if (ageIndex_) return std::make_shared<const std::vector<User>>(ageIndex_->usersByMinAge(minAge));
+        }
+        Rows rows;
+        if (byMinAge_.get(minAge, rows)) return rows;
+        uint64_t seen = generation_.load();
+        rows = std::make_shared<const std::vector<User>>(getUsersByMinAge(con, minAge));
+        if (admit("getUsersByMinAge", minAge) && generation_.load() == seen && charge(rowsBytes(*rows))) {
+            byMinAge_.put(minAge, rows);
+            if (generation_.load() != seen) byMinAge_.erase(minAge);  // invalidated while we put
+        }
+        return rows;
+    }
+
+    bool userByName(sql::Connection* con, const std::string& name, User& out) {
+        std::string key = foldNameKey(name);
+        if (byName_.get(key, out)) return true;
+        if (knownAbsent(key)) return false;
+        uint64_t seen = generation_.load();
+        if (!getUserByName(con, name, out)) return false;
+        if (admit("getUserByName", name) && generation_.load() == seen && charge(userBytes(key, out))) {
+            byName_.put(key, out);
+            if (generation_.load() != seen) byName_.erase(key);
+        }
+        return true;
+    }
+
+    // The insert reaches the caches and indexes through noteWrite()
+    int insertUser(sql::Connection* con, const User& u) {
+        std::lock_guard<std::mutex> write(writeMu_);
+        return ::insertUser(con, u);
+    }
+
+    int updateUserAgeByName(sql::Connection* con, const std::string& name, int newAge) {
+        std::lock_guard<std::mutex> write(writeMu_);
+        int changed;
+        {
+            OwnWrite own(this);  // noteWrite() would drop the range index
+            changed = ::updateUserAgeByName(con, name, newAge);
+        }
+        ++generation_;
+        byName_.erase(foldNameKey(name));
+        byMinAge_.clear();
+        // The range index is keyed by id, which only the server knows;
+        // re-read the row (writes through this class are serialized, so
+        // it is ours)
+        User row;
+        if (changed > 0 && hasRangeIndex() && getUserByName(con, name, row)) {
+            std::unique_lock<std::shared_mutex> lock(indexMu_);
+            if (ageIndex_) ageIndex_->upsert(row);  // unless invalidateAll() dropped it meanwhile
+        }
+        return changed;
+    }
+
+    void invalidateAll() {
+        ++generation_;
+        byMinAge_.clear();
+        byName_.clear();
+        std::unique_lock<std::shared_mutex> lock(indexMu_);
+        ageIndex_.reset();
+        autocomplete_.reset();
+        nameIndex_.reset();
+        insertedNames_.clear();
+    }
+
+private:
+    // No user has this (folded) name: not in the name index, and not
+    // inserted through this class since it was loaded
+    bool knownAbsent(const std::string& key) const {
+        std::shared_lock<std::shared_mutex> lock(indexMu_);
+        return nameIndex_ && nameIndex_->idOf(key) == 0 && !insertedNames_.count(key);
+    }
+
+    bool hasRangeIndex() const {
+        std::shared_lock<std::shared_mutex> lock(indexMu_);
+        return ageIndex_ != nullptr;
+    }
+
+    // Marks the calling thread as writing through `self`, whose own
+    // write hook then leaves the write to the caller
+    struct OwnWrite {
+        explicit OwnWrite(const CachedUserQueries* self) : prev(ownWriter_) { ownWriter_ = self; }
+        ~OwnWrite() { ownWriter_ = prev; }
+        const CachedUserQueries* prev;
+    };
+
+    // A UserWriteHooks::Write that owns its name
+    struct PendingWrite {
+        UserWriteHooks::Write::Kind kind;
+        int                         id;
+        std::string                 name;
+        int                         age;
+    };
+
+    // Scan into a new index and install it. Writes from other threads
+    // are not held up by writeMu_: noteWrite() queues what it sees
+    // while the scan runs, and the queue is replayed onto the result.
+    template <typename Index, typename OnInstall>
+    void loadIndex(sql::Connection* con, std::unique_ptr<Index>& slot, OnInstall onInstall) {
+        std::lock_guard<std::mutex> write(writeMu_);
+        {
+            std::unique_lock<std::shared_mutex> lock(indexMu_);
+            loading_ = true;
+        }
+        std::unique_ptr<Index> index;
+        try {
+            index = std::make_unique<Index>();
+            index->load(con);
+        }
+        catch (...) {
+            std::unique_lock<std::shared_mutex> lock(indexMu_);
+            loading_ = false;
+            pending_.clear();
+            throw;
+        }
+        std::unique_lock<std::shared_mutex> lock(indexMu_);
+        slot = std::move(index);
+        onInstall();
+        for (const PendingWrite& w : pending_) applyWrite({ w.kind, w.id, w.name, w.age });  // all idempotent
+        pending_.clear();
+        loading_ = false;
+    }
+
+    // UserWriteHooks callback: a write made through a users helper
+    void noteWrite(const UserWriteHooks::Write& w) {
+        if (ownWriter_ == this) return;
+        ++generation_;
+        byName_.erase(foldNameKey(w.name));
+        byMinAge_.clear();  // any result list may include the row now, or no longer
+        std::unique_lock<std::shared_mutex> lock(indexMu_);
+        if (loading_) pending_.push_back({ w.kind, w.id, std::string(w.name), w.age });
+        applyWrite(w);
+    }
+
+    // Under indexMu_
+    void applyWrite(const UserWriteHooks::Write& w) {
+        if (ageIndex_) {
+            if (w.kind == UserWriteHooks::Write::Insert && w.id != 0) ageIndex_->upsert({ w.id, std::string(w.name), w.age });
+            else ageIndex_.reset();  // no id to place the row by
+        }
+        if (w.kind != UserWriteHooks::Write::Insert) return;
+        if (autocomplete_) autocomplete_->add(std::string(w.name));
+        if (nameIndex_) insertedNames_.insert(foldNameKey(w.name));
+    }
+
+    template <typename Key>
+    bool admit(const char* statement, const Key& key) const {
+        return admitAfter_ == 0 || HeavyHitters::instance().estimate(statement, key) >= admitAfter_;
+    }
+
+    static size_t rowsBytes(const std::vector<User>& rows) { return sizeof(std::vector<User>) + userVectorBytes(rows); }
+    static size_t userBytes(const std::string& key, const User& u) {
+        return sizeof(std::string) + sizeof(User) + key.size() + u.name.size();  // same at put and removal
+    }
+
+    bool charge(size_t bytes) {
+        if (!mem_.tryCharge(bytes)) return false;
+        bytes_ += bytes;
+        return true;
+    }
+
+    void uncharge(size_t bytes) {
+        bytes_ -= bytes;
+        mem_.release(bytes);
+    }
+
+    ShardedCache<int, Rows>           byMinAge_;
+    ShardedCache<std::string, User>   byName_;
+    uint64_t                          admitAfter_;
+    MemoryGovernor::Account&          mem_;
+    std::atomic<size_t>               bytes_{ 0 };  // charged by this instance
+    std::atomic<uint64_t>             generation_{ 0 };  // bumped by every invalidation
+    uint64_t                          reclaimer_ = 0;
+    std::mutex                        writeMu_;    // serializes writes through this class
+    mutable std::shared_mutex         indexMu_;    // guards the local indexes below
+    std::unique_ptr<AgeRangeIndex>    ageIndex_;   // set by loadRangeIndex()
+    std::unique_ptr<NameAutocomplete> autocomplete_;  // set by loadAutocomplete()
+    std::unique_ptr<NameIdIndex>      nameIndex_;     // set by loadNameIndex()
+    std::unordered_set<std::string>   insertedNames_; // folded, since loadNameIndex()
+    bool                              loading_ = false;  // a load*() scan is running
+    std::vector<PendingWrite>         pending_;          // writes noted during that scan
+    uint64_t                          writeHook_ = 0;
+    static inline thread_local const CachedUserQueries* ownWriter_ = nullptr;  // see OwnWrite
+};
+
+// ---------------------------------------------------------
+// Function: demoTransaction
+// Shows how to group operations in a transaction.
+// If one fails, rollback undoes all prior changes.
+// ---------------------------------------------------------
+void demoTransaction(sql::Connection* con) {
+    // Disable autocommit to start a transaction manually
+    con->setAutoCommit(false);
+
+    try {
+        // Insert a few users
+        insertUsersBulk(con, {
+            {0, "alice", 24},
+            {0, "bob",   29}
+            });
+
+        // Update one record
+        int changed = updateUserAgeByName(con, "alice", 25);
+        std::cout << "Rows updated: " << changed << "\n";
+
+        // Uncomment to simulate an error and trigger rollback:
+        // insertUser(con, {0, "alice", 40}); // violates unique constraint
+
+        // Commit changes if all succeeded
+        con->commit();
+        con->setAutoCommit(true);
+        std::cout << "Transaction committed.\n";
+    }
+    catch (const sql::SQLException& e) {
+        // Print the error, rollback changes
+        printSqlError(e, "demoTransaction");
+        try {
+            con->rollback();
+            std::cerr << "Transaction rolled back.\n";
+        }
+        catch (const sql::SQLException& e2) {
+            printSqlError(e2, "rollback");
+        }
+        con->setAutoCommit(true);  // restore default behavior
+        throw; // rethrow to inform caller
+    }
+}
+
+// ---------------------------------------------------------
+// Struct: UserBatch
+// A columnar batch of users used by the importers and result readers.
+// Each field lives in its own contiguous array, and all names
+// share one byte buffer, so filling and binding a batch never
+// allocates a User (or a std::string) per row.
+//
+// With useDictionary(), the name column is dictionary-encoded
+// instead: each row stores a NameInterner handle (nameCodes) and the
+// interner, which can be shared by many batches, holds every distinct
+// name once. That pays off when result sets repeat the same names.
+// ---------------------------------------------------------
+struct UserBatch {
+    std::vector<int>      ids;          // id column (0 when not assigned yet)
+    std::vector<int>      ages;         // age column (0 = NULL, same as User)
+    std::vector<uint32_t> nameOffsets;  // name i is nameBytes[off[i], off[i+1])
+    std::string           nameBytes;    // all names, back to back
+    std::vector<NameInterner::Handle> nameCodes;  // dictionary-encoded names
+    std::shared_ptr<NameInterner>     dict;       // set: names are in nameCodes
+
+    UserBatch() { nameOffsets.push_back(0); }
+
+    size_t size() const { return ids.size(); }
+    bool   empty() const { return ids.empty(); }
+
+    // Switch the (empty) batch to dictionary-encoded names
+    void useDictionary(std::shared_ptr<NameInterner> d) {
+        if (!empty()) throw std::logic_error("useDictionary on a non-empty batch");
+        dict = std::move(d);
+    }
+
+    // Append one row; the name bytes are copied into the shared buffer
+    // (or interned, for a dictionary-encoded batch)
+    void append(int id, std::string_view name, int age) {
+        ids.push_back(id);
+        ages.push_back(age);
+        if (dict) {
+            nameCodes.push_back(dict->intern(name));
+            return;
+        }
+        nameBytes.append(name.data(), name.size());
+        nameOffsets.push_back(static_cast<uint32_t>(nameBytes.size()));
+    }
+
+    // View of row i's name (valid until the batch is modified)
+    std::string_view name(size_t i) const {
+        if (dict) return dict->lookup(nameCodes[i]);
+        return std::string_view(nameBytes).substr(nameOffsets[i], nameOffsets[i + 1] - nameOffsets[i]);
+    }
+
+    // Drop the rows but keep the capacity (and dictionary), so a batch can be reused
+    void clear() {
+        ids.clear();
+        ages.clear();
+        nameBytes.clear();
+        nameOffsets.resize(1);
+        nameCodes.clear();
+    }
+
+    // Heap bytes of the columns, not counting a (shared) dictionary
+    size_t memoryBytes() const {
+        return (ids.capacity() + ages.capacity()) * sizeof(int) + nameOffsets.capacity() * sizeof(uint32_t)
+            + nameBytes.capacity() + nameCodes.capacity() * sizeof(NameInterner::Handle);
+    }
+};
+
+// ---------------------------------------------------------
+// Function: getUsersByMinAge (columnar)
+// Same query as above, appended into a UserBatch. Combined with
+// UserBatch::useDictionary, repeated names across many result
+// batches are stored only once.
+// ---------------------------------------------------------
+void getUsersByMinAge(sql::Connection* con, int minAge, UserBatch& out) {
+    StatementScope scope("getUsersByMinAge");
+    HeavyHitters::instance().record("getUsersByMinAge", minAge);
+    out.clear();
+
+    std::unique_ptr<sql::PreparedStatement> ps(
+        con->prepareStatement("SELECT id, name, age FROM users WHERE age >= ? ORDER BY age DESC, id ASC")
+    );
+    ps->setInt(1, minAge);
+
+    std::unique_ptr<sql::ResultSet> rs(ps->executeQuery());
+    while (rs->next()) {
+        sql::SQLString name = rs->getString(2);
+        out.append(rs->getInt(1), std::string_view(name.c_str(), name.length()), rs->isNull(3) ? 0 : rs->getInt(3));
+    }
+}
+
+// ---------------------------------------------------------
+// Helper function: forEachThread
+// Runs fn(t) for t in [0, threads): t = 0 on the calling thread, the
+// rest on threads of their own; returns when all are done.
+// ---------------------------------------------------------
+template <typename Fn>
+void forEachThread(unsigned threads, Fn fn) {
+    std::vector<std::thread> pool;
+    for (unsigned t = 1; t < threads; ++t) pool.emplace_back(fn, t);
+    fn(0u);
+    for (auto& th : pool) th.join();
+}
+
+// Rows [first, last) of n that thread t of `threads` works on
+inline std::pair<size_t, size_t> threadRange(size_t n, unsigned t, unsigned threads) {
+    return { n * t / threads, n * (t + 1) / threads };
+}
+
+// ---------------------------------------------------------
+// Function: radixSortOrder
+// Stable LSD radix sort of row numbers by a signed int32 key column:
+// returns `order` such that keys[order[0]] <= keys[order[1]] <= ...,
+// with ties kept in row order. Four passes of 8-bit digits; passes
+// whose digit is the same for every key (the high bytes of ages, for
+// instance) are skipped. Each pass runs on `threads` threads: every
+// thread counts digits in its own slice of the rows, the counts give
+// each (digit, thread) pair its own output range, and the threads
+// then scatter their slices without any synchronization.
+// For a descending sort, pass ~key (that keeps ties in row order).
+// ---------------------------------------------------------
+std::vector<uint32_t> radixSortOrder(const std::vector<int>& keys, unsigned threads = 1) {
+    size_t n = keys.size();
+    if (n > UINT32_MAX) throw std::length_error("radixSortOrder: too many rows");
+    threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, n / 16384)));  // ~16k rows per thread at least
+
+    std::vector<uint32_t> k(n), kOut(n), order(n), orderOut(n);
+    std::vector<uint32_t> orBits(threads, 0), andBits(threads, ~0u);
+    forEachThread(threads, [&](unsigned t) {
+        auto [first, last] = threadRange(n, t, threads);
+        for (size_t i = first; i < last; ++i) {
+            k[i] = static_cast<uint32_t>(keys[i]) ^ 0x80000000u;  // signed order as unsigned
+            order[i] = static_cast<uint32_t>(i);
+            orBits[t] |= k[i];
+            andBits[t] &= k[i];
+        }
+    });
+    uint32_t varying = 0;
+    for (unsigned t = 0; t < threads; ++t) varying |= orBits[t] ^ andBits[t];
+
+    std::vector<std::array<size_t, 256>> counts(threads);
+    for (unsigned shift = 0; shift < 32; shift += 8) {
+        if (((varying >> shift) & 0xff) == 0) continue;
+        forEachThread(threads, [&](unsigned t) {
+            auto [first, last] = threadRange(n, t, threads);
+            counts[t].fill(0);
+            for (size_t i = first; i < last; ++i) ++counts[t][(k[i] >> shift) & 0xff];
+        });
+        size_t pos = 0;
+        for (size_t d = 0; d < 256; ++d) {
+            for (unsigned t = 0; t < threads; ++t) {
+                size_t c = counts[t][d];
+                counts[t][d] = pos;  // now: where thread t writes digit d
+                pos += c;
+            }
+        }
+        forEachThread(threads, [&](unsigned t) {
+            auto [first, last] = threadRange(n, t, threads);
+            auto& next = counts[t];
+            for (size_t i = first; i < last; ++i) {
+                size_t at = next[(k[i] >> shift) & 0xff]++;
+                kOut[at] = k[i];
+                orderOut[at] = order[i];
+            }
+        });
+        k.swap(kOut);
+        order.swap(orderOut);
+    }
+    return order;
+}
+
+// ---------------------------------------------------------
+// Function: permuteBatch
+// Row order[i] of `in` becomes row i of the result, for every column
+// (payload permutation after radixSortOrder). The fixed-width
+// columns and the name bytes are gathered on `threads` threads.
+// ---------------------------------------------------------
+UserBatch permuteBatch(const UserBatch& in, const std::vector<uint32_t>& order, unsigned threads = 1) {
+    size_t n = order.size();
+    threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, n / 16384)));
+    UserBatch out;
+    out.dict = in.dict;
+    out.ids.resize(n);
+    out.ages.resize(n);
+    if (in.dict) out.nameCodes.resize(n);
+    else {
+        out.nameOffsets.resize(n + 1);
+        for (size_t i = 0; i < n; ++i)
+            out.nameOffsets[i + 1] = out.nameOffsets[i] + (in.nameOffsets[order[i] + 1] - in.nameOffsets[order[i]]);
+        out.nameBytes.resize(out.nameOffsets[n]);
+    }
+    forEachThread(threads, [&](unsigned t) {
+        auto [first, last] = threadRange(n, t, threads);
+        for (size_t i = first; i < last; ++i) {
+            uint32_t r = order[i];
+            out.ids[i] = in.ids[r];
+            out.ages[i] = in.ages[r];
+            if (in.dict) out.nameCodes[i] = in.nameCodes[r];
+            else std::memcpy(&out.nameBytes[out.nameOffsets[i]], in.nameBytes.data() + in.nameOffsets[r],
+                     in.nameOffsets[r + 1] - in.nameOffsets[r]);
+        }
+    });
+    return out;
+}
+
+// Sorts the batch (stable, ascending) by keys[i], one key per row,
+// e.g. ages, age / 10 for buckets, or name lengths
+void sortBatch(UserBatch& batch, const std::vector<int>& keys, unsigned threads = 1) {
+    if (keys.size() != batch.size()) throw std::invalid_argument("sortBatch: one key per row");
+    batch = permuteBatch(batch, radixSortOrder(keys, threads), threads);
+}
+
+// ---------------------------------------------------------
+// Struct: GroupAggregate
+// One group from groupByAggregate(): count, sum, min and max of the
+// value column over the rows whose key is `key`.
+// ---------------------------------------------------------
+struct GroupAggregate {
+    int     key = 0;
+    int64_t count = 0;
+    int64_t sum = 0;
+    int     min = INT_MAX;
+    int     max = INT_MIN;
+
+    void add(int v) {
+        ++count;
+        sum += v;
+        min = std::min(min, v);
+        max = std::max(max, v);
+    }
+
+    void merge(const GroupAggregate& o) {
+        count += o.count;
+        sum += o.sum;
+        min = std::min(min, o.min);
+        max = std::max(max, o.max);
+    }
+};
+
+// Multiplicative hash: the top bits pick a partition, the low bits a slot
+inline uint64_t groupKeyHash(int key) {
+    uint64_t h = static_cast<uint32_t>(key) * 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 29);
+}
+
+// ---------------------------------------------------------
+// Function: groupByAggregate
+// SELECT key, COUNT(*), SUM(value), MIN(value), MAX(value) GROUP BY
+// key over two int32 columns, on `threads` threads; groups come back
+// sorted by key. Partitioned hash aggregation: every thread
+// aggregates its slice of the rows into its own small hash tables,
+// one per partition (a partition is a range of key hashes), so the
+// first phase shares nothing. In the second phase each thread
+// merges one partition's tables from all threads; partitions hold
+// disjoint keys, so again no locks.
+// ---------------------------------------------------------
+std::vector<GroupAggregate> groupByAggregate(const std::vector<int>& keys, const std::vector<int>& values, unsigned threads = 1) {
+    if (keys.size() != values.size()) throw std::invalid_argument("groupByAggregate: column sizes differ");
+    size_t n = keys.size();
+    threads = static_cast<unsigned>(std::max<size_t>(1, std::min<size_t>(threads, n / 16384)));
+    size_t partitions = 1;
+    while (partitions < 4 * threads) partitions *= 2;
+    unsigned partitionShift = 64 - __builtin_ctzll(partitions);
+
+    // Open addressing, linear probing, grows at half full
+    struct Table {
+        std::vector<GroupAggregate> slots = std::vector<GroupAggregate>(16);
+        std::vector<uint8_t>        used = std::vector<uint8_t>(16, 0);
+        size_t                      size = 0;
+
+        GroupAggregate& at(int key, uint64_t h) {
+            size_t mask = slots.size() - 1;
+            for (size_t i = h & mask;; i = (i + 1) & mask) {
+                if (!used[i]) {
+                    if (2 * (size + 1) > slots.size()) {
+                        grow();
+                        return at(key, h);
+                    }
+                    used[i] = 1;
+                    ++size;
+                    slots[i].key = key;
+                    return slots[i];
+                }
+                if (slots[i].key == key) return slots[i];
+            }
+        }
+
+        void grow() {
+            Table bigger;
+            bigger.slots.resize(slots.size() * 2);
+            bigger.used.assign(slots.size() * 2, 0);
+            for (size_t i = 0; i < slots.size(); ++i)
+                if (used[i]) bigger.at(slots[i].key, groupKeyHash(slots[i].key)).merge(slots[i]);
+            *this = std::move(bigger);
+        }
+    };
+    // Phase 1: thread-local pre-aggregation, split by partition
+    std::vector<std::vector<Table>> local(threads, std::vector<Table>(partitions));
+    forEachThread(threads, [&](unsigned t) {
+        auto [first, last] = threadRange(n, t, threads);
+        auto& mine = local[t];
+        for (size_t i = first; i < last; ++i) {
+            uint64_t h = groupKeyHash(keys[i]);
+            mine[h >> partitionShift].at(keys[i], h).add(values[i]);
+        }
+    });
+
+    // Phase 2: merge each partition across threads
+    std::vector<std::vector<GroupAggregate>> merged(partitions);
+    forEachThread(threads, [&](unsigned t) {
+        for (size_t p = t; p < partitions; p += threads) {
+            Table all;
+            for (unsigned s = 0; s < threads; ++s) {
+                const Table& part = local[s][p];
+                for (size_t i = 0; i < part.slots.size(); ++i)
+                    if (part.used[i]) all.at(part.slots[i].key, groupKeyHash(part.slots[i].key)).merge(part.slots[i]);
+            }
+            for (size_t i = 0; i < all.slots.size(); ++i)
+                if (all.used[i]) merged[p].push_back(all.slots[i]);
+        }
+    });
+
+    std::vector<GroupAggregate> out;
+    for (auto& m : merged) out.insert(out.end(), m.begin(), m.end());
+    std::sort(out.begin(), out.end(), [](const GroupAggregate& a, const GroupAggregate& b) { return a.key < b.key; });
+    return out;
+}
+
+// users.name is VARCHAR(100) in utf8mb4, which counts characters
+// (code points), not bytes; importers reject longer names up front
+constexpr size_t kMaxNameChars = 100;
+
+inline bool nameFits(std::string_view name) {
+    if (name.size() <= kMaxNameChars) return true;
+    size_t chars = 0;
+    for (char c : name) chars += (static_cast<unsigned char>(c) & 0xC0) != 0x80;  // skip continuation bytes
+    return chars <= kMaxNameChars;
+}
+
+// ---------------------------------------------------------
+// Interface: UserBatchReader
+// Source of user rows delivered in record batches.
+// next() refills `batch` with up to maxRows rows and returns false
+// once the source is exhausted. Any columnar format (CSV, Arrow IPC,
+// Parquet, ...) can be plugged into the importer by implementing it.
+// ---------------------------------------------------------
+class UserBatchReader {
+public:
+    virtual ~UserBatchReader() = default;
+    virtual bool next(UserBatch& batch, size_t maxRows) = 0;
+};
+
+// ---------------------------------------------------------
+// Class: CsvUserBatchReader
+// Reads "name,age" lines (an optional "name,age" header is skipped).
+// Names may be double-quoted, with "" standing for a literal quote.
+// An empty age field is imported as NULL. A name longer than
+// kMaxNameChars or an age that is not a whole integer fails the
+// import with the line number.
+// ---------------------------------------------------------
+class CsvUserBatchReader : public UserBatchReader {
+public:
+    explicit CsvUserBatchReader(const std::string& path) : in_(path) {
+        if (!in_) throw std::runtime_error("cannot open " + path);
+    }
+
+    bool next(UserBatch& batch, size_t maxRows) override {
+        batch.clear();
+        while (batch.size() < maxRows && std::getline(in_, line_)) {
+            ++lineNo_;
+            if (!line_.empty() && line_.back() == '\r') line_.pop_back();  // tolerate CRLF files
+            if (line_.empty()) continue;
+            if (lineNo_ == 1 && line_ == "name,age") continue;             // header row
+            parseLine(batch);
+        }
+        return !batch.empty();
+    }
+
+private:
+    void parseLine(UserBatch& batch) {
+        size_t pos = 0;
+        std::string_view name;
+        if (line_[0] == '"') {
+            // Quoted name: unescape into a scratch buffer
+            field_.clear();
+            for (pos = 1; pos < line_.size(); ++pos) {
+                if (line_[pos] != '"') field_ += line_[pos];
+                else if (pos + 1 < line_.size() && line_[pos + 1] == '"') field_ += line_[++pos];
+                else break;
+            }
+            name = field_;
+            pos = line_.find(',', pos);
+        }
+        else {
+            pos = line_.find(',');
+            name = std::string_view(line_).substr(0, pos);
+        }
+        if (pos == std::string::npos) throw std::runtime_error("line " + std::to_string(lineNo_) + ": expected name,age");
+        if (!nameFits(name)) throw std::runtime_error("line " + std::to_string(lineNo_) + ": name longer than 100 characters");
+
+        int age = 0;
+        const char* first = line_.data() + pos + 1;
+        const char* last = line_.data() + line_.size();
+        if (first != last) {
+            auto res = std::from_chars(first, last, age);
+            if (res.ec != std::errc() || res.ptr != last)  // "30x" or "3,4" is not an age
+                throw std::runtime_error("line " + std::to_string(lineNo_) + ": bad age");
+        }
+        batch.append(0, name, age);
+    }
+
+    std::ifstream in_;
+    std::string   line_;    // reused for every line
+    std::string   field_;   // scratch for unescaped quoted names
+    size_t        lineNo_ = 0;
+};
+
+#ifdef APP_WITH_ARROW
+// ---------------------------------------------------------
+// Class: ArrowUserBatchReader
+// Reads Parquet (.parquet) or Arrow IPC files (.arrow / .feather in
+// the file format, .arrows in the stream format) one record batch at
+// a time. The "name" column (string or large_string) and the "age"
+// column (any integer type, null = NULL) are copied from the Arrow
+// buffers straight into the UserBatch; other columns are ignored.
+// Same checks as the CSV reader: null or over-long names and ages
+// outside int fail the import with the row number.
+// ---------------------------------------------------------
+class ArrowUserBatchReader : public UserBatchReader {
+public:
+    explicit ArrowUserBatchReader(const std::string& path) : path_(path) {
+        std::shared_ptr<arrow::io::ReadableFile> file = orThrow(arrow::io::ReadableFile::Open(path));
+        std::shared_ptr<arrow::Schema> schema;
+        if (hasSuffix(".parquet")) {
+            parquet::arrow::FileReaderBuilder builder;
+            check(builder.Open(file));
+            check(builder.Build(&parquet_));
+            stream_ = orThrow(parquet_->GetRecordBatchReader());
+            schema = stream_->schema();
+        }
+        else if (hasSuffix(".arrows")) {
+            stream_ = orThrow(arrow::ipc::RecordBatchStreamReader::Open(file));
+            schema = stream_->schema();
+        }
+        else {
+            ipcFile_ = orThrow(arrow::ipc::RecordBatchFileReader::Open(file));
+            schema = ipcFile_->schema();
+        }
+        nameCol_ = schema->GetFieldIndex("name");
+        ageCol_ = schema->GetFieldIndex("age");
+        if (nameCol_ < 0 || ageCol_ < 0) throw std::runtime_error(path + ": expected \"name\" and \"age\" columns");
+    }
+
+    bool next(UserBatch& batch, size_t maxRows) override {
+        batch.clear();
+        while (batch.size() < maxRows) {
+            if (!current_ || row_ == current_->num_rows()) {
+                if (!nextRecordBatch()) break;
+                continue;
+            }
+            int64_t n = std::min<int64_t>(current_->num_rows() - row_, static_cast<int64_t>(maxRows - batch.size()));
+            appendRows(batch, n);
+            row_ += n;
+        }
+        return !batch.empty();
+    }
+
+private:
+    template <typename T>
+    T orThrow(arrow::Result<T> result) {
+        if (!result.ok()) throw std::runtime_error(path_ + ": " + result.status().ToString());
+        return std::move(result).ValueUnsafe();
+    }
+
+    void check(const arrow::Status& status) {
+        if (!status.ok()) throw std::runtime_error(path_ + ": " + status.ToString());
+    }
+
+    bool hasSuffix(std::string_view suffix) const {
+        return path_.size() >= suffix.size() && path_.compare(path_.size() - suffix.size(), suffix.size(), suffix) == 0;
+    }
+
+    std::runtime_error rowError(int64_t i, const char* what) const {
+        return std::runtime_error(path_ + ": row " + std::to_string(rowsBefore_ + i + 1) + ": " + what);
+    }
+
+    bool nextRecordBatch() {
+        if (current_) rowsBefore_ += current_->num_rows();
+        current_.reset();
+        row_ = 0;
+        if (stream_) check(stream_->ReadNext(&current_));
+        else if (nextIpcBatch_ < ipcFile_->num_record_batches()) current_ = orThrow(ipcFile_->ReadRecordBatch(nextIpcBatch_++));
+        return current_ != nullptr;
+    }
+
+    // Dispatch on the column types once per run of rows, not per row
+    void appendRows(UserBatch& batch, int64_t n) {
+        const arrow::Array& names = *current_->column(nameCol_);
+        switch (names.type_id()) {
+        case arrow::Type::STRING:       return appendRows(batch, n, static_cast<const arrow::StringArray&>(names));
+        case arrow::Type::LARGE_STRING: return appendRows(batch, n, static_cast<const arrow::LargeStringArray&>(names));
+        default: throw std::runtime_error(path_ + ": \"name\" must be a string column");
+        }
+    }
+
+    template <typename Names>
+    void appendRows(UserBatch& batch, int64_t n, const Names& names) {
+        const arrow::Array& ages = *current_->column(ageCol_);
+        switch (ages.type_id()) {
+        case arrow::Type::INT8:   return appendRows(batch, n, names, static_cast<const arrow::Int8Array&>(ages));
+        case arrow::Type::INT16:  return appendRows(batch, n, names, static_cast<const arrow::Int16Array&>(ages));
+        case arrow::Type::INT32:  return appendRows(batch, n, names, static_cast<const arrow::Int32Array&>(ages));
+        case arrow::Type::INT64:  return appendRows(batch, n, names, static_cast<const arrow::Int64Array&>(ages));
+        case arrow::Type::UINT8:  return appendRows(batch, n, names, static_cast<const arrow::UInt8Array&>(ages));
+        case arrow::Type::UINT16: return appendRows(batch, n, names, static_cast<const arrow::UInt16Array&>(ages));
+        case arrow::Type::UINT32: return appendRows(batch, n, names, static_cast<const arrow::UInt32Array&>(ages));
+        case arrow::Type::UINT64: return appendRows(batch, n, names, static_cast<const arrow::UInt64Array&>(ages));
+        default: throw std::runtime_error(path_ + ": \"age\" must be an integer column");
+        }
+    }
+
+    template <typename Names, typename Ages>
+    void appendRows(UserBatch& batch, int64_t n, const Names& names, const Ages& ages) {
+        for (int64_t i = row_; i < row_ + n; ++i) {
+            if (names.IsNull(i)) throw rowError(i, "null name");
+            std::string_view name = names.GetView(i);
+            if (!nameFits(name)) throw rowError(i, "name longer than 100 characters");
+            int age = 0;
+            if (ages.IsValid(i)) {
+                auto v = ages.Value(i);
+                bool fits = std::is_signed<decltype(v)>::value
+                    ? static_cast<int64_t>(v) >= INT_MIN && static_cast<int64_t>(v) <= INT_MAX
+                    : static_cast<uint64_t>(v) <= static_cast<uint64_t>(INT_MAX);
+                if (!fits) throw rowError(i, "age out of range");
+                age = static_cast<int>(v);
+            }
+            batch.append(0, name, age);
+        }
+    }
+
+    std::string                                      path_;
+    std::unique_ptr<parquet::arrow::FileReader>      parquet_;  // must outlive stream_
+    std::shared_ptr<arrow::RecordBatchReader>        stream_;   // Parquet or IPC stream
+    std::shared_ptr<arrow::ipc::RecordBatchFileReader> ipcFile_;
+    int                                              nextIpcBatch_ = 0;
+    int                                              nameCol_ = -1;
+    int                                              ageCol_ = -1;
+    std::shared_ptr<arrow::RecordBatch>              current_;
+    int64_t                                          row_ = 0;         // next row of current_
+    int64_t                                          rowsBefore_ = 0;  // rows in earlier record batches
+};
+#endif
+
+// ---------------------------------------------------------
+// Function: openUserBatchReader
+// Picks the reader by file extension: .parquet, .arrow, .arrows and
+// .feather need a build with Arrow (-DAPP_WITH_ARROW=ON), anything
+// else is read as CSV.
+// ---------------------------------------------------------
+std::unique_ptr<UserBatchReader> openUserBatchReader(const std::string& path) {
+    for (const char* ext : { ".parquet", ".arrow", ".arrows", ".feather" }) {
+        std::string_view e(ext);
+        if (path.size() < e.size() || path.compare(path.size() - e.size(), e.size(), e) != 0) continue;
+#ifdef APP_WITH_ARROW
+        return std::make_unique<ArrowUserBatchReader>(path);
+#else
+        throw std::runtime_error(path + ": this build cannot read Parquet/Arrow files (configure with -DAPP_WITH_ARROW=ON)");
+#endif
+    }
+    return std::make_unique<CsvUserBatchReader>(path);
+}
+
+// ---------------------------------------------------------
+// Class template: BoundedQueue
+// A small blocking FIFO with a fixed capacity.
+// push() waits while the queue is full, which is what gives the
+// importer its backpressure; close() wakes everyone up and makes
+// pop() return false once the queue drains.
+// ---------------------------------------------------------
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mu_);
+        notFull_.wait(lock, [&] { return closed_ || items_.size() < capacity_; });
+        if (closed_) return false;
+        items_.push_back(std::move(item));
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    // Like push, but gives up instead of waiting when the queue is full
+    bool tryPush(T item) {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (closed_ || items_.size() >= capacity_) return false;
+        items_.push_back(std::move(item));
+        notEmpty_.notify_one();
+        return true;
+    }
+
+    bool pop(T& out) {
+        std::unique_lock<std::mutex> lock(mu_);
+        notEmpty_.wait(lock, [&] { return closed_ || !items_.empty(); });
+        if (items_.empty()) return false;
+        out = std::move(items_.front());
+        items_.pop_front();
+        notFull_.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mu_);
+        closed_ = true;
+        notFull_.notify_all();
+        notEmpty_.notify_all();
+    }
+
+    // close() and throw away whatever is still queued; returns how many
+    // items were dropped, so pop() returns false right away
+    size_t cancel() {
+        std::lock_guard<std::mutex> lock(mu_);
+        closed_ = true;
+        size_t dropped = items_.size();
+        items_.clear();
+        notFull_.notify_all();
+        notEmpty_.notify_all();
+        return dropped;
+    }
+
+private:
+    std::mutex              mu_;
+    std::condition_variable notFull_, notEmpty_;
+    std::deque<T>           items_;
+    size_t                  capacity_;
+    bool                    closed_ = false;
+};
+
+// ---------------------------------------------------------
+// Function: insertUserBatch
+// Inserts a whole UserBatch using multi-row INSERT statements
+// ("VALUES (?, ?), (?, ?), ...") bound straight from the columns.
+// One round trip now carries rowsPerStatement rows instead of one.
+// ---------------------------------------------------------
+void insertUserBatch(sql::Connection* con, const UserBatch& batch, size_t rowsPerStatement) {
+    StatementScope scope("insertUserBatch");
+    for (size_t i = 0; i < batch.size(); ++i) HeavyHitters::instance().record("insertUserBatch", batch.name(i));
+    auto makeInsert = [&](size_t rows) {
+        std::string q = "INSERT INTO users(name, age) VALUES ";
+        for (size_t i = 0; i < rows; ++i) q += (i ? ",(?, ?)" : "(?, ?)");
+        return std::unique_ptr<sql::PreparedStatement>(con->prepareStatement(q));
+    };
+
+    std::unique_ptr<sql::PreparedStatement> full;  // prepared lazily, reused for every full chunk
+    for (size_t start = 0; start < batch.size(); start += rowsPerStatement) {
+        size_t rows = std::min(rowsPerStatement, batch.size() - start);
+        std::unique_ptr<sql::PreparedStatement> tail;
+        sql::PreparedStatement* ps;
+        if (rows == rowsPerStatement) {
+            if (!full) full = makeInsert(rows);
+            ps = full.get();
+        }
+        else {
+            tail = makeInsert(rows);
+            ps = tail.get();
+        }
+
+        for (size_t i = 0; i < rows; ++i) {
+            bindNameAge(ps, static_cast<unsigned int>(2 * i + 1), batch.name(start + i), batch.ages[start + i]);
+        }
+        ps->executeUpdate();
+        for (size_t i = start; i < start + rows; ++i) UserWriteHooks::instance().inserted(0, batch.name(i), batch.ages[i]);
+    }
+}
+
+// ---------------------------------------------------------
+// Struct: ExternalSortOptions
+// Knobs for SortedDedupUserReader.
+// ---------------------------------------------------------
+enum class DedupPolicy { FirstWins, LastWins };
+
+// "first" or "last", as given to --dedup
+DedupPolicy parseDedupPolicy(const std::string& text) {
+    if (text == "first") return DedupPolicy::FirstWins;
+    if (text == "last") return DedupPolicy::LastWins;
+    throw std::invalid_argument("--dedup takes first or last, not \"" + text + "\"");
+}
+
+struct ExternalSortOptions {
+    size_t      memoryBudget = 64u << 20;   // bytes of row buffers (capacity) before spilling a run
+    std::string spillDir = "/tmp";          // parent of each reader's private run directory (local disk)
+    DedupPolicy dedup = DedupPolicy::LastWins;
+    size_t      maxFanIn = 64;              // most runs merged (files open) at once, >= 2
+};
+
+// ---------------------------------------------------------
+// Class: SortedDedupUserReader
+// Wraps another UserBatchReader and returns its rows sorted by name
+// with duplicate names removed, so a following bulk load can neither
+// hit uq_users_name nor insert out of index order.
+//
+// The constructor drains the source: rows are collected until their
+// buffers would grow past the memory budget, sorted by (name, input
+// position), reduced to one winner per name and spilled to disk as a
+// run. next() then performs a k-way merge over all runs, again keeping
+// one row per name (the first or last one seen in the input, per
+// DedupPolicy).
+// The last run is merged straight from memory, so inputs that fit in
+// the budget never touch the disk. No merge reads more than maxFanIn
+// runs: whenever maxFanIn runs of the same generation exist they are
+// merged into one run of the next, and before the final merge the
+// smallest runs are combined until at most maxFanIn remain.
+// Run files live in a private directory under spillDir, created with
+// mkdtemp on the first spill and removed with the reader.
+// ---------------------------------------------------------
+class SortedDedupUserReader : public UserBatchReader {
+public:
+    SortedDedupUserReader(UserBatchReader& source, const ExternalSortOptions& opts = {}) : opts_(opts) {
+        if (opts_.maxFanIn < 2) throw std::invalid_argument("ExternalSortOptions::maxFanIn must be at least 2");
+        try {
+            drain(source);
+        }
+        catch (...) {
+            removeSpill();  // the destructor does not run for a throwing constructor
+            throw;
+        }
+    }
+
+    ~SortedDedupUserReader() override { removeSpill(); }
+
+    bool next(UserBatch& batch, size_t maxRows) override {
+        batch.clear();
+        std::string name;
+        int age;
+        uint64_t seq;
+        while (batch.size() < maxRows && merge_->next(name, age, seq)) {
+            batch.append(0, name, age);
+            ++outputRows_;
+        }
+        return !batch.empty();
+    }
+
+    size_t spilledRuns() const { return spilled_; }
+    size_t mergePasses() const { return mergePasses_; }  // intermediate merges before the final one
+    size_t duplicatesDropped() const { return static_cast<size_t>(inputRows_) - outputRows_; }  // final once drained
+
+private:
+    struct Entry {
+        uint32_t off, len;  // name bytes in arena_
+        int      age;
+        uint64_t seq;       // position in the input, decides first/last wins
+    };
+
+    struct RunFile {
+        std::string path;
+        unsigned    generation;  // 0 = spilled from memory, n + 1 = merged from runs of generation n
+    };
+
+    // One sorted input of the merge
+    struct Run {
+        virtual ~Run() = default;
+        virtual bool advance() = 0;  // load the next row into the fields below
+        std::string_view name;
+        int      age = 0;
+        uint64_t seq = 0;
+    };
+
+    // Run file format: per row u32 nameLen, name bytes, i32 age, u64 seq
+    struct FileRun : Run {
+        explicit FileRun(const std::string& path) : in(path, std::ios::binary) {
+            if (!in) throw std::runtime_error("cannot open sort run " + path);
+        }
+        bool advance() override {
+            uint32_t len;
+            if (!in.read(reinterpret_cast<char*>(&len), sizeof len)) return false;
+            buf.resize(len);
+            in.read(&buf[0], len);
+            in.read(reinterpret_cast<char*>(&age), sizeof age);
+            in.read(reinterpret_cast<char*>(&seq), sizeof seq);
+            if (!in) throw std::runtime_error("truncated sort run");
+            name = buf;
+            return true;
+        }
+        std::ifstream in;
+        std::string   buf;
+    };
+
+    static void writeRow(std::ofstream& out, std::string_view name, int age, uint64_t seq) {
+        uint32_t len = static_cast<uint32_t>(name.size());
+        out.write(reinterpret_cast<const char*>(&len), sizeof len);
+        out.write(name.data(), len);
+        out.write(reinterpret_cast<const char*>(&age), sizeof age);
+        out.write(reinterpret_cast<const char*>(&seq), sizeof seq);
+    }
+
+    struct MemRun : Run {
+        explicit MemRun(const SortedDedupUserReader& r) : owner(r) {}
+        bool advance() override {
+            if (pos == owner.mem_.size()) return false;
+            const Entry& e = owner.mem_[pos++];
+            name = owner.entryName(e);
+            age = e.age;
+            seq = e.seq;
+            return true;
+        }
+        const SortedDedupUserReader& owner;
+        size_t pos = 0;
+    };
+
+    // k-way merge of sorted runs, one row (the winner) per name key
+    class Merge {
+    public:
+        Merge(std::vector<std::unique_ptr<Run>> runs, DedupPolicy dedup) : runs_(std::move(runs)), dedup_(dedup) {
+            for (size_t r = 0; r < runs_.size(); ++r)
+                if (runs_[r]->advance()) heap_.push_back(r);
+            std::make_heap(heap_.begin(), heap_.end(), HeapOrder{ this });
+        }
+
+        bool next(std::string& name, int& age, uint64_t& seq) {
+            if (heap_.empty()) return false;
+            // Pop the smallest row, then every row with the same name key
+            Run* winner = pop();
+            name.assign(winner->name);
+            age = winner->age;
+            seq = winner->seq;
+            repush(winner);
+            while (!heap_.empty() && compareNameKeys(runs_[heap_.front()]->name, name) == 0) {
+                Run* dup = pop();
+                bool later = dup->seq > seq;
+                if (later == (dedup_ == DedupPolicy::LastWins)) {
+                    name.assign(dup->name);
+                    age = dup->age;
+                    seq = dup->seq;
+                }
+                repush(dup);
+            }
+            return true;
+        }
+
+    private:
+        // std heap functions build a max-heap, so "less" means "comes later"
+        struct HeapOrder {
+            const Merge* self;
+            bool operator()(size_t a, size_t b) const {
+                const Run& x = *self->runs_[a];
+                const Run& y = *self->runs_[b];
+                int c = compareNameKeys(x.name, y.name);
+                return c != 0 ? c > 0 : x.seq > y.seq;
+            }
+        };
+
+        Run* pop() {
+            std::pop_heap(heap_.begin(), heap_.end(), HeapOrder{ this });
+            popped_ = heap_.back();
+            heap_.pop_back();
+            return runs_[popped_].get();
+        }
+
+        // Advance the run just popped and put it back if it has more rows
+        void repush(Run* run) {
+            if (!run->advance()) return;
+            heap_.push_back(popped_);
+            std::push_heap(heap_.begin(), heap_.end(), HeapOrder{ this });
+        }
+
+        std::vector<std::unique_ptr<Run>> runs_;
+        DedupPolicy                       dedup_;
+        std::vector<size_t>               heap_;  // indexes into runs_
+        size_t                            popped_ = 0;
+    };
+
+    std::string_view entryName(const Entry& e) const { return std::string_view(arena_).substr(e.off, e.len); }
+
+    // Bytes the row buffers would hold (capacity, not size) once a row
+    // with a `nameLen`-byte name is added; growth doubles, see reserveFor
+    size_t bytesAfterAdding(size_t nameLen) const {
+        size_t entries = mem_.size() < mem_.capacity() ? mem_.capacity() : std::max<size_t>(1024, 2 * mem_.capacity());
+        size_t bytes = arena_.size() + nameLen <= arena_.capacity()
+            ? arena_.capacity() : std::max(2 * arena_.capacity(), arena_.size() + nameLen);
+        return entries * sizeof(Entry) + bytes;
+    }
+
+    // Grow the buffers exactly as bytesAfterAdding assumes
+    void reserveFor(size_t nameLen) {
+        if (mem_.size() == mem_.capacity()) mem_.reserve(std::max<size_t>(1024, 2 * mem_.capacity()));
+        if (arena_.size() + nameLen > arena_.capacity()) arena_.reserve(std::max(2 * arena_.capacity(), arena_.size() + nameLen));
+    }
+
+    // Sort the in-memory rows and keep only the winner of each name
+    void sortAndReduce() {
+        std::sort(mem_.begin(), mem_.end(), [&](const Entry& a, const Entry& b) {
+            int c = compareNameKeys(entryName(a), entryName(b));
+            return c != 0 ? c < 0 : a.seq < b.seq;
+        });
+        size_t out = 0;
+        for (size_t i = 0; i < mem_.size(); ) {
+            size_t j = i + 1;
+            while (j < mem_.size() && compareNameKeys(entryName(mem_[i]), entryName(mem_[j])) == 0) ++j;
+            mem_[out++] = mem_[opts_.dedup == DedupPolicy::FirstWins ? i : j - 1];
+            i = j;
+        }
+        mem_.resize(out);
+    }
+
+    // Sorts the source into runs and sets up the final merge
+    void drain(UserBatchReader& source) {
+        UserBatch batch;
+        uint64_t seq = 0;
+        while (source.next(batch, 4096)) {
+            for (size_t i = 0; i < batch.size(); ++i) {
+                std::string_view name = batch.name(i);
+                if (!mem_.empty() && bytesAfterAdding(name.size()) > opts_.memoryBudget) spillRun();
+                reserveFor(name.size());
+                mem_.push_back({ static_cast<uint32_t>(arena_.size()), static_cast<uint32_t>(name.size()), batch.ages[i], seq++ });
+                arena_.append(name.data(), name.size());
+            }
+        }
+        sortAndReduce();
+        inputRows_ = seq;
+
+        // The memory run takes one of the maxFanIn inputs
+        while (runFiles_.size() > opts_.maxFanIn - 1)
+            mergeLastRuns(std::min(opts_.maxFanIn, runFiles_.size() - opts_.maxFanIn + 2));
+
+        std::vector<std::unique_ptr<Run>> runs;
+        for (auto& f : runFiles_) runs.push_back(std::make_unique<FileRun>(f.path));
+        runs.push_back(std::make_unique<MemRun>(*this));
+        merge_ = std::make_unique<Merge>(std::move(runs), opts_.dedup);
+    }
+
+    // Removes the run files and the spill directory
+    void removeSpill() {
+        merge_.reset();  // close files before removing them
+        for (auto& f : runFiles_) std::remove(f.path.c_str());
+        runFiles_.clear();
+        if (!runDir_.empty()) ::rmdir(runDir_.c_str());
+        runDir_.clear();
+    }
+
+    // A new, empty run file; registered first so removeSpill() cleans up on failure.
+    // Runs go in a directory of their own, made by mkdtemp (mode 0700) on
+    // the first spill, so nobody else can pre-create or link a run's path
+    std::ofstream newRunFile(unsigned generation) {
+        if (runDir_.empty()) {
+            std::string dirTemplate = opts_.spillDir + "/users-sort-XXXXXX";
+            if (!::mkdtemp(&dirTemplate[0]))
+                throw std::runtime_error("cannot create spill directory in " + opts_.spillDir + ": " + std::strerror(errno));
+            runDir_ = dirTemplate;
+        }
+        std::string path = runDir_ + "/run-" + std::to_string(runCounter_++) + ".bin";
+        runFiles_.push_back({ path, generation });
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        if (!out) throw std::runtime_error("cannot create sort run " + path);
+        return out;
+    }
+
+    void spillRun() {
+        sortAndReduce();
+        std::ofstream out = newRunFile(0);
+        for (const Entry& e : mem_) writeRow(out, entryName(e), e.age, e.seq);
+        if (!out.flush()) throw std::runtime_error("cannot write sort run " + runFiles_.back().path);
+        mem_.clear();    // both keep their capacity for the next run
+        arena_.clear();
+        ++spilled_;
+
+        // Runs are listed oldest first, so generations never increase
+        // along the list; maxFanIn equal ones are always at the end
+        for (;;) {
+            size_t n = runFiles_.size();
+            if (n < opts_.maxFanIn || runFiles_[n - opts_.maxFanIn].generation != runFiles_.back().generation) break;
+            mergeLastRuns(opts_.maxFanIn);
+        }
+    }
+
+    // Merge the last `count` run files into one
+    void mergeLastRuns(size_t count) {
+        size_t first = runFiles_.size() - count;
+        std::vector<RunFile> inputs(runFiles_.begin() + first, runFiles_.end());
+        runFiles_.resize(first);
+        unsigned generation = 0;
+        for (const auto& f : inputs) generation = std::max(generation, f.generation + 1);
+        try {
+            std::vector<std::unique_ptr<Run>> runs;
+            for (const auto& f : inputs) runs.push_back(std::make_unique<FileRun>(f.path));
+            Merge merge(std::move(runs), opts_.dedup);
+            std::ofstream out = newRunFile(generation);
+            std::string name;
+            int age;
+            uint64_t seq;
+            while (merge.next(name, age, seq)) writeRow(out, name, age, seq);
+            if (!out.flush()) throw std::runtime_error("cannot write sort run " + runFiles_.back().path);
+        }
+        catch (...) {
+            for (const auto& f : inputs) std::remove(f.path.c_str());
+            throw;
+        }
+        for (const auto& f : inputs) std::remove(f.path.c_str());
+        ++mergePasses_;
+    }
+
+    ExternalSortOptions                opts_;
+    std::vector<Entry>                 mem_;       // current (last) run
+    std::string                        arena_;     // name bytes of mem_
+    std::string                        runDir_;    // private spill directory, made on the first spill
+    unsigned                           runCounter_ = 0;
+    std::vector<RunFile>               runFiles_;  // oldest first
+    std::unique_ptr<Merge>             merge_;     // the final merge, read by next()
+    size_t                             spilled_ = 0;
+    size_t                             mergePasses_ = 0;
+    uint64_t                           inputRows_ = 0;
+    size_t                             outputRows_ = 0;
+};
+
+// ---------------------------------------------------------
+// Struct: OnlineTunerOptions
+// ---------------------------------------------------------
+struct OnlineTunerOptions {
+    std::chrono::milliseconds window{ 5000 };    // measure each setting at least this long
+    size_t minSamples = 20;                      // ... and over at least this many records
+    std::chrono::milliseconds p99Target{ 0 };    // p99 above this cuts the score (0 = throughput only)
+    std::string stateFile;                       // learned settings as key=value ("" = keep in memory)
+    std::string endpoint;                        // stored as name@endpoint, so each server learns its own
+};
+
+// Where main keeps learned settings: $APP_TUNING_FILE (set but empty:
+// nowhere), else ~/.app-tuning.conf, never the working directory
+std::string defaultTuningFile() {
+    if (const char* path = std::getenv("APP_TUNING_FILE")) return path;
+    if (const char* home = std::getenv("HOME")) return std::string(home) + "/.app-tuning.conf";
+    return "";
+}
+
+// ---------------------------------------------------------
+// Class: OnlineTuner
+// Hill-climbs one integer setting (a pool size, rows per INSERT)
+// while the program runs. Callers time each operation and record()
+// it; every window the tuner scores the current value by throughput
+// (items per second), scaled down by p99Target / p99 when the p99
+// goes over target, and moves on: further the same way while the
+// score improves, back the other way with half the step when it
+// drops. Steps are multiplicative (1.5x at first, never below 1.06x)
+// since these settings span orders of magnitude, and the value never
+// leaves [min, max]. The step never reaches zero, so the tuner keeps
+// following a workload that changes.
+//
+// Each new value is written to stateFile under the tuner's name and
+// endpoint, and a tuner with the same name and endpoint starts from
+// there in the next process (clamped to the current bounds).
+//
+// Metrics: tuner.<name>.value and tuner.<name>.score gauges,
+// tuner.<name>.steps counter.
+// ---------------------------------------------------------
+class OnlineTuner {
+public:
+    using Apply = std::function<void(size_t value)>;
+
+    OnlineTuner(std::string name, size_t initial, size_t min, size_t max,
+                const OnlineTunerOptions& opts = {}, Apply apply = nullptr)
+        : name_(std::move(name)), min_(min), max_(std::max(min, max)), opts_(opts), apply_(std::move(apply)),
+          stateKey_(opts.endpoint.empty() ? name_ : name_ + "@" + opts.endpoint),
+          steps_(Metrics::instance().counter("tuner." + name_ + ".steps")) {
+        if (!opts_.stateFile.empty()) {
+            auto saved = loadSettings(opts_.stateFile);
+            auto it = saved.find(stateKey_);
+            if (it != saved.end()) initial = it->second;
+        }
+        value_.store(std::clamp(initial, min_, max_));
+        if (apply_) apply_(value_.load());
+        windowStart_ = std::chrono::steady_clock::now();
+        windowEnd_.store((windowStart_ + opts_.window).time_since_epoch().count());
+        Metrics::instance().gauge("tuner." + name_ + ".value", [this] { return double(value_.load()); });
+        Metrics::instance().gauge("tuner." + name_ + ".score", [this] { return score_.load(); });
+    }
+
+    ~OnlineTuner() {
+        Metrics::instance().removeGauge("tuner." + name_ + ".value");
+        Metrics::instance().removeGauge("tuner." + name_ + ".score");
+    }
+
+    OnlineTuner(const OnlineTuner&) = delete;
+    OnlineTuner& operator=(const OnlineTuner&) = delete;
+
+    size_t value() const { return value_.load(std::memory_order_relaxed); }
+
+    // Score of the last finished window
+    double score() const { return score_.load(); }
+
+    // One operation that took `latency` and did `items` units of work
+    // (queries, rows); safe from any thread
+    void record(std::chrono::nanoseconds latency, size_t items = 1) {
+        latency_.record(latency);
+        items_.fetch_add(items, std::memory_order_relaxed);
+        samples_.fetch_add(1, std::memory_order_relaxed);
+        auto now = std::chrono::steady_clock::now();
+        if (now.time_since_epoch().count() < windowEnd_.load(std::memory_order_relaxed)) return;
+        std::unique_lock<std::mutex> lock(mu_, std::try_to_lock);
+        if (lock.owns_lock() && now.time_since_epoch().count() >= windowEnd_.load()) endWindow(now);
+    }
+
+    // key=value per line; unreadable or malformed lines are skipped
+    static std::map<std::string, size_t> loadSettings(const std::string& path) {
+        std::map<std::string, size_t> out;
+        std::ifstream in(path);
+        std::string line;
+        while (std::getline(in, line)) {
+            size_t eq = line.find('=');
+            if (eq == std::string::npos) continue;
+            try {
+                out[line.substr(0, eq)] = std::stoull(line.substr(eq + 1));
+            }
+            catch (const std::exception&) {
+            }
+        }
+        return out;
+    }
+
+    // Rewrites the file through a rename, so readers never see half of
+    // it. Load, update and rename happen under an flock on the state
+    // file, so processes (and threads) sharing it keep each other's keys.
+    static void saveSetting(const std::string& path, const std::string& key, size_t value) {
+        int fd;
+        for (;;) {
+            fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+            if (fd < 0) throw std::runtime_error("cannot open " + path + ": " + std::strerror(errno));
+            if (::flock(fd, LOCK_EX) != 0) {
+                int err = errno;
+                ::close(fd);
+                throw std::runtime_error("cannot lock " + path + ": " + std::strerror(err));
+            }
+            // The previous holder may have renamed a new file over the one we locked
+            struct stat locked, current;
+            if (::fstat(fd, &locked) == 0 && ::stat(path.c_str(), &current) == 0 &&
+                locked.st_dev == current.st_dev && locked.st_ino == current.st_ino) break;
+            ::close(fd);
+        }
+        struct Unlock {
+            int fd;
+            ~Unlock() { ::close(fd); }  // closing drops the lock
+        } unlock{ fd };
+
+        auto settings = loadSettings(path);
+        settings[key] = value;
+        std::string text;
+        for (const auto& s : settings) text += s.first + "=" + std::to_string(s.second) + "\n";
+
+        std::string tmp = path + ".XXXXXX";  // same directory, so the rename stays atomic
+        int out = ::mkstemp(&tmp[0]);
+        if (out < 0) throw std::runtime_error("cannot create a temporary file next to " + path + ": " + std::strerror(errno));
+        bool written = ::fchmod(out, 0644) == 0;
+        for (size_t done = 0; written && done < text.size();) {
+            ssize_t n = ::write(out, text.data() + done, text.size() - done);
+            if (n < 0 && errno == EINTR) continue;
+            written = n > 0;
+            if (written) done += static_cast<size_t>(n);
+        }
+        written = ::close(out) == 0 && written;
+        if (!written || std::rename(tmp.c_str(), path.c_str()) != 0) {
+            int err = errno;
+            ::unlink(tmp.c_str());
+            throw std::runtime_error((written ? "cannot replace " + path : "cannot write " + tmp) + ": " + std::strerror(err));
+        }
+    }
+
+private:
+    static constexpr double kFirstStep = 0.5;
+    static constexpr double kMinStep = 0.0625;
+
+    void endWindow(std::chrono::steady_clock::time_point now) {
+        if (samples_.load() < opts_.minSamples) {  // too little traffic to judge: keep measuring
+            windowEnd_.store((now + opts_.window).time_since_epoch().count());
+            return;
+        }
+        double seconds = std::chrono::duration<double>(now - windowStart_).count();
+        double score = items_.exchange(0) / seconds;
+        double p99Us = double(latency_.percentileUs(0.99));
+        double targetUs = std::chrono::duration<double, std::micro>(opts_.p99Target).count();
+        if (targetUs > 0 && p99Us > targetUs) score *= targetUs / p99Us;
+        samples_.store(0);
+        latency_.reset();
+
+        if (havePrevious_ && score < previousScore_) {
+            direction_ = -direction_;
+            step_ = std::max(step_ / 2, kMinStep);
+        }
+        previousScore_ = score;
+        havePrevious_ = true;
+        score_.store(score);
+
+        size_t current = value_.load();
+        double target = current * (1 + direction_ * step_);
+        size_t next = std::clamp<size_t>(size_t(std::llround(std::max(1.0, target))), min_, max_);
+        if (next == current) {  // stuck on a bound or on rounding: try one unit
+            next = std::clamp<size_t>(direction_ > 0 ? current + 1 : current - std::min<size_t>(current, 1), min_, max_);
+            if (next == current) direction_ = -direction_;  // at the bound: come back next window
+        }
+        if (next != current) {
+            value_.store(next);
+            ++steps_;
+            if (apply_) apply_(next);
+            if (!opts_.stateFile.empty()) {
+                try {
+                    saveSetting(opts_.stateFile, stateKey_, next);
+                }
+                catch (const std::exception& e) {
+                    std::cerr << "[TUNER] " << e.what() << "\n";
+                }
+            }
+        }
+        windowStart_ = now;
+        windowEnd_.store((now + opts_.window).time_since_epoch().count());
+    }
+
+    std::string                           name_;
+    size_t                                min_, max_;
+    OnlineTunerOptions                    opts_;
+    Apply                                 apply_;
+    std::string                           stateKey_;        // name@endpoint in stateFile
+    std::atomic<size_t>                   value_{ 0 };
+    LatencyHistogram                      latency_;
+    std::atomic<uint64_t>                 items_{ 0 }, samples_{ 0 };
+    std::atomic<int64_t>                  windowEnd_{ 0 };  // steady_clock ticks
+    std::atomic<double>                   score_{ 0 };
+    std::mutex                            mu_;              // held by whoever closes a window
+    std::chrono::steady_clock::time_point windowStart_;
+    double                                previousScore_ = 0;
+    bool                                  havePrevious_ = false;
+    int                                   direction_ = 1;
+    double                                step_ = kFirstStep;
+    std::atomic<uint64_t>& steps_;
+};
+
+// ---------------------------------------------------------
+// Struct: BulkLoadOptions / ImportStats
+// Knobs and results for importUsers.
+// ---------------------------------------------------------
+struct BulkLoadOptions {
+    size_t   batchRows = 5000;          // rows per record batch read from the source
+    size_t   rowsPerStatement = 500;    // rows per multi-row INSERT
+    unsigned loaders = 4;               // parallel loader threads (one connection each)
+    size_t   queueDepth = 8;            // filled batches allowed in flight
+    std::chrono::milliseconds memoryWait{ 30000 };  // longest wait for the memory budget per batch
+    OnlineTuner* rowsPerStatementTuner = nullptr;   // if set, picks rowsPerStatement per batch and is fed each batch's timing
+};
+
+struct ImportStats {
+    size_t rows = 0;
+    size_t batches = 0;
+    double seconds = 0;
+};
+
+// ---------------------------------------------------------
+// Function: importUsers
+// Streams record batches from `reader` into `opts.loaders` parallel
+// bulk loaders. The calling thread reads, each loader owns its own
+// connection and commits every batch in its own transaction.
+// Batches are recycled through a free queue, so memory stays at
+// roughly (queueDepth + loaders) batches whatever the input size.
+// The first error stops the import and is rethrown to the caller;
+// batches already committed by other loaders stay committed.
+// ---------------------------------------------------------
+ImportStats importUsers(sql::Driver* driver, const DbConfig& cfg,
+    UserBatchReader& reader, const BulkLoadOptions& opts = {}) {
+    auto started = std::chrono::steady_clock::now();
+    size_t slots = opts.queueDepth + opts.loaders;
+    BoundedQueue<std::unique_ptr<UserBatch>> filled(opts.queueDepth), spare(slots);
+
+    // Batch storage is charged to the "buffers" account. The reader
+    // waits for room before handing on a batch that does not fit, and
+    // loaders free a batch's storage instead of recycling it while the
+    // process is over its memory budget.
+    MemoryGovernor& governor = MemoryGovernor::instance();
+    std::unordered_map<const UserBatch*, MemoryGovernor::Reservation> held;
+    for (size_t i = 0; i < slots; ++i) {
+        auto batch = std::make_unique<UserBatch>();
+        held.emplace(batch.get(), MemoryGovernor::Reservation(governor.account("buffers")));
+        spare.push(std::move(batch));
+    }
+
+    std::mutex errMu;
+    std::exception_ptr firstError;
+    auto fail = [&](std::exception_ptr e) {
+        std::lock_guard<std::mutex> lock(errMu);
+        if (!firstError) firstError = e;
+        filled.close();
+        spare.close();
+    };
+
+    std::atomic<size_t> rows{ 0 }, batches{ 0 };
+    std::vector<std::thread> loaders;
+    for (unsigned t = 0; t < opts.loaders; ++t) {
+        loaders.emplace_back([&] {
+            try {
+                std::unique_ptr<sql::Connection> con = connectDb(driver, cfg);
+                con->setSchema(cfg.schema);
+                con->setAutoCommit(false);
+                std::unique_ptr<UserBatch> batch;
+                while (filled.pop(batch)) {
+                    OnlineTuner* tuner = opts.rowsPerStatementTuner;
+                    auto batchStart = std::chrono::steady_clock::now();
+                    try {
+                        insertUserBatch(con.get(), *batch, tuner ? tuner->value() : opts.rowsPerStatement);
+                        con->commit();
+                    }
+                    catch (...) {
+                        con->rollback();
+                        throw;
+                    }
+                    if (tuner) tuner->record(std::chrono::steady_clock::now() - batchStart, batch->size());
+                    rows += batch->size();
+                    ++batches;
+                    if (governor.used() > governor.budget()) {
+                        *batch = UserBatch();
+                        held.at(batch.get()).resize(0);
+                    }
+                    spare.push(std::move(batch));
+                }
+            }
+            catch (...) {
+                fail(std::current_exception());
+            }
+        });
+    }
+
+    try {
+        std::unique_ptr<UserBatch> batch;
+        while (spare.pop(batch) && reader.next(*batch, opts.batchRows)) {
+            if (!held.at(batch.get()).resize(batch->memoryBytes(), opts.memoryWait))
+                throw std::runtime_error("import: memory budget exhausted");
+            if (!filled.push(std::move(batch))) break;  // a loader failed
+        }
+    }
+    catch (...) {
+        fail(std::current_exception());
+    }
+    filled.close();
+    for (auto& t : loaders) t.join();
+    if (firstError) std::rethrow_exception(firstError);
+
+    ImportStats stats;
+    stats.rows = rows;
+    stats.batches = batches;
+    stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    return stats;
+}
+
+// ---------------------------------------------------------
+// Class: UsersByMinAgeReader
+// The getUsersByMinAge query as a UserBatchReader. The result set is
+// forward-only, which makes Connector/C++ stream rows as the server
+// sends them instead of buffering the whole result first; the
+// connection stays busy until the reader is drained or destroyed.
+// ---------------------------------------------------------
+class UsersByMinAgeReader : public UserBatchReader {
+public:
+    UsersByMinAgeReader(sql::Connection* con, int minAge) {
+        StatementScope scope("getUsersByMinAge");
+        HeavyHitters::instance().record("getUsersByMinAge", minAge);
+        ps_.reset(con->prepareStatement("SELECT id, name, age FROM users WHERE age >= ? ORDER BY age DESC, id ASC"));
+        ps_->setResultSetType(sql::ResultSet::TYPE_FORWARD_ONLY);
+        ps_->setInt(1, minAge);
+        rs_.reset(ps_->executeQuery());
+    }
+
+    bool next(UserBatch& batch, size_t maxRows) override {
+        StatementScope scope("getUsersByMinAge");
+        batch.clear();
+        while (batch.size() < maxRows && rs_->next()) {
+            sql::SQLString name = rs_->getString(2);
+            batch.append(rs_->getInt(1), std::string_view(name.c_str(), name.length()), rs_->isNull(3) ? 0 : rs_->getInt(3));
+        }
+        return !batch.empty();
+    }
+
+private:
+    std::unique_ptr<sql::PreparedStatement> ps_;
+    std::unique_ptr<sql::ResultSet>         rs_;
+};
+
+// ---------------------------------------------------------
+// Struct: PipelineOptions
+// ---------------------------------------------------------
+struct PipelineOptions {
+    size_t   batchRows = 4096;  // rows per batch handed to a worker
+    unsigned workers = 2;       // transform threads
+    size_t   queueDepth = 4;    // batches waiting between stages
+    bool     ordered = true;    // sink sees results in source order
+};
+
+// ---------------------------------------------------------
+// Function: runBatchPipeline
+// Three-stage pipeline over a UserBatchReader:
+//   fetch thread  -> reads batches from `source`
+//   worker threads -> r = transform(batch)   (any number, in parallel)
+//   calling thread -> sink(std::move(r))
+// so waiting for the next rows overlaps with CPU work on earlier
+// ones. Batches come from a fixed pool of queueDepth * 2 + workers
+// buffers, and a buffer goes back to the pool only once the sink has
+// taken its result, so a slow sink stalls the workers and then the
+// fetch thread (backpressure end to end) and memory stays bounded.
+// With `ordered`, results reach the sink in source order (held back
+// in a small reorder buffer); otherwise as soon as they are ready.
+// The first exception from any stage stops the pipeline and is
+// rethrown here.
+// ---------------------------------------------------------
+template <typename Transform, typename Sink>
+void runBatchPipeline(UserBatchReader& source, Transform transform, Sink sink, const PipelineOptions& opts = {}) {
+    using Result = std::invoke_result_t<Transform&, const UserBatch&>;
+    struct Work {
+        uint64_t                   seq = 0;
+        std::unique_ptr<UserBatch> batch;
+        std::optional<Result>      result;
+    };
+
+    unsigned workers = std::max(1u, opts.workers);
+    size_t buffers = opts.queueDepth * 2 + workers;
+    BoundedQueue<std::unique_ptr<UserBatch>> spare(buffers);
+    BoundedQueue<Work> fetched(opts.queueDepth), done(buffers);
+    for (size_t i = 0; i < buffers; ++i) spare.push(std::make_unique<UserBatch>());
+
+    std::mutex errMu;
+    std::exception_ptr firstError;
+    auto fail = [&](std::exception_ptr e) {
+        std::lock_guard<std::mutex> lock(errMu);
+        if (!firstError) firstError = e;
+        spare.close();
+        fetched.close();
+        done.close();
+    };
+
+    std::thread fetcher([&] {
+        try {
+            std::unique_ptr<UserBatch> batch;
+            for (uint64_t seq = 0; spare.pop(batch) && source.next(*batch, opts.batchRows); ++seq) {
+                if (!fetched.push(Work{ seq, std::move(batch), std::nullopt })) break;
+            }
+        }
+        catch (...) {
+            fail(std::current_exception());
+        }
+        fetched.close();
+    });
+
+    std::atomic<unsigned> running{ workers };
+    std::vector<std::thread> pool;
+    for (unsigned t = 0; t < workers; ++t) {
+        pool.emplace_back([&] {
+            try {
+                Work w;
+                while (fetched.pop(w)) {
+                    w.result.emplace(transform(static_cast<const UserBatch&>(*w.batch)));
+                    if (!done.push(std::move(w))) break;
+                }
+            }
+            catch (...) {
+                fail(std::current_exception());
+            }
+            if (--running == 0) done.close();  // last worker out
+        });
+    }
+
+    try {
+        std::map<uint64_t, Work> waiting;  // ordered mode: results that arrived early
+        uint64_t nextSeq = 0;
+        auto deliver = [&](Work& w) {
+            sink(std::move(*w.result));
+            spare.push(std::move(w.batch));
+        };
+        Work w;
+        while (done.pop(w)) {
+            if (!opts.ordered) {
+                deliver(w);
+                continue;
+            }
+            waiting.emplace(w.seq, std::move(w));
+            for (auto it = waiting.begin(); it != waiting.end() && it->first == nextSeq; it = waiting.erase(it), ++nextSeq)
+                deliver(it->second);
+        }
+    }
+    catch (...) {
+        fail(std::current_exception());
+    }
+    spare.close();  // unblock the fetcher if the sink stopped early
+    fetcher.join();
+    for (auto& th : pool) th.join();
+    if (firstError) std::rethrow_exception(firstError);
+}
+
+// ---------------------------------------------------------
+// Function: getUsersByMinAge (pipelined)
+// getUsersByMinAge with the fetch on its own thread and
+// transform(batch) on opts.workers threads; see runBatchPipeline.
+// ---------------------------------------------------------
+template <typename Transform, typename Sink>
+void getUsersByMinAge(sql::Connection* con, int minAge, Transform transform, Sink sink, const PipelineOptions& opts = {}) {
+    UsersByMinAgeReader reader(con, minAge);
+    runBatchPipeline(reader, std::move(transform), std::move(sink), opts);
+}
+
+// ---------------------------------------------------------
+// Class: PooledConnection
+// A connection owned by a ConnectionPool, with its own cache of
+// prepared statements: prepare() compiles a statement the first time
+// this connection sees it and hands back the same one (parameters
+// cleared) afterwards.
+//
+// After a server restart or failover the connection is dead.
+// reconnect() opens a new one through the pool's connector and
+// replays the schema and autocommit set through setSchema() and
+// setAutoCommit(). Other session state, like user variables or
+// temporary tables, is lost. Cached statements are not prepared again
+// there: each one is re-prepared by the prepare() call that next asks
+// for it, or by prepareCached(), which the pool's maintenance thread
+// runs on the idle connections it recovers.
+// retryRead() reconnects transparently for reads that are safe to run
+// twice; writes still see the error, since the server may or may not
+// have applied them.
+// ---------------------------------------------------------
+class ConnectionPool;
+
+class PooledConnection {
+public:
+    explicit PooledConnection(std::unique_ptr<sql::Connection> con) : con_(std::move(con)) {}
+
+    sql::Connection* get() const { return con_.get(); }
+
+    sql::PreparedStatement* prepare(const std::string& query) {
+        auto it = statements_.find(query);
+        if (it == statements_.end())
+            it = statements_.emplace(query, std::unique_ptr<sql::PreparedStatement>(con_->prepareStatement(query))).first;
+        else if (!it->second) reprepare(*it);
+        else it->second->clearParameters();
+        return it->second.get();
+    }
+
+    // Prepare again every cached statement that a reconnect() dropped
+    void prepareCached() {
+        for (auto& s : statements_)
+            if (!s.second) reprepare(s);
+    }
+
+    size_t cachedStatements() const { return statements_.size(); }
+
+    // Session state that reconnect() restores
+    void setSchema(const std::string& schema) {
+        con_->setSchema(schema);
+        schema_ = schema;
+    }
+
+    void setAutoCommit(bool on) {
+        con_->setAutoCommit(on);
+        autoCommit_ = on;
+    }
+
+    // Statement pointers from prepare() do not survive this
+    void reconnect();
+
+    // fn(*this), run once more on a fresh connection if it failed with
+    // a connection error. Only for idempotent reads, and not inside a
+    // transaction (autocommit off): the server rolled that back.
+    template <typename Fn>
+    auto retryRead(Fn&& fn) -> decltype(fn(*this)) {
+        try {
+            return fn(*this);
+        }
+        catch (const sql::SQLException& e) {
+            if (!isConnectionError(e.getErrorCode(), e.getSQLState()) || autoCommit_ == false) throw;
+        }
+        reconnect();
+        ++Metrics::instance().counter("pool.read_retries");
+        return fn(*this);
+    }
+
+private:
+    friend class ConnectionPool;
+
+    void reprepare(std::pair<const std::string, std::unique_ptr<sql::PreparedStatement>>& s);
+
+    std::unique_ptr<sql::Connection> con_;
+    ConnectionPool*                  pool_ = nullptr; // owner, whose connector reconnect() uses
+    uint32_t                         poolIndex_ = 0;  // slot in the owning pool
+    std::atomic<uint64_t>            generation_{ 0 }; // pool restart generation it was opened in
+    std::chrono::steady_clock::time_point lastUsed_;  // when it was last returned
+    std::optional<std::string>       schema_;
+    std::optional<bool>              autoCommit_;
+    // Null after a reconnect() until the statement is prepared again
+    std::unordered_map<std::string, std::unique_ptr<sql::PreparedStatement>> statements_;
+};
+
+// ---------------------------------------------------------
+// Struct: ConnectionPoolOptions
+// ---------------------------------------------------------
+struct ConnectionPoolOptions {
+    size_t size = 8;                               // connections, opened on demand
+    std::chrono::milliseconds idleTimeout{ 0 };    // close connections idle this long (0 = never)
+    size_t minIdle = 0;                            // but keep at least this many open
+};
+
+// ---------------------------------------------------------
+// Class: ConnectionPool
+// A fixed-size pool of connections, safe to share between threads.
+// borrow() takes an idle connection (waiting while all are in use);
+// the Lease it returns gives it back.
+//
+// Idle connections sit on per-core free lists: lock-free Treiber
+// stacks of connection indexes, one per CPU, each on its own cache
+// line, with a tag in the head word against ABA. Borrow pops from the
+// current core's stack and return pushes onto it, so threads on
+// different cores never touch the same line. A borrower whose stack
+// is empty steals from the other cores' stacks, then opens a new
+// connection while below size (unopened indexes sit on one more
+// stack), and only then blocks; returns wake it through a mutex that
+// is taken on the waiting path alone.
+//
+// borrowSticky() adds per-thread affinity on top: when the lease
+// ends, the connection is parked in the calling thread's own slot
+// instead of a free list, and that thread's next borrowSticky()
+// picks it up again with one atomic exchange; the connection's
+// prepared statements stay warm. A borrower that finds every free
+// list empty also steals parked connections, and while anyone is
+// waiting returned connections go to a free list rather than a slot.
+//
+// Many worker processes per host each holding `size` connections add
+// up on the server. With idleTimeout, a background reaper closes
+// connections nobody used for that long (keeping minIdle). To share
+// a few server connections between all the processes, point
+// DbConfig::host at a MySqlProxy socket ("unix:///path/to.sock").
+//
+// Server restarts: the first connection that reconnects (see
+// PooledConnection::reconnect()) bumps the pool's generation, and the
+// same background thread then brings every idle connection from the
+// older generation back (ping, else reconnect and re-prepare), so
+// borrowers get warm connections instead of all re-preparing on
+// their first query at once. It holds one connection at a time, so
+// the rest stay available, and stops at the first that cannot
+// connect: while the server is still down it retries with backoff.
+//
+// Metrics: pool.borrow.{stolen,opened,waits} and pool.reaped (slow
+// paths only, so the fast path never writes a shared cache line; see
+// stickyHits()); pool.reconnects, pool.reprepared,
+// pool.read_retries, and histograms pool.reconnect (one connection)
+// and pool.recovery (restart noticed to idle connections all back).
+// ---------------------------------------------------------
+class ConnectionPool {
+public:
+    using Connector = std::function<std::unique_ptr<sql::Connection>()>;
+
+    class Lease {
+    public:
+        Lease() = default;
+        Lease(Lease&& o) noexcept : pool_(o.pool_), pc_(o.pc_), sticky_(o.sticky_) { o.pc_ = nullptr; }
+        Lease& operator=(Lease&& o) noexcept {
+            if (this != &o) {
+                reset();
+                pool_ = o.pool_;
+                pc_ = o.pc_;
+                sticky_ = o.sticky_;
+                o.pc_ = nullptr;
+            }
+            return *this;
+        }
+        ~Lease() { reset(); }
+
+        PooledConnection* operator->() const { return pc_; }
+        PooledConnection& operator*() const { return *pc_; }
+        sql::Connection*  get() const { return pc_->get(); }
+        ConnectionPool*   pool() const { return pool_; }
+        explicit operator bool() const { return pc_ != nullptr; }
+
+        void reset() {
+            if (pc_) pool_->giveBack(pc_, sticky_);
+            pc_ = nullptr;
+        }
+
+    private:
+        friend class ConnectionPool;
+        Lease(ConnectionPool* pool, PooledConnection* pc, bool sticky) : pool_(pool), pc_(pc), sticky_(sticky) {}
+
+        ConnectionPool*   pool_ = nullptr;
+        PooledConnection* pc_ = nullptr;
+        bool              sticky_ = false;
+    };
+
+    ConnectionPool(Connector connect, const ConnectionPoolOptions& opts = {})
+        : connect_(std::move(connect)), opts_(opts), id_(nextPoolId()),
+          all_(opts.size), next_(opts.size),
+          stacks_(std::max(1u, std::thread::hardware_concurrency())), limit_(opts.size),
+          stolen_(metric("stolen")), opened_(metric("opened")), waits_(metric("waits")),
+          reaped_(Metrics::instance().counter("pool.reaped")) {
+        if (opts.size >= UINT32_MAX) throw std::invalid_argument("ConnectionPool: size too large");
+        for (size_t i = opts.size; i-- > 0;) push(unopened_, static_cast<uint32_t>(i));
+        if (opts.idleTimeout.count() > 0) maintenance_ = std::thread([this] { maintain(); });
+    }
+
+    ConnectionPool(const ConnectionPool&) = delete;
+    ConnectionPool& operator=(const ConnectionPool&) = delete;
+
+    // All leases must have ended
+    ~ConnectionPool() {
+        if (maintenance_.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(mu_);
+                stopping_ = true;
+            }
+            maintenanceWake_.notify_all();
+            maintenance_.join();
+        }
+        std::lock_guard<std::mutex> lock(slotsMu_);
+        for (auto& s : slots_) s->parked.store(nullptr);
+    }
+
+    Lease borrow() { return Lease(this, take(), false); }
+
+    Lease borrowSticky() {
+        Slot& slot = localSlot();
+        if (PooledConnection* pc = slot.parked.exchange(nullptr)) {
+            slot.hits.store(slot.hits.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return Lease(this, pc, true);
+        }
+        return Lease(this, take(), true);
+    }
+
+    size_t size() const { return opts_.size; }
+
+    // Connections allowed open at once, 1..size() (all of them unless
+    // set). Lowering it closes connections as they are given back.
+    void setLimit(size_t n) {
+        limit_.store(std::clamp<size_t>(n, 1, opts_.size));
+        // A raised limit may let several waiters open connections
+        std::lock_guard<std::mutex> lock(mu_);
+        ++wakeups_;
+        available_.notify_all();
+    }
+
+    size_t limit() const { return limit_.load(); }
+
+    // borrowSticky() calls served from the thread's own slot
+    uint64_t stickyHits() {
+        std::lock_guard<std::mutex> lock(slotsMu_);
+        uint64_t n = 0;
+        for (auto& s : slots_) n += s->hits.load(std::memory_order_relaxed);
+        return n;
+    }
+
+private:
+    friend class PooledConnection;
+
+    static constexpr uint32_t kNone = UINT32_MAX;
+
+    // Head word: (tag << 32) | (index + 1); 0 in the low half = empty
+    struct alignas(64) FreeStack {
+        std::atomic<uint64_t> head{ 0 };
+    };
+
+    struct alignas(64) Slot {
+        std::atomic<PooledConnection*> parked{ nullptr };
+        std::atomic<bool>              owned{ true };
+        std::atomic<uint64_t>          hits{ 0 };  // written by the owner only
+    };
+
+    static std::atomic<uint64_t>& metric(const char* name) { return Metrics::instance().counter(std::string("pool.borrow.") + name); }
+
+    static uint64_t nextPoolId() {
+        static std::atomic<uint64_t> next{ 0 };
+        return ++next;
+    }
+
+    void push(FreeStack& stack, uint32_t index) {
+        uint64_t old = stack.head.load(std::memory_order_relaxed), next;
+        do {
+            next_[index].store(static_cast<uint32_t>(old), std::memory_order_relaxed);
+            next = (((old >> 32) + 1) << 32) | (index + 1);
+        } while (!stack.head.compare_exchange_weak(old, next, std::memory_order_release, std::memory_order_relaxed));
+    }
+
+    uint32_t pop(FreeStack& stack) {
+        uint64_t old = stack.head.load(std::memory_order_acquire), next;
+        do {
+            uint32_t top = static_cast<uint32_t>(old);
+            if (top == 0) return kNone;
+            // May read a node another thread just popped; the tag
+            // makes the CAS fail in that case
+            next = (((old >> 32) + 1) << 32) | next_[top - 1].load(std::memory_order_relaxed);
+        } while (!stack.head.compare_exchange_weak(old, next, std::memory_order_acquire, std::memory_order_acquire));
+        return static_cast<uint32_t>(old) - 1;
+    }
+
+    static unsigned currentCore() {
+#ifdef __linux__
+        int cpu = sched_getcpu();
+        if (cpu >= 0) return static_cast<unsigned>(cpu);
+#endif
+        thread_local unsigned pseudoCore = static_cast<unsigned>(std::hash<std::thread::id>()(std::this_thread::get_id()));
+        return pseudoCore;
+    }
+
+    FreeStack& localStack() { return stacks_[currentCore() % stacks_.size()]; }
+
+    // Own core's stack, then the others', then a new connection
+    PooledConnection* tryTake() {
+        size_t home = currentCore() % stacks_.size();
+        for (size_t k = 0; k < stacks_.size(); ++k) {
+            uint32_t i = pop(stacks_[(home + k) % stacks_.size()]);
+            if (i == kNone) continue;
+            if (k > 0) ++stolen_;
+            return all_[i].get();
+        }
+        // Count the connection in before opening it, so concurrent
+        // borrowers cannot together go over the limit
+        size_t open = open_.load();
+        do {
+            if (open >= limit_.load(std::memory_order_relaxed)) return nullptr;
+        } while (!open_.compare_exchange_weak(open, open + 1));
+        uint32_t i = pop(unopened_);
+        if (i == kNone) {
+            --open_;
+            return nullptr;
+        }
+        try {
+            all_[i] = std::make_unique<PooledConnection>(connect_());
+        }
+        catch (...) {
+            push(unopened_, i);
+            --open_;
+            wake();  // a waiter may retry the open
+            throw;
+        }
+        all_[i]->pool_ = this;
+        all_[i]->poolIndex_ = i;
+        all_[i]->generation_ = generation_.load();
+        ++opened_;
+        return all_[i].get();
+    }
+
+    PooledConnection* take() {
+        if (PooledConnection* pc = tryTake()) return pc;
+        std::unique_lock<std::mutex> lock(mu_);
+        ++waiters_;  // before the rescan: see giveBack()
+        struct Leave {
+            std::atomic<int>& n;
+            ~Leave() { --n; }
+        } leave{ waiters_ };
+        for (;;) {
+            uint64_t seen = wakeups_;
+            // Not under mu_: opening a connection can take a whole
+            // connect timeout (and a failed open wakes the others)
+            lock.unlock();
+            PooledConnection* pc = tryTake();
+            if (!pc && (pc = stealParked())) ++stolen_;
+            if (pc) return pc;
+            lock.lock();
+            ++waits_;
+            available_.wait(lock, [&] { return wakeups_ != seen; });
+        }
+    }
+
+    void wake() {
+        if (waiters_.load() == 0) return;
+        std::lock_guard<std::mutex> lock(mu_);
+        ++wakeups_;
+        available_.notify_one();
+    }
+
+    void giveBack(PooledConnection* pc, bool sticky) {
+        pc->lastUsed_ = std::chrono::steady_clock::now();
+        if (pc->generation_ != generation_.load(std::memory_order_relaxed)) requestRecovery();
+        // Over a lowered limit: count it out (re-checking the limit on
+        // every try, it may be raised meanwhile) and close it
+        bool overLimit = false;
+        size_t open = open_.load(std::memory_order_relaxed);
+        while (!overLimit && open > limit_.load(std::memory_order_relaxed))
+            overLimit = open_.compare_exchange_weak(open, open - 1);
+        if (overLimit) {
+            uint32_t i = pc->poolIndex_;
+            all_[i].reset();
+            push(unopened_, i);
+            wake();
+            return;
+        }
+        if (sticky && waiters_.load() == 0) {
+            Slot& slot = localSlot();
+            PooledConnection* empty = nullptr;
+            if (slot.parked.compare_exchange_strong(empty, pc)) {
+                // A borrower that started waiting after our check may
+                // already have scanned the slots: hand it over instead
+                if (waiters_.load() == 0) return;
+                pc = slot.parked.exchange(nullptr);
+                if (!pc) return;  // it stole the connection itself
+            }
+        }
+        push(localStack(), pc->poolIndex_);
+        wake();
+    }
+
+    // Called by a connection that reconnected; returns the generation
+    // it belongs to now. Only the first one after a restart (still in
+    // the current generation) starts a new one.
+    uint64_t noteRestart(uint64_t seen) {
+        uint64_t current = seen;
+        if (!generation_.compare_exchange_strong(current, seen + 1)) return current;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            restartSeen_ = std::chrono::steady_clock::now();
+        }
+        requestRecovery();
+        return seen + 1;
+    }
+
+    void requestRecovery() {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (stopping_) return;
+        recoverPending_ = true;
+        if (!maintenance_.joinable()) maintenance_ = std::thread([this] { maintain(); });
+        maintenanceWake_.notify_all();
+    }
+
+    // Background thread: reaps every idleTimeout / 2 and recovers idle
+    // connections after a restart, retrying while the server is down
+    void maintain() {
+        bool recovering = false;
+        auto backoff = std::chrono::milliseconds(100);
+        std::unique_lock<std::mutex> lock(mu_);
+        for (;;) {
+            auto woken = [&] { return stopping_ || recoverPending_; };
+            if (recovering) maintenanceWake_.wait_for(lock, backoff, woken);
+            else if (opts_.idleTimeout.count() > 0) maintenanceWake_.wait_for(lock, opts_.idleTimeout / 2, woken);
+            else maintenanceWake_.wait(lock, woken);
+            if (stopping_) return;
+            if (recoverPending_) {
+                recoverPending_ = false;
+                recovering = true;
+                backoff = std::chrono::milliseconds(100);
+            }
+            auto since = restartSeen_;
+            lock.unlock();
+            if (!recovering) reapIdle();
+            else if (recoverIdle()) {
+                recovering = false;
+                recovery_.record(std::chrono::steady_clock::now() - since);
+            }
+            else backoff = std::min(backoff * 2, std::chrono::milliseconds(5000));
+            lock.lock();
+        }
+    }
+
+    // Takes every idle connection off the free lists and slots, asks
+    // visit() whether to close it and puts the rest back. visit() runs
+    // without locks, so it may talk to the server.
+    void sweepIdle(const std::function<bool(PooledConnection&)>& visit) {
+        auto close = [&](uint32_t i) {
+            all_[i].reset();
+            --open_;
+            push(unopened_, i);
+        };
+        std::vector<std::pair<FreeStack*, uint32_t>> keep;
+        for (auto& stack : stacks_)
+            for (uint32_t i; (i = pop(stack)) != kNone;) {
+                if (visit(*all_[i])) close(i);
+                else keep.push_back({ &stack, i });
+            }
+        std::vector<std::pair<Slot*, PooledConnection*>> parked;
+        {
+            std::lock_guard<std::mutex> lock(slotsMu_);
+            for (auto& slot : slots_)
+                if (PooledConnection* pc = slot->parked.exchange(nullptr)) parked.push_back({ slot.get(), pc });
+        }
+        for (auto& p : parked) {
+            PooledConnection* empty = nullptr;
+            if (visit(*p.second)) close(p.second->poolIndex_);
+            else if (!p.first->parked.compare_exchange_strong(empty, p.second)) keep.push_back({ &stacks_[0], p.second->poolIndex_ });
+        }
+        for (auto& k : keep) push(*k.first, k.second);
+        wake();  // borrowers may have found the lists empty meanwhile
+    }
+
+    // Close what sat unused for idleTimeout
+    void reapIdle() {
+        auto cutoff = std::chrono::steady_clock::now() - opts_.idleTimeout;
+        size_t open = open_.load();
+        sweepIdle([&](PooledConnection& pc) {
+            if (opts_.idleTimeout.count() == 0 || pc.lastUsed_ >= cutoff || open <= opts_.minIdle) return false;
+            --open;
+            ++reaped_;
+            return true;
+        });
+    }
+
+    // Bring idle connections from before the last restart back, one
+    // at a time so borrowers keep every other idle connection, and
+    // stop at the first that cannot reach the server (the caller backs
+    // off). False while any are left.
+    bool recoverIdle() {
+        while (PooledConnection* pc = takeStale(generation_.load())) {
+            bool ok = false;
+            try {
+                if (pc->con_->isValid()) pc->generation_ = generation_.load();  // survived (a blip, not a restart)
+                else pc->reconnect();
+                pc->prepareCached();  // here rather than on a borrower's first query
+                ok = true;
+            }
+            catch (const sql::SQLException&) {
+            }
+            catch (const std::exception& e) {
+                std::cerr << "[POOL] reconnect failed: " << e.what() << "\n";
+            }
+            catch (...) {
+                std::cerr << "[POOL] reconnect failed\n";
+            }
+            push(localStack(), pc->poolIndex_);
+            wake();
+            if (!ok) return false;
+        }
+        return true;
+    }
+
+    // One idle connection opened before `current`, taken off its free
+    // list or slot (the others it passes go straight back), or null
+    PooledConnection* takeStale(uint64_t current) {
+        for (auto& stack : stacks_) {
+            std::vector<uint32_t> passed;
+            PooledConnection* found = nullptr;
+            for (uint32_t i; !found && (i = pop(stack)) != kNone;) {
+                if (all_[i]->generation_ != current) found = all_[i].get();
+                else passed.push_back(i);
+            }
+            for (auto it = passed.rbegin(); it != passed.rend(); ++it) push(stack, *it);
+            if (found) return found;
+        }
+        std::lock_guard<std::mutex> lock(slotsMu_);
+        for (auto& slot : slots_) {
+            PooledConnection* pc = slot->parked.load();
+            if (pc && pc->generation_ != current && slot->parked.compare_exchange_strong(pc, nullptr)) return pc;
+        }
+        return nullptr;
+    }
+
+    PooledConnection* stealParked() {
+        std::lock_guard<std::mutex> lock(slotsMu_);
+        for (auto& s : slots_)
+            if (PooledConnection* pc = s->parked.exchange(nullptr)) return pc;
+        return nullptr;
+    }
+
+    // This thread's slot in this pool. A slot outlives its thread so a
+    // parked connection is never lost; a new thread adopts a free one.
+    Slot& localSlot() {
+        struct Local {
+            std::vector<std::pair<uint64_t, std::shared_ptr<Slot>>> byPool;
+            ~Local() { for (auto& p : byPool) p.second->owned.store(false); }
+        };
+        thread_local Local local;
+        for (auto& p : local.byPool)
+            if (p.first == id_) return *p.second;
+        // Forget slots of pools that are gone (we hold the last reference)
+        local.byPool.erase(std::remove_if(local.byPool.begin(), local.byPool.end(),
+            [](const auto& p) { return p.second.use_count() == 1; }), local.byPool.end());
+
+        std::shared_ptr<Slot> slot;
+        {
+            std::lock_guard<std::mutex> lock(slotsMu_);
+            for (auto& s : slots_) {
+                bool expected = false;
+                if (s->owned.compare_exchange_strong(expected, true)) { slot = s; break; }
+            }
+            if (!slot) {
+                slots_.push_back(std::make_shared<Slot>());
+                slot = slots_.back();
+            }
+        }
+        local.byPool.emplace_back(id_, slot);
+        return *slot;
+    }
+
+    Connector                                      connect_;
+    ConnectionPoolOptions                          opts_;
+    uint64_t                                       id_;        // keys this pool's thread-local slots
+    std::vector<std::unique_ptr<PooledConnection>> all_;       // owns every connection, by index
+    std::vector<std::atomic<uint32_t>>             next_;      // free-stack links, by index (+1, 0 = end)
+    std::vector<FreeStack>                         stacks_;    // one per core
+    FreeStack                                      unopened_;  // indexes without a connection yet
+    std::atomic<size_t>                            open_{ 0 };
+    std::atomic<size_t>                            limit_;     // see setLimit()
+    std::mutex                                     mu_;        // waiting path only
+    std::condition_variable                        available_;
+    uint64_t                                       wakeups_ = 0;
+    std::atomic<int>                               waiters_{ 0 };
+    std::mutex                                     slotsMu_;
+    std::vector<std::shared_ptr<Slot>>             slots_;
+    std::atomic<uint64_t>                          generation_{ 0 };  // bumped per server restart
+    std::thread                                    maintenance_;      // reaper and restart recovery
+    std::condition_variable                        maintenanceWake_;
+    bool                                           stopping_ = false;
+    bool                                           recoverPending_ = false;
+    std::chrono::steady_clock::time_point          restartSeen_;
+    LatencyHistogram&                              recovery_ = Metrics::instance().histogram("pool.recovery");
+    std::atomic<uint64_t>& stolen_;
+    std::atomic<uint64_t>& opened_;
+    std::atomic<uint64_t>& waits_;
+    std::atomic<uint64_t>& reaped_;
+};
+
+void PooledConnection::reconnect() {
+    if (!pool_) throw std::runtime_error("PooledConnection: no pool to reconnect through");
+    auto start = std::chrono::steady_clock::now();
+    // Build the replacement completely before dropping anything, so a
+    // failed attempt leaves this object as it was
+    std::unique_ptr<sql::Connection> fresh = pool_->connect_();
+    if (schema_) fresh->setSchema(*schema_);
+    if (autoCommit_) fresh->setAutoCommit(*autoCommit_);
+    for (auto& s : statements_) s.second.reset();  // before the connection they belong to; prepare() redoes them
+    con_ = std::move(fresh);
+    generation_ = pool_->noteRestart(generation_);
+
+    Metrics& m = Metrics::instance();
+    ++m.counter("pool.reconnects");
+    m.histogram("pool.reconnect").record(std::chrono::steady_clock::now() - start);
+}
+
+void PooledConnection::reprepare(std::pair<const std::string, std::unique_ptr<sql::PreparedStatement>>& s) {
+    s.second.reset(con_->prepareStatement(s.first));
+    ++Metrics::instance().counter("pool.reprepared");
+}
+
+// ---------------------------------------------------------
+// Functions: insertUser / updateUserAgeByName / getUsersByMinAge (pooled)
+// Same statements as above, prepared once per pooled connection. The
+// read survives a server restart (see PooledConnection::retryRead());
+// the writes report it.
+// ---------------------------------------------------------
+int insertUser(PooledConnection& pc, std::string_view name, int age) {
+    StatementScope scope("insertUser");
+    HeavyHitters::instance().record("insertUser", name);
+    sql::PreparedStatement* ps = pc.prepare("INSERT INTO users(name, age) VALUES(?, ?)");
+    bindNameAge(ps, 1, name, age);
+    ps->executeUpdate();
+    std::unique_ptr<sql::ResultSet> r(pc.prepare("SELECT LAST_INSERT_ID()")->executeQuery());
+    int id = r->next() ? r->getInt(1) : 0;
+    UserWriteHooks::instance().inserted(id, name, age);
+    return id;
+}
+
+int updateUserAgeByName(PooledConnection& pc, std::string_view name, int newAge) {
+    StatementScope scope("updateUserAgeByName");
+    HeavyHitters::instance().record("updateUserAgeByName", name);
+    sql::PreparedStatement* ps = pc.prepare("UPDATE users SET age = ? WHERE name = ?");
+    ps->setInt(1, newAge);
+    ps->setString(2, sql::SQLString(name.data(), name.size()));
+    int changed = ps->executeUpdate();
+    if (changed > 0) UserWriteHooks::instance().updated(name, newAge);
+    return changed;
+}
+
+std::vector<User> getUsersByMinAge(PooledConnection& pc, int minAge) {
+    StatementScope scope("getUsersByMinAge");
+    HeavyHitters::instance().record("getUsersByMinAge", minAge);
+    return pc.retryRead([&](PooledConnection& c) {
+        sql::PreparedStatement* ps = c.prepare("SELECT id, name, age FROM users WHERE age >= ? ORDER BY age DESC, id ASC");
+        ps->setInt(1, minAge);
+        std::unique_ptr<sql::ResultSet> rs(ps->executeQuery());
+        std::vector<User> out;
+        while (rs->next()) out.push_back({ rs->getInt("id"), rs->getString("name"), rs->isNull("age") ? 0 : rs->getInt("age") });
+        return out;
+    });
+}
+
+// ---------------------------------------------------------
+// Struct: ReadRouterOptions
+// ---------------------------------------------------------
+struct ReadRouterOptions {
+    std::chrono::milliseconds maxLag{ 1000 };        // replicas further behind get no reads
+    std::chrono::milliseconds pollInterval{ 500 };   // how often lag is measured
+    // Empty: lag is Seconds_Behind_Source from SHOW REPLICA STATUS
+    // (whole seconds, and 0 while the SQL thread is idle). Otherwise the
+    // router writes NOW(6) into this table on the primary at every poll
+    // and a replica's lag is how old the newest row it has is. A table
+    // name or schema.table, letters, digits, _ and $ only.
+    std::string heartbeatTable;
+};
+
+// ---------------------------------------------------------
+// Class: ReadRouter
+// Sends reads to replicas that are within maxLag of the primary, and
+// writes to the primary.
+// A background thread measures each replica's lag every pollInterval
+// on one of that replica's pooled connections; a replica whose lag
+// is unknown (query failed, replication stopped) or above maxLag gets
+// no reads until a later poll finds it caught up. Reads rotate over
+// the healthy replicas and fall back to the primary when there is
+// none.
+//
+// Read-after-write: after committing on the primary, take a token
+// with writeToken(); read(token) only picks a replica whose
+// gtid_executed already contains it (GTID_SUBSET), so the read sees
+// the write. Needs gtid_mode=ON. The token is the primary's whole
+// gtid_executed, which is conservative but never wrong.
+//
+// To try it with lag on purpose: on a replica, STOP REPLICA SQL_THREAD
+// (or CHANGE REPLICATION SOURCE TO SOURCE_DELAY = 5) and watch
+// router.replica.<i>.lag_ms and router.reads.* in Metrics.
+// checkReadRouter replaces the lag and GTID queries with fakes.
+// ---------------------------------------------------------
+class ReadRouter {
+public:
+    // Lag of replica i in ms (-1 when unknown), measured on one of its connections
+    using LagProbe = std::function<int64_t(size_t, PooledConnection&)>;
+    // Whether replica i has applied the GTID set `token`
+    using GtidCheck = std::function<bool(size_t, PooledConnection&, const std::string& token)>;
+
+    // Empty probeLag / hasExecuted: ask the servers (see above)
+    ReadRouter(ConnectionPool& primary, std::vector<ConnectionPool*> replicas, const ReadRouterOptions& opts = {},
+        LagProbe probeLag = nullptr, GtidCheck hasExecuted = nullptr)
+        : primary_(primary), opts_(opts), probeLag_(std::move(probeLag)), hasExecuted_(std::move(hasExecuted)),
+          toReplica_(Metrics::instance().counter("router.reads.replica")),
+          toPrimary_(Metrics::instance().counter("router.reads.primary")),
+          gtidBehind_(Metrics::instance().counter("router.reads.gtid_behind")),
+          replicaErrors_(Metrics::instance().counter("router.reads.replica_errors")),
+          pollErrors_(Metrics::instance().counter("router.poll.errors")) {
+        for (size_t i = 0; i < replicas.size(); ++i) {
+            replicas_.push_back(std::make_unique<Replica>());
+            replicas_.back()->pool = replicas[i];
+            Replica* r = replicas_.back().get();
+            Metrics::instance().gauge("router.replica." + std::to_string(i) + ".lag_ms", [r] { return double(r->lagMs.load()); });
+        }
+        if (!opts_.heartbeatTable.empty()) {
+            heartbeat_ = quoteTableName(opts_.heartbeatTable);
+            ConnectionPool::Lease con = primary_.borrow();
+            std::unique_ptr<sql::Statement> s(con.get()->createStatement());
+            s->execute("CREATE TABLE IF NOT EXISTS " + heartbeat_ + " (id INT PRIMARY KEY, ts TIMESTAMP(6) NOT NULL)");
+        }
+        poll();  // route with real numbers from the start
+        poller_ = std::thread([this] { pollLoop(); });
+    }
+
+    ~ReadRouter() {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        poller_.join();
+        for (size_t i = 0; i < replicas_.size(); ++i) Metrics::instance().removeGauge("router.replica." + std::to_string(i) + ".lag_ms");
+    }
+
+    ConnectionPool::Lease write() { return primary_.borrowSticky(); }
+
+    // Call on the write connection after the commit
+    std::string writeToken(sql::Connection* primaryCon) {
+        std::unique_ptr<sql::Statement> s(primaryCon->createStatement());
+        std::unique_ptr<sql::ResultSet> rs(s->executeQuery("SELECT @@GLOBAL.gtid_executed"));
+        return rs->next() ? std::string(rs->getString(1)) : std::string();
+    }
+
+    // A connection that is fresh enough (and has seen `token`, if given)
+    ConnectionPool::Lease read(const std::string& token = "") {
+        size_t n = replicas_.size();
+        size_t start = next_.fetch_add(1, std::memory_order_relaxed);
+        for (size_t k = 0; k < n; ++k) {
+            size_t i = (start + k) % n;
+            Replica& r = *replicas_[i];
+            int64_t lag = r.lagMs.load(std::memory_order_relaxed);
+            if (lag < 0 || lag > opts_.maxLag.count()) continue;
+            try {
+                ConnectionPool::Lease con = r.pool->borrowSticky();
+                if (!token.empty() && !(hasExecuted_ ? hasExecuted_(i, *con, token) : hasExecuted(*con, token))) {
+                    ++gtidBehind_;
+                    continue;
+                }
+                ++toReplica_;
+                return con;
+            }
+            catch (const sql::SQLException&) {
+                ++replicaErrors_;  // try the next replica, then the primary
+            }
+        }
+        ++toPrimary_;
+        return primary_.borrowSticky();
+    }
+
+    // Last measured lag of replica i in ms, -1 when unknown
+    int64_t lagMs(size_t i) const { return replicas_[i]->lagMs.load(); }
+
+private:
+    struct Replica {
+        ConnectionPool*      pool = nullptr;
+        std::atomic<int64_t> lagMs{ -1 };
+        bool                 legacyStatus = false;  // server predates SHOW REPLICA STATUS
+    };
+
+    // `name` or `schema`.`name`; anything else could inject SQL
+    static std::string quoteTableName(const std::string& name) {
+        std::string quoted = "`";
+        size_t partStart = 0;
+        for (size_t i = 0; i <= name.size(); ++i) {
+            if (i == name.size() || name[i] == '.') {
+                if (i == partStart || (i < name.size() && partStart > 0))
+                    throw std::invalid_argument("ReadRouterOptions::heartbeatTable: not a table name: \"" + name + "\"");
+                quoted += i < name.size() ? "`.`" : "`";
+                partStart = i + 1;
+                continue;
+            }
+            unsigned char c = static_cast<unsigned char>(name[i]);
+            if (!std::isalnum(c) && c != '_' && c != '$')
+                throw std::invalid_argument("ReadRouterOptions::heartbeatTable: not a table name: \"" + name + "\"");
+            quoted += name[i];
+        }
+        return quoted;
+    }
+
+    static bool hasExecuted(PooledConnection& con, const std::string& token) {
+        sql::PreparedStatement* ps = con.prepare("SELECT GTID_SUBSET(?, @@GLOBAL.gtid_executed)");
+        ps->setString(1, token);
+        std::unique_ptr<sql::ResultSet> rs(ps->executeQuery());
+        return rs->next() && rs->getInt(1) == 1;
+    }
+
+    void pollLoop() {
+        std::unique_lock<std::mutex> lock(mu_);
+        while (!wake_.wait_for(lock, opts_.pollInterval, [&] { return stopping_; })) {
+            lock.unlock();
+            poll();
+            lock.lock();
+        }
+    }
+
+    void poll() {
+        if (!opts_.heartbeatTable.empty()) {
+            try {
+                ConnectionPool::Lease con = primary_.borrow();
+                std::unique_ptr<sql::Statement> s(con.get()->createStatement());
+                s->execute("REPLACE INTO " + heartbeat_ + " (id, ts) VALUES (1, NOW(6))");
+            }
+            catch (const sql::SQLException& e) {
+                ++pollErrors_;
+                printSqlError(e, "ReadRouter heartbeat");
+            }
+        }
+        for (size_t i = 0; i < replicas_.size(); ++i) {
+            Replica& r = *replicas_[i];
+            try {
+                ConnectionPool::Lease con = r.pool->borrow();
+                r.lagMs.store(probeLag_ ? probeLag_(i, *con) : measureLag(r, *con));
+            }
+            catch (const sql::SQLException&) {
+                ++pollErrors_;
+                r.lagMs.store(-1);
+            }
+        }
+    }
+
+    int64_t measureLag(Replica& r, PooledConnection& con) {
+        std::unique_ptr<sql::Statement> s(con.get()->createStatement());
+        if (!heartbeat_.empty()) {
+            std::unique_ptr<sql::ResultSet> rs(s->executeQuery(
+                "SELECT TIMESTAMPDIFF(MICROSECOND, MAX(ts), NOW(6)) FROM " + heartbeat_));
+            if (!rs->next() || rs->isNull(1)) return -1;
+            return std::max<int64_t>(0, rs->getInt64(1) / 1000);
+        }
+        std::unique_ptr<sql::ResultSet> rs;
+        if (!r.legacyStatus) {
+            try {
+                rs.reset(s->executeQuery("SHOW REPLICA STATUS"));
+            }
+            catch (const sql::SQLException& e) {
+                if (e.getErrorCode() != 1064) throw;  // only ER_PARSE_ERROR means a server before 8.0.22
+                r.legacyStatus = true;
+            }
+        }
+        if (r.legacyStatus) rs.reset(s->executeQuery("SHOW SLAVE STATUS"));
+        const char* column = r.legacyStatus ? "Seconds_Behind_Master" : "Seconds_Behind_Source";
+        if (!rs->next() || rs->isNull(column)) return -1;  // not a replica, or replication stopped
+        return rs->getInt64(column) * 1000;
+    }
+
+    ConnectionPool&                       primary_;
+    std::vector<std::unique_ptr<Replica>> replicas_;
+    ReadRouterOptions                     opts_;
+    std::string                           heartbeat_;  // heartbeatTable, quoted
+    LagProbe                              probeLag_;
+    GtidCheck                             hasExecuted_;
+    std::atomic<size_t>                   next_{ 0 };
+    std::mutex                            mu_;
+    std::condition_variable               wake_;
+    bool                                  stopping_ = false;
+    std::thread                           poller_;
+    std::atomic<uint64_t>& toReplica_;
+    std::atomic<uint64_t>& toPrimary_;
+    std::atomic<uint64_t>& gtidBehind_;
+    std::atomic<uint64_t>& replicaErrors_;
+    std::atomic<uint64_t>& pollErrors_;
+};
+
+// ---------------------------------------------------------
+// Struct: RefreshAheadOptions
+// ---------------------------------------------------------
+struct RefreshAheadOptions {
+    std::chrono::milliseconds ttl{ 30000 };  // entries older than this are misses
+    double refreshAt = 0.75;                 // a hit past this fraction of ttl schedules a refresh
+    double refreshesPerSecond = 20;          // background refresh rate limit
+    size_t capacity = 1024;                  // cached minAge values
+    size_t queueDepth = 256;                 // pending refreshes; more are dropped
+};
+
+// ---------------------------------------------------------
+// Class: RefreshAheadUserCache
+// TTL cache for getUsersByMinAge with refresh-ahead.
+// A hit on an entry that is close to expiring returns the cached rows
+// at once and schedules a background reload of that minAge, so hot
+// entries are replaced before they expire and callers do not all
+// miss together at the TTL boundary. Refreshes run on one background
+// thread with its own connection, deduplicated per key and limited
+// to refreshesPerSecond; when the queue is full, refreshes are dropped
+// and the entry simply expires as usual. Destroying the cache drops
+// the refreshes still queued instead of waiting for them.
+// invalidateAll() also discards loads and refreshes that started
+// before it, so they cannot put stale rows back.
+//
+// Metrics (see Metrics): cache.min_age.{hits,misses,expired},
+// cache.min_age.refresh.{scheduled,completed,dropped,failed} and the
+// latency histogram cache.min_age.latency.
+// ---------------------------------------------------------
+class RefreshAheadUserCache {
+public:
+    using Rows = std::shared_ptr<const std::vector<User>>;
+    using Loader = std::function<std::vector<User>(sql::Connection*, int)>;
+    using Connector = std::function<std::unique_ptr<sql::Connection>()>;
+
+    RefreshAheadUserCache(Connector connect, const RefreshAheadOptions& opts = {},
+        Loader load = [](sql::Connection* con, int minAge) { return getUsersByMinAge(con, minAge); })
+        : opts_(opts), load_(std::move(load)), connect_(std::move(connect)),
+          cache_(opts.capacity), queue_(opts.queueDepth),
+          hits_(metric("hits")), misses_(metric("misses")), expired_(metric("expired")),
+          scheduled_(metric("refresh.scheduled")), completed_(metric("refresh.completed")),
+          dropped_(metric("refresh.dropped")), failed_(metric("refresh.failed")),
+          latency_(Metrics::instance().histogram("cache.min_age.latency")) {
+        if (!(opts_.refreshesPerSecond > 0))
+            throw std::invalid_argument("RefreshAheadOptions::refreshesPerSecond must be greater than 0");
+        refresher_ = std::thread([this] { refreshLoop(); });
+    }
+
+    // Pending refreshes are dropped rather than run at the rate limit:
+    // nobody will read what they load
+    ~RefreshAheadUserCache() {
+        {
+            std::lock_guard<std::mutex> lock(stopMu_);
+            stopping_ = true;
+        }
+        stop_.notify_all();
+        dropped_ += queue_.cancel();
+        refresher_.join();
+    }
+
+    // Cached getUsersByMinAge; a miss loads on the caller's connection
+    Rows usersByMinAge(sql::Connection* con, int minAge) {
+        auto started = Clock::now();
+        Entry e;
+        Rows rows;
+        if (cache_.get(minAge, e)) {
+            auto age = started - e.loadedAt;
+            if (age < opts_.ttl) {
+                ++hits_;
+                if (age > opts_.ttl * opts_.refreshAt) scheduleRefresh(minAge);
+                rows = e.rows;
+            }
+            else ++expired_;
+        }
+        if (!rows) {
+            ++misses_;
+            uint64_t seen = generation_.load();
+            rows = std::make_shared<const std::vector<User>>(load_(con, minAge));
+            put(minAge, rows, seen);
+        }
+        latency_.record(Clock::now() - started);
+        return rows;
+    }
+
+    void invalidateAll() {
+        ++generation_;
+        cache_.clear();
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Entry {
+        Rows              rows;
+        Clock::time_point loadedAt;
+    };
+
+    static std::atomic<uint64_t>& metric(const char* name) {
+        return Metrics::instance().counter(std::string("cache.min_age.") + name);
+    }
+
+    // Rows loaded before an invalidateAll() that ran during the load
+    // are dropped instead of put back over the cleared cache
+    void put(int minAge, Rows rows, uint64_t seen) {
+        if (generation_.load() != seen) return;
+        cache_.put(minAge, { std::move(rows), Clock::now() });
+        if (generation_.load() != seen) cache_.erase(minAge);  // invalidated while we put
+    }
+
+    void scheduleRefresh(int minAge) {
+        {
+            std::lock_guard<std::mutex> lock(inflightMu_);
+            if (!inflight_.insert(minAge).second) return;  // already queued
+        }
+        if (queue_.tryPush(minAge)) { ++scheduled_; return; }
+        ++dropped_;
+        std::lock_guard<std::mutex> lock(inflightMu_);
+        inflight_.erase(minAge);
+    }
+
+    void refreshLoop() {
+        std::unique_ptr<sql::Connection> con;
+        auto interval = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>(1.0 / opts_.refreshesPerSecond));
+        auto nextSlot = Clock::now();
+        int minAge;
+        while (queue_.pop(minAge)) {
+            // Token bucket with a burst of one: at most one refresh per interval
+            {
+                std::unique_lock<std::mutex> lock(stopMu_);
+                if (stop_.wait_until(lock, nextSlot, [this] { return stopping_; })) { ++dropped_; break; }
+            }
+            nextSlot = std::max(nextSlot, Clock::now()) + interval;
+            try {
+                if (!con) con = connect_();
+                uint64_t seen = generation_.load();
+                put(minAge, std::make_shared<const std::vector<User>>(load_(con.get(), minAge)), seen);
+                ++completed_;
+            }
+            catch (const std::exception&) {
+                ++failed_;
+                con.reset();  // reconnect on the next refresh
+            }
+            std::lock_guard<std::mutex> lock(inflightMu_);
+            inflight_.erase(minAge);
+        }
+    }
+
+    RefreshAheadOptions        opts_;
+    Loader                     load_;
+    Connector                  connect_;
+    ShardedCache<int, Entry>   cache_;
+    BoundedQueue<int>          queue_;
+    std::mutex                 inflightMu_;
+    std::unordered_set<int>    inflight_;
+    std::mutex                 stopMu_;
+    std::condition_variable    stop_;
+    bool                       stopping_ = false;
+    std::atomic<uint64_t>      generation_{ 0 };  // bumped by every invalidateAll()
+    std::atomic<uint64_t>&     hits_;
+    std::atomic<uint64_t>&     misses_;
+    std::atomic<uint64_t>&     expired_;
+    std::atomic<uint64_t>&     scheduled_;
+    std::atomic<uint64_t>&     completed_;
+    std::atomic<uint64_t>&     dropped_;
+    std::atomic<uint64_t>&     failed_;
+    LatencyHistogram&          latency_;
+    std::thread                refresher_;
+};
+
+// ---------------------------------------------------------
+// Class: MySqlWire
+// A socket speaking the MySQL client/server protocol: packets of a
+// 3-byte payload length, a sequence id and the payload. Reads are
+// buffered; writes collect until flush() (or 64 KiB), so a result set
+// goes out in a few send() calls. A failed read or write, or the peer
+// closing mid-packet, throws std::runtime_error.
+// ---------------------------------------------------------
+class MySqlWire {
+public:
+    static constexpr size_t kMaxPayload = 0xFFFFFF;  // longer payloads go on in the next packet
+
+    MySqlWire() = default;
+    explicit MySqlWire(int fd) : fd_(fd) {}
+    MySqlWire(const MySqlWire&) = delete;
+    MySqlWire& operator=(const MySqlWire&) = delete;
+    ~MySqlWire() { close(); }
+
+    int  fd() const { return fd_; }
+    bool buffered() const { return pos_ < in_.size(); }
+
+    void close() {
+        if (fd_ >= 0) ::close(fd_);
+        fd_ = -1;
+    }
+
+    // One packet; false when the peer closed the socket between packets
+    bool tryRead(std::string& payload, uint8_t& seq) {
+        if (!fill(4, true)) return false;
+        size_t len = static_cast<size_t>(fixed(std::string_view(in_).substr(pos_, 3), 0, 3));
+        seq = static_cast<uint8_t>(in_[pos_ + 3]);
+        fill(4 + len, false);
+        payload.assign(in_, pos_ + 4, len);
+        pos_ += 4 + len;
+        return true;
+    }
+
+    std::string read(uint8_t& seq) {
+        std::string payload;
+        if (!tryRead(payload, seq)) throw std::runtime_error("MySqlWire: connection closed");
+        return payload;
+    }
+
+    // One packet as read from another wire (at most kMaxPayload)
+    void writePacket(std::string_view payload, uint8_t seq) {
+        size_t n = payload.size();
+        char header[4] = { static_cast<char>(n), static_cast<char>(n >> 8), static_cast<char>(n >> 16), static_cast<char>(seq) };
+        out_.append(header, 4);
+        out_.append(payload.data(), n);
+        if (out_.size() >= 64 * 1024) flush();
+    }
+
+    // A payload of any length, split into packets; seq moves past them
+    void write(std::string_view payload, uint8_t& seq) {
+        for (;;) {
+            size_t n = std::min(payload.size(), kMaxPayload);
+            writePacket(payload.substr(0, n), seq++);
+            payload.remove_prefix(n);
+            if (n < kMaxPayload) return;  // exactly k * kMaxPayload ends with an empty packet
+        }
+    }
+
+    void flush() {
+        size_t done = 0;
+        while (done < out_.size()) {
+            ssize_t n = ::send(fd_, out_.data() + done, out_.size() - done, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0) throw std::runtime_error(std::string("MySqlWire: send: ") + std::strerror(errno));
+            done += static_cast<size_t>(n);
+        }
+        out_.clear();
+    }
+
+    // A connected Unix socket, for MySqlWire(fd)
+    static int connectUnix(const std::string& path) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("socket path too long: " + path);
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+        int fd = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd >= 0 && ::connect(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0) return fd;
+        std::string err = std::strerror(errno);
+        if (fd >= 0) ::close(fd);
+        throw std::runtime_error("cannot connect to " + path + ": " + err);
+    }
+
+    // Protocol integers: fixed-length little-endian, and length-encoded
+    static uint64_t fixed(std::string_view p, size_t at, size_t bytes) {
+        if (at + bytes > p.size()) throw std::runtime_error("MySqlWire: short packet");
+        uint64_t v = 0;
+        for (size_t i = 0; i < bytes; ++i) v |= uint64_t(static_cast<uint8_t>(p[at + i])) << (8 * i);
+        return v;
+    }
+
+    static uint64_t lenenc(std::string_view p, size_t& at) {
+        uint8_t first = static_cast<uint8_t>(fixed(p, at, 1));
+        size_t bytes = first < 0xFB ? 0 : first == 0xFC ? 2 : first == 0xFD ? 3 : first == 0xFE ? 8 : SIZE_MAX;
+        if (bytes == SIZE_MAX) throw std::runtime_error("MySqlWire: bad length-encoded integer");
+        uint64_t v = bytes == 0 ? first : fixed(p, at + 1, bytes);
+        at += 1 + bytes;
+        return v;
+    }
+
+    static void putFixed(std::string& out, uint64_t v, size_t bytes) {
+        for (size_t i = 0; i < bytes; ++i) out += static_cast<char>(v >> (8 * i));
+    }
+
+    static void putLenenc(std::string& out, uint64_t v) {
+        if (v < 0xFB) putFixed(out, v, 1);
+        else if (v <= 0xFFFF) { out += '\xFC'; putFixed(out, v, 2); }
+        else if (v <= 0xFFFFFF) { out += '\xFD'; putFixed(out, v, 3); }
+        else { out += '\xFE'; putFixed(out, v, 8); }
+    }
+
+    static void putLenencString(std::string& out, std::string_view s) {
+        putLenenc(out, s.size());
+        out.append(s.data(), s.size());
+    }
+
+    // OK (header 0xFE: the end of a result set under CLIENT_DEPRECATE_EOF)
+    static std::string okPacket(uint16_t status, uint64_t affectedRows = 0, uint64_t insertId = 0, char header = 0) {
+        std::string p(1, header);
+        putLenenc(p, affectedRows);
+        putLenenc(p, insertId);
+        putFixed(p, status, 2);
+        putFixed(p, 0, 2);  // warnings
+        return p;
+    }
+
+    static std::string eofPacket(uint16_t status) {
+        std::string p(1, '\xFE');
+        putFixed(p, 0, 2);  // warnings
+        putFixed(p, status, 2);
+        return p;
+    }
+
+    static std::string errPacket(uint16_t code, std::string_view sqlState, std::string_view message) {
+        std::string p(1, '\xFF');
+        putFixed(p, code, 2);
+        p += '#';
+        p.append(sqlState.data(), std::min<size_t>(sqlState.size(), 5));
+        p.append(message.data(), message.size());
+        return p;
+    }
+
+private:
+    // Until `need` bytes are buffered; false on a close with nothing
+    // buffered, when that is allowed
+    bool fill(size_t need, bool closeOk) {
+        while (in_.size() - pos_ < need) {
+            if (pos_ > 0) {
+                in_.erase(0, pos_);
+                pos_ = 0;
+            }
+            size_t have = in_.size();
+            in_.resize(have + std::max<size_t>(16 * 1024, need - have));
+            ssize_t n = ::recv(fd_, &in_[have], in_.size() - have, 0);
+            in_.resize(have + static_cast<size_t>(std::max<ssize_t>(n, 0)));
+            if (n > 0 || (n < 0 && errno == EINTR)) continue;
+            if (n == 0 && closeOk && have == 0) return false;
+            throw std::runtime_error(n == 0 ? std::string("MySqlWire: connection closed")
+                                            : std::string("MySqlWire: recv: ") + std::strerror(errno));
+        }
+        return true;
+    }
+
+    int         fd_ = -1;
+    std::string in_;
+    size_t      pos_ = 0;
+    std::string out_;
+};
+
+// ---------------------------------------------------------
+// Struct: MySqlProxyOptions
+// ---------------------------------------------------------
+struct MySqlProxyOptions {
+    std::string listenPath;                          // Unix socket the clients connect to
+    std::string server = DbConfig{}.host;            // mysqld: tcp://host[:port] or unix:///path
+    size_t backendsPerUser = 8;                      // server connections shared by one user's clients
+    size_t maxLogins = 4;                            // clients logging in at once (each on a connection of its own)
+    std::chrono::milliseconds backendWait{ 10000 };  // a command waits this long for a connection
+    size_t statementsPerBackend = 256;               // prepared statements kept on each server connection
+};
+
+// ---------------------------------------------------------
+// Class: MySqlProxy
+// A local proxy for hosts running many worker processes: it speaks
+// the MySQL protocol on a Unix socket and lets all the clients of one
+// user share a few server connections (backendsPerUser), lending a
+// connection to a client for one transaction at a time. Workers point
+// DbConfig::host at "unix://<listenPath>".
+//
+// Logins are passed through: a new client authenticates against
+// mysqld over a server connection of its own (the proxy never sees a
+// password), which then joins the user's pool, or is closed if the
+// pool is full; at most maxLogins run at once. Pools are per user,
+// capability flags and character set, so all connections in a pool
+// speak the same protocol variant. SSL, compression, LOAD DATA LOCAL,
+// query attributes and optional result set metadata are taken out of
+// the server's greeting.
+//
+// A client gets a connection for its next command and gives it back
+// after a reply whose status has autocommit on and no transaction
+// open: after COMMIT or ROLLBACK, or after each statement outside a
+// transaction. Session state goes along where the proxy can track it:
+//   - the default schema (COM_INIT_DB, USE) and session variables set
+//     by a single "SET [SESSION] var = value", "SET SESSION
+//     TRANSACTION ..." or SET NAMES are replayed on the connection a
+//     client gets, and reset on one that has them and the client not
+//     (to DEFAULT, or to the character set the client logged in with);
+//   - prepared statements belong to the proxy: it hands out its own
+//     statement ids and prepares a statement again on a connection it
+//     has not run on yet (the connection keeps it for later clients,
+//     up to statementsPerBackend); COM_STMT_SEND_LONG_DATA is held
+//     back until the execute;
+//   - SELECT LAST_INSERT_ID() is answered from the last OK packet the
+//     client got, since the INSERT may have run on another connection.
+// Anything else that leaves state in the server session (user
+// variables, temporary tables, LOCK TABLES, GET_LOCK, SQL PREPARE,
+// several statements in one COM_QUERY, ...) pins the client
+// to its connection until it disconnects or sends
+// COM_RESET_CONNECTION. A pinned connection leaves the pool, so a
+// later login can take its place, and is closed with the client.
+// COM_CHANGE_USER, cursors and replication commands are refused.
+//
+// When a user's pool has no connection left (the server closed them,
+// or all are pinned), a command gets ER_SERVER_SHUTDOWN and the client
+// is disconnected; reconnecting logs in again and refills the pool.
+// One thread per client, which sleeps on its socket while idle.
+//
+// Metrics: proxy.logins, proxy.login_failures, proxy.backend_waits,
+// proxy.pinned, proxy.reprepared, proxy.last_insert_id_answers, and
+// gauges proxy.clients and proxy.backends (open server connections).
+// ---------------------------------------------------------
+class MySqlProxy {
+public:
+    explicit MySqlProxy(MySqlProxyOptions opts)
+        : opts_(std::move(opts)),
+          logins_(Metrics::instance().counter("proxy.logins")),
+          loginFailures_(Metrics::instance().counter("proxy.login_failures")),
+          backendWaits_(Metrics::instance().counter("proxy.backend_waits")),
+          pinned_(Metrics::instance().counter("proxy.pinned")),
+          reprepared_(Metrics::instance().counter("proxy.reprepared")),
+          lastInsertIdAnswers_(Metrics::instance().counter("proxy.last_insert_id_answers")) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (opts_.listenPath.empty() || opts_.listenPath.size() >= sizeof(addr.sun_path))
+            throw std::invalid_argument("MySqlProxy: listenPath must be a socket path shorter than "
+                                        + std::to_string(sizeof(addr.sun_path)) + " bytes");
+        if (opts_.backendsPerUser == 0 || opts_.maxLogins == 0)
+            throw std::invalid_argument("MySqlProxy: backendsPerUser and maxLogins must be positive");
+        std::memcpy(addr.sun_path, opts_.listenPath.c_str(), opts_.listenPath.size() + 1);
+        listen_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_ < 0 || ::pipe2(wake_, O_CLOEXEC) != 0) {
+            std::string err = std::strerror(errno);
+            closeListener();
+            throw std::runtime_error("MySqlProxy: " + err);
+        }
+        ::unlink(opts_.listenPath.c_str());  // a socket left by an earlier run
+        if (::bind(listen_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listen_, SOMAXCONN) != 0) {
+            std::string err = std::strerror(errno);
+            closeListener();
+            throw std::runtime_error("MySqlProxy: cannot listen on " + opts_.listenPath + ": " + err);
+        }
+        Metrics::instance().gauge("proxy.clients", [this] { return double(clients_.load()); });
+        Metrics::instance().gauge("proxy.backends", [this] { return double(backends_.load()); });
+        acceptor_ = std::thread([this] { acceptLoop(); });
+    }
+
+    MySqlProxy(const MySqlProxy&) = delete;
+    MySqlProxy& operator=(const MySqlProxy&) = delete;
+
+    ~MySqlProxy() { stop(); }
+
+    // Disconnects every client and closes every server connection. A
+    // client in the middle of a query goes when the server answers.
+    void stop() {
+        if (stopping_.exchange(true)) return;
+        char byte = 0;
+        while (::write(wake_[1], &byte, 1) < 0 && errno == EINTR) {}
+        acceptor_.join();
+        {
+            std::lock_guard<std::mutex> lock(sessionsMu_);
+            for (SessionThread& t : sessions_)
+                if (t.fd >= 0) ::shutdown(t.fd, SHUT_RDWR);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            for (auto& p : pools_) p.second->returned.notify_all();
+            loginDone_.notify_all();
+        }
+        for (SessionThread& t : sessions_) t.thread.join();
+        sessions_.clear();
+        std::vector<std::unique_ptr<Backend>> idle;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            for (auto& p : pools_)
+                for (auto& b : p.second->idle) idle.push_back(std::move(b));
+            for (auto& b : closing_) idle.push_back(std::move(b));
+            pools_.clear();
+            closing_.clear();
+        }
+        for (auto& b : idle) discard(std::move(b));
+        Metrics::instance().removeGauge("proxy.clients");
+        Metrics::instance().removeGauge("proxy.backends");
+        closeListener();
+        ::unlink(opts_.listenPath.c_str());
+    }
+
+    size_t clients() const { return static_cast<size_t>(clients_.load()); }
+    size_t backends() const { return static_cast<size_t>(backends_.load()); }
+
+private:
+    // Command bytes, capability flags and status flags (mysql_com.h)
+    enum : uint8_t {
+        kComQuit = 0x01, kComInitDb = 0x02, kComQuery = 0x03, kComFieldList = 0x04, kComRefresh = 0x07,
+        kComShutdown = 0x08, kComStatistics = 0x09, kComProcessInfo = 0x0a, kComProcessKill = 0x0c,
+        kComDebug = 0x0d, kComPing = 0x0e, kComChangeUser = 0x11, kComStmtPrepare = 0x16,
+        kComStmtExecute = 0x17, kComStmtSendLongData = 0x18, kComStmtClose = 0x19, kComStmtReset = 0x1a,
+        kComSetOption = 0x1b, kComStmtFetch = 0x1c, kComResetConnection = 0x1f
+    };
+    static constexpr uint32_t kClientConnectWithDb = 0x8, kClientCompress = 0x20, kClientLocalFiles = 0x80,
+        kClientProtocol41 = 0x200, kClientSsl = 0x800, kClientSecureConnection = 0x8000,
+        kClientPluginAuthLenenc = 0x200000, kClientDeprecateEof = 0x1000000;
+    // Protocol features the proxy does not relay
+    static constexpr uint32_t kClientUnsupported = kClientCompress | kClientLocalFiles | kClientSsl
+        | (1u << 25) /* optional metadata */ | (1u << 26) /* zstd */ | (1u << 27) /* query attributes */;
+    static constexpr uint16_t kStatusInTrans = 0x1, kStatusAutocommit = 0x2, kStatusMoreResults = 0x8;
+
+    struct SessionVar {
+        std::string set;    // the statement that set it
+        std::string reset;  // and one that puts it back to the default
+    };
+    using SessionVars = std::map<std::string, SessionVar>;
+
+    // A server connection
+    struct Backend {
+        explicit Backend(int fd) : wire(fd) {}
+        MySqlWire   wire;
+        std::string db;
+        SessionVars vars;
+        std::unordered_map<std::string, uint32_t> statements;  // SQL -> server statement id
+        std::deque<std::string> statementOrder;                // oldest first
+    };
+
+    struct Pool {
+        std::vector<std::unique_ptr<Backend>> idle;
+        size_t open = 0;  // idle and lent out; pinned ones no longer count
+        std::condition_variable returned;
+    };
+
+    struct ClientStatement {
+        std::string sql;
+        uint16_t    params = 0;
+        bool        lastInsertId = false;     // SELECT LAST_INSERT_ID(), answered by the proxy
+        std::string types;                    // parameter types from the last execute that sent them
+        std::vector<std::string> longData;    // COM_STMT_SEND_LONG_DATA for the next execute
+    };
+
+    struct Session {
+        Pool*       pool = nullptr;
+        uint32_t    caps = 0;
+        uint8_t     charset = 0;                 // collation id from the login
+        std::string db;
+        SessionVars vars;
+        uint16_t    status = kStatusAutocommit;  // from the last reply
+        uint64_t    lastInsertId = 0;
+        bool        pinned = false;
+        std::unique_ptr<Backend> backend;        // while lent, or pinned
+        std::unordered_map<uint32_t, ClientStatement> statements;
+        uint32_t    nextStatement = 1;
+
+        bool deprecateEof() const { return (caps & kClientDeprecateEof) != 0; }
+    };
+
+    struct Reply {
+        bool     ok = false;  // false: an ERR packet
+        uint16_t status = 0;
+        uint64_t insertId = 0;
+    };
+
+    // What a COM_QUERY does to the session, from its text
+    struct Classified {
+        enum Kind { Plain, Pin, SessionVariable, Use, LastInsertId } kind = Plain;
+        std::string name;   // SessionVariable: the variable; Use: the schema
+        std::string reset;  // SessionVariable: how to reset it; empty: to the login's character set
+    };
+
+    struct SessionThread {
+        std::thread thread;
+        int         fd = -1;  // -1 once the session closed it
+        bool        done = false;
+    };
+
+    void closeListener() {
+        if (listen_ >= 0) ::close(listen_);
+        for (int& fd : wake_) {
+            if (fd >= 0) ::close(fd);
+            fd = -1;
+        }
+        listen_ = -1;
+    }
+
+    void acceptLoop() {
+        while (!stopping_) {
+            pollfd fds[2] = { { listen_, POLLIN, 0 }, { wake_[0], POLLIN, 0 } };
+            if (::poll(fds, 2, -1) < 0 || fds[1].revents) continue;  // EINTR, or stop()
+            int fd = ::accept4(listen_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (fd < 0) {
+                if (errno == EMFILE || errno == ENFILE) std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                continue;
+            }
+            std::lock_guard<std::mutex> lock(sessionsMu_);
+            for (auto it = sessions_.begin(); it != sessions_.end();) {
+                if (!it->done) { ++it; continue; }
+                it->thread.join();
+                it = sessions_.erase(it);
+            }
+            sessions_.emplace_back();
+            SessionThread& t = sessions_.back();
+            t.fd = fd;
+            t.thread = std::thread([this, &t] { serve(t); });
+        }
+    }
+
+    void serve(SessionThread& t) {
+        ++clients_;
+        MySqlWire client(t.fd);
+        Session s;
+        try {
+            if (logIn(client, s)) commands(client, s);
+        }
+        catch (const std::exception&) {
+            // The client or the server went away, or broke the protocol
+        }
+        if (s.backend) drop(s);
+        {
+            std::lock_guard<std::mutex> lock(sessionsMu_);
+            t.fd = -1;
+            t.done = true;
+        }
+        client.close();
+        --clients_;
+    }
+
+    // ----- Logging in ---------------------------------------
+
+    int connectServer() const {
+        const std::string& server = opts_.server;
+        if (server.compare(0, 7, "unix://") == 0) return MySqlWire::connectUnix(server.substr(7));
+        // tcp://host[:port], [v6-address]:port, or a bare host
+        std::string host = server.compare(0, 6, "tcp://") == 0 ? server.substr(6) : server, port = "3306";
+        size_t colon = host.rfind(':');
+        if (colon != std::string::npos && host.find(']', colon) == std::string::npos) {
+            port = host.substr(colon + 1);
+            host.resize(colon);
+        }
+        if (host.size() >= 2 && host.front() == '[' && host.back() == ']') host = host.substr(1, host.size() - 2);
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* found = nullptr;
+        if (int rc = ::getaddrinfo(host.c_str(), port.c_str(), &hints, &found))
+            throw std::runtime_error("cannot resolve " + host + ": " + ::gai_strerror(rc));
+        std::string err = "no address";
+        for (addrinfo* a = found; a; a = a->ai_next) {
+            int fd = ::socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+            if (fd < 0) continue;
+            if (::connect(fd, a->ai_addr, a->ai_addrlen) == 0) {
+                int one = 1;
+                ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                ::freeaddrinfo(found);
+                return fd;
+            }
+            err = std::strerror(errno);
+            ::close(fd);
+        }
+        ::freeaddrinfo(found);
+        throw std::runtime_error("cannot connect to " + host + ":" + port + ": " + err);
+    }
+
+    // Passes the login through on a new server connection, which joins
+    // the user's pool afterwards. False when it did not succeed (the
+    // client has been told).
+    bool logIn(MySqlWire& client, Session& s) {
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            loginDone_.wait(lock, [&] { return loggingIn_ < opts_.maxLogins || stopping_; });
+            if (stopping_) return false;
+            ++loggingIn_;
+        }
+        struct Turn {
+            MySqlProxy& p;
+            ~Turn() {
+                std::lock_guard<std::mutex> lock(p.mu_);
+                --p.loggingIn_;
+                p.loginDone_.notify_one();
+            }
+        } turn{ *this };
+
+        std::unique_ptr<Backend> b;
+        try {
+            b = std::make_unique<Backend>(connectServer());
+        }
+        catch (const std::exception& e) {
+            uint8_t seq = 0;
+            client.write(MySqlWire::errPacket(2003, "HY000", std::string("MySqlProxy: ") + e.what()), seq);
+            client.flush();
+            ++loginFailures_;
+            return false;
+        }
+        ++backends_;
+        std::string key;
+        bool ok = false;
+        try {
+            ok = handshake(client, s, *b, key);
+        }
+        catch (const std::exception&) {
+        }
+        if (!ok) {
+            ++loginFailures_;
+            discard(std::move(b));
+            return false;
+        }
+        ++logins_;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            std::unique_ptr<Pool>& pool = pools_[key];
+            if (!pool) pool = std::make_unique<Pool>();
+            s.pool = pool.get();
+            if (pool->open < opts_.backendsPerUser) {
+                ++pool->open;
+                pool->idle.push_back(std::move(b));
+                pool->returned.notify_one();
+            }
+        }
+        if (b) discard(std::move(b), true);  // the pool is full; gone before the next login starts
+        return true;
+    }
+
+    bool handshake(MySqlWire& client, Session& s, Backend& b, std::string& key) {
+        uint8_t seq = 0;
+        std::string greeting = b.wire.read(seq);
+        if (greeting.empty() || greeting[0] != 0x0a) {  // an ERR, e.g. too many connections
+            client.writePacket(greeting, seq);
+            client.flush();
+            return false;
+        }
+        // Capability flags: after the version string, connection id (4),
+        // auth data (8) and a filler byte; the upper half after charset
+        // and status
+        size_t low = greeting.find('\0', 1);
+        if (low == std::string::npos) throw std::runtime_error("MySqlProxy: bad greeting");
+        low += 1 + 4 + 8 + 1;
+        size_t high = low + 2 + 1 + 2;
+        uint32_t caps = static_cast<uint32_t>(MySqlWire::fixed(greeting, low, 2) | MySqlWire::fixed(greeting, high, 2) << 16);
+        caps &= ~kClientUnsupported;
+        greeting[low] = static_cast<char>(caps);
+        greeting[low + 1] = static_cast<char>(caps >> 8);
+        greeting[high] = static_cast<char>(caps >> 16);
+        greeting[high + 1] = static_cast<char>(caps >> 24);
+        client.writePacket(greeting, seq);
+        client.flush();
+
+        std::string response = client.read(seq);
+        uint32_t clientCaps = static_cast<uint32_t>(MySqlWire::fixed(response, 0, 4));
+        if (!(clientCaps & kClientProtocol41) || (clientCaps & kClientSsl) || response.size() < 33) {
+            uint8_t next = seq + 1;
+            client.write(MySqlWire::errPacket(1251, "08004", "MySqlProxy: SSL and pre-4.1 clients are not supported"), next);
+            client.flush();
+            return false;
+        }
+        clientCaps &= ~kClientUnsupported;
+        for (size_t i = 0; i < 4; ++i) response[i] = static_cast<char>(clientCaps >> (8 * i));
+        // Fixed part (32 bytes: caps, max packet, charset, filler), then
+        // user, auth response and, with CLIENT_CONNECT_WITH_DB, the schema
+        size_t at = response.find('\0', 32);
+        if (at == std::string::npos) throw std::runtime_error("MySqlProxy: bad handshake response");
+        std::string user = response.substr(32, at - 32), db;
+        ++at;
+        if (clientCaps & kClientPluginAuthLenenc) at += MySqlWire::lenenc(response, at);
+        else if (clientCaps & kClientSecureConnection) at += 1 + MySqlWire::fixed(response, at, 1);
+        else at = response.find('\0', at) + 1;
+        if ((clientCaps & kClientConnectWithDb) && at < response.size())
+            db = response.substr(at, response.find('\0', at) - at);
+        b.wire.writePacket(response, seq);
+        b.wire.flush();
+
+        // Auth switches and extra rounds go back and forth as they come,
+        // until the server says OK or ERR
+        for (;;) {
+            MySqlWire* from = &b.wire;
+            if (!b.wire.buffered() && !client.buffered()) {
+                pollfd fds[2] = { { b.wire.fd(), POLLIN, 0 }, { client.fd(), POLLIN, 0 } };
+                int n = ::poll(fds, 2, 30000);
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) throw std::runtime_error("MySqlProxy: login timed out");
+                if (!fds[0].revents) from = &client;
+            }
+            else if (!b.wire.buffered()) {
+                from = &client;
+            }
+            MySqlWire& to = from == &b.wire ? client : b.wire;
+            std::string packet = from->read(seq);
+            to.writePacket(packet, seq);
+            to.flush();
+            if (from != &b.wire || packet.empty()) continue;
+            if (packet[0] == 0x00) {
+                s.status = parseEnd(packet, false).status;
+                break;
+            }
+            if (static_cast<uint8_t>(packet[0]) == 0xFF) return false;
+        }
+        s.caps = clientCaps;
+        s.charset = static_cast<uint8_t>(response[8]);
+        s.db = b.db = db;
+        key = user + '\0' + std::to_string(clientCaps) + '\0' + std::to_string(s.charset);
+        return true;
+    }
+
+    // ----- Commands -----------------------------------------
+
+    void commands(MySqlWire& client, Session& s) {
+        std::string cmd, part;
+        uint8_t seq = 0;
+        for (;;) {
+            closeRetired();
+            if (!client.tryRead(cmd, seq)) return;
+            for (size_t len = cmd.size(); len == MySqlWire::kMaxPayload; len = part.size()) {
+                part = client.read(seq);
+                cmd += part;
+            }
+            if (cmd.empty()) throw std::runtime_error("MySqlProxy: empty command");
+            uint8_t reply = seq + 1;
+            uint8_t command = static_cast<uint8_t>(cmd[0]);
+            switch (command) {
+            case kComQuit:
+                return;
+            case kComQuery:
+                query(client, s, cmd, reply);
+                break;
+            case kComInitDb:
+                if (forward(client, s, cmd, reply, &MySqlProxy::relayEnd)) s.db = s.backend->db = cmd.substr(1);
+                break;
+            case kComFieldList:
+                forward(client, s, cmd, reply, &MySqlProxy::relayFields);
+                break;
+            case kComProcessInfo:
+                forward(client, s, cmd, reply, &MySqlProxy::relayResult);
+                break;
+            case kComStatistics:  // a plain string, no status
+                forward(client, s, cmd, reply, &MySqlProxy::relayText);
+                break;
+            case kComRefresh:
+            case kComShutdown:
+            case kComProcessKill:
+            case kComDebug:
+                forward(client, s, cmd, reply, &MySqlProxy::relayEnd);
+                break;
+            case kComPing:
+                if (s.backend) forward(client, s, cmd, reply, &MySqlProxy::relayEnd);
+                else client.write(MySqlWire::okPacket(s.status), reply);
+                break;
+            case kComSetOption:  // multi-statements on or off
+                if (forward(client, s, cmd, reply, &MySqlProxy::relayEnd)) pin(s);
+                break;
+            case kComStmtPrepare:
+                prepare(client, s, cmd, reply);
+                break;
+            case kComStmtExecute:
+                execute(client, s, cmd, reply);
+                break;
+            case kComStmtSendLongData:  // no reply
+                if (auto* st = statement(s, cmd)) st->longData.push_back(cmd);
+                break;
+            case kComStmtClose:  // no reply; the server connections keep theirs
+                if (statement(s, cmd)) s.statements.erase(static_cast<uint32_t>(MySqlWire::fixed(cmd, 1, 4)));
+                break;
+            case kComStmtReset:
+                if (auto* st = statement(s, cmd)) {
+                    st->longData.clear();
+                    client.write(MySqlWire::okPacket(s.status), reply);
+                }
+                else {
+                    client.write(unknownStatement(cmd, "mysqld_stmt_reset"), reply);
+                }
+                break;
+            case kComResetConnection:
+                resetConnection(client, s, cmd, reply);
+                break;
+            case kComChangeUser:
+            case kComStmtFetch:
+                client.write(MySqlWire::errPacket(1235, "42000", command == kComChangeUser
+                    ? "MySqlProxy: COM_CHANGE_USER is not supported, reconnect instead"
+                    : "MySqlProxy: cursors are not supported"), reply);
+                break;
+            default:
+                client.write(MySqlWire::errPacket(1047, "08S01", "Unknown command"), reply);
+                break;
+            }
+            client.flush();
+            release(s);
+        }
+    }
+
+    void query(MySqlWire& client, Session& s, const std::string& cmd, uint8_t seq) {
+        std::string_view sql = std::string_view(cmd).substr(1);
+        Classified c = classify(sql);
+        if (c.kind == Classified::LastInsertId && !s.pinned) return answerLastInsertId(client, s, seq, false);
+        if (!forward(client, s, cmd, seq, &MySqlProxy::relayResult)) return;
+        switch (c.kind) {
+        case Classified::Pin:
+            pin(s);
+            break;
+        case Classified::SessionVariable:
+            if (c.reset.empty()) c.reset = namesFor(s.charset);
+            if (c.reset.empty()) pin(s);
+            else s.vars[c.name] = s.backend->vars[c.name] = SessionVar{ std::string(sql), c.reset };
+            break;
+        case Classified::Use:
+            s.db = s.backend->db = c.name;
+            break;
+        default:
+            break;
+        }
+    }
+
+    void prepare(MySqlWire& client, Session& s, const std::string& cmd, uint8_t seq) {
+        if (!attach(client, s, seq)) return;
+        Backend& b = *s.backend;
+        send(b, cmd);
+        std::string ok = b.wire.read(seq);
+        if (ok.size() < 12 || ok[0] != 0x00) {  // ERR
+            client.writePacket(ok, seq);
+            return;
+        }
+        uint32_t serverId = static_cast<uint32_t>(MySqlWire::fixed(ok, 1, 4));
+        uint16_t columns = static_cast<uint16_t>(MySqlWire::fixed(ok, 5, 2));
+        uint16_t params = static_cast<uint16_t>(MySqlWire::fixed(ok, 7, 2));
+        uint32_t id = s.nextStatement++;
+        for (size_t i = 0; i < 4; ++i) ok[1 + i] = static_cast<char>(id >> (8 * i));
+        client.writePacket(ok, seq);
+        relayMetadata(b.wire, &client, params, columns, s.deprecateEof());
+        keep(b, cmd.substr(1), serverId);
+        ClientStatement& st = s.statements[id];
+        st.sql = cmd.substr(1);
+        st.params = params;
+        st.lastInsertId = classify(st.sql).kind == Classified::LastInsertId;
+    }
+
+    void execute(MySqlWire& client, Session& s, std::string& cmd, uint8_t seq) {
+        ClientStatement* st = statement(s, cmd);
+        if (!st) return client.write(unknownStatement(cmd, "mysqld_stmt_execute"), seq);
+        if (MySqlWire::fixed(cmd, 5, 1) & 0x07)
+            return client.write(MySqlWire::errPacket(1235, "42000", "MySqlProxy: cursors are not supported"), seq);
+        if (st->lastInsertId && !s.pinned) return answerLastInsertId(client, s, seq, true);
+        // Parameter types are only sent when they change; the server
+        // statement this runs on may have been bound by another client,
+        // so always send them
+        if (st->params > 0) {
+            size_t flag = 10 + (st->params + 7) / 8;  // after the NULL bitmap
+            if (cmd.size() > flag && cmd[flag] == 1) {
+                st->types = cmd.substr(flag + 1, 2 * st->params);
+            }
+            else if (cmd.size() > flag && !st->types.empty()) {
+                cmd[flag] = 1;
+                cmd.insert(flag + 1, st->types);
+            }
+        }
+        if (!attach(client, s, seq)) return;
+        Backend& b = *s.backend;
+        uint32_t serverId = 0;
+        if (!prepared(client, s, *st, seq, serverId)) return;
+        auto setId = [serverId](std::string& packet) {
+            for (size_t i = 0; i < 4; ++i) packet[1 + i] = static_cast<char>(serverId >> (8 * i));
+        };
+        for (std::string& data : st->longData) {
+            setId(data);
+            uint8_t out = 0;
+            b.wire.write(data, out);
+        }
+        st->longData.clear();
+        setId(cmd);
+        send(b, cmd);
+        note(s, relayResult(b.wire, &client, s.deprecateEof()));
+    }
+
+    void resetConnection(MySqlWire& client, Session& s, const std::string& cmd, uint8_t seq) {
+        if (s.backend) {
+            if (!forward(client, s, cmd, seq, &MySqlProxy::relayEnd)) return;
+            // The server dropped the statements and variables too
+            s.backend->vars.clear();
+            s.backend->statements.clear();
+            s.backend->statementOrder.clear();
+            if (s.pinned) unpin(s);
+        }
+        else {
+            client.write(MySqlWire::okPacket(s.status), seq);
+        }
+        s.vars.clear();
+        s.statements.clear();
+    }
+
+    ClientStatement* statement(Session& s, const std::string& cmd) {
+        auto it = s.statements.find(static_cast<uint32_t>(MySqlWire::fixed(cmd, 1, 4)));
+        return it == s.statements.end() ? nullptr : &it->second;
+    }
+
+    static std::string unknownStatement(const std::string& cmd, const char* where) {
+        return MySqlWire::errPacket(1243, "HY000", "Unknown prepared statement handler ("
+            + std::to_string(MySqlWire::fixed(cmd, 1, 4)) + ") given to " + where);
+    }
+
+    // SELECT LAST_INSERT_ID() as the server would answer it, from the
+    // last insert id this client saw
+    void answerLastInsertId(MySqlWire& client, Session& s, uint8_t seq, bool binary) {
+        ++lastInsertIdAnswers_;
+        std::string p;
+        MySqlWire::putLenenc(p, 1);
+        client.write(p, seq);
+        p.clear();
+        for (const char* field : { "def", "", "", "", "LAST_INSERT_ID()", "" }) MySqlWire::putLenencString(p, field);
+        MySqlWire::putLenenc(p, 0x0c);
+        MySqlWire::putFixed(p, 63, 2);      // binary
+        MySqlWire::putFixed(p, 21, 4);      // display length
+        p += '\x08';                        // BIGINT
+        MySqlWire::putFixed(p, 0xA1, 2);    // NOT NULL, UNSIGNED, BINARY
+        MySqlWire::putFixed(p, 0, 3);       // decimals, filler
+        client.write(p, seq);
+        if (!s.deprecateEof()) client.write(MySqlWire::eofPacket(s.status), seq);
+        p.clear();
+        if (binary) {
+            p.append(2, '\0');  // row header, NULL bitmap
+            MySqlWire::putFixed(p, s.lastInsertId, 8);
+        }
+        else {
+            MySqlWire::putLenencString(p, std::to_string(s.lastInsertId));
+        }
+        client.write(p, seq);
+        client.write(s.deprecateEof() ? MySqlWire::okPacket(s.status, 0, 0, '\xFE') : MySqlWire::eofPacket(s.status), seq);
+    }
+
+    // ----- Lending server connections -----------------------
+
+    using Relay = Reply (MySqlProxy::*)(MySqlWire&, MySqlWire*, bool);
+
+    // Sends the command on the session's server connection and passes
+    // the reply on; false when it failed (the client got an ERR)
+    bool forward(MySqlWire& client, Session& s, const std::string& cmd, uint8_t seq, Relay relay) {
+        if (!attach(client, s, seq)) return false;
+        send(*s.backend, cmd);
+        Reply r = (this->*relay)(s.backend->wire, &client, s.deprecateEof());
+        note(s, r);
+        return r.ok;
+    }
+
+    static void send(Backend& b, const std::string& cmd) {
+        uint8_t seq = 0;
+        b.wire.write(cmd, seq);
+        b.wire.flush();
+    }
+
+    static void note(Session& s, const Reply& r) {
+        if (!r.ok) return;  // an error leaves the transaction state as it was
+        s.status = r.status;
+        if (r.insertId) s.lastInsertId = r.insertId;
+    }
+
+    // Gives the session a server connection with its schema and
+    // session variables. False (the client got an ERR for the command)
+    // when none became free within backendWait; when the user has no
+    // connection left at all, the client is disconnected.
+    bool attach(MySqlWire& client, Session& s, uint8_t seq) {
+        if (s.backend) return true;
+        Pool& pool = *s.pool;
+        std::vector<std::unique_ptr<Backend>> dead;
+        bool gone = false;
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            auto deadline = std::chrono::steady_clock::now() + opts_.backendWait;
+            bool waited = false;
+            while (!s.backend) {
+                if (!pool.idle.empty()) {
+                    s.backend = takeIdle(pool, s);
+                    if (!alive(*s.backend)) {  // closed by the server (wait_timeout, restart)
+                        --pool.open;
+                        dead.push_back(std::move(s.backend));
+                    }
+                    continue;
+                }
+                if (pool.open == 0 || stopping_) {
+                    gone = true;
+                    break;
+                }
+                if (!waited) ++backendWaits_;
+                waited = true;
+                if (pool.returned.wait_until(lock, deadline) == std::cv_status::timeout && pool.idle.empty()) break;
+            }
+        }
+        for (auto& b : dead) discard(std::move(b));
+        if (gone) {
+            client.write(MySqlWire::errPacket(1053, "08S01", "MySqlProxy: no server connection left for this user, reconnect"), seq);
+            client.flush();
+            throw std::runtime_error("MySqlProxy: pool empty");
+        }
+        if (!s.backend) {
+            client.write(MySqlWire::errPacket(1040, "08004", "MySqlProxy: timed out waiting for a server connection"), seq);
+            return false;
+        }
+        return sync(client, s, seq);
+    }
+
+    // Prefers a connection already in the session's state, newest first
+    std::unique_ptr<Backend> takeIdle(Pool& pool, const Session& s) {
+        size_t pick = pool.idle.size() - 1;
+        int best = -1;
+        for (size_t i = pool.idle.size(); i-- > 0 && best < 2;) {
+            const Backend& b = *pool.idle[i];
+            int score = sameVars(b.vars, s.vars) ? (b.db == s.db ? 2 : 1) : 0;
+            if (score > best) {
+                best = score;
+                pick = i;
+            }
+        }
+        std::unique_ptr<Backend> b = std::move(pool.idle[pick]);
+        pool.idle.erase(pool.idle.begin() + static_cast<std::ptrdiff_t>(pick));
+        return b;
+    }
+
+    static bool sameVars(const SessionVars& a, const SessionVars& b) {
+        return a.size() == b.size() && std::equal(a.begin(), a.end(), b.begin(), [](const auto& x, const auto& y) {
+            return x.first == y.first && x.second.set == y.second.set;
+        });
+    }
+
+    // An idle connection has nothing to read unless the server closed it
+    static bool alive(const Backend& b) {
+        pollfd fd{ b.wire.fd(), POLLIN, 0 };
+        return ::poll(&fd, 1, 0) == 0;
+    }
+
+    // Brings the lent connection to the session's schema and variables
+    bool sync(MySqlWire& client, Session& s, uint8_t seq) {
+        Backend& b = *s.backend;
+        std::vector<std::string> steps;
+        if (!s.db.empty() && b.db != s.db) steps.push_back(char(kComInitDb) + s.db);
+        // A reset can undo more than its variable (SET NAMES sets three),
+        // so after one every variable of the session is set again
+        bool reset = false;
+        for (const auto& v : b.vars) {
+            std::string step = char(kComQuery) + v.second.reset;
+            if (s.vars.count(v.first) || std::find(steps.begin(), steps.end(), step) != steps.end()) continue;
+            steps.push_back(std::move(step));
+            reset = true;
+        }
+        for (const auto& v : s.vars) {
+            auto theirs = b.vars.find(v.first);
+            if (reset || theirs == b.vars.end() || theirs->second.set != v.second.set)
+                steps.push_back(char(kComQuery) + v.second.set);
+        }
+        for (const std::string& step : steps) {
+            send(b, step);
+            std::string reply = relayPacket(b.wire, nullptr);
+            if (!parseEnd(reply, s.deprecateEof()).ok) {
+                client.write(reply, seq);
+                drop(s);
+                return false;
+            }
+        }
+        if (!s.db.empty()) b.db = s.db;
+        b.vars = s.vars;
+        return true;
+    }
+
+    // Prepares the statement on the lent connection unless it already is
+    bool prepared(MySqlWire& client, Session& s, const ClientStatement& st, uint8_t seq, uint32_t& serverId) {
+        Backend& b = *s.backend;
+        auto found = b.statements.find(st.sql);
+        if (found != b.statements.end()) {
+            serverId = found->second;
+            return true;
+        }
+        send(b, char(kComStmtPrepare) + st.sql);
+        uint8_t rseq = 0;
+        std::string ok = b.wire.read(rseq);
+        if (ok.size() < 12 || ok[0] != 0x00) {
+            client.write(ok, seq);
+            return false;
+        }
+        serverId = static_cast<uint32_t>(MySqlWire::fixed(ok, 1, 4));
+        relayMetadata(b.wire, nullptr, static_cast<uint16_t>(MySqlWire::fixed(ok, 7, 2)),
+                      static_cast<uint16_t>(MySqlWire::fixed(ok, 5, 2)), s.deprecateEof());
+        keep(b, st.sql, serverId);
+        ++reprepared_;
+        return true;
+    }
+
+    // Remembers a statement prepared on b, closing the oldest beyond
+    // statementsPerBackend
+    void keep(Backend& b, const std::string& sql, uint32_t serverId) {
+        auto [it, added] = b.statements.try_emplace(sql, serverId);
+        if (!added) {
+            closeStatement(b, it->second);
+            it->second = serverId;
+            return;
+        }
+        b.statementOrder.push_back(sql);
+        while (b.statements.size() > std::max<size_t>(1, opts_.statementsPerBackend)) {
+            auto oldest = b.statements.find(b.statementOrder.front());
+            closeStatement(b, oldest->second);
+            b.statements.erase(oldest);
+            b.statementOrder.pop_front();
+        }
+    }
+
+    // No reply; goes out with the next command
+    static void closeStatement(Backend& b, uint32_t serverId) {
+        std::string cmd(1, char(kComStmtClose));
+        MySqlWire::putFixed(cmd, serverId, 4);
+        uint8_t seq = 0;
+        b.wire.write(cmd, seq);
+    }
+
+    // After each command: back to the pool unless a transaction is open,
+    // autocommit is off, or the session is pinned
+    void release(Session& s) {
+        if (!s.backend || s.pinned || (s.status & kStatusInTrans) || !(s.status & kStatusAutocommit)) return;
+        std::lock_guard<std::mutex> lock(mu_);
+        s.pool->idle.push_back(std::move(s.backend));
+        s.pool->returned.notify_one();
+    }
+
+    void pin(Session& s) {
+        if (s.pinned || !s.backend) return;
+        s.pinned = true;
+        ++pinned_;
+        std::lock_guard<std::mutex> lock(mu_);
+        --s.pool->open;
+        s.pool->returned.notify_all();  // waiters may now find the pool empty
+    }
+
+    void unpin(Session& s) {
+        s.pinned = false;
+        std::lock_guard<std::mutex> lock(mu_);
+        if (s.pool->open < opts_.backendsPerUser) ++s.pool->open;
+        else closing_.push_back(std::move(s.backend));
+    }
+
+    // Closes the session's connection: its state is unknown, or private
+    void drop(Session& s) {
+        if (!s.pinned) {
+            std::lock_guard<std::mutex> lock(mu_);
+            --s.pool->open;
+            s.pool->returned.notify_all();
+        }
+        discard(std::move(s.backend));
+    }
+
+    // With `waitClosed`, until the server closed its end too (at most
+    // a second), so it no longer counts the connection
+    void discard(std::unique_ptr<Backend> b, bool waitClosed = false) {
+        try {
+            uint8_t seq = 0;
+            b->wire.write(std::string(1, char(kComQuit)), seq);
+            b->wire.flush();
+            pollfd closed{ b->wire.fd(), POLLIN, 0 };
+            if (waitClosed) ::poll(&closed, 1, 1000);
+        }
+        catch (const std::exception&) {
+        }
+        b.reset();
+        --backends_;
+    }
+
+    // Connections unpin() had no room for; closed outside mu_
+    void closeRetired() {
+        std::vector<std::unique_ptr<Backend>> retired;
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            if (closing_.empty()) return;
+            retired.swap(closing_);
+        }
+        for (auto& b : retired) discard(std::move(b));
+    }
+
+    // ----- Reading replies ----------------------------------
+
+    // The next packet from the server, passed on to `to` (unless null).
+    // Returns the first packet of a payload of kMaxPayload or more; the
+    // rest is passed on as well.
+    static std::string relayPacket(MySqlWire& server, MySqlWire* to) {
+        if (to && !server.buffered()) to->flush();  // before waiting on the server
+        uint8_t seq = 0;
+        std::string p = server.read(seq);
+        if (to) to->writePacket(p, seq);
+        for (size_t len = p.size(); len == MySqlWire::kMaxPayload;) {
+            std::string more = server.read(seq);
+            if (to) to->writePacket(more, seq);
+            len = more.size();
+        }
+        if (p.empty()) throw std::runtime_error("MySqlProxy: empty reply packet");
+        return p;
+    }
+
+    // OK, ERR, or 0xFE: EOF, or under CLIENT_DEPRECATE_EOF an OK that
+    // ends a result set
+    static Reply parseEnd(std::string_view p, bool deprecateEof) {
+        Reply r;
+        uint8_t header = p.empty() ? 0xFF : static_cast<uint8_t>(p[0]);
+        if (header == 0xFF) return r;
+        r.ok = true;
+        if (header == 0xFE && !deprecateEof) {
+            if (p.size() >= 5) r.status = static_cast<uint16_t>(MySqlWire::fixed(p, 3, 2));
+            return r;
+        }
+        if (header != 0x00 && header != 0xFE) return r;  // not a status packet
+        size_t at = 1;
+        MySqlWire::lenenc(p, at);  // affected rows
+        r.insertId = MySqlWire::lenenc(p, at);
+        r.status = static_cast<uint16_t>(MySqlWire::fixed(p, at, 2));
+        return r;
+    }
+
+    // A reply of one OK, ERR or EOF packet
+    Reply relayEnd(MySqlWire& server, MySqlWire* to, bool deprecateEof) {
+        return parseEnd(relayPacket(server, to), deprecateEof);
+    }
+
+    // A reply without status (COM_STATISTICS)
+    Reply relayText(MySqlWire& server, MySqlWire* to, bool) {
+        std::string p = relayPacket(server, to);
+        Reply r;
+        r.ok = static_cast<uint8_t>(p[0]) != 0xFF;
+        return r;
+    }
+
+    // Column definitions up to EOF (COM_FIELD_LIST)
+    Reply relayFields(MySqlWire& server, MySqlWire* to, bool deprecateEof) {
+        for (;;) {
+            std::string p = relayPacket(server, to);
+            uint8_t header = static_cast<uint8_t>(p[0]);
+            if (header == 0xFF || (header == 0xFE && p.size() < MySqlWire::kMaxPayload)) return parseEnd(p, deprecateEof);
+        }
+    }
+
+    // The reply to COM_QUERY or COM_STMT_EXECUTE: OK, ERR, or result
+    // sets (text or binary rows, the same framing), one after another
+    // while SERVER_MORE_RESULTS_EXISTS is set
+    Reply relayResult(MySqlWire& server, MySqlWire* to, bool deprecateEof) {
+        Reply all;
+        for (;;) {
+            std::string p = relayPacket(server, to);
+            uint8_t header = static_cast<uint8_t>(p[0]);
+            Reply r;
+            if (header == 0xFF) return Reply{};
+            if (header == 0xFB) throw std::runtime_error("MySqlProxy: LOAD DATA LOCAL is not supported");
+            if (header == 0x00) {
+                r = parseEnd(p, deprecateEof);
+            }
+            else {
+                size_t at = 0;
+                uint64_t columns = MySqlWire::lenenc(p, at);
+                for (uint64_t i = 0; i < columns; ++i) relayPacket(server, to);
+                if (!deprecateEof) relayPacket(server, to);
+                for (;;) {
+                    p = relayPacket(server, to);
+                    header = static_cast<uint8_t>(p[0]);
+                    if (header == 0xFF) return Reply{};
+                    if (header == 0xFE && p.size() < MySqlWire::kMaxPayload) break;
+                }
+                r = parseEnd(p, deprecateEof);
+            }
+            all.ok = true;
+            all.status = r.status;
+            if (r.insertId) all.insertId = r.insertId;
+            if (!(r.status & kStatusMoreResults)) return all;
+        }
+    }
+
+    // Parameter and column definitions after a COM_STMT_PREPARE OK
+    static void relayMetadata(MySqlWire& server, MySqlWire* to, uint16_t params, uint16_t columns, bool deprecateEof) {
+        for (uint16_t n : { params, columns }) {
+            if (n == 0) continue;
+            for (uint16_t i = 0; i < n; ++i) relayPacket(server, to);
+            if (!deprecateEof) relayPacket(server, to);
+        }
+    }
+
+    // ----- Reading statements -------------------------------
+
+    static bool is(std::string_view token, std::string_view word) {
+        return token.size() == word.size() && std::equal(token.begin(), token.end(), word.begin(),
+            [](char a, char b) { return std::toupper(static_cast<unsigned char>(a)) == b; });
+    }
+
+    // Decides from the words of the statement (comments, string
+    // literals and anything after a ';' aside) what it does to the
+    // session. When unsure it pins: that costs sharing, never results.
+    static Classified classify(std::string_view sql) {
+        Classified c;
+        std::vector<std::string_view> t;  // words, quoted identifiers, punctuation
+        bool userVariable = false;
+        size_t i = 0, end = sql.size();
+        auto word = [](char ch) { return std::isalnum(static_cast<unsigned char>(ch)) || ch == '_' || ch == '$'; };
+        while (i < end) {
+            char ch = sql[i];
+            if (std::isspace(static_cast<unsigned char>(ch))) {
+                ++i;
+            }
+            else if (sql.compare(i, 2, "/*") == 0) {
+                if (sql.compare(i, 3, "/*!") == 0) c.kind = Classified::Pin;  // executable comment
+                size_t close = sql.find("*/", i + 2);
+                i = close == std::string_view::npos ? end : close + 2;
+            }
+            else if (ch == '#' || (sql.compare(i, 2, "--") == 0 && (i + 2 == end || std::isspace(static_cast<unsigned char>(sql[i + 2]))))) {
+                size_t nl = sql.find('\n', i);
+                i = nl == std::string_view::npos ? end : nl + 1;
+            }
+            else if (ch == '\'' || ch == '"' || ch == '`') {
+                size_t start = i++;
+                while (i < end && sql[i] != ch) i += sql[i] == '\\' && ch != '`' ? 2 : 1;
+                i = std::min(i + 1, end);
+                if (ch == '`') t.push_back(sql.substr(start, i - start));
+                else t.push_back("'");  // a literal; its text does not matter
+            }
+            else if (ch == ';') {
+                for (++i; i < end && (std::isspace(static_cast<unsigned char>(sql[i])) || sql[i] == ';');) ++i;
+                if (i < end) c.kind = Classified::Pin;  // more statements (or a comment) follow
+                break;
+            }
+            else if (ch == '@') {
+                if (i + 1 < end && sql[i + 1] == '@') {
+                    t.push_back(sql.substr(i, 2));
+                    i += 2;
+                }
+                else {
+                    userVariable = true;
+                    ++i;
+                }
+            }
+            else if (word(ch)) {
+                size_t start = i;
+                while (i < end && word(sql[i])) ++i;
+                t.push_back(sql.substr(start, i - start));
+            }
+            else {
+                t.push_back(sql.substr(i++, 1));
+            }
+        }
+        if (c.kind == Classified::Pin || t.empty()) return c;
+        auto pin = [&] {
+            c.kind = Classified::Pin;
+            return c;
+        };
+        if (userVariable) return pin();
+        for (std::string_view w : t)
+            if (is(w, "GET_LOCK") || is(w, "SQL_CALC_FOUND_ROWS")) return pin();
+        std::string_view first = t[0];
+        if (is(first, "LOCK") || is(first, "PREPARE") || is(first, "EXECUTE") || is(first, "DEALLOCATE")
+            || is(first, "HANDLER") || is(first, "XA") || (is(first, "CREATE") && t.size() > 1 && is(t[1], "TEMPORARY")))
+            return pin();
+        if (is(first, "SELECT") && t.size() == 4 && is(t[1], "LAST_INSERT_ID") && t[2] == "(" && t[3] == ")") {
+            c.kind = Classified::LastInsertId;
+            return c;
+        }
+        if (is(first, "USE")) {
+            if (t.size() != 2) return pin();
+            c.kind = Classified::Use;
+            c.name = t[1].front() == '`' ? std::string(t[1].substr(1, t[1].size() - 2)) : std::string(t[1]);
+            return c;
+        }
+        if (!is(first, "SET")) return c;
+
+        // SET [SESSION | LOCAL] TRANSACTION ..., or one assignment:
+        // SET [SESSION | LOCAL | @@[SESSION. | LOCAL.]]var = value
+        size_t k = 1;
+        bool session = false;
+        if (k < t.size() && (is(t[k], "GLOBAL") || is(t[k], "PERSIST") || is(t[k], "PERSIST_ONLY"))) return c;
+        if (k < t.size() && (is(t[k], "SESSION") || is(t[k], "LOCAL"))) {
+            session = true;
+            ++k;
+        }
+        if (!session && k < t.size() && (is(t[k], "NAMES") || is(t[k], "CHARSET")
+                || (is(t[k], "CHARACTER") && k + 1 < t.size() && is(t[k + 1], "SET")))) {
+            for (size_t j = k + 1; j < t.size(); ++j)
+                if (t[j] == ",") return pin();
+            c.kind = Classified::SessionVariable;
+            c.name = "names";  // SET NAMES and SET CHARACTER SET replace each other
+            return c;
+        }
+        if (k < t.size() && is(t[k], "TRANSACTION")) {
+            if (!session) return pin();  // the next transaction only
+            c.kind = Classified::SessionVariable;
+            c.name = "transaction";
+            c.reset = "SET SESSION transaction_isolation = DEFAULT, transaction_read_only = DEFAULT";
+            return c;
+        }
+        if (!session && k < t.size() && t[k] == "@@") {
+            ++k;
+            if (k + 1 < t.size() && t[k + 1] == ".") {
+                if (is(t[k], "GLOBAL") || is(t[k], "PERSIST") || is(t[k], "PERSIST_ONLY")) return c;
+                if (!is(t[k], "SESSION") && !is(t[k], "LOCAL")) return pin();
+                k += 2;
+            }
+        }
+        if (k + 1 >= t.size() || !(t[k + 1] == "=" || (t[k + 1] == ":" && k + 2 < t.size() && t[k + 2] == "=")))
+            return pin();  // SET PASSWORD, SET ROLE, ...
+        for (size_t j = k + 2; j < t.size(); ++j)
+            if (t[j] == ",") return pin();  // several assignments
+        if (is(t[k], "AUTOCOMMIT")) return c;  // the reply's status tells
+        c.kind = Classified::SessionVariable;
+        c.name.resize(t[k].size());
+        std::transform(t[k].begin(), t[k].end(), c.name.begin(), [](char ch) { return static_cast<char>(std::tolower(static_cast<unsigned char>(ch))); });
+        // DEFAULT is the global value; these start from the login's character set
+        if (c.name != "character_set_client" && c.name != "character_set_connection"
+            && c.name != "character_set_results" && c.name != "collation_connection")
+            c.reset = "SET SESSION " + std::string(t[k]) + " = DEFAULT";
+        return c;
+    }
+
+    // The statement that gives a session the character set of a login
+    // with this collation id, as the server did; empty for ids not
+    // listed (SET NAMES then pins)
+    static std::string namesFor(uint8_t collation) {
+        switch (collation) {
+        case 8:   return "SET NAMES latin1 COLLATE latin1_swedish_ci";
+        case 33:  return "SET NAMES utf8 COLLATE utf8_general_ci";
+        case 45:  return "SET NAMES utf8mb4 COLLATE utf8mb4_general_ci";
+        case 46:  return "SET NAMES utf8mb4 COLLATE utf8mb4_bin";
+        case 63:  return "SET NAMES binary";
+        case 83:  return "SET NAMES utf8 COLLATE utf8_bin";
+        case 224: return "SET NAMES utf8mb4 COLLATE utf8mb4_unicode_ci";
+        case 255: return "SET NAMES utf8mb4 COLLATE utf8mb4_0900_ai_ci";
+        default:  return "";
+        }
+    }
+
+    MySqlProxyOptions         opts_;
+    int                       listen_ = -1;
+    int                       wake_[2] = { -1, -1 };  // stop() writes to it to end acceptLoop()
+    std::thread               acceptor_;
+    std::atomic<bool>         stopping_{ false };
+    std::mutex                sessionsMu_;
+    std::list<SessionThread>  sessions_;
+    std::mutex                mu_;        // pools, logins
+    std::map<std::string, std::unique_ptr<Pool>> pools_;  // by user, capabilities, charset
+    std::vector<std::unique_ptr<Backend>> closing_;
+    size_t                    loggingIn_ = 0;
+    std::condition_variable   loginDone_;
+    std::atomic<int64_t>      clients_{ 0 };
+    std::atomic<int64_t>      backends_{ 0 };
+    std::atomic<uint64_t>&    logins_;
+    std::atomic<uint64_t>&    loginFailures_;
+    std::atomic<uint64_t>&    backendWaits_;
+    std::atomic<uint64_t>&    pinned_;
+    std::atomic<uint64_t>&    reprepared_;
+    std::atomic<uint64_t>&    lastInsertIdAnswers_;
+};
+
+// ---------------------------------------------------------
+// Class: PerfCounters
+// Hardware counters for the calling thread via perf_event_open
+// (Linux only): cycles, instructions, L1d read misses, LLC misses
+// and branch misses, user space only. They are opened as one group,
+// so they count over exactly the same instructions, and a counter the
+// machine (or VM, or container) lacks is left out of the group while
+// the others still report. When the kernel had to multiplex the group
+// with other events, counts are scaled by time enabled / time
+// running. Where none are available, available() is false and the
+// benchmarks print "n/a" instead of failing.
+// ---------------------------------------------------------
+class PerfCounters {
+public:
+    enum Counter { Cycles, Instructions, L1dMisses, LlcMisses, BranchMisses, kCount };
+
+    struct Values {
+        uint64_t value[kCount] = {};
+        bool     valid[kCount] = {};
+        size_t   samples = 0;  // stop() results added up here
+
+        // A total is only valid if every sample in it was
+        Values& operator+=(const Values& o) {
+            for (int i = 0; i < kCount; ++i) {
+                value[i] += o.value[i];
+                valid[i] = (samples == 0 ? true : valid[i]) && o.valid[i];
+            }
+            samples += o.samples;
+            return *this;
+        }
+    };
+
+    PerfCounters() {
+#ifdef __linux__
+        const uint32_t types[kCount] = { PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE,
+                                         PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE };
+        const uint64_t configs[kCount] = {
+            PERF_COUNT_HW_CPU_CYCLES,
+            PERF_COUNT_HW_INSTRUCTIONS,
+            PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+            PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES,
+        };
+        for (int i = 0; i < kCount; ++i) {
+            struct perf_event_attr attr {};
+            attr.size = sizeof attr;
+            attr.type = types[i];
+            attr.config = configs[i];
+            attr.disabled = leader_ < 0;  // members start and stop with the leader
+            attr.exclude_kernel = 1;      // allowed at the default perf_event_paranoid level
+            attr.exclude_hv = 1;
+            attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+            int fd = static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, leader_, 0));
+            if (fd < 0) continue;
+            if (leader_ < 0) leader_ = fd;
+            fds_[i] = fd;
+            position_[i] = members_++;
+        }
+#endif
+    }
+
+    ~PerfCounters() {
+        for (int fd : fds_) if (fd >= 0) close(fd);
+    }
+
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    bool available() const { return leader_ >= 0; }
+
+    void start() {
+#ifdef __linux__
+        if (leader_ < 0) return;
+        ioctl(leader_, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(leader_, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+#endif
+    }
+
+    // Stop counting and return what was counted since start()
+    Values stop() {
+        Values v;
+        v.samples = 1;
+#ifdef __linux__
+        if (leader_ < 0) return v;
+        ioctl(leader_, PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+        // { nr, time_enabled, time_running, value[nr] }
+        uint64_t buf[3 + kCount] = {};
+        ssize_t n = read(leader_, buf, sizeof buf);
+        if (n < ssize_t(3 * sizeof(uint64_t)) || buf[0] != uint64_t(members_) || buf[2] == 0) return v;  // never scheduled
+        double scale = double(buf[1]) / double(buf[2]);
+        for (int i = 0; i < kCount; ++i) {
+            if (fds_[i] < 0) continue;
+            v.value[i] = static_cast<uint64_t>(double(buf[3 + position_[i]]) * scale + 0.5);
+            v.valid[i] = true;
+        }
+#endif
+        return v;
+    }
+
+    static const char* name(int counter) {
+        static const char* names[kCount] = { "cycles", "instructions", "l1d_misses", "llc_misses", "branch_misses" };
+        return names[counter];
+    }
+
+private:
+    int fds_[kCount] = { -1, -1, -1, -1, -1 };
+    int position_[kCount] = {};  // place in the group's read buffer
+    int leader_ = -1;
+    int members_ = 0;
+};
+
+// ---------------------------------------------------------
+// Struct: BenchResult
+// Outcome of one benchmark: `reps` repetitions of `iterations`
+// operations each, every operation touching `rowsPerOp` rows.
+// nsPerOp and counterSamples hold one sample per repetition;
+// counters is their total.
+// ---------------------------------------------------------
+struct BenchResult {
+    std::string          name;
+    size_t               iterations = 0;
+    size_t               rowsPerOp = 1;
+    std::vector<double>  nsPerOp;
+    PerfCounters::Values counters;
+    std::vector<PerfCounters::Values> counterSamples;
+    std::string          note;  // extra line printed under the result (memory use, ...)
+
+    size_t totalOps() const { return iterations * nsPerOp.size(); }
+
+    double medianNsPerOp() const {
+        std::vector<double> v = nsPerOp;
+        std::sort(v.begin(), v.end());
+        return v.empty() ? 0 : v[v.size() / 2];
+    }
+};
+
+// ---------------------------------------------------------
+// Helper function: benchSelected
+// Whether a benchmark runs: its full name (as printed, e.g.
+// "insertUsersBulk/100") must contain the --bench filter that
+// runBenchmarks() set. Skipped benchmarks come back with no samples.
+// ---------------------------------------------------------
+std::string& benchFilter() {
+    static std::string filter;
+    return filter;
+}
+
+bool benchSelected(const std::string& name) { return name.find(benchFilter()) != std::string::npos; }
+
+// ---------------------------------------------------------
+// Function: runBench
+// Calls op(i) `iterations` times per repetition, with one untimed
+// warm-up repetition first, and collects wall time and counters.
+// ---------------------------------------------------------
+template <typename Op>
+BenchResult runBench(const std::string& name, size_t rowsPerOp, size_t iterations, size_t reps, Op&& op) {
+    BenchResult r;
+    r.name = name;
+    r.iterations = iterations;
+    r.rowsPerOp = rowsPerOp;
+    if (!benchSelected(name)) return r;
+
+    PerfCounters pc;
+    size_t call = 0;
+    for (size_t i = 0; i < iterations; ++i) op(call++);  // warm-up
+    for (size_t rep = 0; rep < reps; ++rep) {
+        auto t0 = std::chrono::steady_clock::now();
+        pc.start();
+        for (size_t i = 0; i < iterations; ++i) op(call++);
+        PerfCounters::Values v = pc.stop();
+        r.counters += v;
+        r.counterSamples.push_back(v);
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+        r.nsPerOp.push_back(ns / iterations);
+    }
+    return r;
+}
+
+// ---------------------------------------------------------
+// Function: runThreadedBench
+// Runs op(thread, i) opsPerThread times on each of `threads` threads
+// at once. nsPerOp is wall time divided by all operations, i.e. the
+// inverse of aggregate throughput, so it drops as a workload scales.
+// Counters are not collected (they are per thread).
+// ---------------------------------------------------------
+template <typename Op>
+BenchResult runThreadedBench(const std::string& name, unsigned threads, size_t opsPerThread, size_t reps, Op&& op) {
+    BenchResult r;
+    r.name = name;
+    r.iterations = opsPerThread * threads;
+    if (!benchSelected(name)) return r;
+    for (size_t rep = 0; rep <= reps; ++rep) {  // rep 0 is the warm-up
+        std::atomic<unsigned> ready{ 0 };
+        std::atomic<bool> go{ false };
+        std::vector<std::thread> pool;
+        for (unsigned t = 0; t < threads; ++t) {
+            pool.emplace_back([&, t] {
+                ++ready;
+                while (!go.load()) std::this_thread::yield();
+                for (size_t i = 0; i < opsPerThread; ++i) op(t, i);
+            });
+        }
+        while (ready.load() < threads) std::this_thread::yield();
+        auto t0 = std::chrono::steady_clock::now();
+        go = true;
+        for (auto& th : pool) th.join();
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - t0).count();
+        if (rep > 0) r.nsPerOp.push_back(ns / r.iterations);
+    }
+    std::ostringstream note;
+    note << std::fixed << std::setprecision(2) << 1e3 / r.medianNsPerOp() << " M ops/s on " << threads << " thread(s)";
+    r.note = note.str();
+    return r;
+}
+
+// ---------------------------------------------------------
+// Function: printBenchResults
+// One line per benchmark: time and counters per operation and per row.
+// ---------------------------------------------------------
+void printBenchResults(const std::vector<BenchResult>& results, std::ostream& out) {
+    out << std::left << std::setw(28) << "benchmark" << std::right
+        << std::setw(12) << "ns/op" << std::setw(12) << "ns/row"
+        << std::setw(12) << "cyc/op" << std::setw(12) << "cyc/row" << std::setw(12) << "ins/op" << std::setw(12) << "ins/row"
+        << std::setw(8) << "IPC"
+        << std::setw(12) << "L1dm/op" << std::setw(12) << "L1dm/row" << std::setw(12) << "LLCm/op" << std::setw(12) << "LLCm/row"
+        << std::setw(12) << "brm/op" << std::setw(12) << "brm/row" << "\n";
+    for (const auto& r : results) {
+        double ops = static_cast<double>(r.totalOps());
+        double rows = ops * r.rowsPerOp;
+        auto per = [&](int c, double n) -> std::string {
+            if (!r.counters.valid[c] || n == 0) return "n/a";
+            std::ostringstream s;
+            s << std::fixed << std::setprecision(1) << r.counters.value[c] / n;
+            return s.str();
+        };
+        auto perOpAndRow = [&](int c) {
+            std::ostringstream s;
+            s << std::setw(12) << per(c, ops) << std::setw(12) << per(c, rows);
+            return s.str();
+        };
+        std::string ipc = "n/a";
+        if (r.counters.valid[PerfCounters::Cycles] && r.counters.valid[PerfCounters::Instructions] && r.counters.value[PerfCounters::Cycles]) {
+            std::ostringstream s;
+            s << std::fixed << std::setprecision(2)
+              << double(r.counters.value[PerfCounters::Instructions]) / r.counters.value[PerfCounters::Cycles];
+            ipc = s.str();
+        }
+        double ns = r.medianNsPerOp();
+        out << std::left << std::setw(28) << r.name << std::right << std::fixed << std::setprecision(0)
+            << std::setw(12) << ns << std::setprecision(1) << std::setw(12) << ns / r.rowsPerOp
+            << perOpAndRow(PerfCounters::Cycles) << perOpAndRow(PerfCounters::Instructions)
+            << std::setw(8) << ipc
+            << perOpAndRow(PerfCounters::L1dMisses) << perOpAndRow(PerfCounters::LlcMisses)
+            << perOpAndRow(PerfCounters::BranchMisses) << "\n";
+        if (!r.note.empty()) out << "    " << r.note << "\n";
+    }
+}
+
+// ---------------------------------------------------------
+// Function: writeBenchJson
+// Writes benchmark results as JSON, keeping every repetition's sample
+// so two runs can be compared statistically (see compareBenchFiles).
+//   {"benchmarks": [{"name": ..., "iterations": ..., "rows_per_op": ...,
+//     "metrics": {"ns_per_op": [..], "cycles_per_op": [..], ...}}]}
+// ---------------------------------------------------------
+void writeBenchJson(const std::vector<BenchResult>& results, std::ostream& out) {
+    auto writeSamples = [&](const char* metric, const std::vector<double>& v) {
+        out << ", \"" << metric << "\": [";
+        for (size_t i = 0; i < v.size(); ++i) out << (i ? ", " : "") << v[i];
+        out << "]";
+    };
+    out << std::setprecision(10) << "{\"benchmarks\": [\n";
+    for (size_t b = 0; b < results.size(); ++b) {
+        const BenchResult& r = results[b];
+        std::string name;
+        for (char c : r.name) {
+            if (c == '"' || c == '\\') name += '\\';
+            name += c;
+        }
+        out << "  {\"name\": \"" << name << "\", \"iterations\": " << r.iterations
+            << ", \"rows_per_op\": " << r.rowsPerOp << ", \"metrics\": {\"ns_per_op\": [";
+        for (size_t i = 0; i < r.nsPerOp.size(); ++i) out << (i ? ", " : "") << r.nsPerOp[i];
+        out << "]";
+        for (int c = 0; c < PerfCounters::kCount; ++c) {
+            if (!r.counters.valid[c]) continue;
+            std::vector<double> perOp;
+            for (const auto& s : r.counterSamples) perOp.push_back(double(s.value[c]) / r.iterations);
+            writeSamples((std::string(PerfCounters::name(c)) + "_per_op").c_str(), perOp);
+        }
+        out << "}}" << (b + 1 < results.size() ? "," : "") << "\n";
+    }
+    out << "]}\n";
+}
+
+// ---------------------------------------------------------
+// Function: readBenchJson
+// Reads the file written by writeBenchJson back into
+// benchmark name -> metric name -> samples. This is a small parser
+// for that format only (objects, arrays, strings, numbers).
+// ---------------------------------------------------------
+using BenchSamples = std::map<std::string, std::map<std::string, std::vector<double>>>;
+
+BenchSamples readBenchJson(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) throw std::runtime_error("cannot open " + path);
+    std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t pos = 0;
+
+    auto fail = [&](const char* what) -> void { throw std::runtime_error(path + ": " + what + " at offset " + std::to_string(pos)); };
+    auto skipWs = [&] { while (pos < text.size() && std::isspace(static_cast<unsigned char>(text[pos]))) ++pos; };
+    auto expect = [&](char c) { skipWs(); if (pos >= text.size() || text[pos] != c) fail("unexpected character"); ++pos; };
+    auto peek = [&] { skipWs(); return pos < text.size() ? text[pos] : '\0'; };
+    auto readString = [&] {
+        expect('"');
+        std::string s;
+        while (pos < text.size() && text[pos] != '"') {
+            if (text[pos] == '\\' && pos + 1 < text.size()) ++pos;
+            s += text[pos++];
+        }
+        expect('"');
+        return s;
+    };
+    auto readNumber = [&] {
+        skipWs();
+        char* end = nullptr;
+        double d = std::strtod(text.c_str() + pos, &end);
+        if (end == text.c_str() + pos) fail("expected a number");
+        pos = end - text.c_str();
+        return d;
+    };
+    // Calls item() for each element of an array or each key of an object
+    auto readList = [&](char open, char close, const std::function<void()>& item) {
+        expect(open);
+        if (peek() == close) { ++pos; return; }
+        for (;;) {
+            item();
+            if (peek() == ',') { ++pos; continue; }
+            expect(close);
+            return;
+        }
+    };
+
+    BenchSamples out;
+    readList('{', '}', [&] {
+        if (readString() != "benchmarks") fail("expected \"benchmarks\"");
+        expect(':');
+        readList('[', ']', [&] {
+            std::string name;
+            std::map<std::string, std::vector<double>> metrics;
+            readList('{', '}', [&] {
+                std::string key = readString();
+                expect(':');
+                if (key == "name") name = readString();
+                else if (key == "metrics") {
+                    readList('{', '}', [&] {
+                        std::vector<double>& v = metrics[readString()];
+                        expect(':');
+                        readList('[', ']', [&] { v.push_back(readNumber()); });
+                    });
+                }
+                else readNumber();
+            });
+            out[name] = std::move(metrics);
+        });
+    });
+    return out;
+}
+
+// ---------------------------------------------------------
+// Function: mannWhitneyP
+// Two-sided p-value of the Mann-Whitney U test (normal approximation
+// with tie and continuity correction). Small p: the two sets of
+// samples are unlikely to come from the same distribution.
+// ---------------------------------------------------------
+double mannWhitneyP(const std::vector<double>& a, const std::vector<double>& b) {
+    size_t n1 = a.size(), n2 = b.size(), n = n1 + n2;
+    if (n1 == 0 || n2 == 0) return 1;
+
+    std::vector<std::pair<double, int>> all;
+    for (double x : a) all.push_back({ x, 0 });
+    for (double x : b) all.push_back({ x, 1 });
+    std::sort(all.begin(), all.end());
+
+    // Rank sum of `a` with average ranks for ties
+    double rankSumA = 0, tieTerm = 0;
+    for (size_t i = 0; i < n; ) {
+        size_t j = i;
+        while (j < n && all[j].first == all[i].first) ++j;
+        double avgRank = (i + 1 + j) / 2.0;
+        for (size_t k = i; k < j; ++k) if (all[k].second == 0) rankSumA += avgRank;
+        double t = double(j - i);
+        tieTerm += t * t * t - t;
+        i = j;
+    }
+    double u = rankSumA - n1 * (n1 + 1) / 2.0;
+    double mean = n1 * n2 / 2.0;
+    double var = n1 * n2 / 12.0 * ((n + 1) - tieTerm / (double(n) * (n - 1)));
+    if (var <= 0) return 1;
+    double z = (std::fabs(u - mean) - 0.5) / std::sqrt(var);
+    return z <= 0 ? 1 : std::erfc(z / std::sqrt(2.0));
+}
+
+// ---------------------------------------------------------
+// Function: bootstrapChangeCi
+// 95% bootstrap confidence interval of the relative change of the
+// median, (median(b) - median(a)) / median(a). Fixed seed, so the
+// same inputs always give the same interval.
+// ---------------------------------------------------------
+std::pair<double, double> bootstrapChangeCi(const std::vector<double>& a, const std::vector<double>& b, int resamples = 2000) {
+    auto median = [](std::vector<double>& v) {
+        std::nth_element(v.begin(), v.begin() + v.size() / 2, v.end());
+        return v[v.size() / 2];
+    };
+    std::mt19937 rng(12345);
+    std::vector<double> changes, ra(a.size()), rb(b.size());
+    for (int i = 0; i < resamples; ++i) {
+        for (auto& x : ra) x = a[rng() % a.size()];
+        for (auto& x : rb) x = b[rng() % b.size()];
+        double ma = median(ra);
+        if (ma != 0) changes.push_back((median(rb) - ma) / ma);
+    }
+    if (changes.empty()) return { 0, 0 };
+    std::sort(changes.begin(), changes.end());
+    return { changes[changes.size() * 25 / 1000], changes[changes.size() * 975 / 1000] };
+}
+
+// ---------------------------------------------------------
+// Function: compareBenchFiles
+// Compares two --bench JSON files metric by metric (all metrics are
+// lower-is-better) and prints a table. A change counts as significant
+// when the Mann-Whitney p-value is below 0.05 and the bootstrap
+// interval excludes zero. Returns the number of significant
+// regressions larger than thresholdPct.
+// ---------------------------------------------------------
+int compareBenchFiles(const std::string& basePath, const std::string& newPath, double thresholdPct, std::ostream& out) {
+    BenchSamples base = readBenchJson(basePath), cur = readBenchJson(newPath);
+    auto median = [](std::vector<double> v) {
+        std::sort(v.begin(), v.end());
+        return v.empty() ? 0 : v[v.size() / 2];
+    };
+
+    int regressions = 0;
+    out << std::left << std::setw(28) << "benchmark" << std::setw(22) << "metric" << std::right
+        << std::setw(14) << "base" << std::setw(14) << "new" << std::setw(10) << "change"
+        << std::setw(20) << "95% CI" << std::setw(9) << "p" << "  verdict\n";
+    for (const auto& bench : cur) {
+        auto baseBench = base.find(bench.first);
+        if (baseBench == base.end()) { out << std::left << std::setw(28) << bench.first << "(new benchmark)\n"; continue; }
+        for (const auto& metric : bench.second) {
+            auto baseMetric = baseBench->second.find(metric.first);
+            if (baseMetric == baseBench->second.end() || baseMetric->second.empty() || metric.second.empty()) continue;
+            const std::vector<double>& a = baseMetric->second;
+            const std::vector<double>& b = metric.second;
+
+            double ma = median(a), mb = median(b);
+            double change = ma != 0 ? (mb - ma) / ma * 100 : 0;
+            double p = mannWhitneyP(a, b);
+            auto ci = bootstrapChangeCi(a, b);
+            bool significant = p < 0.05 && (ci.first > 0 || ci.second < 0);
+            const char* verdict = "same";
+            if (significant && change > thresholdPct) { verdict = "REGRESSION"; ++regressions; }
+            else if (significant && change < -thresholdPct) verdict = "improvement";
+            else if (significant) verdict = "small change";
+
+            std::ostringstream ciText;
+            ciText << std::fixed << std::setprecision(1) << "[" << ci.first * 100 << ", " << ci.second * 100 << "]%";
+            out << std::left << std::setw(28) << bench.first << std::setw(22) << metric.first << std::right
+                << std::fixed << std::setprecision(1) << std::setw(14) << ma << std::setw(14) << mb
+                << std::setw(9) << change << "%" << std::setw(20) << ciText.str()
+                << std::setprecision(3) << std::setw(9) << p << "  " << verdict << "\n";
+        }
+    }
+    for (const auto& bench : base)
+        if (!cur.count(bench.first)) out << std::left << std::setw(28) << bench.first << "(missing in new run)\n";
+    return regressions;
+}
+
+// ---------------------------------------------------------
+// Function: makeBenchNames
+// Deterministic, realistic-looking names for the local benchmarks:
+// `distinct` different names (about 1 in 10 longer than 22 bytes),
+// drawn with a skew so some repeat much more often than others.
+// ---------------------------------------------------------
+std::vector<std::string> makeBenchNames(size_t n, size_t distinct, uint32_t seed = 42) {
+    static const char* first[] = { "alice", "bob", "carol", "dave", "erin", "frank", "grace", "heidi",
+                                   "ivan", "judy", "mallory", "niaj", "olivia", "peggy", "rupert", "sybil" };
+    std::mt19937 rng(seed);
+    std::vector<std::string> pool;
+    for (size_t i = 0; i < distinct; ++i) {
+        std::string name = std::string(first[rng() % 16]) + "." + std::to_string(i);
+        if (rng() % 10 == 0) name += "@long-example-domain.org";
+        pool.push_back(std::move(name));
+    }
+    std::vector<std::string> out;
+    out.reserve(n);
+    for (size_t i = 0; i < n; ++i) {
+        size_t a = rng() % distinct, b = rng() % distinct;
+        out.push_back(pool[std::min(a, b)]);  // low indexes are drawn more often
+    }
+    return out;
+}
+
+// Heap bytes owned by a vector<User>, counting names that outgrew the
+// string's inline (SSO) buffer; allocator overhead is not included
+size_t userVectorBytes(const std::vector<User>& users) {
+    size_t bytes = users.capacity() * sizeof(User);
+    for (const auto& u : users) {
+        const char* obj = reinterpret_cast<const char*>(&u.name);
+        bool inlineStorage = u.name.data() >= obj && u.name.data() < obj + sizeof(u.name);
+        if (!inlineStorage) bytes += u.name.capacity() + 1;
+    }
+    return bytes;
+}
+
+// ---------------------------------------------------------
+// Function: runBenchmarks
+// Benchmarks every statement helper in this file against the users
+// table (the table is emptied first). Benchmarks whose full name does
+// not contain `filter` are skipped (see benchSelected()); a group's
+// setup only runs when the filter could select something in it. With
+// con == nullptr only the benchmarks that need no server run.
+// ---------------------------------------------------------
+std::vector<BenchResult> runBenchmarks(sql::Connection* con, const std::string& filter, size_t reps = 5) {
+    std::vector<BenchResult> results;
+    benchFilter() = filter;
+    // Group names are prefixes of their benchmarks' names
+    auto wanted = [&](const std::string& group) {
+        return group.find(filter) != std::string::npos || filter.compare(0, group.size(), group) == 0;
+    };
+    if (!PerfCounters().available())
+        std::cerr << "Hardware counters unavailable (not Linux, or perf_event_paranoid too high)\n";
+
+    if (con != nullptr) {
+        std::unique_ptr<sql::Statement> s(con->createStatement());
+        s->execute("DELETE FROM users");
+        size_t seq = 0;
+        auto uniqueName = [&] { return "bench-" + std::to_string(seq++); };
+
+        if (wanted("insertUser"))
+            results.push_back(runBench("insertUser", 1, 200, reps, [&](size_t) {
+                insertUser(con, { 0, uniqueName(), 30 });
+            }));
+
+        if (wanted("insertUsersBulk")) {
+            std::vector<User> users(100);
+            results.push_back(runBench("insertUsersBulk/100", users.size(), 10, reps, [&](size_t) {
+                for (auto& u : users) u = { 0, uniqueName(), 40 };
+                insertUsersBulk(con, users);
+            }));
+        }
+
+        if (wanted("insertUserBatch")) {
+            UserBatch batch;
+            results.push_back(runBench("insertUserBatch/1000", 1000, 5, reps, [&](size_t) {
+                batch.clear();
+                for (int i = 0; i < 1000; ++i) batch.append(0, uniqueName(), 20 + i % 60);
+                insertUserBatch(con, batch, 500);
+            }));
+        }
+
+        if (wanted("updateUserAgeByName")) {
+            // Its own rows, whichever insert benchmarks ran before
+            std::vector<User> targets(100);
+            for (size_t i = 0; i < targets.size(); ++i) targets[i] = { 0, "bench-update-" + std::to_string(i), 30 };
+            if (benchSelected("updateUserAgeByName")) insertUsersBulk(con, targets);
+            results.push_back(runBench("updateUserAgeByName", 1, 200, reps, [&](size_t i) {
+                updateUserAgeByName(con, targets[i % targets.size()].name, 18 + static_cast<int>(i % 70));
+            }));
+        }
+
+        if (wanted("getUsersByMinAge")) {
+            size_t rows = getUsersByMinAge(con, 50).size();
+            results.push_back(runBench("getUsersByMinAge", rows ? rows : 1, 20, reps, [&](size_t) {
+                getUsersByMinAge(con, 50);
+            }));
+
+            // Same query with per-row work done inline vs in the pipeline
+            auto work = [](const UserBatch& b) {
+                uint64_t h = 0;
+                for (size_t i = 0; i < b.size(); ++i)
+                    for (char c : b.name(i)) h = (h ^ static_cast<unsigned char>(std::toupper(c))) * 1099511628211ull;
+                return h;
+            };
+            volatile uint64_t sink = 0;
+            results.push_back(runBench("getUsersByMinAge/inline", rows ? rows : 1, 20, reps, [&](size_t) {
+                UsersByMinAgeReader reader(con, 50);
+                UserBatch batch;
+                while (reader.next(batch, 4096)) sink = sink + work(batch);
+            }));
+            for (unsigned workers : { 1u, 2u, 4u }) {
+                PipelineOptions opts;
+                opts.workers = workers;
+                results.push_back(runBench("getUsersByMinAge/pipelined/W=" + std::to_string(workers), rows ? rows : 1, 20, reps,
+                    [&](size_t) { getUsersByMinAge(con, 50, work, [&](uint64_t h) { sink = sink + h; }, opts); }));
+            }
+        }
+
+        if (wanted("autocomplete")) {
+            // Same prefixes against LIKE on the server and the local index
+            NameAutocomplete ac;
+            ac.load(con);
+            std::vector<std::string> prefixes;
+            for (int i = 0; i < 100; ++i) prefixes.push_back("bench-" + std::to_string(i % 10));
+            volatile size_t sink = 0;
+            results.push_back(runBench("autocomplete/server-LIKE", 1, prefixes.size(), reps, [&](size_t i) {
+                sink = getNamesByPrefix(con, prefixes[i % prefixes.size()], 10).size();
+            }));
+            results.push_back(runBench("autocomplete/local-table", 1, prefixes.size(), reps, [&](size_t i) {
+                sink = ac.complete(prefixes[i % prefixes.size()], 10).size();
+            }));
+        }
+
+        if (wanted("rangeIndex")) {
+            // Same query answered locally from the table's current rows
+            AgeRangeIndex index;
+            index.load(con);
+            std::vector<User> server = getUsersByMinAge(con, 50), local = index.usersByMinAge(50);
+            bool same = server.size() == local.size() && std::equal(server.begin(), server.end(), local.begin(),
+                [](const User& a, const User& b) { return a.id == b.id && a.age == b.age && a.name == b.name; });
+            BenchResult r = runBench("rangeIndex/local-vs-server", local.empty() ? 1 : local.size(), 20, reps, [&](size_t) {
+                index.usersByMinAge(50);
+            });
+            r.note = same ? "identical rows and order to getUsersByMinAge" : "MISMATCH with getUsersByMinAge";
+            results.push_back(r);
+        }
+    }
+
+    // ====== Local benchmarks (no server needed) ======
+    if (wanted("compactUser")) {
+        const size_t n = 1000000;
+        std::vector<std::string> names = makeBenchNames(n, n / 2);
+        std::vector<User> users;
+        CompactUserTable compact;
+        users.reserve(n);
+        compact.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            users.push_back({ int(i), names[i], 18 + int(i % 70) });
+            compact.push_back(int(i), names[i], 18 + int(i % 70));
+        }
+
+        volatile size_t sink = 0;
+        BenchResult r = runBench("compactUser/vector<User>", n, 1, reps, [&](size_t) {
+            size_t sum = 0;
+            for (const auto& u : users) sum += u.name.back() + u.age;
+            sink = sum;
+        });
+        r.note = "memory " + std::to_string(userVectorBytes(users) / n) + " bytes/row";
+        results.push_back(r);
+
+        r = runBench("compactUser/CompactUserTable", n, 1, reps, [&](size_t) {
+            size_t sum = 0;
+            for (const auto& u : compact) sum += u.name().back() + u.age;
+            sink = sum;
+        });
+        r.note = "memory " + std::to_string(compact.memoryBytes() / n) + " bytes/row";
+        results.push_back(r);
+    }
+
+    if (wanted("intern")) {
+        // Duplicate-heavy: one million rows over 20k distinct names
+        const size_t n = 1000000;
+        std::vector<std::string> names = makeBenchNames(n, 20000);
+        UserBatch plain, encoded;
+        encoded.useDictionary(std::make_shared<NameInterner>());
+        for (size_t i = 0; i < n; ++i) {
+            plain.append(int(i), names[i], 30);
+            encoded.append(int(i), names[i], 30);
+        }
+
+        // Rows per distinct name: hash the bytes vs index by handle
+        volatile size_t sink = 0;
+        BenchResult r = runBench("intern/count-by-name/bytes", n, 1, reps, [&](size_t) {
+            std::unordered_map<std::string_view, uint32_t> counts;
+            for (size_t i = 0; i < plain.size(); ++i) ++counts[plain.name(i)];
+            sink = counts.size();
+        });
+        r.note = "plain batch " + std::to_string(plain.memoryBytes() / n) + " bytes/row";
+        results.push_back(r);
+
+        r = runBench("intern/count-by-name/handle", n, 1, reps, [&](size_t) {
+            std::vector<uint32_t> counts(encoded.dict->size());
+            for (NameInterner::Handle h : encoded.nameCodes) ++counts[h];
+            sink = counts.size();
+        });
+        size_t dictBytes = encoded.memoryBytes() + encoded.dict->memoryBytes();
+        std::ostringstream note;
+        note << "dictionary batch " << dictBytes / n << " bytes/row incl. dictionary of "
+             << encoded.dict->size() << " names (" << std::fixed << std::setprecision(1)
+             << 100.0 * (1.0 - double(dictBytes) / plain.memoryBytes()) << "% saved)";
+        r.note = note.str();
+        results.push_back(r);
+    }
+
+    if (wanted("rangeIndex")) {
+        // One million users, ages 18..89; queries return the oldest ~3%
+        const size_t n = 1000000;
+        std::vector<User> users;
+        std::mt19937 rng(11);
+        for (size_t i = 0; i < n; ++i) users.push_back({ int(i + 1), "u" + std::to_string(i), 18 + int(rng() % 72) });
+        std::vector<int> minAges(1000);
+        for (auto& a : minAges) a = 88 + int(rng() % 2);
+
+        AgeRangeIndex index;
+        index.build(users);
+        for (int i = 0; i < 1000; ++i) index.upsert({ int(n + 1 + i), "new" + std::to_string(i), 18 + int(rng() % 72) });
+
+        std::map<std::pair<int, int>, User> tree;  // key (-age, id) gives the query order
+        for (const auto& u : users) tree.emplace(std::make_pair(-u.age, u.id), u);
+
+        size_t rows = index.usersByMinAge(minAges[0]).size();
+        volatile size_t sink = 0;
+        results.push_back(runBench("rangeIndex/std::map", rows, minAges.size() / 10, reps, [&](size_t i) {
+            int minAge = minAges[i % minAges.size()];
+            std::vector<User> out;
+            for (auto it = tree.begin(); it != tree.end() && -it->first.first >= minAge; ++it) out.push_back(it->second);
+            sink = out.size();
+        }));
+        results.push_back(runBench("rangeIndex/AgeRangeIndex", rows, minAges.size() / 10, reps, [&](size_t i) {
+            sink = index.usersByMinAge(minAges[i % minAges.size()]).size();
+        }));
+    }
+
+    if (wanted("snapshotTable")) {
+        // Point reads by id on 1..N threads while a writer keeps updating
+        const int n = 100000;
+        SnapshotUserTable rcu;
+        std::mutex mu;
+        std::unordered_map<int, User> locked;
+        for (int i = 1; i <= n; ++i) {
+            rcu.upsert({ i, "user" + std::to_string(i), 20 + i % 50 });
+            locked[i] = { i, "user" + std::to_string(i), 20 + i % 50 };
+        }
+        rcu.flush();
+
+        unsigned maxThreads = std::max(2u, std::thread::hardware_concurrency());
+        for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+            for (int variant = 0; variant < 2; ++variant) {
+                std::atomic<bool> stop{ false };
+                std::thread writer([&] {
+                    for (int i = 0; !stop.load(); ++i) {
+                        User u{ 1 + i % n, "user" + std::to_string(1 + i % n), 20 + i % 60 };
+                        if (variant == 0) rcu.upsert(u);
+                        else { std::lock_guard<std::mutex> lock(mu); locked[u.id] = u; }
+                    }
+                });
+                volatile int sink = 0;
+                std::string name = std::string("snapshotTable/") + (variant == 0 ? "rcu" : "mutex") + "/T=" + std::to_string(threads);
+                results.push_back(runThreadedBench(name, threads, 200000, reps, [&](unsigned t, size_t i) {
+                    int id = 1 + static_cast<int>((i * 7919 + t * 104729) % n);
+                    if (variant == 0) {
+                        auto snap = rcu.read();
+                        const User* u = snap->findById(id);
+                        sink = u ? u->age : 0;
+                    }
+                    else {
+                        std::lock_guard<std::mutex> lock(mu);
+                        sink = locked[id].age;
+                    }
+                }));
+                stop = true;
+                writer.join();
+            }
+        }
+    }
+
+    if (wanted("shardedCache")) {
+        // 95% get / 5% put over 10k hot keys, 1..N threads
+        const int keys = 10000;
+        ShardedCache<int, int> sharded(keys * 2);
+        std::mutex mu;
+        std::unordered_map<int, int> global;
+        for (int k = 0; k < keys; ++k) { sharded.put(k, k); global[k] = k; }
+
+        unsigned maxThreads = std::max(2u, std::thread::hardware_concurrency());
+        for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+            volatile int sink = 0;
+            results.push_back(runThreadedBench("shardedCache/global-lock/T=" + std::to_string(threads), threads, 500000, reps,
+                [&](unsigned t, size_t i) {
+                    int k = static_cast<int>((i * 2654435761u + t) % keys);
+                    std::lock_guard<std::mutex> lock(mu);
+                    if (i % 20 == 0) global[k] = int(i);
+                    else sink = global[k];
+                }));
+            results.push_back(runThreadedBench("shardedCache/sharded/T=" + std::to_string(threads), threads, 500000, reps,
+                [&](unsigned t, size_t i) {
+                    int k = static_cast<int>((i * 2654435761u + t) % keys), v;
+                    if (i % 20 == 0) sharded.put(k, int(i));
+                    else if (sharded.get(k, v)) sink = v;
+                }));
+        }
+    }
+
+    if (wanted("heavyHitters")) {
+        // Skewed names (key k drawn with weight ~1/k over 100k keys),
+        // 1..N threads recording, then one merged snapshot
+        std::vector<std::string> names = makeBenchNames(100000, 100000);
+        std::vector<uint32_t> draws(1 << 16);
+        std::mt19937 rng(11);
+        std::uniform_real_distribution<double> u(0.0, std::log(double(names.size())));
+        for (auto& d : draws) d = static_cast<uint32_t>(std::exp(u(rng))) - 1;
+
+        HeavyHitters& hh = HeavyHitters::instance();
+        unsigned maxThreads = std::max(2u, std::thread::hardware_concurrency());
+        for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+            results.push_back(runThreadedBench("heavyHitters/record/T=" + std::to_string(threads), threads, 500000, reps,
+                [&](unsigned t, size_t i) {
+                    hh.record("bench", names[draws[(i * 7 + t * 4099) & (draws.size() - 1)]]);
+                }));
+        }
+        volatile size_t sink = 0;
+        results.push_back(runBench("heavyHitters/snapshot", 1, 100, reps, [&](size_t) { sink = hh.snapshot(20).size(); }));
+
+        // How many of the true top 10 the sketch reports in its top 10
+        std::unordered_map<uint32_t, size_t> exact;
+        for (uint32_t d : draws) ++exact[d];
+        std::vector<std::pair<size_t, uint32_t>> truth;
+        for (auto& e : exact) truth.emplace_back(e.second, e.first);
+        std::sort(truth.rbegin(), truth.rend());
+        size_t found = 0;
+        std::vector<HeavyHitters::Item> top = hh.snapshot(10);
+        for (size_t i = 0; i < 10 && i < truth.size(); ++i)
+            for (const auto& it : top)
+                if (it.statement == "bench" && it.key == names[truth[i].second]) { ++found; break; }
+        results.back().note = "top-10 recall " + std::to_string(found) + "/10";
+    }
+
+    if (wanted("radixSort")) {
+        // 1M-row batch sorted by age (1..100), by random id, and by
+        // name length, against std::stable_sort of a row order
+        const size_t n = 1000000;
+        std::vector<std::string> names = makeBenchNames(n, n);
+        UserBatch batch;
+        std::mt19937 rng(17);
+        for (size_t i = 0; i < n; ++i) batch.append(static_cast<int>(rng() >> 1), names[i], static_cast<int>(rng() % 100) + 1);
+        std::vector<int> nameLengths(n);
+        for (size_t i = 0; i < n; ++i) nameLengths[i] = static_cast<int>(batch.name(i).size());
+
+        struct Key { const char* name; const std::vector<int>* keys; };
+        volatile uint32_t sink = 0;
+        for (Key key : { Key{ "age", &batch.ages }, Key{ "id", &batch.ids }, Key{ "nameLength", &nameLengths } }) {
+            const std::vector<int>& keys = *key.keys;
+            results.push_back(runBench(std::string("radixSort/") + key.name + "/std::stable_sort", n, 1, reps, [&](size_t) {
+                std::vector<uint32_t> order(n);
+                for (size_t i = 0; i < n; ++i) order[i] = static_cast<uint32_t>(i);
+                std::stable_sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) { return keys[a] < keys[b]; });
+                sink = order[n / 2];
+            }));
+            unsigned maxThreads = std::max(2u, std::thread::hardware_concurrency());
+            for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+                results.push_back(runBench(std::string("radixSort/") + key.name + "/T=" + std::to_string(threads), n, 1, reps,
+                    [&](size_t) { sink = radixSortOrder(keys, threads)[n / 2]; }));
+            }
+        }
+        unsigned maxThreads = std::max(2u, std::thread::hardware_concurrency());
+        std::vector<uint32_t> order = radixSortOrder(batch.ages, 1);
+        for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+            results.push_back(runBench("radixSort/permuteBatch/T=" + std::to_string(threads), n, 1, reps,
+                [&](size_t) { sink = permuteBatch(batch, order, threads).ids[n / 2]; }));
+        }
+    }
+
+    if (wanted("groupBy")) {
+        // COUNT/SUM/MIN/MAX(age) over 1M rows grouped by age bucket
+        // (10 groups) and by id % 100000 (100k groups), against std::map
+        const size_t n = 1000000;
+        std::mt19937 rng(19);
+        std::vector<int> ages(n), buckets(n), ids(n);
+        for (size_t i = 0; i < n; ++i) {
+            ages[i] = static_cast<int>(rng() % 100) + 1;
+            buckets[i] = ages[i] / 10;
+            ids[i] = static_cast<int>(rng() % 100000);
+        }
+        struct Key { const char* name; const std::vector<int>* keys; };
+        volatile size_t sink = 0;
+        for (Key key : { Key{ "ageBucket", &buckets }, Key{ "id", &ids } }) {
+            const std::vector<int>& keys = *key.keys;
+            results.push_back(runBench(std::string("groupBy/") + key.name + "/std::map", n, 1, reps, [&](size_t) {
+                std::map<int, GroupAggregate> groups;
+                for (size_t i = 0; i < n; ++i) groups[keys[i]].add(ages[i]);
+                sink = groups.size();
+            }));
+            unsigned maxThreads = std::max(2u, std::thread::hardware_concurrency());
+            for (unsigned threads = 1; threads <= maxThreads; threads *= 2) {
+                results.push_back(runBench(std::string("groupBy/") + key.name + "/T=" + std::to_string(threads), n, 1, reps,
+                    [&](size_t) { sink = groupByAggregate(keys, ages, threads).size(); }));
+            }
+        }
+    }
+
+    if (wanted("pipeline")) {
+        // 100 batches of 4096 rows from a source that waits 2 ms per
+        // batch (the network), each needing ~2 ms of CPU: done inline,
+        // fetch and work take turns; in the pipeline they overlap
+        struct SlowSource : UserBatchReader {
+            size_t left = 100;
+            bool next(UserBatch& batch, size_t maxRows) override {
+                batch.clear();
+                if (left == 0) return false;
+                --left;
+                std::this_thread::sleep_for(std::chrono::milliseconds(2));
+                for (size_t i = 0; i < maxRows; ++i) batch.append(int(i), "pipeline-user", int(i % 100));
+                return true;
+            }
+        };
+        auto work = [](const UserBatch& b) {
+            auto until = std::chrono::steady_clock::now() + std::chrono::milliseconds(2);
+            uint64_t h = b.size();
+            while (std::chrono::steady_clock::now() < until) h = h * 6364136223846793005ull + 1;
+            return h;
+        };
+        volatile uint64_t sink = 0;
+        const size_t rows = 100 * 4096;
+        results.push_back(runBench("pipeline/inline", rows, 1, reps, [&](size_t) {
+            SlowSource source;
+            UserBatch batch;
+            while (source.next(batch, 4096)) sink = sink + work(batch);
+        }));
+        for (bool ordered : { true, false }) {
+            for (unsigned workers : { 1u, 2u, 4u }) {
+                PipelineOptions opts;
+                opts.workers = workers;
+                opts.ordered = ordered;
+                results.push_back(runBench(std::string("pipeline/") + (ordered ? "ordered" : "unordered") + "/W=" + std::to_string(workers),
+                    rows, 1, reps, [&](size_t) {
+                        SlowSource source;
+                        runBatchPipeline(source, work, [&](uint64_t h) { sink = sink + h; }, opts);
+                    }));
+            }
+        }
+    }
+
+    if (wanted("pool")) {
+        // Borrow + return around a short call, 8 connections (no server:
+        // the pool hands out empty connections), 1..64 threads: a
+        // mutex-protected free list, the per-core lock-free lists, and
+        // sticky leases on top. Every 16th borrow + return is timed.
+        for (unsigned threads = 1; threads <= 64; threads *= 2) {
+            const size_t ops = 200000 / threads;
+            const char* modes[] = { "global-mutex", "percore", "sticky" };
+            for (int mode = 0; mode < 3; ++mode) {
+                ConnectionPoolOptions opts;
+                opts.size = 8;
+                ConnectionPool pool([] { return std::unique_ptr<sql::Connection>(); }, opts);
+                std::mutex mu;
+                std::vector<int> freeList{ 0, 1, 2, 3, 4, 5, 6, 7 };
+                std::vector<std::vector<uint32_t>> samples(threads);
+                for (auto& v : samples) v.reserve(ops / 16 * (reps + 1) + 1);
+                volatile size_t sink = 0;
+                results.push_back(runThreadedBench(std::string("pool/") + modes[mode] + "/T=" + std::to_string(threads), threads, ops, reps,
+                    [&](unsigned t, size_t i) {
+                        auto t0 = (i & 15) == 0 ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point();
+                        if (mode == 0) {
+                            int c;
+                            {
+                                std::lock_guard<std::mutex> lock(mu);
+                                c = freeList.back();
+                                freeList.pop_back();
+                            }
+                            sink = c;
+                            std::lock_guard<std::mutex> lock(mu);
+                            freeList.push_back(c);
+                        }
+                        else {
+                            ConnectionPool::Lease lease = mode == 2 ? pool.borrowSticky() : pool.borrow();
+                            sink = lease->cachedStatements();
+                        }
+                        if ((i & 15) == 0)
+                            samples[t].push_back(static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - t0).count()));
+                    }));
+                std::vector<uint32_t> all;
+                for (auto& v : samples) all.insert(all.end(), v.begin(), v.end());
+                std::sort(all.begin(), all.end());
+                if (!all.empty())
+                    results.back().note += ", borrow+return p50 " + std::to_string(all[all.size() / 2]) + " ns, p99 "
+                        + std::to_string(all[all.size() * 99 / 100]) + " ns";
+            }
+        }
+    }
+
+    if (wanted("autocomplete")) {
+        // Top-10 completions of random 3-byte prefixes over 1M names
+        std::vector<std::string> names = makeBenchNames(1000000, 1000000);
+        NameAutocomplete ac;
+        ac.build(names);
+        for (int i = 0; i < 1000; ++i) ac.add("zed." + std::to_string(i));
+        std::vector<std::string> prefixes;
+        std::mt19937 rng(5);
+        for (int i = 0; i < 1000; ++i) prefixes.push_back(names[rng() % names.size()].substr(0, 3));
+
+        volatile size_t sink = 0;
+        results.push_back(runBench("autocomplete/local", 1, prefixes.size(), reps, [&](size_t i) {
+            sink = ac.complete(prefixes[i % prefixes.size()], 10).size();
+        }));
+    }
+
+    if (wanted("refreshAhead")) {
+        // Simulated 5 ms query, 100 ms TTL, 10 hot minAge values loaded
+        // together (so they also expire together), 4 callers
+        auto slowQuery = [](sql::Connection*, int minAge) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+            return std::vector<User>(10, User{ 1, "x", minAge });
+        };
+        for (double refreshAt : { 1.0, 0.75 }) {
+            RefreshAheadOptions opts;
+            opts.ttl = std::chrono::milliseconds(100);
+            opts.refreshAt = refreshAt;
+            opts.refreshesPerSecond = 500;
+            RefreshAheadUserCache cache([] { return std::unique_ptr<sql::Connection>(); }, opts, slowQuery);
+            LatencyHistogram& latency = Metrics::instance().histogram("cache.min_age.latency");
+            auto& refreshed = Metrics::instance().counter("cache.min_age.refresh.completed");
+            auto& misses = Metrics::instance().counter("cache.min_age.misses");
+            for (int k = 0; k < 10; ++k) cache.usersByMinAge(nullptr, k);
+            latency.reset();
+            uint64_t refreshed0 = refreshed, misses0 = misses;
+
+            auto t0 = std::chrono::steady_clock::now();
+            BenchResult r = runThreadedBench(refreshAt < 1 ? "refreshAhead/on" : "refreshAhead/off", 4, 2000, 1,
+                [&](unsigned t, size_t i) {
+                    cache.usersByMinAge(nullptr, static_cast<int>((i + t) % 10));
+                    std::this_thread::sleep_for(std::chrono::microseconds(200));
+                });
+            double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            std::ostringstream note;
+            note << "latency p50 " << latency.percentileUs(0.5) << " us, p99 " << latency.percentileUs(0.99)
+                 << " us, p99.9 " << latency.percentileUs(0.999) << " us; misses " << (misses - misses0)
+                 << ", refreshes " << std::fixed << std::setprecision(1) << (refreshed - refreshed0) / secs << "/s";
+            r.note = note.str();
+            results.push_back(r);
+        }
+    }
+
+    if (wanted("frontCoding")) {
+        // One million distinct sorted names; random point lookups
+        std::vector<std::string> names = makeBenchNames(1000000, 1000000);
+        std::sort(names.begin(), names.end());
+        names.erase(std::unique(names.begin(), names.end()), names.end());
+        FrontCodedNames coded(names);
+        const size_t n = names.size(), lookups = 100000;
+        std::vector<size_t> probe(lookups);
+        std::mt19937 rng(7);
+        for (auto& p : probe) p = rng() % n;
+
+        volatile size_t sink = 0;
+        size_t stringBytes = names.capacity() * sizeof(std::string);
+        for (const auto& s : names) if (s.capacity() > 15) stringBytes += s.capacity() + 1;
+        BenchResult r = runBench("frontCoding/vector<string>/find", lookups, 1, reps, [&](size_t) {
+            size_t hits = 0;
+            for (size_t p : probe) hits += std::binary_search(names.begin(), names.end(), names[p]);
+            sink = hits;
+        });
+        r.note = "memory " + std::to_string(stringBytes / n) + " bytes/name";
+        results.push_back(r);
+
+        r = runBench("frontCoding/coded/find", lookups, 1, reps, [&](size_t) {
+            size_t hits = 0;
+            for (size_t p : probe) hits += coded.find(names[p]) != FrontCodedNames::npos;
+            sink = hits;
+        });
+        std::ostringstream note;
+        note << "memory " << std::fixed << std::setprecision(1) << double(coded.memoryBytes()) / n
+             << " bytes/name, compression " << double(coded.rawBytes()) / coded.memoryBytes()
+             << "x vs raw name bytes";
+        r.note = note.str();
+        results.push_back(r);
+
+        results.push_back(runBench("frontCoding/coded/get", lookups, 1, reps, [&](size_t) {
+            size_t len = 0;
+            for (size_t p : probe) len += coded.get(p).size();
+            sink = len;
+        }));
+    }
+    results.erase(std::remove_if(results.begin(), results.end(), [](const BenchResult& r) { return r.nsPerOp.empty(); }), results.end());
+    return results;
+}
+
+// ---------------------------------------------------------
+// Function: benchImport
+// Loads the same CSV file twice into an empty users table and prints
+// the rows/second of each path:
+//   row-by-row : parse into vector<User>, then insertUsersBulk
+//   batched    : importUsers (columnar batches, parallel loaders)
+// Given `samePath` (the same rows as Parquet or Arrow IPC), it is
+// loaded a third time through importUsers for a format comparison.
+// ---------------------------------------------------------
+void benchImport(sql::Driver* driver, const DbConfig& cfg, sql::Connection* con, const std::string& path,
+    const std::string& samePath = "") {
+    std::unique_ptr<sql::Statement> s(con->createStatement());
+
+    s->execute("DELETE FROM users");
+    auto t0 = std::chrono::steady_clock::now();
+    {
+        std::vector<User> users;
+        CsvUserBatchReader reader(path);
+        UserBatch batch;
+        while (reader.next(batch, 5000))
+            for (size_t i = 0; i < batch.size(); ++i)
+                users.push_back({ 0, std::string(batch.name(i)), batch.ages[i] });
+        con->setAutoCommit(false);
+        insertUsersBulk(con, users);
+        con->commit();
+        con->setAutoCommit(true);
+    }
+    double rowByRow = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    s->execute("DELETE FROM users");
+    CsvUserBatchReader reader(path);
+    ImportStats stats = importUsers(driver, cfg, reader);
+
+    std::cout << "import " << stats.rows << " rows\n"
+        << "  row-by-row : " << std::fixed << std::setprecision(3) << rowByRow << " s ("
+        << static_cast<long>(stats.rows / rowByRow) << " rows/s)\n"
+        << "  batched    : " << stats.seconds << " s ("
+        << static_cast<long>(stats.rows / stats.seconds) << " rows/s)\n";
+
+    if (samePath.empty()) return;
+    s->execute("DELETE FROM users");
+    auto same = openUserBatchReader(samePath);
+    ImportStats other = importUsers(driver, cfg, *same);
+    std::cout << "  batched, " << samePath << " : " << other.rows << " rows in " << other.seconds << " s ("
+        << static_cast<long>(other.rows / other.seconds) << " rows/s)\n";
+}
+
+// ---------------------------------------------------------
+// Function: measureRecovery
+// Runs pooled getUsersByMinAge reads on `threads` threads for
+// `duration` and reports what a server restart during that time
+// looked like from here: how long reads failed, read latency before
+// the outage and in the first second after it, how fast the failed
+// reads failed (the circuit breaker's job), and the pool's reconnect
+// and recovery histograms. Restart mysqld while it runs; stopping it
+// for longer than the breaker's openFor shows the breaker opening.
+// ---------------------------------------------------------
+void measureRecovery(sql::Driver* driver, const DbConfig& cfg, std::chrono::seconds duration, std::ostream& out,
+    unsigned threads = 8) {
+    using Clock = std::chrono::steady_clock;
+    ConnectionPoolOptions opts;
+    opts.size = threads;
+    ConnectionPool pool([&] {
+        std::unique_ptr<sql::Connection> con = connectDb(driver, cfg);
+        con->setSchema(cfg.schema);
+        return con;
+    }, opts);
+
+    std::mutex mu;
+    Clock::time_point firstError, lastError;  // guarded by mu
+    std::atomic<uint64_t> ok{ 0 }, failed{ 0 };
+    LatencyHistogram before, after, failing;
+    auto end = Clock::now() + duration;
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&] {
+            while (Clock::now() < end) {
+                auto t0 = Clock::now();
+                try {
+                    ConnectionPool::Lease con = pool.borrowSticky();
+                    getUsersByMinAge(*con, 50);
+                    ++ok;
+                    std::lock_guard<std::mutex> lock(mu);
+                    if (firstError == Clock::time_point()) before.record(Clock::now() - t0);
+                    else if (t0 > lastError && t0 - lastError < std::chrono::seconds(1)) after.record(Clock::now() - t0);
+                }
+                catch (const sql::SQLException&) {
+                    ++failed;
+                    failing.record(Clock::now() - t0);
+                    {
+                        std::lock_guard<std::mutex> lock(mu);
+                        if (firstError == Clock::time_point()) firstError = Clock::now();
+                        lastError = Clock::now();
+                    }
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));  // don't spin while it is down
+                }
+            }
+        });
+    }
+    for (auto& w : workers) w.join();
+
+    Metrics& m = Metrics::instance();
+    out << "reads: " << ok << " ok, " << failed << " failed\n";
+    if (failed == 0) {
+        out << "no failed reads (restart mysqld while this runs)\n";
+        return;
+    }
+    out << "reads failed for " << std::chrono::duration_cast<std::chrono::milliseconds>(lastError - firstError).count() << " ms\n"
+        << "read p50/p99 before: " << before.percentileUs(0.5) << "/" << before.percentileUs(0.99) << " us, "
+        << "first second after: " << after.percentileUs(0.5) << "/" << after.percentileUs(0.99) << " us\n"
+        << "reconnect p50/p99: " << m.histogram("pool.reconnect").percentileUs(0.5) << "/"
+        << m.histogram("pool.reconnect").percentileUs(0.99) << " us, "
+        << "idle connections back after: " << m.histogram("pool.recovery").percentileUs(0.99) << " us, "
+        << "statements re-prepared: " << m.counter("pool.reprepared").load() << "\n";
+    std::string endpoint = Metrics::labelValue(CircuitBreaker::endpointOf(cfg));
+    out << "failed read p50/p99: " << failing.percentileUs(0.5) << "/" << failing.percentileUs(0.99) << " us, "
+        << "breaker opened " << m.counter("breaker.opened{endpoint=\"" + endpoint + "\"}").load() << " times, "
+        << "refused " << m.counter("breaker.rejected{endpoint=\"" + endpoint + "\"}").load() << " connects\n";
+}
+
+// ---------------------------------------------------------
+// Function: measureTuning
+// Live check of OnlineTuner on a pool: `threads` threads run pooled
+// getUsersByMinAge reads for `duration` while a tuner moves the
+// pool's limit between 2 and `threads` (p99 target 50 ms). Prints the
+// limit and score every second and saves what it learned like
+// --import does.
+// ---------------------------------------------------------
+void measureTuning(sql::Driver* driver, const DbConfig& cfg, std::chrono::seconds duration, std::ostream& out,
+    unsigned threads = 64) {
+    using Clock = std::chrono::steady_clock;
+    ConnectionPoolOptions opts;
+    opts.size = threads;
+    ConnectionPool pool([&] {
+        std::unique_ptr<sql::Connection> con = connectDb(driver, cfg);
+        con->setSchema(cfg.schema);
+        return con;
+    }, opts);
+    OnlineTunerOptions tuning;
+    tuning.window = std::chrono::milliseconds(1000);
+    tuning.p99Target = std::chrono::milliseconds(50);
+    tuning.stateFile = defaultTuningFile();
+    tuning.endpoint = CircuitBreaker::endpointOf(cfg);
+    OnlineTuner tuner("pool.size", 4, 2, threads, tuning, [&](size_t n) { pool.setLimit(n); });
+
+    std::atomic<uint64_t> reads{ 0 }, failed{ 0 };
+    std::atomic<bool> done{ false };
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; ++t) {
+        workers.emplace_back([&] {
+            while (!done.load()) {
+                auto t0 = Clock::now();
+                try {
+                    ConnectionPool::Lease con = pool.borrow();
+                    getUsersByMinAge(*con, 50);
+                    ++reads;
+                }
+                catch (const sql::SQLException&) {
+                    ++failed;
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+                tuner.record(Clock::now() - t0);
+            }
+        });
+    }
+    for (auto s = std::chrono::seconds(1); s <= duration; ++s) {
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+        out << s.count() << "s: limit " << pool.limit() << ", score " << tuner.score() << " reads/s\n";
+    }
+    done = true;
+    for (auto& w : workers) w.join();
+    out << reads.load() << " reads, " << failed.load() << " failed; learned pool.size = " << tuner.value()
+        << (tuning.stateFile.empty() ? "" : " (saved to " + tuning.stateFile + ")") << "\n";
+}
+
+// ---------------------------------------------------------
+// Function: checkOnlineTuner
+// Runs OnlineTuner against two simulated servers, no server or
+// driver needed, and checks it settles near the best setting:
+//   rows per INSERT: a statement costs 300 us + 1 us per row, plus
+//     5 us per row above 1000 (bigger packets, longer locks), so
+//     throughput peaks at 1000 rows;
+//   pool size: 32 threads share a pool whose limit the tuner sets;
+//     a request takes 1 ms while at most 8 run at once and
+//     (in use / 8)^2 ms beyond that, so throughput peaks at 8.
+// Both start far from the optimum. Returns true when both end up
+// within a factor of two of it.
+// ---------------------------------------------------------
+bool checkOnlineTuner(std::ostream& out) {
+    using namespace std::chrono;
+    using Clock = steady_clock;
+    OnlineTunerOptions opts;
+    opts.window = milliseconds(40);
+    opts.minSamples = 5;
+    bool ok = true;
+
+    {
+        OnlineTuner rows("check.rows_per_statement", 100, 10, 10000, opts);
+        auto end = Clock::now() + seconds(3);
+        while (Clock::now() < end) {
+            size_t n = rows.value();
+            auto cost = microseconds(300 + n + (n > 1000 ? 5 * (n - 1000) : 0));
+            auto t0 = Clock::now();
+            std::this_thread::sleep_for(cost);
+            rows.record(Clock::now() - t0, n);
+        }
+        bool near = rows.value() >= 500 && rows.value() <= 2000;
+        out << (near ? "ok     " : "FAILED ") << "rows per INSERT: 100 -> " << rows.value() << " (best 1000)\n";
+        ok = ok && near;
+    }
+
+    {
+        std::mutex mu;
+        std::condition_variable freed;
+        size_t limit = 0, inUse = 0;
+        OnlineTuner pool("check.pool_size", 2, 1, 32, opts, [&](size_t n) {
+            std::lock_guard<std::mutex> lock(mu);
+            limit = n;
+            freed.notify_all();
+        });
+        auto end = Clock::now() + seconds(3);
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 32; ++t) {
+            threads.emplace_back([&] {
+                while (Clock::now() < end) {
+                    auto t0 = Clock::now();
+                    size_t running;
+                    {
+                        std::unique_lock<std::mutex> lock(mu);
+                        freed.wait(lock, [&] { return inUse < limit; });
+                        running = ++inUse;
+                    }
+                    double ms = running <= 8 ? 1.0 : (running / 8.0) * (running / 8.0);
+                    std::this_thread::sleep_for(duration<double, std::milli>(ms));
+                    {
+                        std::lock_guard<std::mutex> lock(mu);
+                        --inUse;
+                        freed.notify_one();
+                    }
+                    pool.record(Clock::now() - t0);
+                }
+            });
+        }
+        for (auto& t : threads) t.join();
+        bool near = pool.value() >= 4 && pool.value() <= 16;
+        out << (near ? "ok     " : "FAILED ") << "pool size: 2 -> " << pool.value() << " (best 8)\n";
+        ok = ok && near;
+    }
+    return ok;
+}
+
+// ---------------------------------------------------------
+// Function: checkCircuitBreaker
+// Walks a CircuitBreaker through a simulated outage, no server
+// needed: the endpoint is "down" (every call fails with error 2003
+// after 20 ms) and later "up" again. Checks that
+//   - failureThreshold failures open it and later calls fail at once,
+//   - after openFor, concurrent callers send exactly one probe,
+//   - a failed probe reopens it and a good one closes it,
+//   - a server-side error (1062) does not count as a failure,
+//   - abandoning an ordinary call does not free the probe slot,
+//   - a call let through before the circuit opened neither closes
+//     nor reopens it when it finishes, and leaves the probe alone.
+// Returns true when all hold; prints each step to `out`.
+// ---------------------------------------------------------
+bool checkCircuitBreaker(std::ostream& out) {
+    using namespace std::chrono;
+    using Permit = CircuitBreaker::Permit;
+    using State = CircuitBreaker::State;
+    CircuitBreakerOptions opts;
+    opts.failureThreshold = 3;
+    opts.openFor = milliseconds(200);
+    CircuitBreaker breaker("check", opts);
+    std::atomic<bool> up{ false };
+    std::atomic<int> reached{ 0 };
+    int errorCode = 2003;  // CR_CONN_HOST_ERROR while down
+    auto call = [&] {
+        return tryCall(breaker, [&] {
+            ++reached;
+            std::this_thread::sleep_for(milliseconds(20));
+            if (!up) throw sql::SQLException("Can't connect to MySQL server", "HY000", errorCode);
+            return 1;
+        });
+    };
+    bool ok = true;
+    auto expect = [&](bool cond, const char* what) {
+        out << (cond ? "ok     " : "FAILED ") << what << "\n";
+        ok = ok && cond;
+    };
+
+    auto t0 = steady_clock::now();
+    for (int i = 0; i < 10; ++i) call();
+    auto elapsed = steady_clock::now() - t0;
+    expect(reached == opts.failureThreshold && breaker.state() == State::Open, "down: opens after failureThreshold errors");
+    expect(elapsed < milliseconds(20) * (opts.failureThreshold + 2), "down: the other calls fail without waiting");
+    expect(call().error().circuitOpen(), "open: calls return kCircuitOpen");
+
+    std::this_thread::sleep_for(opts.openFor + milliseconds(50));
+    reached = 0;
+    std::vector<std::thread> callers;
+    for (int t = 0; t < 8; ++t) callers.emplace_back([&] { call(); });
+    for (auto& c : callers) c.join();
+    expect(reached == 1 && breaker.state() == State::Open, "half open: one probe among 8 callers, failed probe reopens");
+
+    up = true;
+    std::this_thread::sleep_for(opts.openFor + milliseconds(50));
+    expect(call().ok() && breaker.state() == State::Closed, "up: a good probe closes it");
+
+    errorCode = 1062;  // ER_DUP_ENTRY: the server answered
+    up = false;
+    for (int i = 0; i < opts.failureThreshold + 2; ++i) call();
+    expect(breaker.state() == State::Closed, "server-side errors do not open it");
+
+    errorCode = 2003;
+    Permit inFlight = breaker.allow();  // an ordinary call, still running when the circuit opens
+    for (int i = 0; i < opts.failureThreshold; ++i) call();
+    std::this_thread::sleep_for(opts.openFor + milliseconds(50));
+    Permit probe = breaker.allow();
+    breaker.abandon(inFlight);
+    expect(inFlight == Permit::Call && probe == Permit::Probe && breaker.allow() == Permit::Refused,
+        "abandoning an ordinary call keeps the probe slot");
+    breaker.abandon(probe);
+    expect(breaker.allow() == Permit::Probe, "abandoning the probe frees it");
+
+    // The probe from the last allow() is still in flight
+    Permit stale = Permit::Call;
+    breaker.onSuccess(stale);
+    breaker.onSuccess(stale);  // e.g. a 1062 from a call that started while closed
+    expect(breaker.state() == State::HalfOpen && breaker.allow() == Permit::Refused,
+        "a stale call that succeeds neither closes it nor frees the probe");
+    for (int i = 0; i < opts.failureThreshold; ++i) breaker.onFailure(stale);
+    expect(breaker.state() == State::HalfOpen && breaker.allow() == Permit::Refused,
+        "stale calls that fail do not reopen it");
+    breaker.onSuccess(Permit::Probe);
+    expect(breaker.state() == State::Closed && breaker.allow() == Permit::Call, "only the probe closes it");
+    return ok;
+}
+
+// ---------------------------------------------------------
+// Function: checkReadRouter
+// Routes reads over a primary and two replicas whose lag and applied
+// GTIDs are faked, no server needed (the pools hold no connections).
+// Checks that
+//   - reads spread over the replicas while both are within maxLag,
+//   - a replica above maxLag gets none until a later poll finds it
+//     caught up, then gets reads again,
+//   - a replica whose lag is unknown (-1, or the lag query failed)
+//     gets none, and with no healthy replica reads go to the primary,
+//   - a token a replica has not applied sends that read elsewhere,
+//     to the primary when no replica has it,
+//   - heartbeatTable only takes table names.
+// Returns true when all hold; prints each step to `out`.
+// ---------------------------------------------------------
+bool checkReadRouter(std::ostream& out) {
+    using namespace std::chrono;
+    auto none = [] { return std::unique_ptr<sql::Connection>(); };
+    ConnectionPool primary(none), replica0(none), replica1(none);
+    std::vector<ConnectionPool*> replicas{ &replica0, &replica1 };
+    std::atomic<int64_t> lag[2] = { { 10 }, { 10 } };      // -2: the lag query fails
+    std::atomic<int64_t> applied[2] = { { 0 }, { 0 } };    // tokens are transaction counts
+    ReadRouterOptions opts;
+    opts.maxLag = milliseconds(100);
+    opts.pollInterval = milliseconds(10);
+    ReadRouter router(primary, replicas, opts,
+        [&](size_t i, PooledConnection&) -> int64_t {
+            if (lag[i] == -2) throw sql::SQLException("Lost connection to MySQL server during query", "HY000", 2013);
+            return lag[i];
+        },
+        [&](size_t i, PooledConnection&, const std::string& token) { return applied[i] >= std::stoll(token); });
+
+    bool ok = true;
+    auto expect = [&](bool cond, const std::string& what) {
+        out << (cond ? "ok     " : "FAILED ") << what << "\n";
+        ok = ok && cond;
+    };
+    // Reads per destination (replica 0, replica 1, primary) out of 20
+    auto route = [&](const std::string& token = "") {
+        std::array<int, 3> n{};
+        for (int k = 0; k < 20; ++k) {
+            ConnectionPool::Lease con = router.read(token);
+            ++n[con.pool() == &replica0 ? 0 : con.pool() == &replica1 ? 1 : 2];
+        }
+        return n;
+    };
+    auto show = [](const std::array<int, 3>& n) {
+        return " (" + std::to_string(n[0]) + "/" + std::to_string(n[1]) + "/" + std::to_string(n[2]) + ")";
+    };
+    auto settle = [&] { std::this_thread::sleep_for(opts.pollInterval * 5); };
+
+    auto n = route();
+    expect(n[0] == 10 && n[1] == 10 && n[2] == 0, "both within maxLag: reads alternate" + show(n));
+
+    lag[1] = 500;
+    settle();
+    n = route();
+    expect(router.lagMs(1) == 500 && n[0] == 20, "replica 1 above maxLag: excluded" + show(n));
+
+    lag[1] = 20;
+    settle();
+    n = route();
+    expect(n[0] == 10 && n[1] == 10, "replica 1 caught up: readmitted" + show(n));
+
+    lag[0] = -1;
+    settle();
+    n = route();
+    expect(router.lagMs(0) == -1 && n[1] == 20, "replica 0 lag unknown: excluded" + show(n));
+
+    lag[1] = -2;
+    settle();
+    n = route();
+    expect(router.lagMs(1) == -1 && n[2] == 20, "lag query fails too: reads go to the primary" + show(n));
+
+    lag[0] = 10;
+    lag[1] = 10;
+    applied[0] = 5;
+    applied[1] = 8;
+    settle();
+    n = route("8");
+    expect(n[1] == 20, "token applied on replica 1 only: read there" + show(n));
+    n = route("9");
+    expect(n[2] == 20, "token applied nowhere yet: read on the primary" + show(n));
+    applied[0] = 9;
+    n = route("9");
+    expect(n[0] == 20, "token applied on replica 0: read there" + show(n));
+
+    for (const char* bad : { "t; DROP TABLE users", "a.b.c", ".t", "t`" }) {
+        ReadRouterOptions o;
+        o.heartbeatTable = bad;
+        bool rejected = false;
+        try {
+            ReadRouter r(primary, {}, o);
+        }
+        catch (const std::invalid_argument&) {
+            rejected = true;
+        }
+        expect(rejected, std::string("heartbeatTable \"") + bad + "\" rejected");
+    }
+    return ok;
+}
+
+// ---------------------------------------------------------
+// Class: FakeMySqlServer
+// Just enough of mysqld for checkMySqlProxy, on a Unix socket. Every
+// login succeeds (every other one after an auth switch). Each
+// connection keeps its own transaction flag, last insert id,
+// isolation level, user variable @x and prepared statements, so a
+// client can tell which connection answered it. It knows BEGIN,
+// COMMIT, ROLLBACK, INSERT (a new id each time), SET SESSION
+// TRANSACTION ISOLATION LEVEL, SET SESSION transaction_isolation =
+// DEFAULT, SET @x = v, and SELECT CONNECTION_ID(), LAST_INSERT_ID(),
+// DATABASE(), @@transaction_isolation or @x; anything else gets OK.
+// An execute that leaves out parameter types the statement was never
+// given fails, as on mysqld. Counts connections: all of them, and the
+// most open at once.
+// ---------------------------------------------------------
+class FakeMySqlServer {
+public:
+    explicit FakeMySqlServer(std::string path) : path_(std::move(path)) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        if (path_.size() >= sizeof(addr.sun_path)) throw std::invalid_argument("FakeMySqlServer: path too long");
+        std::memcpy(addr.sun_path, path_.c_str(), path_.size() + 1);
+        listen_ = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (listen_ < 0 || ::bind(listen_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || ::listen(listen_, SOMAXCONN) != 0) {
+            std::string err = std::strerror(errno);
+            if (listen_ >= 0) ::close(listen_);
+            throw std::runtime_error("FakeMySqlServer: cannot listen on " + path_ + ": " + err);
+        }
+        acceptor_ = std::thread([this] { acceptLoop(); });
+    }
+
+    ~FakeMySqlServer() {
+        stopping_ = true;
+        acceptor_.join();
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            for (int fd : fds_)
+                if (fd >= 0) ::shutdown(fd, SHUT_RDWR);
+        }
+        for (auto& t : threads_) t.join();
+        ::close(listen_);
+        ::unlink(path_.c_str());
+    }
+
+    int connections() const { return total_.load(); }
+    int maxOpen() const { return maxOpen_.load(); }
+
+private:
+    static constexpr uint32_t kCaps = 0x1 /* long password */ | 0x8 /* with db */ | 0x80 /* local files */
+        | 0x200 /* 4.1 */ | 0x800 /* SSL */ | 0x2000 /* transactions */ | 0x8000 /* secure connection */
+        | 0x20000 /* multi results */ | 0x40000 /* ps multi results */ | 0x80000 /* plugin auth */
+        | 0x200000 /* lenenc auth data */ | 0x1000000 /* deprecate EOF */;
+    static constexpr uint16_t kInTrans = 0x1, kAutocommit = 0x2;
+
+    struct Statement {
+        std::string sql;
+        size_t      params = 0;
+        bool        typesBound = false;
+    };
+
+    struct Connection {
+        uint32_t    id = 0;
+        bool        deprecateEof = false;
+        uint16_t    status = kAutocommit;
+        uint64_t    lastInsertId = 0;
+        std::string db, isolation = "REPEATABLE-READ", x = "NULL", names = "utf8";  // as the clients log in
+        std::map<uint32_t, Statement> statements;
+        uint32_t    nextStatement = 1;
+    };
+
+    void acceptLoop() {
+        while (!stopping_) {
+            pollfd fd{ listen_, POLLIN, 0 };
+            if (::poll(&fd, 1, 20) <= 0) continue;
+            int client = ::accept4(listen_, nullptr, nullptr, SOCK_CLOEXEC);
+            if (client < 0) continue;
+            std::lock_guard<std::mutex> lock(mu_);
+            size_t slot = fds_.size();
+            fds_.push_back(client);
+            uint32_t id = static_cast<uint32_t>(++total_);
+            threads_.emplace_back([this, client, slot, id] { serve(client, slot, id); });
+        }
+    }
+
+    void serve(int fd, size_t slot, uint32_t id) {
+        int now = ++open_;
+        for (int seen = maxOpen_.load(); now > seen && !maxOpen_.compare_exchange_weak(seen, now);) {}
+        MySqlWire wire(fd);
+        Connection c;
+        c.id = id;
+        try {
+            if (logIn(wire, c)) commands(wire, c);
+        }
+        catch (const std::exception&) {
+        }
+        --open_;  // before the peer can see the close
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            fds_[slot] = -1;
+        }
+        wire.close();
+    }
+
+    static bool logIn(MySqlWire& wire, Connection& c) {
+        std::string g(1, '\x0a');
+        g += "8.0.99-fake";
+        g += '\0';
+        MySqlWire::putFixed(g, c.id, 4);
+        g.append(8, 'a');
+        g += '\0';
+        MySqlWire::putFixed(g, kCaps & 0xFFFF, 2);
+        g += '\x21';
+        MySqlWire::putFixed(g, kAutocommit, 2);
+        MySqlWire::putFixed(g, kCaps >> 16, 2);
+        g += char(21);
+        g.append(10, '\0');
+        g.append(12, 'b');
+        g += '\0';
+        g += "mysql_native_password";
+        g += '\0';
+        uint8_t seq = 0;
+        wire.write(g, seq);
+        wire.flush();
+        std::string response = wire.read(seq);
+        uint64_t caps = MySqlWire::fixed(response, 0, 4);
+        c.deprecateEof = (caps & kCaps & 0x1000000) != 0;
+        if (caps & 0x8) {  // CLIENT_CONNECT_WITH_DB: after the user and the auth response
+            size_t at = response.find('\0', 32) + 1;
+            at += 1 + static_cast<uint8_t>(response[at]);
+            c.db = response.substr(at, response.find('\0', at) - at);
+        }
+        uint8_t next = seq + 1;
+        if (c.id % 2 == 0) {
+            std::string change(1, '\xFE');
+            change += "mysql_native_password";
+            change += '\0';
+            change.append(20, 'c');
+            change += '\0';
+            wire.write(change, next);
+            wire.flush();
+            wire.read(seq);
+            next = seq + 1;
+        }
+        wire.write(MySqlWire::okPacket(c.status), next);
+        wire.flush();
+        return true;
+    }
+
+    void commands(MySqlWire& wire, Connection& c) {
+        std::string cmd;
+        uint8_t seq = 0;
+        while (wire.tryRead(cmd, seq)) {
+            uint8_t next = seq + 1;
+            switch (cmd.empty() ? 0 : static_cast<uint8_t>(cmd[0])) {
+            case 0x01:  // COM_QUIT
+                return;
+            case 0x02:  // COM_INIT_DB
+                c.db = cmd.substr(1);
+                wire.write(MySqlWire::okPacket(c.status), next);
+                break;
+            case 0x03:  // COM_QUERY
+                answer(wire, c, cmd.substr(1), next, false);
+                break;
+            case 0x16:  // COM_STMT_PREPARE
+                prepare(wire, c, cmd.substr(1), next);
+                break;
+            case 0x17: {  // COM_STMT_EXECUTE
+                auto it = c.statements.find(static_cast<uint32_t>(MySqlWire::fixed(cmd, 1, 4)));
+                if (it == c.statements.end()) {
+                    wire.write(MySqlWire::errPacket(1243, "HY000", "Unknown prepared statement handler"), next);
+                    break;
+                }
+                Statement& st = it->second;
+                size_t flag = 10 + (st.params + 7) / 8;
+                if (st.params > 0 && cmd.size() > flag && cmd[flag] == 1) st.typesBound = true;
+                if (st.params > 0 && !st.typesBound) {
+                    wire.write(MySqlWire::errPacket(1210, "HY000", "Incorrect arguments to mysqld_stmt_execute"), next);
+                    break;
+                }
+                answer(wire, c, st.sql, next, true);
+                break;
+            }
+            case 0x19:  // COM_STMT_CLOSE, no reply
+                c.statements.erase(static_cast<uint32_t>(MySqlWire::fixed(cmd, 1, 4)));
+                break;
+            case 0x1f:  // COM_RESET_CONNECTION
+                c.status = kAutocommit;
+                c.isolation = "REPEATABLE-READ";
+                c.x = "NULL";
+                c.names = "utf8";
+                c.statements.clear();
+                wire.write(MySqlWire::okPacket(c.status), next);
+                break;
+            default:
+                wire.write(MySqlWire::okPacket(c.status), next);
+                break;
+            }
+            wire.flush();
+        }
+    }
+
+    void answer(MySqlWire& wire, Connection& c, const std::string& sql, uint8_t seq, bool binary) {
+        auto startsWith = [&](const char* prefix) { return sql.compare(0, std::strlen(prefix), prefix) == 0; };
+        uint64_t insertId = 0;
+        std::optional<std::string> value;
+        if (sql == "BEGIN") c.status |= kInTrans;
+        else if (sql == "COMMIT" || sql == "ROLLBACK") c.status &= static_cast<uint16_t>(~kInTrans);
+        else if (startsWith("INSERT")) insertId = c.lastInsertId = ++nextId_;
+        else if (startsWith("SET SESSION TRANSACTION ISOLATION LEVEL ")) {
+            c.isolation = sql.substr(std::strlen("SET SESSION TRANSACTION ISOLATION LEVEL "));
+            std::replace(c.isolation.begin(), c.isolation.end(), ' ', '-');
+        }
+        else if (startsWith("SET SESSION transaction_isolation = DEFAULT")) c.isolation = "REPEATABLE-READ";
+        else if (startsWith("SET @x = ")) c.x = sql.substr(std::strlen("SET @x = "));
+        else if (startsWith("SET NAMES ")) c.names = sql.substr(10, sql.find(' ', 10) - 10);
+        else if (sql == "SELECT CONNECTION_ID()") value = std::to_string(c.id);
+        else if (sql == "SELECT LAST_INSERT_ID()") value = std::to_string(c.lastInsertId);
+        else if (sql == "SELECT DATABASE()") value = c.db;
+        else if (sql == "SELECT @@transaction_isolation") value = c.isolation;
+        else if (sql == "SELECT @x") value = c.x;
+        else if (sql == "SELECT @@character_set_client") value = c.names;
+        if (!value) {
+            wire.write(MySqlWire::okPacket(c.status, insertId ? 1 : 0, insertId), seq);
+            return;
+        }
+        std::string p;
+        MySqlWire::putLenenc(p, 1);
+        wire.write(p, seq);
+        wire.write(column("v"), seq);
+        if (!c.deprecateEof) wire.write(MySqlWire::eofPacket(c.status), seq);
+        p = binary ? std::string(2, '\0') : std::string();  // binary rows: header, NULL bitmap
+        MySqlWire::putLenencString(p, *value);
+        wire.write(p, seq);
+        wire.write(c.deprecateEof ? MySqlWire::okPacket(c.status, 0, 0, '\xFE') : MySqlWire::eofPacket(c.status), seq);
+    }
+
+    void prepare(MySqlWire& wire, Connection& c, const std::string& sql, uint8_t seq) {
+        Statement st{ sql, static_cast<size_t>(std::count(sql.begin(), sql.end(), '?')), false };
+        uint16_t columns = sql.compare(0, 6, "SELECT") == 0 ? 1 : 0;
+        uint32_t id = c.nextStatement++;
+        c.statements[id] = st;
+        std::string ok(1, '\0');
+        MySqlWire::putFixed(ok, id, 4);
+        MySqlWire::putFixed(ok, columns, 2);
+        MySqlWire::putFixed(ok, st.params, 2);
+        MySqlWire::putFixed(ok, 0, 3);  // filler, warnings
+        wire.write(ok, seq);
+        for (size_t n : { st.params, size_t(columns) }) {
+            if (n == 0) continue;
+            for (size_t i = 0; i < n; ++i) wire.write(column("?"), seq);
+            if (!c.deprecateEof) wire.write(MySqlWire::eofPacket(c.status), seq);
+        }
+    }
+
+    static std::string column(const char* name) {
+        std::string p;
+        for (const char* field : { "def", "", "", "", name, "" }) MySqlWire::putLenencString(p, field);
+        MySqlWire::putLenenc(p, 0x0c);
+        MySqlWire::putFixed(p, 33, 2);   // utf8
+        MySqlWire::putFixed(p, 255, 4);  // length
+        p += '\xFD';                     // VAR_STRING
+        MySqlWire::putFixed(p, 0, 5);    // flags, decimals, filler
+        return p;
+    }
+
+    std::string              path_;
+    int                      listen_ = -1;
+    std::thread              acceptor_;
+    std::atomic<bool>        stopping_{ false };
+    std::mutex               mu_;
+    std::vector<int>         fds_;      // by connection, -1 once closed
+    std::vector<std::thread> threads_;
+    std::atomic<int>         total_{ 0 }, open_{ 0 }, maxOpen_{ 0 };
+    std::atomic<uint64_t>    nextId_{ 0 };
+};
+
+// ---------------------------------------------------------
+// Function: checkMySqlProxy
+// Many client processes through one MySqlProxy to one (fake) server,
+// no mysqld needed. Forks `clients` processes that log in over the
+// raw protocol (half with CLIENT_DEPRECATE_EOF, so there are two
+// pools), wait until all are logged in, then run transactions,
+// autocommit INSERTs and prepared statements. Checks that
+//   - every statement of a transaction runs on one server connection,
+//   - SELECT LAST_INSERT_ID() (text and prepared) returns the id of
+//     the client's own last INSERT,
+//   - prepared statements run wherever the client lands, sending
+//     their parameter types there even when the client left them out,
+//   - session variables, SET NAMES and the schema follow the client, and a
+//     connection handed on resets what the next client did not set,
+//   - a client that sets a user variable stays on its connection,
+//   - the server saw one connection per login and never more open
+//     at once than the pools, the logins in flight and the pinned
+//     clients allow, and fewer than there were clients.
+// Returns true when all hold; prints each check to `out`.
+// ---------------------------------------------------------
+bool checkMySqlProxy(unsigned clients, std::ostream& out) {
+    const size_t backendsPerUser = 4, maxLogins = 4;
+    const int iterations = 20;
+    struct Shared {
+        std::atomic<int> loggedIn;
+    };
+    void* mem = ::mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) throw std::runtime_error(std::string("mmap: ") + std::strerror(errno));
+    Shared* shared = new (mem) Shared{ { 0 } };
+    char dirTemplate[] = "/tmp/app-proxy-XXXXXX";
+    if (!::mkdtemp(dirTemplate)) throw std::runtime_error(std::string("mkdtemp: ") + std::strerror(errno));
+    std::string dir = dirTemplate, proxyPath = dir + "/proxy.sock", serverPath = dir + "/mysqld.sock";
+
+    // The client side, run in the children: the raw protocol on one connection
+    struct Client {
+        struct Result {
+            bool        ok = false;
+            uint64_t    insertId = 0;
+            std::string value;  // first column of the first row
+        };
+
+        MySqlWire   wire;
+        bool        deprecateEof;
+        std::string error;  // from the last ERR
+
+        Client(const std::string& path, bool deprecateEof) : wire(MySqlWire::connectUnix(path)), deprecateEof(deprecateEof) {}
+
+        bool logIn() {
+            uint8_t seq = 0;
+            std::string greeting = wire.read(seq);
+            size_t low = greeting.find('\0', 1) + 1 + 4 + 8 + 1;
+            uint64_t offered = MySqlWire::fixed(greeting, low, 2) | MySqlWire::fixed(greeting, low + 5, 2) << 16;
+            if (offered & (0x800 | 0x80)) return fail("greeting still offers SSL or LOAD DATA LOCAL");
+            uint32_t caps = 0x1 | 0x8 | 0x200 | 0x2000 | 0x8000 | 0x20000 | 0x40000 | 0x80000
+                | (deprecateEof ? 0x1000000 : 0);
+            std::string response;
+            MySqlWire::putFixed(response, caps, 4);
+            MySqlWire::putFixed(response, 1 << 24, 4);
+            response += '\x21';
+            response.append(23, '\0');
+            response += "app";
+            response += '\0';
+            response += char(20);
+            response.append(20, 's');
+            response += "testdb";
+            response += '\0';
+            response += "mysql_native_password";
+            response += '\0';
+            ++seq;
+            wire.write(response, seq);
+            wire.flush();
+            for (;;) {
+                std::string p = wire.read(seq);
+                if (p[0] == 0x00) return true;
+                if (static_cast<uint8_t>(p[0]) != 0xFE) return fail("login: " + p.substr(std::min<size_t>(9, p.size())));
+                ++seq;  // an auth switch: any answer will do
+                wire.write(std::string(20, 't'), seq);
+                wire.flush();
+            }
+        }
+
+        Result query(const std::string& sql) { return command('\x03' + sql, false); }
+
+        uint32_t prepare(const std::string& sql) {
+            uint8_t seq = 0;
+            wire.write('\x16' + sql, seq);
+            wire.flush();
+            std::string ok = wire.read(seq);
+            if (ok[0] != 0x00) {
+                fail("prepare: " + ok.substr(std::min<size_t>(9, ok.size())));
+                return 0;
+            }
+            for (uint64_t n : { MySqlWire::fixed(ok, 7, 2), MySqlWire::fixed(ok, 5, 2) }) {
+                for (uint64_t i = 0; i < n; ++i) wire.read(seq);
+                if (n > 0 && !deprecateEof) wire.read(seq);
+            }
+            return static_cast<uint32_t>(MySqlWire::fixed(ok, 1, 4));
+        }
+
+        // With one BIGINT parameter (value 7) when `params`; its type
+        // only when `sendTypes`
+        Result execute(uint32_t id, bool params, bool sendTypes) {
+            std::string cmd(1, '\x17');
+            MySqlWire::putFixed(cmd, id, 4);
+            cmd += '\0';                      // no cursor
+            MySqlWire::putFixed(cmd, 1, 4);   // iteration count
+            if (params) {
+                cmd += '\0';                  // NULL bitmap
+                cmd += sendTypes ? '\1' : '\0';
+                if (sendTypes) MySqlWire::putFixed(cmd, 0x08, 2);
+                MySqlWire::putFixed(cmd, 7, 8);
+            }
+            return command(cmd, true);
+        }
+
+        Result command(const std::string& cmd, bool binary) {
+            uint8_t seq = 0;
+            wire.write(cmd, seq);
+            wire.flush();
+            Result r;
+            std::string p = wire.read(seq);
+            if (static_cast<uint8_t>(p[0]) == 0xFF) {
+                fail(p.substr(std::min<size_t>(9, p.size())));
+                return r;
+            }
+            size_t at = 1;
+            if (p[0] == 0x00) {
+                MySqlWire::lenenc(p, at);
+                r.insertId = MySqlWire::lenenc(p, at);
+                r.ok = true;
+                return r;
+            }
+            at = 0;
+            uint64_t columns = MySqlWire::lenenc(p, at);
+            uint8_t type = 0;
+            for (uint64_t i = 0; i < columns; ++i) {
+                p = wire.read(seq);
+                at = 0;
+                for (int field = 0; field < 6; ++field) at += static_cast<size_t>(MySqlWire::lenenc(p, at));
+                MySqlWire::lenenc(p, at);  // length of the fixed fields
+                if (i == 0) type = static_cast<uint8_t>(MySqlWire::fixed(p, at + 6, 1));
+            }
+            if (!deprecateEof) wire.read(seq);
+            for (bool first = true;; first = false) {
+                p = wire.read(seq);
+                if (static_cast<uint8_t>(p[0]) == 0xFE) break;
+                if (!first) continue;
+                at = binary ? 1 + (columns + 9) / 8 : 0;  // row header, NULL bitmap
+                if (binary && type == 0x08) {  // BIGINT
+                    r.value = std::to_string(MySqlWire::fixed(p, at, 8));
+                    continue;
+                }
+                size_t len = static_cast<size_t>(MySqlWire::lenenc(p, at));
+                r.value = p.substr(at, len);
+            }
+            r.ok = true;
+            return r;
+        }
+
+        void quit() {
+            uint8_t seq = 0;
+            wire.write("\x01", seq);
+            wire.flush();
+        }
+
+        bool fail(const std::string& why) {
+            error = why;
+            return false;
+        }
+    };
+
+    // A child's whole run: 0 when every check held
+    auto runClient = [&](unsigned index) -> int {
+        bool deprecateEof = index % 2 == 1;
+        Client c(proxyPath, deprecateEof);
+        auto check = [&](bool cond, const std::string& what) {
+            if (!cond) std::cerr << "client " << index << ": " << what << (c.error.empty() ? "" : ": " + c.error) << "\n";
+            return cond;
+        };
+        if (!check(c.logIn(), "login")) return 1;
+        ++shared->loggedIn;
+        for (auto until = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+             shared->loggedIn.load() < static_cast<int>(clients) && std::chrono::steady_clock::now() < until;)
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+        std::string isolation = "REPEATABLE-READ";
+        if (index % 3 == 0) {
+            if (!check(c.query("SET SESSION TRANSACTION ISOLATION LEVEL READ COMMITTED").ok, "SET SESSION")) return 1;
+            isolation = "READ-COMMITTED";
+        }
+        std::string names = "utf8";
+        if (index % 4 == 1) {  // as pymysql and others do after every login
+            if (!check(c.query("SET NAMES latin1").ok, "SET NAMES")) return 1;
+            names = "latin1";
+        }
+        // Its own statement text, so few server connections have it yet
+        uint32_t insert = c.prepare("INSERT INTO t (v) VALUES (?) /* client " + std::to_string(index) + " */");
+        uint32_t lastId = c.prepare("SELECT LAST_INSERT_ID()");
+        if (!check(insert && lastId, "prepare")) return 1;
+        for (int i = 0; i < iterations; ++i) {
+            bool ok = c.query("BEGIN").ok;
+            std::string first = c.query("SELECT CONNECTION_ID()").value;
+            ok = ok && c.query("INSERT INTO t (v) VALUES (1)").ok;
+            std::string second = c.query("SELECT CONNECTION_ID()").value;
+            ok = ok && c.query("COMMIT").ok;
+            if (!check(ok && !first.empty() && first == second, "transaction moved from connection " + first + " to " + second)) return 1;
+
+            Client::Result inserted = c.query("INSERT INTO t (v) VALUES (2)");
+            std::string seen = c.query("SELECT LAST_INSERT_ID()").value;
+            if (!check(inserted.insertId > 0 && seen == std::to_string(inserted.insertId),
+                       "LAST_INSERT_ID() " + seen + " after inserting " + std::to_string(inserted.insertId))) return 1;
+
+            inserted = c.execute(insert, true, i == 0);
+            seen = c.execute(lastId, false, false).value;
+            if (!check(inserted.ok && seen == std::to_string(inserted.insertId),
+                       "prepared LAST_INSERT_ID() " + seen + " after inserting " + std::to_string(inserted.insertId))) return 1;
+
+            seen = c.query("SELECT @@transaction_isolation").value;
+            if (!check(seen == isolation, "isolation " + seen + ", expected " + isolation)) return 1;
+            seen = c.query("SELECT @@character_set_client").value;
+            if (!check(seen == names, "character set " + seen + ", expected " + names)) return 1;
+            seen = c.query("SELECT DATABASE()").value;
+            if (!check(seen == "testdb", "schema " + seen)) return 1;
+        }
+        if (index < 2) {  // one in each pool, so neither runs out
+            if (!check(c.query("SET @x = 42").ok, "SET @x")) return 1;
+            std::string home = c.query("SELECT CONNECTION_ID()").value;
+            for (int i = 0; i < 5; ++i) {
+                c.query("INSERT INTO t (v) VALUES (3)");
+                if (!check(c.query("SELECT CONNECTION_ID()").value == home && c.query("SELECT @x").value == "42",
+                           "pinned client moved")) return 1;
+            }
+        }
+        c.quit();
+        return 0;
+    };
+
+    // Fork before any thread starts; the children wait for the proxy
+    int go[2];
+    if (::pipe(go) != 0) throw std::runtime_error(std::string("pipe: ") + std::strerror(errno));
+    std::vector<pid_t> children;
+    for (unsigned i = 0; i < clients; ++i) {
+        pid_t pid = ::fork();
+        if (pid < 0) throw std::runtime_error(std::string("fork: ") + std::strerror(errno));
+        if (pid == 0) {
+            ::close(go[1]);
+            char byte;
+            int rc = 1;
+            if (::read(go[0], &byte, 1) == 1) {
+                try {
+                    rc = runClient(i);
+                }
+                catch (const std::exception& e) {
+                    std::cerr << "client " << i << ": " << e.what() << "\n";
+                }
+            }
+            ::_exit(rc);
+        }
+        children.push_back(pid);
+    }
+    ::close(go[0]);
+
+    Metrics& m = Metrics::instance();
+    uint64_t reprepared = m.counter("proxy.reprepared").load(), answered = m.counter("proxy.last_insert_id_answers").load();
+    int connections = 0, maxOpen = 0;
+    bool childrenOk = true;
+    {
+        FakeMySqlServer server(serverPath);
+        MySqlProxyOptions opts;
+        opts.listenPath = proxyPath;
+        opts.server = "unix://" + serverPath;
+        opts.backendsPerUser = backendsPerUser;
+        opts.maxLogins = maxLogins;
+        MySqlProxy proxy(opts);
+        std::string bytes(clients, 'g');
+        if (::write(go[1], bytes.data(), bytes.size()) != static_cast<ssize_t>(bytes.size())) childrenOk = false;
+        ::close(go[1]);
+        for (pid_t pid : children) {
+            int status = 0;
+            if (::waitpid(pid, &status, 0) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) childrenOk = false;
+        }
+        proxy.stop();
+        connections = server.connections();
+        maxOpen = server.maxOpen();
+    }
+    ::munmap(mem, sizeof(Shared));
+    ::rmdir(dir.c_str());
+
+    bool ok = true;
+    auto expect = [&](bool cond, const std::string& what) {
+        out << (cond ? "ok     " : "FAILED ") << what << "\n";
+        ok = ok && cond;
+    };
+    unsigned pinned = std::min(clients, 2u);
+    int bound = static_cast<int>(2 * backendsPerUser + maxLogins + pinned);
+    expect(childrenOk, std::to_string(clients) + " clients: transactions, LAST_INSERT_ID(), prepared statements and session state all held");
+    expect(connections == static_cast<int>(clients), std::to_string(connections) + " server connections opened, one per login");
+    expect(maxOpen <= bound && maxOpen < static_cast<int>(clients),
+           "at most " + std::to_string(maxOpen) + " open at once (bound " + std::to_string(bound) + ")");
+    expect(m.counter("proxy.reprepared").load() > reprepared, "statements prepared again on other connections");
+    expect(m.counter("proxy.last_insert_id_answers").load() > answered, "LAST_INSERT_ID() answered by the proxy");
+    return ok;
+}
+
+// ---------------------------------------------------------
+// Function: measureProxy
+// Forks `clients` worker processes that each keep one connection to
+// the server through an in-process MySqlProxy (backendsPerUser
+// server connections) and run the demo's statements in a loop for
+// `duration`: insertUser, a two-statement transaction with autocommit
+// off, and getUsersByMinAge. Prints statements per second, failures,
+// and the most server connections open at once (Threads_connected,
+// sampled over a direct connection), where one connection per worker
+// would be `clients`. The rows it inserts are deleted afterwards.
+// ---------------------------------------------------------
+void measureProxy(sql::Driver* driver, const DbConfig& cfg, unsigned clients, size_t backendsPerUser,
+    std::chrono::seconds duration, std::ostream& out) {
+    using Clock = std::chrono::steady_clock;
+    struct Shared {
+        std::atomic<uint64_t> statements, failures;
+    };
+    void* mem = ::mmap(nullptr, sizeof(Shared), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED) throw std::runtime_error(std::string("mmap: ") + std::strerror(errno));
+    Shared* shared = new (mem) Shared{ { 0 }, { 0 } };
+    char dirTemplate[] = "/tmp/app-proxy-XXXXXX";
+    if (!::mkdtemp(dirTemplate)) throw std::runtime_error(std::string("mkdtemp: ") + std::strerror(errno));
+    std::string dir = dirTemplate, socket = dir + "/proxy.sock";
+
+    // Fork before the proxy starts its threads; the workers wait for it
+    int go[2];
+    if (::pipe(go) != 0) throw std::runtime_error(std::string("pipe: ") + std::strerror(errno));
+    std::vector<pid_t> children;
+    for (unsigned i = 0; i < clients; ++i) {
+        pid_t pid = ::fork();
+        if (pid < 0) throw std::runtime_error(std::string("fork: ") + std::strerror(errno));
+        if (pid == 0) {
+            ::close(go[1]);
+            char byte;
+            if (::read(go[0], &byte, 1) != 1) ::_exit(1);
+            DbConfig viaProxy = cfg;
+            viaProxy.host = "unix://" + socket;
+            std::string name = "proxy-" + std::to_string(i);
+            auto end = Clock::now() + duration;
+            std::unique_ptr<sql::Connection> con;
+            while (Clock::now() < end) {
+                try {
+                    if (!con) {
+                        con = connectDb(driver, viaProxy);
+                        con->setSchema(cfg.schema);
+                    }
+                    insertUser(con.get(), name, 20);
+                    con->setAutoCommit(false);
+                    updateUserAgeByName(con.get(), name, 21);
+                    insertUser(con.get(), name, 22);
+                    con->commit();
+                    con->setAutoCommit(true);
+                    getUsersByMinAge(con.get(), 1000);
+                    shared->statements += 8;  // with autocommit on and off
+                }
+                catch (const sql::SQLException& e) {
+                    ++shared->failures;
+                    if (isConnectionError(e.getErrorCode(), e.getSQLState())) con.reset();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+                }
+            }
+            con.reset();
+            ::_exit(0);
+        }
+        children.push_back(pid);
+    }
+    ::close(go[0]);
+
+    std::unique_ptr<sql::Connection> direct = connectDb(driver, cfg);
+    auto threadsConnected = [&] {
+        std::unique_ptr<sql::Statement> s(direct->createStatement());
+        std::unique_ptr<sql::ResultSet> rs(s->executeQuery("SHOW GLOBAL STATUS LIKE 'Threads_connected'"));
+        return rs->next() ? rs->getInt(2) - 1 : 0;  // not counting this one
+    };
+    int before = threadsConnected(), peak = before;
+    auto start = Clock::now();
+    {
+        MySqlProxyOptions opts;
+        opts.listenPath = socket;
+        opts.server = cfg.host;
+        opts.backendsPerUser = backendsPerUser;
+        MySqlProxy proxy(opts);
+        std::string bytes(clients, 'g');
+        if (::write(go[1], bytes.data(), bytes.size()) != static_cast<ssize_t>(bytes.size()))
+            throw std::runtime_error("cannot start the workers");
+        ::close(go[1]);
+        size_t exited = 0;
+        while (exited < children.size()) {
+            peak = std::max(peak, threadsConnected());
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            while (exited < children.size() && ::waitpid(children[exited], nullptr, WNOHANG) == children[exited]) ++exited;
+        }
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    {
+        std::unique_ptr<sql::Statement> s(direct->createStatement());
+        s->execute("DELETE FROM " + cfg.schema + ".users WHERE name LIKE 'proxy-%'");
+    }
+    ::rmdir(dir.c_str());
+
+    Metrics& m = Metrics::instance();
+    out << clients << " workers through " << backendsPerUser << " shared connections: "
+        << static_cast<uint64_t>(shared->statements.load() / seconds) << " statements/s, "
+        << shared->failures.load() << " failures\n"
+        << "server connections: " << before << " before, at most " << peak << " during (" << peak - before
+        << " for the workers, vs " << clients << " without the proxy)\n"
+        << "proxy: " << m.counter("proxy.logins").load() << " logins, " << m.counter("proxy.backend_waits").load()
+        << " waits for a connection, " << m.counter("proxy.reprepared").load() << " statements re-prepared, "
+        << m.counter("proxy.pinned").load() << " clients pinned\n";
+    ::munmap(mem, sizeof(Shared));
+}
+
+// ---------------------------------------------------------
+// Class: SamplingProfiler
+// A SIGPROF sampling profiler. An interval timer fires every 1/hz
+// seconds of process CPU time; the signal handler records the
+// interrupted thread's stack plus its StatementScope name into a
+// preallocated buffer (no locks, no allocation in the handler).
+// writeCollapsed() symbolizes the samples and writes one line per
+// distinct stack ("stmt;outer;...;inner count"), the input format of
+// flamegraph.pl and speedscope.
+//
+// A sample costs a few microseconds; measureProfilerOverhead
+// (--measure-profiler) shows what 100 Hz costs a busy thread. Only
+// one profiler can run per process.
+// On Linux, link with -rdynamic so dladdr() can name our own functions.
+// ---------------------------------------------------------
+class SamplingProfiler {
+public:
+    static constexpr int kMaxDepth = 48;
+
+    explicit SamplingProfiler(size_t maxSamples = 100 * 600) : samples_(maxSamples) {}
+    ~SamplingProfiler() { stop(); }
+
+    // hz: samples per second of CPU time, 2..1000000
+    void start(int hz = 100) {
+        if (hz <= 1 || hz > 1000000) throw std::invalid_argument("SamplingProfiler: hz must be in 2..1000000");
+        if (active_ != nullptr) throw std::runtime_error("a SamplingProfiler is already running");
+        void* warm[1];
+        backtrace(warm, 1);  // the first call may allocate (unwinder loading); never do that in the handler
+
+        active_ = this;
+        struct sigaction sa {};
+        sa.sa_sigaction = &SamplingProfiler::onSignal;
+        sa.sa_flags = SA_SIGINFO | SA_RESTART;
+        sigemptyset(&sa.sa_mask);
+        if (sigaction(SIGPROF, &sa, &oldAction_) != 0) {
+            active_ = nullptr;
+            throw std::runtime_error(std::string("SamplingProfiler: sigaction: ") + std::strerror(errno));
+        }
+
+        struct itimerval timer {};
+        timer.it_interval.tv_usec = 1000000 / hz;
+        timer.it_value = timer.it_interval;
+        if (setitimer(ITIMER_PROF, &timer, nullptr) != 0) {
+            int err = errno;
+            sigaction(SIGPROF, &oldAction_, nullptr);
+            active_ = nullptr;
+            throw std::runtime_error(std::string("SamplingProfiler: setitimer: ") + std::strerror(err));
+        }
+        running_ = true;
+    }
+
+    void stop() {
+        if (!running_) return;
+        // Ignore SIGPROF before disarming: a signal already on its way
+        // must not reach the default action, which kills the process
+        struct sigaction ignore {};
+        ignore.sa_handler = SIG_IGN;
+        sigemptyset(&ignore.sa_mask);
+        if (sigaction(SIGPROF, &ignore, nullptr) != 0)
+            std::cerr << "[PROFILER] sigaction(SIG_IGN): " << std::strerror(errno) << "\n";
+        struct itimerval off {};
+        if (setitimer(ITIMER_PROF, &off, nullptr) != 0)
+            std::cerr << "[PROFILER] setitimer(off): " << std::strerror(errno) << "\n";
+        active_ = nullptr;
+        if (sigaction(SIGPROF, &oldAction_, nullptr) != 0)
+            std::cerr << "[PROFILER] restoring the SIGPROF action: " << std::strerror(errno) << "\n";
+        running_ = false;
+    }
+
+    size_t sampleCount() const { return std::min(next_.load(), samples_.size()); }
+    size_t droppedCount() const { return next_.load() - sampleCount(); }
+
+    // Aggregate the samples into collapsed-stack format
+    void writeCollapsed(std::ostream& out) const {
+        std::map<void*, std::string> symbols;  // symbolize each address once
+        std::map<std::string, size_t> stacks;
+        std::string key;
+        for (size_t i = 0; i < sampleCount(); ++i) {
+            const Sample& s = samples_[i];
+            key = s.statement ? s.statement : "[no statement]";
+            // Frames are innermost first; skip the handler and the signal trampoline
+            for (int f = s.depth - 1; f >= 2; --f) {
+                auto it = symbols.find(s.frames[f]);
+                if (it == symbols.end()) it = symbols.emplace(s.frames[f], symbolize(s.frames[f])).first;
+                key += ';';
+                key += it->second;
+            }
+            ++stacks[key];
+        }
+        for (const auto& st : stacks) out << st.first << ' ' << st.second << '\n';
+    }
+
+private:
+    struct Sample {
+        const char* statement;
+        int         depth;
+        void*       frames[kMaxDepth];
+    };
+
+    static void onSignal(int, siginfo_t*, void*) {
+        SamplingProfiler* self = active_;
+        if (self == nullptr) return;
+        int savedErrno = errno;
+        size_t slot = self->next_.fetch_add(1, std::memory_order_relaxed);
+        if (slot < self->samples_.size()) {
+            Sample& s = self->samples_[slot];
+            s.statement = StatementScope::current();
+            s.depth = backtrace(s.frames, kMaxDepth);
+        }
+        errno = savedErrno;
+    }
+
+    static std::string symbolize(void* pc) {
+        Dl_info info;
+        if (dladdr(pc, &info) && info.dli_sname) {
+            int status = 0;
+            char* demangled = abi::__cxa_demangle(info.dli_sname, nullptr, nullptr, &status);
+            std::string name = status == 0 ? demangled : info.dli_sname;
+            std::free(demangled);
+            // Drop the parameter list; it is noise in a flame graph and may contain ';'
+            size_t paren = name.find('(');
+            if (paren != std::string::npos && paren > 0) name.erase(paren);
+            return name;
+        }
+        std::ostringstream hex;
+        hex << pc;
+        return hex.str();
+    }
+
+    std::vector<Sample>  samples_;
+    std::atomic<size_t>  next_{ 0 };
+    struct sigaction     oldAction_ {};
+    bool                 running_ = false;
+    static SamplingProfiler* volatile active_;
+};
+
+SamplingProfiler* volatile SamplingProfiler::active_ = nullptr;
+
+// ---------------------------------------------------------
+// Struct: ProfileToFile
+// RAII helper for main: profiles from construction to destruction
+// and writes the collapsed stacks to `path` when it goes away.
+// ---------------------------------------------------------
+struct ProfileToFile {
+    explicit ProfileToFile(std::string path, int hz = 100) : path(std::move(path)) { profiler.start(hz); }
+    ~ProfileToFile() {
+        profiler.stop();
+        std::ofstream out(path);
+        profiler.writeCollapsed(out);
+        std::cerr << "Profile: " << profiler.sampleCount() << " samples ("
+            << profiler.droppedCount() << " dropped) written to " << path << "\n";
+    }
+    std::string      path;
+    SamplingProfiler profiler;
+};
+
+// ---------------------------------------------------------
+// Function: measureProfilerOverhead
+// Times a CPU-bound loop with and without the profiler at `hz`,
+// alternating `rounds` times, and prints the median of each and the
+// difference. Returns the overhead in percent of the unprofiled time.
+// ---------------------------------------------------------
+double measureProfilerOverhead(std::ostream& out, int hz = 100, size_t rounds = 7) {
+    // About 0.3 s of work per round, so every profiled round takes ~30 samples at 100 Hz
+    volatile uint64_t sink = 0;
+    auto work = [&] {
+        uint64_t h = 1469598103934665603ull;
+        for (uint64_t i = 0; i < 150000000; ++i) h = (h ^ (i & 0xff)) * 1099511628211ull;
+        sink = h;
+    };
+    auto timed = [&] {
+        auto t0 = std::chrono::steady_clock::now();
+        work();
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    };
+    auto median = [](std::vector<double> v) {
+        std::sort(v.begin(), v.end());
+        return v[v.size() / 2];
+    };
+
+    timed();  // warm-up
+    std::vector<double> off, on;
+    size_t samples = 0;
+    for (size_t i = 0; i < rounds; ++i) {
+        off.push_back(timed());
+        SamplingProfiler profiler;
+        profiler.start(hz);
+        on.push_back(timed());
+        profiler.stop();
+        samples += profiler.sampleCount();
+    }
+    double a = median(off), b = median(on), pct = (b - a) / a * 100;
+    out << std::fixed << std::setprecision(1) << "profiler at " << hz << " Hz: " << a << " ms without, "
+        << b << " ms with (" << samples / rounds << " samples/round), overhead "
+        << std::setprecision(2) << pct << "%\n";
+    return pct;
+}
+
+// ---------------------------------------------------------
+// Struct: MetricsToFile
+// RAII helper for main: rewrites `path` with Metrics::write every
+// `interval` and once more on destruction, for a node_exporter
+// textfile collector or a plain `cat`. Each dump goes to a temporary
+// file that is renamed over `path`, so readers never see half a dump.
+// ---------------------------------------------------------
+struct MetricsToFile {
+    explicit MetricsToFile(std::string path, std::chrono::milliseconds interval = std::chrono::seconds(10))
+        : path(std::move(path)), interval(interval) {
+        HeavyHitters::instance().startPublishing();  // its heavy_hitter gauges
+        writer = std::thread([this] {
+            std::unique_lock<std::mutex> lock(mu);
+            while (!stop.wait_for(lock, this->interval, [this] { return stopping; })) dump();
+        });
+    }
+    ~MetricsToFile() {
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            stopping = true;
+        }
+        stop.notify_all();
+        writer.join();
+        dump();
+    }
+
+    void dump() {
+        std::string tmp = path + ".tmp";
+        {
+            std::ofstream out(tmp, std::ios::trunc);
+            Metrics::instance().write(out);
+            if (!out) {
+                std::cerr << "[METRICS] cannot write " << tmp << "\n";
+                return;
+            }
+        }
+        if (std::rename(tmp.c_str(), path.c_str()) != 0) std::cerr << "[METRICS] cannot replace " << path << "\n";
+    }
+
+    std::string               path;
+    std::chrono::milliseconds interval;
+    std::mutex                mu;
+    std::condition_variable   stop;
+    bool                      stopping = false;
+    std::thread               writer;
+};
+
+// ---------------------------------------------------------
+// Main entry point
+//   app                        run the demo
+//   app --import <file>        bulk import a CSV (or Parquet/Arrow) file into users
+//       [--dedup first|last]   sort by name and drop duplicate names first
+//   app --bench-import <file.csv> [<same.parquet>]
+//                              compare row-by-row vs batched import (vs Parquet)
+//   app --bench [filter]       benchmark the statement helpers
+//       [--json <file>]        also save every sample as JSON
+//   app --bench-compare <base.json> <new.json> [threshold%]
+//                              exit 2 on significant regressions
+//   app --proxy <socket> [backends]
+//                              share a few server connections between clients
+//   app --check-proxy [clients]
+//                              MySqlProxy with forked clients and a fake server
+//   app --check-breaker        circuit breaker through a simulated outage
+//   app --check-router         ReadRouter with faked replica lag and GTIDs
+//   app --check-tuner          OnlineTuner against simulated servers
+//   app --measure-tuning [seconds]
+//                              OnlineTuner sizing a pool against the server
+//   app --measure-proxy [clients] [seconds]
+//                              forked workers through MySqlProxy against the server
+//   app --profile <out> ...    any of the above under the sampling profiler
+//   app --metrics <out> ...    any of the above, dumping metrics to <out>
+// ---------------------------------------------------------
+int main(int argc, char** argv) {
+    DbConfig cfg; // Use default config values above
+    if (const char* host = std::getenv("APP_DB_HOST")) cfg.host = host;  // e.g. unix:///tmp/app-proxy.sock
+
+    // Optional, before the other arguments: "--profile <file>" samples
+    // the whole run, "--metrics <file>" keeps a metrics dump up to date
+    std::unique_ptr<MetricsToFile> metrics;
+    std::unique_ptr<ProfileToFile> profile;
+    while (argc >= 3) {
+        std::string opt = argv[1];
+        if (opt == "--profile" && !profile) profile = std::make_unique<ProfileToFile>(argv[2]);
+        else if (opt == "--metrics" && !metrics) metrics = std::make_unique<MetricsToFile>(argv[2]);
+        else break;
+        argc -= 2;
+        argv += 2;
+    }
+
+    try {
+        // Step 1: Get the driver instance (singleton)
+        sql::mysql::MySQL_Driver* driver = sql::mysql::get_mysql_driver_instance();
+
+        // Compare two --bench JSON files; exit code 2 flags regressions
+        if (argc >= 4 && std::string(argv[1]) == "--bench-compare") {
+            double threshold = argc >= 5 ? std::stod(argv[4]) : 5.0;
+            int regressions = compareBenchFiles(argv[2], argv[3], threshold, std::cout);
+            std::cout << regressions << " significant regression(s) above " << threshold << "%\n";
+            return regressions > 0 ? 2 : 0;
+        }
+
+        // Connection sharing proxy in front of cfg.host until SIGINT/SIGTERM;
+        // the workers connect with APP_DB_HOST=unix://<socket>
+        if (argc >= 3 && std::string(argv[1]) == "--proxy") {
+            sigset_t signals;
+            sigemptyset(&signals);
+            sigaddset(&signals, SIGINT);
+            sigaddset(&signals, SIGTERM);
+            pthread_sigmask(SIG_BLOCK, &signals, nullptr);  // before the proxy's threads inherit the mask
+            MySqlProxyOptions opts;
+            opts.listenPath = argv[2];
+            opts.server = cfg.host;
+            if (argc >= 4) opts.backendsPerUser = std::stoul(argv[3]);
+            MySqlProxy proxy(opts);
+            std::cout << "proxy on " << opts.listenPath << " for " << opts.server << "\n";
+            int signal = 0;
+            sigwait(&signals, &signal);
+            proxy.stop();
+            return 0;
+        }
+
+        // MySqlProxy against a fake server from forked clients; needs no server
+        if (argc >= 2 && std::string(argv[1]) == "--check-proxy")
+            return checkMySqlProxy(argc >= 3 ? static_cast<unsigned>(std::stoul(argv[2])) : 32, std::cout) ? 0 : 1;
+
+        if (argc >= 2 && std::string(argv[1]) == "--check-breaker") return checkCircuitBreaker(std::cout) ? 0 : 1;
+        if (argc >= 2 && std::string(argv[1]) == "--check-router") return checkReadRouter(std::cout) ? 0 : 1;
+        if (argc >= 2 && std::string(argv[1]) == "--check-tuner") return checkOnlineTuner(std::cout) ? 0 : 1;
+
+        // What the sampling profiler costs a busy thread: "--measure-profiler [hz]"
+        if (argc >= 2 && std::string(argv[1]) == "--measure-profiler") {
+            measureProfilerOverhead(std::cout, argc >= 3 ? std::stoi(argv[2]) : 100);
+            return 0;
+        }
+
+        // Benchmark mode: "--bench [filter] [--json <file>]". Without a
+        // server only the benchmarks that need none run. The app_bench
+        // target (APP_BENCH_ONLY) always runs it and takes the same
+        // arguments without "--bench".
+#ifdef APP_BENCH_ONLY
+        bool benchMode = true;
+        int firstBenchArg = 1;
+#else
+        bool benchMode = argc >= 2 && std::string(argv[1]) == "--bench";
+        int firstBenchArg = 2;
+#endif
+        if (benchMode) {
+            std::string filter, jsonPath;
+            for (int i = firstBenchArg; i < argc; ++i) {
+                if (std::string(argv[i]) == "--json" && i + 1 < argc) jsonPath = argv[++i];
+                else filter = argv[i];
+            }
+            std::unique_ptr<sql::Connection> benchCon;
+            try {
+                benchCon = connectDb(driver, cfg);
+                ensureSchemaAndTables(benchCon.get(), cfg.schema);
+            }
+            catch (const sql::SQLException& e) {
+                printSqlError(e, "bench (server benchmarks skipped)");
+                benchCon.reset();
+            }
+            auto results = runBenchmarks(benchCon.get(), filter);
+            printBenchResults(results, std::cout);
+            if (!jsonPath.empty()) {
+                std::ofstream json(jsonPath);
+                writeBenchJson(results, json);
+            }
+            return 0;
+        }
+
+        // Step 2: Create a connection to the MySQL server
+        std::unique_ptr<sql::Connection> con = connectDb(driver, cfg);
+
+        // Step 3: Ensure the schema and users table exist
+        ensureSchemaAndTables(con.get(), cfg.schema);
+
+        // Import modes run instead of the demo
+        std::string mode = argc > 1 ? argv[1] : "";
+        if (mode == "--import" && (argc == 3 || (argc == 5 && std::string(argv[3]) == "--dedup"))) {
+            std::unique_ptr<UserBatchReader> file = openUserBatchReader(argv[2]);
+            std::unique_ptr<SortedDedupUserReader> sorted;
+            UserBatchReader* reader = file.get();
+            if (argc == 5) {
+                ExternalSortOptions sortOpts;
+                sortOpts.dedup = parseDedupPolicy(argv[4]);
+                sorted = std::make_unique<SortedDedupUserReader>(*file, sortOpts);
+                reader = sorted.get();
+            }
+            // Rows per INSERT adapts to this server and is remembered for the next run
+            BulkLoadOptions loadOpts;
+            OnlineTunerOptions tuning;
+            tuning.p99Target = std::chrono::milliseconds(2000);
+            tuning.stateFile = defaultTuningFile();
+            tuning.endpoint = CircuitBreaker::endpointOf(cfg);
+            OnlineTuner rowsTuner("bulk.rows_per_statement", loadOpts.rowsPerStatement, 50, 5000, tuning);
+            loadOpts.rowsPerStatementTuner = &rowsTuner;
+            ImportStats stats = importUsers(driver, cfg, *reader, loadOpts);
+            std::cout << "Imported " << stats.rows << " rows in " << stats.batches
+                << " batches (" << stats.seconds << " s)\n";
+            if (sorted) std::cout << "Dropped " << sorted->duplicatesDropped() << " duplicate names ("
+                << sorted->spilledRuns() << " runs spilled, " << sorted->mergePasses() << " extra merge passes)\n";
+            return 0;
+        }
+        if (mode == "--bench-import" && (argc == 3 || argc == 4)) {
+            benchImport(driver, cfg, con.get(), argv[2], argc == 4 ? argv[3] : "");
+            return 0;
+        }
+        // "--measure-proxy [clients] [seconds]": server connections with the proxy
+        if (mode == "--measure-proxy") {
+            unsigned clients = argc >= 3 ? static_cast<unsigned>(std::stoul(argv[2])) : 64;
+            measureProxy(driver, cfg, clients, MySqlProxyOptions{}.backendsPerUser,
+                std::chrono::seconds(argc >= 4 ? std::stoi(argv[3]) : 30), std::cout);
+            return 0;
+        }
+        if (mode == "--measure-tuning") {
+            measureTuning(driver, cfg, std::chrono::seconds(argc >= 3 ? std::stoi(argv[2]) : 60), std::cout);
+            return 0;
+        }
+        // "--measure-recovery [seconds]": restart mysqld meanwhile
+        if (mode == "--measure-recovery") {
+            measureRecovery(driver, cfg, std::chrono::seconds(argc >= 3 ? std::stoi(argv[2]) : 60), std::cout);
+            return 0;
+        }
 
         // Step 4: For demo, clear any previous rows (DON’T do this in production)
         {